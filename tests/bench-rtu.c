@@ -0,0 +1,451 @@
+/**
+\file bench-rtu.c
+\brief End-to-end benchmark of the YAM library against simulated slaves
+\author Jim George
+
+Runs each function code, at several payload sizes and line speeds, against
+a slave simulated in the same process, and prints one JSON object per line
+for each case. Latency percentiles come from the library's own metrics;
+CPU time and read and write calls are those of the calling thread alone, so
+the simulator's share is not counted. The calls are those counted by the
+kernel in /proc/thread-self/io; other system calls, such as poll(),
+tcdrain() and the termios ioctls, are not included.
+
+Each case can also be run through a fault injector (see fault.h); the
+recovery time of a failed transaction is the time from its start to the end
+of the next one that succeeds.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <yam/modbus.h>
+#include <yam/image.h>
+#include <yam/metrics.h>
+#include <yam/sim.h>
+#include <yam/loopback.h>
+#include <yam/fault.h>
+
+#define BENCH_ADDR 1
+#define BENCH_TABLE_SIZE 2000
+#define BENCH_WARMUP 10
+#define BENCH_MAX_SIZES 4
+/* Speed the bus is opened at when the slave replies at once */
+#define BENCH_DEFAULT_BAUDRATE 115200
+/* Reply timeout, short so that lost frames do not dominate a case */
+#define BENCH_DEFAULT_TIMEOUT 100
+
+enum {
+	OPT_COUNT,
+	OPT_DURATION,
+	OPT_BAUDRATES,
+	OPT_TRANSPORTS,
+	OPT_FUNCTIONS,
+	OPT_FAULTS,
+	OPT_TIMEOUT,
+};
+
+char *usage_string =
+"Benchmark libyam against simulated slaves\n"
+"Usage: bench-rtu [options]\n"
+"Options:\n"
+"--count=val: Most transactions per case (default: 2000)\n"
+"--duration=val: Longest time per case (in milliseconds, default: 1000)\n"
+"--baudrates=val[,val...]: Line speeds to emulate, 0 for none\n"
+"             (default: 19200,115200)\n"
+"--transports=name[,name...]: Transports to use (default: all)\n"
+"--functions=name[,name...]: Functions to run (default: all)\n"
+"--faults=name[,name...]: Fault profiles to inject (default: none)\n"
+"--timeout=val: Reply timeout (in milliseconds, default: 100)\n"
+"\n"
+"Prints one JSON object per line for each case. Transports: pty, loopback.\n"
+"Fault profiles: none, noise, drops, jitter, late.\n"
+"Functions: read_coils, read_discretes, read_registers, read_inputs,\n"
+"write_coil, write_register, read_exception_status, write_coils,\n"
+"write_registers.\n";
+
+struct bench_function {
+	const char *name;
+	uint8_t fncode;
+	int sizes[BENCH_MAX_SIZES]; /* Values per request, 0 ends the list */
+};
+
+static const struct bench_function functions[] = {
+	{"read_coils", YAM_READ_COILS, {1, 64, 512, YAM_COILS_PER_REQUEST}},
+	{"read_discretes", YAM_READ_DISCRETES,
+	 {1, 64, 512, YAM_COILS_PER_REQUEST}},
+	{"read_registers", YAM_READ_REGISTERS, {1, 16, 64, YAM_REGS_PER_REQUEST}},
+	{"read_inputs", YAM_READ_INPUTS, {1, 16, 64, YAM_REGS_PER_REQUEST}},
+	{"write_coil", YAM_WRITE_SINGLECOIL, {1}},
+	{"write_register", YAM_WRITE_SINGLEREGISTER, {1}},
+	{"read_exception_status", YAM_READ_EXCEPTIONSTATUS, {1}},
+	{"write_coils", YAM_WRITE_COILS, {1, 64, 512, YAM_COILS_PER_REQUEST}},
+	{"write_registers", YAM_WRITE_REGISTERS,
+	 {1, 16, 64, YAM_REGS_PER_REQUEST}},
+};
+
+/* A bus and the slave at the other end of it */
+struct bench_env {
+	struct yam_modbus bus;
+	struct yam_image image;
+	struct yam_sim sim;
+	struct yam_loopback loopback;
+};
+
+struct bench_transport {
+	const char *name;
+	int (*open)(struct bench_env *env, unsigned int baudrate);
+	void (*close)(struct bench_env *env);
+};
+
+static int pty_open(struct bench_env *env, unsigned int baudrate)
+{
+	struct yam_sim_slave slave;
+
+	if (yam_sim_init(&env->sim, baudrate, 1) != YAM_OK) {
+		return -1;
+	}
+	bzero(&slave, sizeof(slave));
+	slave.image = &env->image;
+	yam_sim_add_slave(&env->sim, BENCH_ADDR, &slave);
+	if (yam_sim_start(&env->sim) != YAM_OK ||
+	    yam_modbus_init(env->sim.path,
+	                    baudrate ? baudrate : BENCH_DEFAULT_BAUDRATE,
+	                    YAM_SERIAL_FLAGS_DEFAULT, &env->bus) != YAM_OK) {
+		yam_sim_close(&env->sim);
+		return -1;
+	}
+	return 0;
+}
+
+static void pty_close(struct bench_env *env)
+{
+	yam_modbus_close(&env->bus);
+	yam_sim_close(&env->sim);
+}
+
+/* The library paces frames itself when given a line speed */
+static int loopback_open(struct bench_env *env, unsigned int baudrate)
+{
+	struct yam_sim_slave slave;
+
+	yam_sim_init_engine(&env->sim, 1);
+	bzero(&slave, sizeof(slave));
+	slave.image = &env->image;
+	yam_sim_add_slave(&env->sim, BENCH_ADDR, &slave);
+	if (yam_modbus_loopback(&env->loopback, &env->sim,
+	                        &env->bus) != YAM_OK) {
+		return -1;
+	}
+	env->bus.baudrate = baudrate;
+	return 0;
+}
+
+static void loopback_close(struct bench_env *env)
+{
+	yam_modbus_close(&env->bus);
+}
+
+static const struct bench_transport transports[] = {
+	{"pty", pty_open, pty_close},
+	{"loopback", loopback_open, loopback_close},
+};
+
+struct bench_faults {
+	const char *name;
+	struct yam_fault_profile profile;
+};
+
+static const struct bench_faults fault_profiles[] = {
+	{"none", {0}},
+	{"noise", {.drop_byte_permille = 1, .corrupt_byte_permille = 2,
+	           .dup_byte_permille = 1}},
+	{"drops", {.drop_frame_permille = 20}},
+	{"jitter", {.delay_permille = 20, .delay_ms = 5,
+	            .split_permille = 200}},
+	/* Replies arriving after the timeout, into the next transaction */
+	{"late", {.delay_permille = 10, .delay_ms = 60000}},
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t thread_cpu_us(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+	       ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/* Read and write calls made by this thread so far, -1 if unknown */
+static long long thread_rw_calls(void)
+{
+	char line[64];
+	long long total = 0, value;
+	int found = 0;
+	FILE *fp;
+
+	if ((fp = fopen("/proc/thread-self/io", "r")) == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "syscr: %lld", &value) == 1 ||
+		    sscanf(line, "syscw: %lld", &value) == 1) {
+			total += value;
+			found++;
+		}
+	}
+	fclose(fp);
+	return (found == 2) ? total : -1;
+}
+
+static int bench_call(struct yam_modbus *bus, uint8_t fncode, int size,
+                      int iter)
+{
+	static uint16_t regs[BENCH_TABLE_SIZE];
+	static uint8_t coils[BENCH_TABLE_SIZE];
+	uint8_t status;
+
+	switch (fncode) {
+	case YAM_READ_COILS:
+		return yam_read_coils(bus, BENCH_ADDR, 0, size, coils);
+	case YAM_READ_DISCRETES:
+		return yam_read_discretes(bus, BENCH_ADDR, 0, size, coils);
+	case YAM_READ_REGISTERS:
+		return yam_read_registers(bus, BENCH_ADDR, 0, size, regs);
+	case YAM_READ_INPUTS:
+		return yam_read_inputs(bus, BENCH_ADDR, 0, size, regs);
+	case YAM_WRITE_SINGLECOIL:
+		return yam_write_single_coil(bus, BENCH_ADDR, 0, iter & 1);
+	case YAM_WRITE_SINGLEREGISTER:
+		return yam_write_single_register(bus, BENCH_ADDR, 0, iter);
+	case YAM_READ_EXCEPTIONSTATUS:
+		return yam_read_exception_status(bus, BENCH_ADDR, &status);
+	case YAM_WRITE_COILS:
+		coils[0] = iter & 1;
+		return yam_write_multiple_coils(bus, BENCH_ADDR, 0, size, coils);
+	case YAM_WRITE_REGISTERS:
+		regs[0] = iter;
+		return yam_write_multiple_registers(bus, BENCH_ADDR, 0, size, regs);
+	default:
+		return YAM_ILLEGAL_FUNCTION;
+	}
+}
+
+static void bench_case(struct bench_env *env, const char *transport,
+                       const struct bench_faults *faults,
+                       const struct bench_function *fn, int size,
+                       unsigned int baudrate, int count, int duration_ms)
+{
+	static struct yam_metrics metrics;
+	static struct yam_fault fault;
+	static const struct yam_fault_profile no_faults;
+	struct yam_metrics_cell cell;
+	uint64_t start, elapsed, cpu, call_start, fail_start = 0;
+	uint64_t recovery, recovery_total = 0, recovery_max = 0;
+	long long calls;
+	int iter, errors = 0, recoveries = 0;
+
+	for (iter = 0; iter < BENCH_WARMUP; iter++) {
+		bench_call(&env->bus, fn->fncode, size, iter);
+	}
+
+	/* Without faults, measure the transport alone */
+	if (memcmp(&faults->profile, &no_faults, sizeof(no_faults))) {
+		yam_fault_init(&fault, &faults->profile, 1);
+		yam_set_faults(&env->bus, &fault);
+	}
+	yam_metrics_init(&metrics);
+	yam_set_metrics(&env->bus, &metrics);
+	calls = thread_rw_calls();
+	cpu = thread_cpu_us();
+	start = now_ns();
+	for (iter = 0; iter < count; iter++) {
+		call_start = now_ns();
+		if (bench_call(&env->bus, fn->fncode, size, iter) != YAM_OK) {
+			errors++;
+			if (fail_start == 0) {
+				fail_start = call_start;
+			}
+		}
+		else if (fail_start) {
+			recovery = now_ns() - fail_start;
+			recovery_total += recovery;
+			if (recovery > recovery_max) {
+				recovery_max = recovery;
+			}
+			recoveries++;
+			fail_start = 0;
+		}
+		if ((iter & 15) == 15 &&
+		    now_ns() - start > (uint64_t)duration_ms * 1000000) {
+			iter++;
+			break;
+		}
+	}
+	elapsed = now_ns() - start;
+	cpu = thread_cpu_us() - cpu;
+	if (calls >= 0) {
+		calls = thread_rw_calls() - calls;
+	}
+	yam_set_metrics(&env->bus, NULL);
+	yam_set_faults(&env->bus, NULL);
+	yam_metrics_snapshot(&metrics, 0, 0, &cell);
+	yam_metrics_free(&metrics);
+
+	printf("{\"transport\":\"%s\",\"faults\":\"%s\",\"function\":\"%s\","
+	       "\"fncode\":%d,\"size\":%d,\"baudrate\":%u,\"transactions\":%d,"
+	       "\"errors\":%d,\"seconds\":%.6f,\"tps\":%.1f,\"goodput_tps\":%.1f,"
+	       "\"recoveries\":%d,\"recovery_mean_us\":%.1f,"
+	       "\"recovery_max_us\":%.1f,\"p50_us\":%lu,\"p99_us\":%lu,"
+	       "\"p999_us\":%lu,\"max_us\":%lu,\"cpu_us_per_tx\":%.2f,",
+	       transport, faults->name, fn->name, fn->fncode, size, baudrate,
+	       iter, errors, elapsed / 1e9, iter / (elapsed / 1e9),
+	       (iter - errors) / (elapsed / 1e9),
+	       recoveries, recoveries ? recovery_total / 1e3 / recoveries : 0.0,
+	       recovery_max / 1e3,
+	       (unsigned long)yam_metrics_percentile(&cell, 50),
+	       (unsigned long)yam_metrics_percentile(&cell, 99),
+	       (unsigned long)yam_metrics_percentile(&cell, 99.9),
+	       (unsigned long)cell.latency_max_us, (double)cpu / iter);
+	if (calls >= 0) {
+		printf("\"rw_calls_per_tx\":%.2f}\n", (double)calls / iter);
+	}
+	else {
+		printf("\"rw_calls_per_tx\":null}\n");
+	}
+	fflush(stdout);
+}
+
+/* Is name in the comma-separated list (NULL for everything)? */
+static int selected(const char *list, const char *name)
+{
+	const char *p = list;
+	size_t len = strlen(name);
+
+	if (list == NULL) {
+		return 1;
+	}
+	while ((p = strstr(p, name)) != NULL) {
+		if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == 0)) {
+			return 1;
+		}
+		p += len;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct bench_env env;
+	char *transport_list = NULL, *function_list = NULL, *fault_list = "none";
+	char baud_list[128] = "19200,115200";
+	int count = 2000, duration_ms = 1000, timeout_ms = BENCH_DEFAULT_TIMEOUT;
+	unsigned int baudrate, ctr, prof, fn, size;
+	int opt_idx, opt;
+	char *save, *str;
+
+	static struct option opt_lst[] = {
+		{"count", required_argument, 0, OPT_COUNT},
+		{"duration", required_argument, 0, OPT_DURATION},
+		{"baudrates", required_argument, 0, OPT_BAUDRATES},
+		{"transports", required_argument, 0, OPT_TRANSPORTS},
+		{"functions", required_argument, 0, OPT_FUNCTIONS},
+		{"faults", required_argument, 0, OPT_FAULTS},
+		{"timeout", required_argument, 0, OPT_TIMEOUT},
+
+		{NULL, 0, 0, 0}
+	};
+
+	while (-1 != (opt = getopt_long(argc, argv, "", opt_lst, &opt_idx))) {
+		switch (opt) {
+		case OPT_COUNT:
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case OPT_DURATION:
+			duration_ms = strtoul(optarg, NULL, 10);
+			break;
+		case OPT_BAUDRATES:
+			strncpy(baud_list, optarg, sizeof(baud_list) - 1);
+			break;
+		case OPT_TRANSPORTS:
+			transport_list = optarg;
+			break;
+		case OPT_FUNCTIONS:
+			function_list = optarg;
+			break;
+		case OPT_FAULTS:
+			fault_list = optarg;
+			break;
+		case OPT_TIMEOUT:
+			timeout_ms = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			puts(usage_string);
+			return -1;
+		}
+	}
+	if (count < 1 || timeout_ms < 1) {
+		puts(usage_string);
+		return -1;
+	}
+
+	if (yam_image_init(&env.image, BENCH_TABLE_SIZE, BENCH_TABLE_SIZE,
+	                   BENCH_TABLE_SIZE, BENCH_TABLE_SIZE) != YAM_OK) {
+		printf("Out of memory\n");
+		return -1;
+	}
+
+	for (str = strtok_r(baud_list, ",", &save); str != NULL;
+	     str = strtok_r(NULL, ",", &save)) {
+		baudrate = strtoul(str, NULL, 10);
+		for (ctr = 0; ctr < sizeof(transports) / sizeof(transports[0]);
+		     ctr++) {
+			if (!selected(transport_list, transports[ctr].name)) {
+				continue;
+			}
+			if (transports[ctr].open(&env, baudrate)) {
+				fprintf(stderr, "Cannot open transport %s at %u bps\n",
+				        transports[ctr].name, baudrate);
+				continue;
+			}
+			yam_set_timeout(&env.bus, timeout_ms);
+			for (prof = 0; prof < sizeof(fault_profiles) /
+			     sizeof(fault_profiles[0]); prof++) {
+				if (!selected(fault_list, fault_profiles[prof].name)) {
+					continue;
+				}
+				for (fn = 0; fn < sizeof(functions) / sizeof(functions[0]);
+				     fn++) {
+					if (!selected(function_list, functions[fn].name)) {
+						continue;
+					}
+					for (size = 0; size < BENCH_MAX_SIZES &&
+					     functions[fn].sizes[size]; size++) {
+						bench_case(&env, transports[ctr].name,
+						           &fault_profiles[prof], &functions[fn],
+						           functions[fn].sizes[size], baudrate, count,
+						           duration_ms);
+					}
+				}
+			}
+			transports[ctr].close(&env);
+		}
+	}
+	yam_image_free(&env.image);
+
+	return 0;
+}
@@ -0,0 +1,1008 @@
+/**
+\file check-rtu.c
+\brief Behavioural tests of the YAM library, run by make check
+\author Jim George
+
+Drives the library against slaves simulated in the same process, mostly
+through the loopback transport, so that no hardware is needed. Each check
+prints one line; the program exits nonzero if any of them failed. The serial
+port path is checked on a pseudo-terminal, and skipped if none can be
+opened.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <yam/modbus.h>
+#include <yam/image.h>
+#include <yam/sim.h>
+#include <yam/loopback.h>
+#include <yam/fault.h>
+#include <yam/cache.h>
+#include <yam/shm.h>
+#include <yam/gateway.h>
+#include <yam/busd.h>
+#include <yam/scheduler.h>
+#include <yam/change.h>
+#include <yam/trace.h>
+#include <yam/metrics.h>
+#include <yam/capture.h>
+
+#define CHECK_ADDR 1
+#define CHECK_BUSY_ADDR 2
+#define CHECK_CORRUPT_ADDR 3
+#define CHECK_DROP_ADDR 4
+#define CHECK_ABSENT_ADDR 9
+#define CHECK_TABLE_SIZE 2000
+#define CHECK_GATEWAY_PORT 15020
+#define CHECK_BUSD_SOCKET "check-rtu-busd.sock"
+
+static int failures;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static void check(int ok, const char *what, int line)
+{
+	printf("%s: line %d: %s\n", ok ? "PASS" : "FAIL", line, what);
+	if (!ok) {
+		failures++;
+	}
+}
+
+static uint64_t check_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* A loopback bus and its slaves: a good one, and one for each fault */
+struct check_env {
+	struct yam_image image;
+	struct yam_sim sim;
+	struct yam_loopback loopback;
+	struct yam_modbus bus;
+};
+
+static int env_open(struct check_env *env)
+{
+	struct yam_sim_slave slave;
+	uint16_t regs[CHECK_TABLE_SIZE];
+	int ctr;
+
+	if (yam_image_init(&env->image, CHECK_TABLE_SIZE, CHECK_TABLE_SIZE,
+	                   CHECK_TABLE_SIZE, CHECK_TABLE_SIZE) != YAM_OK) {
+		return -1;
+	}
+	for (ctr = 0; ctr < CHECK_TABLE_SIZE; ctr++) {
+		regs[ctr] = ctr;
+	}
+	yam_image_set_registers(&env->image, 0, CHECK_TABLE_SIZE, regs);
+	yam_image_set_inputs(&env->image, 0, CHECK_TABLE_SIZE, regs);
+
+	yam_sim_init_engine(&env->sim, 1);
+	bzero(&slave, sizeof(slave));
+	slave.image = &env->image;
+	yam_sim_add_slave(&env->sim, CHECK_ADDR, &slave);
+	slave.busy_permille = 1000;
+	yam_sim_add_slave(&env->sim, CHECK_BUSY_ADDR, &slave);
+	slave.busy_permille = 0;
+	slave.corrupt_permille = 1000;
+	yam_sim_add_slave(&env->sim, CHECK_CORRUPT_ADDR, &slave);
+	slave.corrupt_permille = 0;
+	slave.drop_permille = 1000;
+	yam_sim_add_slave(&env->sim, CHECK_DROP_ADDR, &slave);
+
+	return yam_modbus_loopback(&env->loopback, &env->sim, &env->bus);
+}
+
+static void env_close(struct check_env *env)
+{
+	yam_modbus_close(&env->bus);
+	yam_image_free(&env->image);
+}
+
+static void check_function_codes(struct check_env *env)
+{
+	struct yam_modbus *bus = &env->bus;
+	uint16_t regs[YAM_REGS_PER_REQUEST], values[3] = {7, 8, 9};
+	uint8_t coils[YAM_COILS_PER_REQUEST], set[3] = {1, 0, 1}, status;
+	uint8_t id, run_status;
+	char data[256];
+	int len;
+
+	CHECK(yam_read_registers(bus, CHECK_ADDR, 10, 3, regs) == YAM_OK &&
+	      regs[0] == 10 && regs[2] == 12);
+	CHECK(yam_read_registers(bus, CHECK_ADDR, 0, YAM_REGS_PER_REQUEST,
+	                         regs) == YAM_OK &&
+	      regs[YAM_REGS_PER_REQUEST - 1] == YAM_REGS_PER_REQUEST - 1);
+	CHECK(yam_read_inputs(bus, CHECK_ADDR, 20, 2, regs) == YAM_OK &&
+	      regs[1] == 21);
+	CHECK(yam_write_single_register(bus, CHECK_ADDR, 100, 1234) == YAM_OK);
+	CHECK(yam_read_registers(bus, CHECK_ADDR, 100, 1, regs) == YAM_OK &&
+	      regs[0] == 1234);
+	CHECK(yam_write_multiple_registers(bus, CHECK_ADDR, 200, 3,
+	                                   values) == YAM_OK);
+	CHECK(yam_read_registers(bus, CHECK_ADDR, 200, 3, regs) == YAM_OK &&
+	      regs[0] == 7 && regs[2] == 9);
+
+	CHECK(yam_write_single_coil(bus, CHECK_ADDR, 5, 1) == YAM_OK);
+	CHECK(yam_read_coils(bus, CHECK_ADDR, 4, 3, coils) == YAM_OK &&
+	      !coils[0] && coils[1] && !coils[2]);
+	CHECK(yam_write_multiple_coils(bus, CHECK_ADDR, 50, 3, set) == YAM_OK);
+	CHECK(yam_read_coils(bus, CHECK_ADDR, 50, 3, coils) == YAM_OK &&
+	      coils[0] && !coils[1] && coils[2]);
+	CHECK(yam_read_coils(bus, CHECK_ADDR, 0, YAM_COILS_PER_REQUEST,
+	                     coils) == YAM_OK);
+	CHECK(yam_read_discretes(bus, CHECK_ADDR, 0, 16, coils) == YAM_OK);
+	CHECK(yam_read_exception_status(bus, CHECK_ADDR, &status) == YAM_OK);
+
+	/* Exceptions from the slave */
+	CHECK(yam_report_slave_id(bus, CHECK_ADDR, &id, &run_status, data,
+	                          &len) == YAM_ILLEGAL_FUNCTION);
+	CHECK(yam_read_registers(bus, CHECK_ADDR, CHECK_TABLE_SIZE - 1, 2,
+	                         regs) == YAM_ILLEGAL_DATA_ADDR);
+	CHECK(yam_read_registers(bus, CHECK_BUSY_ADDR, 0, 1,
+	                         regs) == YAM_SLAVE_BUSY);
+	CHECK(yam_get_slave(bus, CHECK_BUSY_ADDR)->state == YAM_SLAVE_STATE_UP &&
+	      yam_get_slave(bus, CHECK_BUSY_ADDR)->last_success_ns != 0);
+
+	/* Requests the library refuses to send */
+	CHECK(yam_read_registers(bus, CHECK_ADDR, 0, YAM_REGS_PER_REQUEST + 1,
+	                         regs) < 0);
+}
+
+static void check_errors(struct check_env *env)
+{
+	struct yam_modbus *bus = &env->bus;
+	uint16_t regs[YAM_REGS_PER_REQUEST];
+	int devnull, saved;
+
+	CHECK(yam_read_registers(bus, CHECK_CORRUPT_ADDR, 0, 4,
+	                         regs) == YAM_CRC_ERROR);
+	CHECK(yam_read_registers(bus, CHECK_DROP_ADDR, 0, 4,
+	                         regs) == YAM_TIMEOUT);
+	CHECK(yam_read_registers(bus, CHECK_ABSENT_ADDR, 0, 4,
+	                         regs) == YAM_TIMEOUT);
+	CHECK(yam_get_slave(bus, CHECK_ABSENT_ADDR)->failures > 0 &&
+	      yam_get_slave(bus, CHECK_ABSENT_ADDR)->last_success_ns == 0);
+
+	/* A long frame with an error, printed in debug mode */
+	fflush(stderr);
+	saved = dup(2);
+	devnull = open("/dev/null", O_WRONLY);
+	dup2(devnull, 2);
+	yam_debug(bus, 1);
+	CHECK(yam_read_registers(bus, CHECK_CORRUPT_ADDR, 0,
+	                         YAM_REGS_PER_REQUEST, regs) == YAM_CRC_ERROR);
+	yam_debug(bus, 0);
+	fflush(stderr);
+	dup2(saved, 2);
+	close(saved);
+	close(devnull);
+}
+
+static void check_retry_and_breaker(struct check_env *env)
+{
+	struct yam_modbus *bus = &env->bus;
+	struct yam_retry_policy policy = {2, YAM_RETRY_CRC, 0, 0};
+	uint16_t regs[4];
+	unsigned long retries;
+	uint64_t requests;
+	int ctr;
+
+	retries = yam_get_slave(bus, CHECK_CORRUPT_ADDR)->retries;
+	yam_set_retry(bus, &policy);
+	CHECK(yam_read_registers(bus, CHECK_CORRUPT_ADDR, 0, 1,
+	                         regs) == YAM_CRC_ERROR);
+	CHECK(yam_get_slave(bus, CHECK_CORRUPT_ADDR)->retries == retries + 2);
+
+	/* No retry is started without time left for a reply */
+	policy.deadline_ms = YAM_RETRY_MIN_REPLY_MS / 2;
+	yam_set_retry(bus, &policy);
+	requests = env->sim.stats.requests;
+	CHECK(yam_read_registers(bus, CHECK_CORRUPT_ADDR, 0, 1,
+	                         regs) == YAM_CRC_ERROR);
+	CHECK(env->sim.stats.requests == requests + 1 &&
+	      yam_get_slave(bus, CHECK_CORRUPT_ADDR)->retries == retries + 2);
+	policy.max_retries = 0;
+	policy.deadline_ms = 0;
+	yam_set_retry(bus, &policy);
+
+	yam_reset_slave(bus, CHECK_ABSENT_ADDR);
+	yam_set_breaker(bus, 3, 60000, 60000);
+	for (ctr = 0; ctr < 3; ctr++) {
+		CHECK(yam_read_registers(bus, CHECK_ABSENT_ADDR, 0, 1,
+		                         regs) == YAM_TIMEOUT);
+	}
+	CHECK(yam_get_slave(bus, CHECK_ABSENT_ADDR)->state ==
+	      YAM_SLAVE_STATE_DOWN);
+	CHECK(yam_read_registers(bus, CHECK_ABSENT_ADDR, 0, 1,
+	                         regs) == YAM_SLAVE_DOWN);
+	CHECK(yam_read_registers(bus, CHECK_ADDR, 0, 1, regs) == YAM_OK);
+	yam_set_breaker(bus, 0, 0, 0);
+	yam_reset_slave(bus, CHECK_ABSENT_ADDR);
+}
+
+/* Frames paced for a slave that needs extra turnaround */
+static void check_bus_accounting(struct check_env *env)
+{
+	struct yam_modbus *bus = &env->bus;
+	struct yam_bus_stats stats;
+	uint64_t read_ns;
+	uint16_t regs[1];
+
+	bus->baudrate = 9600;
+	yam_reset_bus_stats(bus);
+	CHECK(yam_read_registers(bus, CHECK_ADDR, 10, 1, regs) == YAM_OK);
+	/* 8 characters of request and 7 of reply */
+	read_ns = bus->stats.wire_ns;
+	CHECK(read_ns > 0 && read_ns % 15 == 0);
+	CHECK(yam_read_registers(bus, CHECK_ABSENT_ADDR, 10, 1,
+	                         regs) == YAM_TIMEOUT);
+	CHECK(yam_read_registers(bus, CHECK_CORRUPT_ADDR, 10, 1,
+	                         regs) == YAM_CRC_ERROR);
+
+	yam_get_bus_stats(bus, &stats);
+	CHECK(stats.transactions == 3 && stats.replies == 2);
+	CHECK(stats.errors == 2 && stats.timeouts == 1);
+	CHECK(stats.wire_ns == read_ns / 15 * (15 + 8 + 15));
+	/* Every moment since the reset is either busy or idle */
+	CHECK(stats.busy_ns + stats.idle_ns == stats.elapsed_ns);
+
+	yam_reset_bus_stats(bus);
+	yam_get_bus_stats(bus, &stats);
+	CHECK(stats.transactions == 0 && stats.wire_ns == 0 && stats.busy_ns == 0);
+	bus->baudrate = 0;
+}
+
+static void check_pacing(struct check_env *env)
+{
+	struct yam_modbus *bus = &env->bus;
+	uint64_t start, idle_ns;
+	uint16_t regs[1];
+
+	bus->baudrate = 9600;
+	yam_set_slave_turnaround(bus, CHECK_ADDR, 20000);
+	yam_reset_bus_stats(bus);
+	CHECK(yam_read_registers(bus, CHECK_ADDR, 10, 1, regs) == YAM_OK);
+	idle_ns = bus->stats.idle_ns;
+	start = check_now_ns();
+	CHECK(yam_read_registers(bus, CHECK_ADDR, 10, 1, regs) == YAM_OK);
+	CHECK(check_now_ns() - start >= 20000000);
+
+	/* The wait is idle line, not part of the slave's turnaround */
+	CHECK(bus->stats.idle_ns - idle_ns >= 20000000);
+	CHECK(bus->stats.replies == 2 && bus->stats.max_turnaround_ns < 1000000);
+	yam_set_slave_turnaround(bus, CHECK_ADDR, 0);
+	bus->baudrate = 0;
+}
+
+/* Order in which the scheduler ran its tasks, and when to stop it */
+struct check_sched_log {
+	struct yam_sched *sched;
+	struct yam_sched_task *ran[4];
+	int num_ran;
+	unsigned long stop_after;
+};
+
+static void sched_done(void *arg, struct yam_sched_task *task)
+{
+	struct check_sched_log *log = arg;
+
+	if (log->num_ran < 4) {
+		log->ran[log->num_ran++] = task;
+	}
+	if (task->runs == log->stop_after) {
+		yam_sched_stop(log->sched);
+	}
+}
+
+static void check_scheduler(struct check_env *env)
+{
+	uint16_t slow_regs[2], fast_regs[2];
+	struct yam_sched_task slow, fast;
+	struct check_sched_log log;
+	struct yam_sched sched;
+	uint64_t start;
+	int wait;
+
+	bzero(&slow, sizeof(slow));
+	bzero(&fast, sizeof(fast));
+	bzero(&log, sizeof(log));
+	slow.req = (struct yam_request){CHECK_ADDR, YAM_READ_REGISTERS, 500, 2,
+	                                slow_regs, 0};
+	fast.req = (struct yam_request){CHECK_ADDR, YAM_READ_REGISTERS, 510, 2,
+	                                fast_regs, 0};
+	slow.done = fast.done = sched_done;
+	slow.arg = fast.arg = &log;
+	fast.period_ms = 10;
+	fast.deadline_ms = 2;
+
+	CHECK(yam_sched_init(&sched, &env->bus) == YAM_OK);
+	log.sched = &sched;
+	CHECK(yam_sched_add(&sched, &slow) == YAM_ILLEGAL_DATA_VALUE);
+	slow.period_ms = 50;
+	CHECK(yam_sched_add(&sched, &slow) == YAM_OK);
+	CHECK(yam_sched_add(&sched, &fast) == YAM_OK);
+
+	/* Both are due at once: the earlier deadline goes first */
+	CHECK(yam_sched_step(&sched) == 0 && yam_sched_step(&sched) == 0);
+	CHECK(log.num_ran == 2 && log.ran[0] == &fast && log.ran[1] == &slow);
+	CHECK(fast.req.status == YAM_OK && fast_regs[1] == 511);
+	CHECK(slow.req.status == YAM_OK && slow_regs[1] == 501);
+	wait = yam_sched_step(&sched);
+	CHECK(wait > 0 && wait <= 10);
+
+	/* The fast task is released every period until the callback stops it */
+	log.stop_after = 6;
+	start = check_now_ns();
+	CHECK(yam_sched_run(&sched) == YAM_OK);
+	CHECK(check_now_ns() - start >= 40000000);
+	CHECK(fast.runs == 6 && slow.runs >= 1 && slow.runs <= 2);
+	CHECK(sched.stats.runs == fast.runs + slow.runs);
+	yam_sched_free(&sched);
+}
+
+static void watch_count(void *arg, struct yam_tag *tag)
+{
+	(*(int *)arg)++;
+	(void)tag;
+}
+
+static void check_change_detection(struct check_env *env)
+{
+	uint16_t regs[12], value;
+	struct yam_request req = {CHECK_ADDR, YAM_READ_REGISTERS, 600, 12, regs, 0};
+	struct yam_tag tags[3];
+	struct yam_watch watch;
+	int calls = 0;
+
+	bzero(tags, sizeof(tags));
+	tags[0].index = 0;
+	tags[0].deadband = 5;
+	tags[1].index = 4;
+	tags[1].type = YAM_DEADBAND_PERCENT;
+	tags[1].deadband = 10;
+	tags[2].index = 11;
+	tags[2].flags = YAM_TAG_SIGNED;
+	CHECK(yam_watch_init(&watch, &req, tags, 3, watch_count,
+	                     &calls) == YAM_OK);
+
+	/* The first update reports every tag */
+	CHECK(yam_request_execute(&env->bus, &req) == YAM_OK);
+	CHECK(yam_watch_update(&watch) == 3 && calls == 3);
+	CHECK(tags[1].reported && tags[1].value == 604);
+
+	/* Within the deadband, outside the percentage, untagged, and signed */
+	value = 603;
+	yam_image_set_registers(&env->image, 600, 1, &value);
+	value = 700;
+	yam_image_set_registers(&env->image, 604, 1, &value);
+	value = 0;
+	yam_image_set_registers(&env->image, 601, 1, &value);
+	value = 0xFFFF;
+	yam_image_set_registers(&env->image, 611, 1, &value);
+	CHECK(yam_request_execute(&env->bus, &req) == YAM_OK);
+	CHECK(yam_watch_update(&watch) == 2 && calls == 5);
+	CHECK(tags[0].value == 600 && tags[1].value == 700 &&
+	      tags[2].value == 0xFFFF);
+
+	/* Drift is measured from the value last reported */
+	value = 606;
+	yam_image_set_registers(&env->image, 600, 1, &value);
+	CHECK(yam_request_execute(&env->bus, &req) == YAM_OK);
+	CHECK(yam_watch_update(&watch) == 1 && tags[0].value == 606);
+
+	/* A failed read says nothing about the values */
+	req.addr = CHECK_ABSENT_ADDR;
+	CHECK(yam_request_execute(&env->bus, &req) == YAM_TIMEOUT);
+	CHECK(yam_watch_update(&watch) == 0 && calls == 6);
+	yam_watch_free(&watch);
+}
+
+static void check_write_batch(struct check_env *env)
+{
+	struct yam_modbus *bus = &env->bus;
+	uint16_t regs[3];
+	uint64_t requests;
+
+	CHECK(yam_set_write_batch(bus, 60000) == YAM_OK);
+	requests = env->sim.stats.requests;
+	CHECK(yam_write_single_register(bus, CHECK_ADDR, 300, 1) == YAM_OK);
+	CHECK(yam_write_single_register(bus, CHECK_ADDR, 301, 2) == YAM_OK);
+	CHECK(yam_write_single_register(bus, CHECK_ADDR, 302, 3) == YAM_OK);
+	CHECK(env->sim.stats.requests == requests);
+	CHECK(yam_flush_writes(bus) == YAM_OK);
+	CHECK(env->sim.stats.requests == requests + 1);
+	CHECK(yam_image_get_registers(&env->image, 300, 3, regs) == YAM_OK &&
+	      regs[0] == 1 && regs[1] == 2 && regs[2] == 3);
+
+	/* A read of the same slave sends the held writes first */
+	CHECK(yam_write_single_register(bus, CHECK_ADDR, 303, 4) == YAM_OK);
+	CHECK(yam_read_registers(bus, CHECK_ADDR, 303, 1, regs) == YAM_OK &&
+	      regs[0] == 4);
+	CHECK(yam_set_write_batch(bus, 0) == YAM_OK);
+}
+
+static void check_batch(struct check_env *env)
+{
+	uint16_t values[YAM_REGS_PER_REQUEST] = {11, 12, 13}, regs[3];
+	struct yam_request reqs[2] = {
+		{CHECK_ADDR, YAM_WRITE_REGISTERS, 400, 3, values, 0},
+		{CHECK_ADDR, YAM_READ_REGISTERS, 400, 3, regs, 0},
+	};
+	struct yam_batch batch;
+
+	CHECK(yam_batch_init(&batch, reqs, 2) == YAM_OK);
+	CHECK(yam_batch_run(&env->bus, &batch) == YAM_OK && regs[2] == 13);
+
+	/* A write whose count no longer encodes is skipped */
+	reqs[0].count = YAM_REGS_PER_REQUEST + 1;
+	CHECK(yam_batch_run(&env->bus, &batch) < 0 && reqs[0].status < 0 &&
+	      reqs[1].status == YAM_OK);
+	reqs[0].count = 3;
+	CHECK(yam_batch_run(&env->bus, &batch) == YAM_OK);
+	yam_batch_free(&batch);
+}
+
+static void check_cache(struct check_env *env)
+{
+	static struct yam_cache cache;
+	uint16_t regs[4];
+	uint64_t requests;
+
+	CHECK(yam_cache_init(&cache, 60000) == YAM_OK);
+	yam_set_cache(&env->bus, &cache);
+	CHECK(yam_read_registers(&env->bus, CHECK_ADDR, 500, 4, regs) == YAM_OK);
+	requests = env->sim.stats.requests;
+	CHECK(yam_read_registers(&env->bus, CHECK_ADDR, 500, 4, regs) == YAM_OK &&
+	      regs[3] == 503);
+	CHECK(cache.stats.hits == 1 && env->sim.stats.requests == requests);
+
+	/* Writes go through to the slave, and keep the cache current */
+	CHECK(yam_write_single_register(&env->bus, CHECK_ADDR, 501, 42) == YAM_OK);
+	CHECK(yam_read_registers(&env->bus, CHECK_ADDR, 500, 4, regs) == YAM_OK &&
+	      regs[1] == 42);
+	CHECK(yam_image_get_registers(&env->image, 501, 1, regs) == YAM_OK &&
+	      regs[0] == 42);
+	yam_set_cache(&env->bus, NULL);
+	yam_cache_free(&cache);
+}
+
+/* Poll results published to shared memory, and the region replaced */
+static void check_shm(struct check_env *env)
+{
+	struct yam_shm_block_def def = {CHECK_ADDR, YAM_TABLE_REGISTERS,
+	                                0, CHECK_TABLE_SIZE};
+	struct yam_shm pub, reader, fresh;
+	uint16_t regs[10];
+	uint64_t ts;
+	char name[32];
+
+	snprintf(name, sizeof(name), "/check-rtu-%d", (int)getpid());
+	CHECK(yam_shm_create(&pub, name, &def, 1) == YAM_OK);
+	yam_set_shm(&env->bus, &pub);
+	CHECK(yam_read_registers(&env->bus, CHECK_ADDR, CHECK_TABLE_SIZE - 10, 10,
+	                         regs) == YAM_OK);
+	yam_set_shm(&env->bus, NULL);
+	CHECK(yam_shm_open(&reader, name) == YAM_OK);
+	CHECK(yam_shm_snapshot(&reader, CHECK_ADDR, YAM_TABLE_REGISTERS,
+	                       CHECK_TABLE_SIZE - 10, 10, regs, &ts) == YAM_OK &&
+	      regs[9] == CHECK_TABLE_SIZE - 1 && ts != 0);
+
+	/* A smaller layout must not pull the old one out from under a reader */
+	yam_shm_close(&pub);
+	def.count = 16;
+	CHECK(yam_shm_create(&pub, name, &def, 1) == YAM_OK);
+	CHECK(yam_shm_snapshot(&reader, CHECK_ADDR, YAM_TABLE_REGISTERS,
+	                       CHECK_TABLE_SIZE - 10, 10, regs, &ts) == YAM_OK &&
+	      regs[9] == CHECK_TABLE_SIZE - 1);
+	CHECK(yam_shm_open(&fresh, name) == YAM_OK);
+	CHECK(yam_shm_snapshot(&fresh, CHECK_ADDR, YAM_TABLE_REGISTERS,
+	                       CHECK_TABLE_SIZE - 10, 10, regs, &ts) < 0);
+	yam_shm_close(&fresh);
+	yam_shm_close(&reader);
+	yam_shm_close(&pub);
+	yam_shm_unlink(name);
+}
+
+static void check_trace(struct check_env *env)
+{
+	struct yam_trace_record recs[8];
+	struct yam_trace_file_header header;
+	struct yam_trace trace;
+	uint16_t regs[1];
+	FILE *fp;
+	int ctr;
+
+	CHECK(yam_trace_init(&trace, 4) == YAM_OK);
+	yam_set_trace(&env->bus, &trace);
+	CHECK(yam_read_registers(&env->bus, CHECK_ADDR, 10, 1, regs) == YAM_OK);
+	CHECK(yam_trace_drain(&trace, recs, 8) == 2);
+	CHECK(recs[0].seq == 0 && recs[0].dir == YAM_TRACE_TX &&
+	      recs[0].len == 8 && recs[0].data[0] == CHECK_ADDR);
+	CHECK(recs[1].seq == 1 && recs[1].dir == YAM_TRACE_RX &&
+	      recs[1].len == 7 && recs[1].status == 7);
+	CHECK(yam_trace_drain(&trace, recs, 8) == 0);
+
+	/* Six more frames in a ring of four: the two oldest are lost */
+	for (ctr = 0; ctr < 3; ctr++) {
+		CHECK(yam_read_registers(&env->bus, CHECK_ADDR, 10, 1,
+		                         regs) == YAM_OK);
+	}
+	CHECK(yam_trace_snapshot(&trace, recs, 8) == 4 && recs[0].seq == 4);
+	CHECK(yam_trace_drain(&trace, recs, 8) == 4 && recs[0].seq == 4 &&
+	      recs[3].seq == 7 && trace.dropped == 2);
+	CHECK(yam_trace_snapshot(&trace, recs, 2) == 2 && recs[1].seq == 7);
+
+	CHECK(yam_trace_save(&trace, "check-rtu.trace") == YAM_OK);
+	CHECK((fp = fopen("check-rtu.trace", "rb")) != NULL);
+	if (fp) {
+		CHECK(fread(&header, sizeof(header), 1, fp) == 1 &&
+		      header.magic == YAM_TRACE_MAGIC && header.num_records == 4 &&
+		      header.dropped == 2);
+		CHECK(fread(recs, sizeof(recs[0]), 5, fp) == 4 && recs[0].seq == 4);
+		fclose(fp);
+	}
+	unlink("check-rtu.trace");
+	yam_set_trace(&env->bus, NULL);
+	yam_trace_free(&trace);
+}
+
+static void check_metrics(struct check_env *env)
+{
+	struct yam_modbus *bus = &env->bus;
+	struct yam_metrics metrics;
+	struct yam_metrics_cell cell;
+	uint64_t p50, p99;
+	uint16_t regs[1];
+	int ctr;
+
+	CHECK(yam_metrics_init(&metrics) == YAM_OK);
+
+	/* Buckets are an eighth of a doubling wide, exact below 8 us */
+	for (ctr = 1; ctr <= 100; ctr++) {
+		yam_metrics_record(&metrics, 5, YAM_READ_REGISTERS, 7, 8, 7, ctr);
+	}
+	yam_metrics_record(&metrics, 6, YAM_READ_REGISTERS, 7, 8, 7, 3);
+	CHECK(yam_metrics_snapshot(&metrics, 5, YAM_READ_REGISTERS,
+	                           &cell) == YAM_OK && cell.transactions == 100);
+	p50 = yam_metrics_percentile(&cell, 50);
+	p99 = yam_metrics_percentile(&cell, 99);
+	CHECK(p50 >= 50 && p50 <= 50 * 9 / 8);
+	CHECK(p99 >= 99 && p99 <= 99 * 9 / 8);
+	CHECK(yam_metrics_percentile(&cell, 100) == 100);
+	CHECK(yam_metrics_snapshot(&metrics, 6, 0, &cell) == YAM_OK &&
+	      yam_metrics_percentile(&cell, 50) == 3);
+	CHECK(yam_metrics_snapshot(&metrics, 0, 0, &cell) == YAM_OK &&
+	      cell.transactions == 101 && cell.latency_max_us == 100);
+	yam_metrics_reset(&metrics);
+	CHECK(yam_metrics_snapshot(&metrics, 0, 0, &cell) == YAM_OK &&
+	      cell.transactions == 0 && yam_metrics_percentile(&cell, 50) == 0);
+
+	/* Traffic on the bus, counted by slave and function */
+	yam_set_metrics(bus, &metrics);
+	CHECK(yam_read_registers(bus, CHECK_ADDR, 10, 1, regs) == YAM_OK);
+	CHECK(yam_read_registers(bus, CHECK_ADDR, 10, 1, regs) == YAM_OK);
+	CHECK(yam_write_single_register(bus, CHECK_ADDR, 10, 10) == YAM_OK);
+	CHECK(yam_read_registers(bus, CHECK_CORRUPT_ADDR, 10, 1,
+	                         regs) == YAM_CRC_ERROR);
+	CHECK(yam_read_registers(bus, CHECK_BUSY_ADDR, 10, 1,
+	                         regs) == YAM_SLAVE_BUSY);
+	CHECK(yam_read_registers(bus, CHECK_ABSENT_ADDR, 10, 1,
+	                         regs) == YAM_TIMEOUT);
+	yam_set_metrics(bus, NULL);
+
+	CHECK(yam_metrics_snapshot(&metrics, CHECK_ADDR, YAM_READ_REGISTERS,
+	                           &cell) == YAM_OK);
+	CHECK(cell.transactions == 2 && cell.bytes_out == 16 &&
+	      cell.bytes_in == 14 && cell.timeouts == 0);
+	CHECK(yam_metrics_percentile(&cell, 100) == cell.latency_max_us);
+	CHECK(yam_metrics_snapshot(&metrics, CHECK_ADDR, 0, &cell) == YAM_OK &&
+	      cell.transactions == 3);
+	CHECK(yam_metrics_snapshot(&metrics, 0, YAM_READ_REGISTERS,
+	                           &cell) == YAM_OK);
+	CHECK(cell.transactions == 5 && cell.crc_errors == 1 &&
+	      cell.exceptions == 1 && cell.timeouts == 1);
+	yam_metrics_free(&metrics);
+}
+
+/* The requests of check_capture, run on the loopback bus and on a replay */
+static void capture_traffic(struct yam_modbus *bus, int *results,
+                            uint16_t *regs)
+{
+	uint16_t values[3] = {70, 71, 72};
+
+	results[0] = yam_write_multiple_registers(bus, CHECK_ADDR, 700, 3, values);
+	results[1] = yam_read_registers(bus, CHECK_ADDR, 700, 3, regs);
+	results[2] = yam_read_registers(bus, CHECK_ABSENT_ADDR, 700, 3, regs + 3);
+	results[3] = yam_read_registers(bus, CHECK_BUSY_ADDR, 700, 3, regs + 3);
+}
+
+static void check_capture(struct check_env *env)
+{
+	struct yam_capture cap;
+	struct yam_replay rep;
+	struct yam_modbus bus;
+	struct yam_image image;
+	int results[4], replayed[4];
+	uint16_t regs[6], replay_regs[6];
+
+	CHECK(yam_capture_open(&cap, "check-rtu.pcap") == YAM_OK);
+	yam_set_capture(&env->bus, &cap);
+	capture_traffic(&env->bus, results, regs);
+	yam_set_capture(&env->bus, NULL);
+	CHECK(yam_capture_close(&cap) == YAM_OK && cap.frames >= 7);
+	CHECK(results[0] == YAM_OK && results[1] == YAM_OK && regs[2] == 72 &&
+	      results[2] == YAM_TIMEOUT && results[3] == YAM_SLAVE_BUSY);
+
+	/* The same requests against the capture get the same results */
+	CHECK(yam_replay_open(&rep, "check-rtu.pcap", 0) == YAM_OK);
+	CHECK(yam_modbus_replay(&rep, &bus) == YAM_OK);
+	bzero(replay_regs, sizeof(replay_regs));
+	capture_traffic(&bus, replayed, replay_regs);
+	CHECK(!memcmp(replayed, results, sizeof(results)) &&
+	      !memcmp(replay_regs, regs, 3 * sizeof(uint16_t)));
+	CHECK(rep.requests == 4 && rep.mismatches == 0 && rep.missing == 0);
+	CHECK(yam_read_registers(&bus, CHECK_ADDR, 700, 3, regs) == YAM_TIMEOUT &&
+	      rep.missing == 1);
+	yam_modbus_close(&bus);
+	yam_replay_close(&rep);
+
+	/* The requests rebuild the slave's registers in an empty image */
+	CHECK(yam_image_init(&image, 1000, 1000, 1000, 1000) == YAM_OK);
+	CHECK(yam_replay_open(&rep, "check-rtu.pcap", 0) == YAM_OK);
+	CHECK(yam_replay_slave(&rep, &image) == YAM_OK);
+	CHECK(rep.requests == 4 && rep.mismatches == 0);
+	CHECK(yam_image_get_registers(&image, 700, 3, regs) == YAM_OK &&
+	      regs[0] == 70 && regs[2] == 72);
+	yam_replay_close(&rep);
+	yam_image_free(&image);
+	unlink("check-rtu.pcap");
+}
+
+static void check_raw_request(struct check_env *env)
+{
+	uint8_t pdu[YAM_MODBUS_MAX_ADU_LEN], resp[YAM_MODBUS_MAX_ADU_LEN];
+	int num_regs = (YAM_MODBUS_MAX_ADU_LEN - 4 - 6) / 2;
+
+	/* The longest request that fits in an ADU */
+	bzero(pdu, sizeof(pdu));
+	pdu[0] = YAM_WRITE_REGISTERS;
+	pdu[4] = num_regs;
+	pdu[5] = 2 * num_regs;
+	CHECK(yam_raw_request(&env->bus, CHECK_ADDR, pdu, 6 + 2 * num_regs, resp,
+	                      sizeof(resp)) == 5 && resp[0] == YAM_WRITE_REGISTERS);
+
+	/* One byte more does not */
+	CHECK(yam_raw_request(&env->bus, CHECK_ADDR, pdu, 7 + 2 * num_regs, resp,
+	                      sizeof(resp)) == YAM_INVALIDBYTECOUNT);
+	CHECK(yam_raw_request(&env->bus, CHECK_ADDR, pdu, YAM_MODBUS_MAX_PDU_LEN,
+	                      resp, sizeof(resp)) == YAM_INVALIDBYTECOUNT);
+}
+
+static void check_faults(struct check_env *env)
+{
+	struct yam_fault_profile profile;
+	static struct yam_fault fault;
+	uint16_t regs[YAM_REGS_PER_REQUEST];
+
+	/* Every byte doubled, on a request that already fills an ADU */
+	bzero(&profile, sizeof(profile));
+	profile.dup_byte_permille = 1000;
+	yam_fault_init(&fault, &profile, 1);
+	yam_set_faults(&env->bus, &fault);
+	CHECK(yam_write_multiple_registers(&env->bus, CHECK_ADDR, 0,
+	                                   YAM_REGS_PER_REQUEST, regs) < 0);
+	CHECK(fault.stats.bytes_duplicated > 0);
+	yam_set_faults(&env->bus, NULL);
+	CHECK(yam_read_registers(&env->bus, CHECK_ADDR, 0, 1, regs) == YAM_OK);
+}
+
+static void *gateway_thread(void *arg)
+{
+	yam_gateway_run(arg);
+	return NULL;
+}
+
+/* Sends one Modbus/TCP request and reads the reply PDU */
+static int tcp_transaction(int fd, uint8_t unit, const uint8_t *pdu, int len,
+                           uint8_t *resp)
+{
+	uint8_t frame[7 + YAM_MODBUS_MAX_ADU_LEN];
+	int got = 0, ret;
+
+	frame[0] = 0;
+	frame[1] = 1;
+	frame[2] = frame[3] = 0;
+	frame[4] = (len + 1) >> 8;
+	frame[5] = (len + 1) & 0xFF;
+	frame[6] = unit;
+	memcpy(&frame[7], pdu, len);
+	if (send(fd, frame, 7 + len, MSG_NOSIGNAL) != 7 + len) {
+		return -1;
+	}
+	while (got < 7 || got < 6 + ((frame[4] << 8) | frame[5])) {
+		ret = recv(fd, &frame[got], sizeof(frame) - got, 0);
+		if (ret <= 0) {
+			return -1;
+		}
+		got += ret;
+	}
+	memcpy(resp, &frame[7], got - 7);
+	return got - 7;
+}
+
+static void check_gateway(struct check_env *env)
+{
+	static struct yam_gateway gw;
+	uint8_t pdu[YAM_MODBUS_MAX_PDU_LEN], resp[YAM_MODBUS_MAX_ADU_LEN];
+	struct sockaddr_in sa;
+	struct timeval tv = {5, 0};
+	pthread_t thread;
+	int port, fd;
+
+	for (port = CHECK_GATEWAY_PORT; port < CHECK_GATEWAY_PORT + 100; port++) {
+		if (yam_gateway_init(&gw, "127.0.0.1", port, 0) == YAM_OK) {
+			break;
+		}
+	}
+	CHECK(port < CHECK_GATEWAY_PORT + 100);
+	if (port == CHECK_GATEWAY_PORT + 100) {
+		return;
+	}
+	yam_gateway_add_bus(&gw, &env->bus, 1, YAM_MAX_SLAVE_ADDR);
+	pthread_create(&thread, NULL, gateway_thread, &gw);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	bzero(&sa, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	CHECK(connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0);
+
+	bzero(pdu, sizeof(pdu));
+	pdu[0] = YAM_READ_REGISTERS;
+	pdu[1] = 1000 >> 8;
+	pdu[2] = 1000 & 0xFF;
+	pdu[4] = 2;
+	CHECK(tcp_transaction(fd, CHECK_ADDR, pdu, 5, resp) == 6 &&
+	      resp[0] == YAM_READ_REGISTERS && resp[1] == 4 &&
+	      ((resp[2] << 8) | resp[3]) == 1000);
+	CHECK(tcp_transaction(fd, CHECK_ABSENT_ADDR, pdu, 5, resp) == 2 &&
+	      resp[0] == (YAM_READ_REGISTERS | 0x80));
+
+	/* The longest PDU a client may send does not fit in an RTU frame */
+	pdu[0] = YAM_WRITE_REGISTERS;
+	CHECK(tcp_transaction(fd, CHECK_ADDR, pdu, YAM_MODBUS_MAX_PDU_LEN,
+	                      resp) == 2 &&
+	      resp[0] == (YAM_WRITE_REGISTERS | 0x80) &&
+	      resp[1] == -YAM_GATEWAY_TARGET_FAILED);
+
+	close(fd);
+	yam_gateway_stop(&gw);
+	pthread_join(thread, NULL);
+	yam_gateway_close(&gw);
+}
+
+/*
+Stands in for yam-busd: answers the first request with a timeout, then goes
+away, so that the next request fails in the library and not on the bus.
+*/
+static void check_lost_daemon(void)
+{
+	struct sockaddr_un sa;
+	struct busd_request req;
+	struct busd_reply reply;
+	struct yam_modbus bus;
+	uint16_t regs[1];
+	int listener, fd;
+
+	listener = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	bzero(&sa, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, CHECK_BUSD_SOCKET);
+	unlink(CHECK_BUSD_SOCKET);
+	if (bind(listener, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    listen(listener, 1)) {
+		printf("SKIP: cannot listen on %s\n", CHECK_BUSD_SOCKET);
+		close(listener);
+		return;
+	}
+	CHECK(yam_modbus_connect(CHECK_BUSD_SOCKET, &bus) == YAM_OK);
+	fd = accept(listener, NULL, NULL);
+
+	/* Queued ahead of the request, which is the client's first */
+	bzero(&reply, sizeof(reply));
+	reply.seq = 1;
+	reply.status = YAM_TIMEOUT;
+	reply.addr = CHECK_ADDR;
+	send(fd, &reply, BUSD_REPLY_HDR_LEN, MSG_NOSIGNAL);
+	yam_set_timeout(&bus, 70000);
+	CHECK(yam_read_registers(&bus, CHECK_ADDR, 0, 1, regs) == YAM_TIMEOUT);
+	CHECK(yam_get_slave(&bus, CHECK_ADDR)->failures == 1);
+
+	/* A timeout too long for the request is capped, not wrapped */
+	CHECK(recv(fd, &req, sizeof(req), 0) == BUSD_REQUEST_HDR_LEN + 5 &&
+	      req.seq == 1 && req.timeout_ms == UINT16_MAX);
+
+	/* A lost daemon says nothing about the slave */
+	close(fd);
+	CHECK(yam_read_registers(&bus, CHECK_ADDR, 0, 1,
+	                         regs) == YAM_SOCKET_FAILED);
+	CHECK(yam_get_slave(&bus, CHECK_ADDR)->failures == 1 &&
+	      yam_get_slave(&bus, CHECK_ADDR)->last_success_ns == 0);
+
+	yam_modbus_close(&bus);
+	close(listener);
+	unlink(CHECK_BUSD_SOCKET);
+}
+
+/* A device that is not a serial port is closed again */
+static void check_serial_open_failure(void)
+{
+	struct yam_modbus bus;
+	int fd, after, devnull, saved;
+
+	fflush(stderr);
+	saved = dup(2);
+	devnull = open("/dev/null", O_WRONLY);
+	dup2(devnull, 2);
+	/* The lowest free descriptor, which a leak would take */
+	fd = dup(0);
+	close(fd);
+	CHECK(yam_modbus_init("/dev/null", 9600, YAM_SERIAL_FLAGS_DEFAULT,
+	                      &bus) == YAM_SERIAL_INIT_FAILED);
+	CHECK((after = dup(0)) == fd);
+	close(after);
+	dup2(saved, 2);
+	close(saved);
+	close(devnull);
+}
+
+/* The serial port path, and a retry deadline used up by held writes */
+static void check_serial(void)
+{
+	static struct yam_sim sim;
+	static struct yam_image image;
+	struct yam_retry_policy policy = {2, YAM_RETRY_TIMEOUT, 0, 20};
+	struct yam_sim_slave slave;
+	struct yam_modbus bus;
+	uint16_t regs[4];
+	uint64_t start;
+
+	if (yam_sim_init(&sim, 0, 1) != YAM_OK) {
+		printf("SKIP: no pseudo-terminal\n");
+		return;
+	}
+	yam_image_init(&image, 16, 16, 16, 16);
+	bzero(&slave, sizeof(slave));
+	slave.image = &image;
+	yam_sim_add_slave(&sim, CHECK_ADDR, &slave);
+	CHECK(yam_sim_start(&sim) == YAM_OK);
+	CHECK(yam_modbus_init(sim.path, 115200, YAM_SERIAL_FLAGS_DEFAULT,
+	                      &bus) == YAM_OK);
+	yam_set_timeout(&bus, 100);
+
+	CHECK(yam_write_single_register(&bus, CHECK_ADDR, 1, 77) == YAM_OK);
+	CHECK(yam_read_registers(&bus, CHECK_ADDR, 0, 2, regs) == YAM_OK &&
+	      regs[1] == 77);
+	CHECK(yam_read_registers(&bus, CHECK_ABSENT_ADDR, 0, 2,
+	                         regs) == YAM_TIMEOUT);
+
+	/* Flushing a write to an absent slave uses up the read's deadline */
+	yam_set_retry(&bus, &policy);
+	yam_set_write_batch(&bus, 1);
+	yam_write_single_register(&bus, CHECK_ABSENT_ADDR + 1, 0, 1);
+	usleep(2000);
+	alarm(10);
+	CHECK(yam_read_registers(&bus, CHECK_ABSENT_ADDR, 0, 2,
+	                         regs) == YAM_TIMEOUT);
+	alarm(0);
+
+	/* Nor does pacing for a slow slave */
+	policy.max_retries = 0;
+	policy.deadline_ms = 40;
+	yam_set_retry(&bus, &policy);
+	yam_set_write_batch(&bus, 0);
+	yam_set_slave_turnaround(&bus, CHECK_ABSENT_ADDR, 30000);
+	CHECK(yam_read_registers(&bus, CHECK_ADDR, 0, 2, regs) == YAM_OK);
+	start = check_now_ns();
+	CHECK(yam_read_registers(&bus, CHECK_ABSENT_ADDR, 0, 2,
+	                         regs) == YAM_TIMEOUT);
+	CHECK(check_now_ns() - start < 55000000);
+
+	yam_modbus_close(&bus);
+	yam_sim_close(&sim);
+	yam_image_free(&image);
+}
+
+/* A port tuned for low latency, with requests drained before the reply wait */
+static void check_low_latency(void)
+{
+	static struct yam_sim sim;
+	static struct yam_image image;
+	struct yam_sim_slave slave;
+	struct yam_modbus bus;
+	uint16_t regs[64];
+
+	if (yam_sim_init(&sim, 0, 1) != YAM_OK) {
+		printf("SKIP: no pseudo-terminal\n");
+		return;
+	}
+	yam_image_init(&image, 16, 16, 16, 64);
+	bzero(&slave, sizeof(slave));
+	slave.image = &image;
+	slave.latency_us = 10000;
+	yam_sim_add_slave(&sim, CHECK_ADDR, &slave);
+	CHECK(yam_sim_start(&sim) == YAM_OK);
+	CHECK(yam_modbus_init(sim.path, 115200, YAM_SERIAL_FLAGS_DEFAULT |
+	                      YAM_SERIAL_FLAGS_LOW_LATENCY, &bus) == YAM_OK);
+	CHECK(bus.serial_tuning & YAM_SERIAL_TUNED_DRAIN);
+	yam_set_timeout(&bus, 100);
+
+	/* Long enough for the data to be read in one threshold read */
+	CHECK(yam_write_single_register(&bus, CHECK_ADDR, 63, 99) == YAM_OK);
+	CHECK(yam_read_registers(&bus, CHECK_ADDR, 0, 64, regs) == YAM_OK &&
+	      regs[63] == 99);
+
+	/* Turnaround runs from the end of the drain to the reply */
+	CHECK(bus.stats.replies == 2 &&
+	      bus.stats.turnaround_ns >= 2 * 10000000ULL &&
+	      bus.stats.max_turnaround_ns < 50000000);
+
+	yam_modbus_close(&bus);
+	yam_sim_close(&sim);
+	yam_image_free(&image);
+}
+
+int main(void)
+{
+	static struct check_env env;
+
+	/* Keep the results printed so far if a hang check ends the run */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	if (env_open(&env) != YAM_OK) {
+		printf("FAIL: cannot set up the loopback bus\n");
+		return 1;
+	}
+	yam_set_timeout(&env.bus, 100);
+	check_function_codes(&env);
+	check_errors(&env);
+	check_retry_and_breaker(&env);
+	check_bus_accounting(&env);
+	check_pacing(&env);
+	check_scheduler(&env);
+	check_change_detection(&env);
+	check_write_batch(&env);
+	check_batch(&env);
+	check_cache(&env);
+	check_shm(&env);
+	check_trace(&env);
+	check_metrics(&env);
+	check_capture(&env);
+	check_raw_request(&env);
+	check_faults(&env);
+	check_gateway(&env);
+	env_close(&env);
+	check_lost_daemon();
+	check_serial_open_failure();
+	check_serial();
+	check_low_latency();
+
+	printf("%d failed\n", failures);
+	return failures ? 1 : 0;
+}
@@ -109,9 +109,9 @@ int main(int argc, char *argv[])
 			yam_set_timeout(bus, strtoul(optarg, NULL, 10));
 			break;
 		case OPT_DEVICE:
-			if (bus->serial == -1) goto bus_not_initialized;
 			{
-			yam_modbus_close(bus);
+			/* The default device need not exist, e.g. when using yam-sim */
+			if (bus->serial != -1) yam_modbus_close(bus);
 			char *delims=", ";
 			strncpy(serdev, strtok(optarg, delims), YAM_MAX_DEVICE_NAME);
 			char *baudstr = strtok(NULL, delims);
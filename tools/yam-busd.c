@@ -0,0 +1,447 @@
+/**
+\file yam-busd.c
+\brief Daemon that shares one Modbus/RTU port between several processes
+\author Jim George
+
+The daemon owns the serial port. Client processes connect to its Unix socket
+with yam_modbus_connect() and send one request at a time. Each client has its
+own queue and the queues are served round robin, so a process polling hard
+cannot starve the others. A read that is identical to one already queued
+(same slave, function, start and count) is not queued again; the requester
+is given the reply to the queued read when it completes.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <yam/modbus.h>
+#include "busd.h"
+
+/** Maximum number of connected clients */
+#define BUSD_MAX_CLIENTS 64
+
+enum {
+	OPT_DEVICE,
+	OPT_SOCKET,
+	OPT_TIMEOUT,
+};
+
+char *usage_string =
+"Modbus/RTU bus sharing daemon\n"
+"Usage: yam-busd [options] --device=...\n"
+"Options:\n"
+"--device=dev[,baudrate[,bits[,par[,stop]]]: Serial bus to share\n"
+"             (default: 57600 bps, 8b, Even parity, 1 stop bit)\n"
+"--socket=path: Socket to listen on (default: " YAM_BUSD_DEFAULT_SOCKET ")\n"
+"--timeout=val: Timeout for requests that do not set one (in milliseconds)\n"
+"\n";
+
+/* A client that asked for the same read as a queued request */
+struct busd_waiter {
+	struct busd_waiter *next;
+	int client;
+	unsigned int gen;
+	uint16_t seq;
+};
+
+struct busd_pending {
+	struct busd_pending *next; /* Next in the owner's queue */
+	struct busd_waiter *waiters;
+	int client; /* Owner, and the generation of its slot */
+	unsigned int gen;
+	uint16_t seq;
+	uint16_t timeout_ms;
+	uint8_t addr;
+	int pdu_len;
+	uint8_t pdu[YAM_MODBUS_MAX_PDU_LEN];
+};
+
+struct busd_client {
+	int fd;
+	unsigned int gen; /* Bumped when the slot is reused */
+	struct busd_pending *head, *tail;
+};
+
+static struct busd_client clients[BUSD_MAX_CLIENTS];
+static struct pollfd pfds[BUSD_MAX_CLIENTS + 1];
+static int last_served = BUSD_MAX_CLIENTS - 1;
+static volatile sig_atomic_t stop;
+
+static unsigned long num_requests, num_merged, num_transactions;
+
+static void handle_signal(int sig)
+{
+	stop = 1;
+}
+
+/* Parses dev[,baudrate[,bits[,par[,stop]]]] into a bus, returns 0 on success */
+static int open_device(char *spec, struct yam_modbus *bus)
+{
+	char *delims = ", ";
+	char *dev = strtok(spec, delims);
+	char *str;
+	int baudrate = 57600;
+	unsigned int flags = 0;
+
+	if (dev == NULL) return -1;
+	if ((str = strtok(NULL, delims)) != NULL) baudrate = strtoul(str, NULL, 10);
+
+	str = strtok(NULL, delims);
+	if (str == NULL || !strcmp(str, "8")) flags |= YAM_SERIAL_FLAGS_8BIT;
+	else if (!strcmp(str, "7")) flags |= YAM_SERIAL_FLAGS_7BIT;
+	else if (!strcmp(str, "6")) flags |= YAM_SERIAL_FLAGS_6BIT;
+	else return -1;
+
+	str = strtok(NULL, delims);
+	if (str == NULL || !strcasecmp(str, "E")) flags |= YAM_SERIAL_FLAGS_EVEN_PARITY;
+	else if (!strcasecmp(str, "N")) flags |= YAM_SERIAL_FLAGS_NO_PARITY;
+	else if (!strcasecmp(str, "O")) flags |= YAM_SERIAL_FLAGS_ODD_PARITY;
+	else return -1;
+
+	str = strtok(NULL, delims);
+	if (str == NULL || !strcmp(str, "1")) flags |= YAM_SERIAL_FLAGS_ONE_STOP;
+	else if (!strcmp(str, "2")) flags |= YAM_SERIAL_FLAGS_TWO_STOP;
+	else return -1;
+
+	if (0 > yam_modbus_init(dev, baudrate, flags, bus)) {
+		printf("Error initializing bus with device %s at %d bps\n",
+			dev, baudrate);
+		return -1;
+	}
+	return 0;
+}
+
+static int listen_socket(const char *path)
+{
+	struct sockaddr_un sa;
+	int fd;
+
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		return -1;
+	}
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	bzero(&sa, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) || listen(fd, 16)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void send_reply(int client, unsigned int gen, uint16_t seq,
+                       struct busd_reply *reply, int len)
+{
+	/* The client went away, and maybe another took its slot */
+	if (clients[client].fd < 0 || clients[client].gen != gen) {
+		return;
+	}
+	reply->seq = seq;
+	send(clients[client].fd, reply, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static void enqueue(int client, struct busd_pending *p)
+{
+	p->next = NULL;
+	if (clients[client].tail) {
+		clients[client].tail->next = p;
+	}
+	else {
+		clients[client].head = p;
+	}
+	clients[client].tail = p;
+}
+
+static int is_read(uint8_t fncode)
+{
+	return fncode >= YAM_READ_COILS && fncode <= YAM_READ_INPUTS;
+}
+
+/* Finds a queued request identical to the given one */
+static struct busd_pending *find_queued(struct busd_request *req, int pdu_len)
+{
+	struct busd_pending *p;
+	int ctr;
+
+	for (ctr = 0; ctr < BUSD_MAX_CLIENTS; ctr++) {
+		for (p = clients[ctr].head; p; p = p->next) {
+			if (p->addr == req->addr && p->pdu_len == pdu_len &&
+			    !memcmp(p->pdu, req->pdu, pdu_len)) {
+				return p;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void intake(int client, struct busd_request *req, int len)
+{
+	struct busd_pending *p;
+	struct busd_waiter *w;
+	int pdu_len = len - BUSD_REQUEST_HDR_LEN;
+
+	num_requests++;
+	if (pdu_len < 1) {
+		return;
+	}
+
+	if (is_read(req->pdu[0]) && (p = find_queued(req, pdu_len)) != NULL) {
+		w = malloc(sizeof(struct busd_waiter));
+		if (w != NULL) {
+			w->client = client;
+			w->gen = clients[client].gen;
+			w->seq = req->seq;
+			w->next = p->waiters;
+			p->waiters = w;
+			num_merged++;
+			return;
+		}
+	}
+
+	p = malloc(sizeof(struct busd_pending));
+	if (p == NULL) {
+		struct busd_reply reply;
+		reply.status = YAM_NO_MEMORY;
+		reply.addr = req->addr;
+		send_reply(client, clients[client].gen, req->seq, &reply,
+		           BUSD_REPLY_HDR_LEN);
+		return;
+	}
+	p->waiters = NULL;
+	p->client = client;
+	p->gen = clients[client].gen;
+	p->seq = req->seq;
+	p->timeout_ms = req->timeout_ms;
+	p->addr = req->addr;
+	p->pdu_len = pdu_len;
+	memcpy(p->pdu, req->pdu, pdu_len);
+	enqueue(client, p);
+}
+
+static void drop_client(int client)
+{
+	struct busd_pending *p, *next;
+	struct busd_waiter *w;
+
+	close(clients[client].fd);
+	clients[client].fd = -1;
+	pfds[client + 1].fd = -1;
+
+	/* Requests other clients are waiting on pass to the first of them */
+	p = clients[client].head;
+	clients[client].head = clients[client].tail = NULL;
+	for (; p; p = next) {
+		next = p->next;
+		while ((w = p->waiters) != NULL) {
+			p->waiters = w->next;
+			if (clients[w->client].fd >= 0 &&
+			    clients[w->client].gen == w->gen) {
+				break;
+			}
+			free(w);
+		}
+		if (w == NULL) {
+			free(p);
+			continue;
+		}
+		p->client = w->client;
+		p->gen = w->gen;
+		p->seq = w->seq;
+		free(w);
+		enqueue(p->client, p);
+	}
+}
+
+static void accept_client(int listen_fd)
+{
+	int fd, ctr;
+
+	fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+	for (ctr = 0; ctr < BUSD_MAX_CLIENTS; ctr++) {
+		if (clients[ctr].fd < 0) {
+			clients[ctr].fd = fd;
+			clients[ctr].gen++;
+			pfds[ctr + 1].fd = fd;
+			return;
+		}
+	}
+	close(fd);
+}
+
+/* Runs the next request, taking the clients in turn */
+static void serve_next(struct yam_modbus *bus, int default_timeout)
+{
+	struct busd_pending *p = NULL;
+	struct busd_waiter *w;
+	struct busd_reply reply;
+	int ctr, client, ret;
+
+	for (ctr = 1; ctr <= BUSD_MAX_CLIENTS; ctr++) {
+		client = (last_served + ctr) % BUSD_MAX_CLIENTS;
+		if ((p = clients[client].head) != NULL) {
+			break;
+		}
+	}
+	if (p == NULL) {
+		return;
+	}
+	last_served = client;
+	clients[client].head = p->next;
+	if (clients[client].head == NULL) {
+		clients[client].tail = NULL;
+	}
+
+	yam_set_timeout(bus, p->timeout_ms ? p->timeout_ms : default_timeout);
+	ret = yam_raw_request(bus, p->addr, p->pdu, p->pdu_len, reply.pdu,
+	                      sizeof(reply.pdu));
+	num_transactions++;
+	reply.addr = p->addr;
+	reply.status = (ret < 0) ? ret : YAM_OK;
+	if (ret < 0) {
+		ret = 0;
+	}
+
+	send_reply(p->client, p->gen, p->seq, &reply, BUSD_REPLY_HDR_LEN + ret);
+	while ((w = p->waiters) != NULL) {
+		p->waiters = w->next;
+		send_reply(w->client, w->gen, w->seq, &reply,
+		           BUSD_REPLY_HDR_LEN + ret);
+		free(w);
+	}
+	free(p);
+}
+
+static int queues_empty(void)
+{
+	int ctr;
+
+	for (ctr = 0; ctr < BUSD_MAX_CLIENTS; ctr++) {
+		if (clients[ctr].head) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct yam_modbus bus;
+	struct busd_request req;
+	char *device = NULL;
+	char *socket_path = YAM_BUSD_DEFAULT_SOCKET;
+	int timeout_ms = YAM_DEFAULT_TIMEOUT;
+	int listen_fd;
+	int opt_idx, opt, ctr, ret;
+
+	static struct option opt_lst[] = {
+		{"device", required_argument, 0, OPT_DEVICE},
+		{"socket", required_argument, 0, OPT_SOCKET},
+		{"timeout", required_argument, 0, OPT_TIMEOUT},
+
+		{NULL, 0, 0, 0}
+	};
+
+	while (-1 != (opt = getopt_long(argc, argv, "", opt_lst, &opt_idx))) {
+		switch (opt) {
+		case OPT_DEVICE:
+			device = optarg;
+			break;
+		case OPT_SOCKET:
+			socket_path = optarg;
+			break;
+		case OPT_TIMEOUT:
+			timeout_ms = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			puts(usage_string);
+			return -1;
+		}
+	}
+	if (device == NULL || open_device(device, &bus)) {
+		puts(usage_string);
+		return -1;
+	}
+
+	listen_fd = listen_socket(socket_path);
+	if (listen_fd < 0) {
+		printf("Could not listen on %s\n", socket_path);
+		yam_modbus_close(&bus);
+		return -1;
+	}
+
+	pfds[0].fd = listen_fd;
+	pfds[0].events = POLLIN;
+	for (ctr = 0; ctr < BUSD_MAX_CLIENTS; ctr++) {
+		clients[ctr].fd = -1;
+		pfds[ctr + 1].fd = -1;
+		pfds[ctr + 1].events = POLLIN;
+	}
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	while (!stop) {
+		/*
+		Pick up everything that has arrived before each transaction, so
+		that queues are fair and reads can be merged; block only when
+		there is nothing to do.
+		*/
+		ret = poll(pfds, BUSD_MAX_CLIENTS + 1, queues_empty() ? -1 : 0);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (pfds[0].revents & POLLIN) {
+			accept_client(listen_fd);
+		}
+		for (ctr = 0; ctr < BUSD_MAX_CLIENTS; ctr++) {
+			if (clients[ctr].fd < 0 || !pfds[ctr + 1].revents) {
+				continue;
+			}
+			while (1) {
+				ret = recv(clients[ctr].fd, &req, sizeof(req),
+				           MSG_DONTWAIT);
+				if (ret > 0) {
+					intake(ctr, &req, ret);
+				}
+				else {
+					if (ret == 0 || errno != EAGAIN) {
+						drop_client(ctr);
+					}
+					break;
+				}
+			}
+		}
+		serve_next(&bus, timeout_ms);
+	}
+
+	for (ctr = 0; ctr < BUSD_MAX_CLIENTS; ctr++) {
+		if (clients[ctr].fd >= 0) {
+			drop_client(ctr);
+		}
+	}
+	close(listen_fd);
+	unlink(socket_path);
+	yam_modbus_close(&bus);
+
+	printf("%lu requests, %lu merged, %lu transactions\n",
+	       num_requests, num_merged, num_transactions);
+	return 0;
+}
@@ -0,0 +1,189 @@
+/**
+\file yam-gateway.c
+\brief Modbus/TCP to Modbus/RTU gateway built on libyam
+\author Jim George
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <getopt.h>
+#include <yam/modbus.h>
+#include <yam/gateway.h>
+
+enum {
+	OPT_LISTEN,
+	OPT_DEVICE,
+	OPT_UNITS,
+	OPT_TIMEOUT,
+	OPT_TTL,
+	OPT_REUSEPORT,
+};
+
+char *usage_string =
+"Modbus/TCP to Modbus/RTU gateway\n"
+"Usage: yam-gateway [options] --device=... [--units=...] [--device=...]\n"
+"Options:\n"
+"--listen=[addr:]port: Address and port to listen on (default: 502)\n"
+"--device=dev[,baudrate[,bits[,par[,stop]]]: Add a serial bus\n"
+"             (default: 57600 bps, 8b, Even parity, 1 stop bit)\n"
+"--units=first[-last]: Unit identifiers routed to the last added bus\n"
+"             (default: 1-247)\n"
+"--timeout=val: Timeout of the following buses (in milliseconds)\n"
+"--ttl=val: Lifetime of cached read replies (in milliseconds, 0 = off)\n"
+"--reuseport: Allow several gateways to share the port\n"
+"\n";
+
+static struct yam_gateway gw;
+
+static void handle_signal(int sig)
+{
+	yam_gateway_stop(&gw);
+}
+
+/* Parses dev[,baudrate[,bits[,par[,stop]]]] into a bus, returns 0 on success */
+static int open_device(char *spec, int timeout_ms, struct yam_modbus *bus)
+{
+	char *delims = ", ";
+	char *dev = strtok(spec, delims);
+	char *str;
+	int baudrate = 57600;
+	unsigned int flags = 0;
+
+	if (dev == NULL) return -1;
+	if ((str = strtok(NULL, delims)) != NULL) baudrate = strtoul(str, NULL, 10);
+
+	str = strtok(NULL, delims);
+	if (str == NULL || !strcmp(str, "8")) flags |= YAM_SERIAL_FLAGS_8BIT;
+	else if (!strcmp(str, "7")) flags |= YAM_SERIAL_FLAGS_7BIT;
+	else if (!strcmp(str, "6")) flags |= YAM_SERIAL_FLAGS_6BIT;
+	else return -1;
+
+	str = strtok(NULL, delims);
+	if (str == NULL || !strcasecmp(str, "E")) flags |= YAM_SERIAL_FLAGS_EVEN_PARITY;
+	else if (!strcasecmp(str, "N")) flags |= YAM_SERIAL_FLAGS_NO_PARITY;
+	else if (!strcasecmp(str, "O")) flags |= YAM_SERIAL_FLAGS_ODD_PARITY;
+	else return -1;
+
+	str = strtok(NULL, delims);
+	if (str == NULL || !strcmp(str, "1")) flags |= YAM_SERIAL_FLAGS_ONE_STOP;
+	else if (!strcmp(str, "2")) flags |= YAM_SERIAL_FLAGS_TWO_STOP;
+	else return -1;
+
+	if (0 > yam_modbus_init(dev, baudrate, flags, bus)) {
+		printf("Error initializing bus with device %s at %d bps\n",
+			dev, baudrate);
+		return -1;
+	}
+	yam_set_timeout(bus, timeout_ms);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct yam_modbus buses[YAM_GATEWAY_MAX_BUSES];
+	int first_unit[YAM_GATEWAY_MAX_BUSES], last_unit[YAM_GATEWAY_MAX_BUSES];
+	int num_buses = 0;
+	int timeout_ms = YAM_DEFAULT_TIMEOUT;
+	int ttl_ms = YAM_GATEWAY_DEFAULT_TTL;
+	unsigned int flags = 0;
+	char *listen_addr = NULL;
+	int port = YAM_TCP_DEFAULT_PORT;
+	int opt_idx, opt, ctr;
+	char *save;
+
+	static struct option opt_lst[] = {
+		{"listen", required_argument, 0, OPT_LISTEN},
+		{"device", required_argument, 0, OPT_DEVICE},
+		{"units", required_argument, 0, OPT_UNITS},
+		{"timeout", required_argument, 0, OPT_TIMEOUT},
+		{"ttl", required_argument, 0, OPT_TTL},
+		{"reuseport", no_argument, 0, OPT_REUSEPORT},
+
+		{NULL, 0, 0, 0}
+	};
+
+	while (-1 != (opt = getopt_long(argc, argv, "", opt_lst, &opt_idx))) {
+		switch (opt) {
+		case OPT_LISTEN:
+			save = strrchr(optarg, ':');
+			if (save != NULL) {
+				*save = 0;
+				listen_addr = optarg;
+				port = strtoul(save + 1, NULL, 10);
+			}
+			else {
+				port = strtoul(optarg, NULL, 10);
+			}
+			break;
+		case OPT_DEVICE:
+			if (num_buses == YAM_GATEWAY_MAX_BUSES) {
+				printf("Too many devices\n");
+				return -1;
+			}
+			if (open_device(optarg, timeout_ms, &buses[num_buses])) {
+				puts(usage_string);
+				return -1;
+			}
+			first_unit[num_buses] = 1;
+			last_unit[num_buses] = 247;
+			num_buses++;
+			break;
+		case OPT_UNITS:
+			if (num_buses == 0) {
+				printf("--units must follow --device\n");
+				return -1;
+			}
+			first_unit[num_buses - 1] = strtoul(optarg, &save, 10);
+			if (*save == '-') last_unit[num_buses - 1] = strtoul(save + 1, NULL, 10);
+			else last_unit[num_buses - 1] = first_unit[num_buses - 1];
+			break;
+		case OPT_TIMEOUT:
+			timeout_ms = strtoul(optarg, NULL, 10);
+			break;
+		case OPT_TTL:
+			ttl_ms = strtoul(optarg, NULL, 10);
+			break;
+		case OPT_REUSEPORT:
+			flags |= YAM_TCP_FLAGS_REUSEPORT;
+			break;
+		default:
+			puts(usage_string);
+			return -1;
+		}
+	}
+	if (num_buses == 0) {
+		puts(usage_string);
+		return -1;
+	}
+
+	if (0 > yam_gateway_init(&gw, listen_addr, port, flags)) {
+		printf("Could not listen on port %d\n", port);
+		return -1;
+	}
+	yam_gateway_set_ttl(&gw, ttl_ms);
+	/* Later buses take precedence where unit ranges overlap */
+	for (ctr = 0; ctr < num_buses; ctr++) {
+		if (0 > yam_gateway_add_bus(&gw, &buses[ctr], first_unit[ctr],
+		                            last_unit[ctr])) {
+			printf("Could not start bus %s\n", buses[ctr].device_name);
+			return -1;
+		}
+	}
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	yam_gateway_run(&gw);
+	yam_gateway_close(&gw);
+
+	printf("%lu requests, %lu cache hits, %lu merged, %lu forwarded\n",
+	       gw.stats.requests, gw.stats.cache_hits, gw.stats.merged,
+	       gw.stats.forwarded);
+	for (ctr = 0; ctr < num_buses; ctr++) {
+		yam_modbus_close(&buses[ctr]);
+	}
+
+	return 0;
+}
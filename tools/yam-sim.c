@@ -0,0 +1,176 @@
+/**
+\file yam-sim.c
+\brief Simulated Modbus/RTU slaves on a pseudo-terminal
+\author Jim George
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <yam/modbus.h>
+#include <yam/image.h>
+#include <yam/sim.h>
+
+enum {
+	OPT_SLAVES,
+	OPT_SIZE,
+	OPT_BAUDRATE,
+	OPT_LATENCY,
+	OPT_DROP,
+	OPT_CORRUPT,
+	OPT_BUSY,
+	OPT_SEED,
+	OPT_LINK,
+};
+
+char *usage_string =
+"Simulate Modbus/RTU slaves on a pseudo-terminal\n"
+"Usage: yam-sim [options]\n"
+"Options:\n"
+"--slaves=first[-last]: Addresses of the simulated slaves (default: 1)\n"
+"--size=val: Coils, discretes, inputs and registers of each slave\n"
+"             (default: 1000)\n"
+"--baudrate=val: Line speed emulated for replies (default: 0, no limit)\n"
+"--latency=val: Time each slave takes to reply (in microseconds)\n"
+"--drop=val: Requests left unanswered (per thousand)\n"
+"--corrupt=val: Replies sent with a bad CRC (per thousand)\n"
+"--busy=val: Requests answered with a busy exception (per thousand)\n"
+"--seed=val: Seed of the fault generator (default: 1)\n"
+"--link=path: Make a symbolic link to the terminal at path\n"
+"\n"
+"Prints the path of the terminal to open, and runs until interrupted.\n"
+"Register n of each slave starts out holding n, and input n holds the\n"
+"slave's address times 1000 plus n.\n";
+
+static struct yam_sim sim;
+
+static void handle_signal(int sig)
+{
+	yam_sim_stop(&sim);
+}
+
+int main(int argc, char *argv[])
+{
+	struct yam_sim_slave cfg;
+	struct yam_image *images;
+	unsigned int first = 1, last = 1, size = 1000, baudrate = 0, seed = 1;
+	unsigned int addr, ctr;
+	uint16_t *values;
+	char *link_path = NULL, *end;
+	int opt_idx, opt;
+
+	static struct option opt_lst[] = {
+		{"slaves", required_argument, 0, OPT_SLAVES},
+		{"size", required_argument, 0, OPT_SIZE},
+		{"baudrate", required_argument, 0, OPT_BAUDRATE},
+		{"latency", required_argument, 0, OPT_LATENCY},
+		{"drop", required_argument, 0, OPT_DROP},
+		{"corrupt", required_argument, 0, OPT_CORRUPT},
+		{"busy", required_argument, 0, OPT_BUSY},
+		{"seed", required_argument, 0, OPT_SEED},
+		{"link", required_argument, 0, OPT_LINK},
+
+		{NULL, 0, 0, 0}
+	};
+
+	bzero(&cfg, sizeof(cfg));
+	while (-1 != (opt = getopt_long(argc, argv, "", opt_lst, &opt_idx))) {
+		switch (opt) {
+		case OPT_SLAVES:
+			first = last = strtoul(optarg, &end, 10);
+			if (*end == '-') last = strtoul(end + 1, NULL, 10);
+			break;
+		case OPT_SIZE:
+			size = strtoul(optarg, NULL, 10);
+			break;
+		case OPT_BAUDRATE:
+			baudrate = strtoul(optarg, NULL, 10);
+			break;
+		case OPT_LATENCY:
+			cfg.latency_us = strtoul(optarg, NULL, 10);
+			break;
+		case OPT_DROP:
+			cfg.drop_permille = strtoul(optarg, NULL, 10);
+			break;
+		case OPT_CORRUPT:
+			cfg.corrupt_permille = strtoul(optarg, NULL, 10);
+			break;
+		case OPT_BUSY:
+			cfg.busy_permille = strtoul(optarg, NULL, 10);
+			break;
+		case OPT_SEED:
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		case OPT_LINK:
+			link_path = optarg;
+			break;
+		default:
+			puts(usage_string);
+			return -1;
+		}
+	}
+	if (first < 1 || last > YAM_MAX_SLAVE_ADDR || first > last ||
+	    size < 1 || size > 65536) {
+		puts(usage_string);
+		return -1;
+	}
+
+	if (yam_sim_init(&sim, baudrate, seed) != YAM_OK) {
+		perror("Cannot open a pseudo-terminal");
+		return -1;
+	}
+	images = calloc(last - first + 1, sizeof(struct yam_image));
+	values = calloc(size, sizeof(uint16_t));
+	if (images == NULL || values == NULL) {
+		printf("Out of memory\n");
+		return -1;
+	}
+	for (addr = first; addr <= last; addr++) {
+		cfg.image = &images[addr - first];
+		if (yam_image_init(cfg.image, size, size, size, size) != YAM_OK) {
+			printf("Out of memory\n");
+			return -1;
+		}
+		for (ctr = 0; ctr < size; ctr++) values[ctr] = ctr;
+		yam_image_set_registers(cfg.image, 0, size, values);
+		for (ctr = 0; ctr < size; ctr++) values[ctr] = addr * 1000 + ctr;
+		yam_image_set_inputs(cfg.image, 0, size, values);
+		yam_sim_add_slave(&sim, addr, &cfg);
+	}
+
+	if (link_path) {
+		unlink(link_path);
+		if (symlink(sim.path, link_path)) {
+			perror(link_path);
+			return -1;
+		}
+	}
+	printf("%s\n", sim.path);
+	fflush(stdout);
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	yam_sim_run(&sim);
+
+	printf("%lu requests, %lu broadcasts, %lu replies, %lu dropped, "
+	       "%lu corrupted, %lu busy, %lu ignored\n",
+	       (unsigned long)sim.stats.requests,
+	       (unsigned long)sim.stats.broadcasts,
+	       (unsigned long)sim.stats.replies, (unsigned long)sim.stats.dropped,
+	       (unsigned long)sim.stats.corrupted, (unsigned long)sim.stats.busy,
+	       (unsigned long)sim.stats.ignored);
+	if (link_path) {
+		unlink(link_path);
+	}
+	yam_sim_close(&sim);
+	for (addr = first; addr <= last; addr++) {
+		yam_image_free(&images[addr - first]);
+	}
+	free(images);
+	free(values);
+
+	return 0;
+}
@@ -0,0 +1,123 @@
+/**
+\file yam-tracedump.c
+\brief Print a frame trace saved with yam_trace_save()
+\author Jim George
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <yam/modbus.h>
+#include <yam/trace.h>
+
+enum {
+	OPT_MONOTONIC,
+};
+
+char *usage_string =
+"Print a libyam frame trace\n"
+"Usage: yam-tracedump [options] file\n"
+"Options:\n"
+"--monotonic: Print CLOCK_MONOTONIC times instead of wall-clock times\n"
+"\n"
+"Each line shows the time of the frame, the time since the previous frame,\n"
+"its direction and its bytes. Received frames that failed show the error.\n";
+
+static void print_time(uint64_t ns, int monotonic)
+{
+	time_t sec = ns / 1000000000ULL;
+	struct tm tm;
+	char buf[32];
+
+	if (monotonic) {
+		printf("%10lu.%06lu", (unsigned long)sec,
+		       (unsigned long)(ns % 1000000000ULL) / 1000);
+		return;
+	}
+	localtime_r(&sec, &tm);
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+	printf("%s.%06lu", buf, (unsigned long)(ns % 1000000000ULL) / 1000);
+}
+
+int main(int argc, char *argv[])
+{
+	struct yam_trace_file_header header;
+	struct yam_trace_record rec;
+	uint64_t last_ns = 0, next_seq = 0;
+	int monotonic = 0;
+	int opt_idx, opt, ctr;
+	uint32_t num;
+	FILE *fp;
+
+	static struct option opt_lst[] = {
+		{"monotonic", no_argument, 0, OPT_MONOTONIC},
+
+		{NULL, 0, 0, 0}
+	};
+
+	while (-1 != (opt = getopt_long(argc, argv, "", opt_lst, &opt_idx))) {
+		switch (opt) {
+		case OPT_MONOTONIC:
+			monotonic = 1;
+			break;
+		default:
+			puts(usage_string);
+			return -1;
+		}
+	}
+	if (optind != argc - 1) {
+		puts(usage_string);
+		return -1;
+	}
+
+	if ((fp = fopen(argv[optind], "rb")) == NULL) {
+		perror(argv[optind]);
+		return -1;
+	}
+	if (fread(&header, sizeof(header), 1, fp) != 1 ||
+	    header.magic != YAM_TRACE_MAGIC ||
+	    header.version != YAM_TRACE_VERSION ||
+	    header.record_size != sizeof(struct yam_trace_record)) {
+		printf("%s is not a libyam trace file\n", argv[optind]);
+		fclose(fp);
+		return -1;
+	}
+	printf("%u frames, %lu dropped before saving\n", header.num_records,
+	       (unsigned long)header.dropped);
+
+	for (num = 0; num < header.num_records; num++) {
+		if (fread(&rec, sizeof(rec), 1, fp) != 1) {
+			printf("File is truncated\n");
+			break;
+		}
+		if (num && rec.seq != next_seq) {
+			printf("... %lu frames missing\n",
+			       (unsigned long)(rec.seq - next_seq));
+		}
+		next_seq = rec.seq + 1;
+
+		print_time(monotonic ? rec.timestamp_ns :
+		           rec.timestamp_ns + header.realtime_offset_ns, monotonic);
+		if (num) {
+			printf(" %+10.3f ms", (rec.timestamp_ns - last_ns) / 1e6);
+		}
+		else {
+			printf(" %13s", "");
+		}
+		last_ns = rec.timestamp_ns;
+
+		printf(" %s", (rec.dir == YAM_TRACE_TX) ? "TX" : "RX");
+		for (ctr = 0; ctr < rec.len; ctr++) {
+			printf(" %.2X", rec.data[ctr]);
+		}
+		if (rec.dir == YAM_TRACE_RX && rec.status < 0) {
+			printf(" (%s)", yam_strerror(rec.status));
+		}
+		printf("\n");
+	}
+	fclose(fp);
+
+	return 0;
+}
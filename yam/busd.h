@@ -0,0 +1,46 @@
+/**
+\file busd.h
+\brief Wire protocol between libyam clients and the yam-busd bus daemon
+\author Jim George
+
+Clients talk to the daemon over a SOCK_SEQPACKET Unix socket, so each
+message is exactly one packet and needs no framing. Fields are in host byte
+order, since both ends are on the same machine. A client has at most one
+request outstanding; the sequence number lets it discard the reply to a
+request it has already given up on.
+*/
+
+#ifndef _YAM_BUSD_H_
+#define _YAM_BUSD_H_
+
+#include <stdint.h>
+#include "modbus.h"
+
+/** Default path of the daemon's socket */
+#define YAM_BUSD_DEFAULT_SOCKET "/var/run/yam-busd.sock"
+/** How long a client waits for the daemon, in milliseconds */
+#define YAM_BUSD_REPLY_TIMEOUT 30000
+
+/** Request header length: seq, timeout_ms, addr */
+#define BUSD_REQUEST_HDR_LEN 5
+/** Reply header length: seq, status, addr */
+#define BUSD_REPLY_HDR_LEN 5
+
+/** Request from a client; the PDU runs to the end of the packet */
+struct busd_request {
+	uint16_t seq; /**< Echoed in the reply */
+	uint16_t timeout_ms; /**< Slave timeout to apply, 0 for the default;
+	                          clients cap longer ones at UINT16_MAX */
+	uint8_t addr; /**< Slave address */
+	uint8_t pdu[YAM_MODBUS_MAX_PDU_LEN]; /**< Request PDU */
+} __attribute__((__packed__));
+
+/** Reply from the daemon; the PDU runs to the end of the packet */
+struct busd_reply {
+	uint16_t seq; /**< Sequence number of the request */
+	int16_t status; /**< YAM_OK, or the error code of the transaction */
+	uint8_t addr; /**< Slave address */
+	uint8_t pdu[YAM_MODBUS_MAX_PDU_LEN]; /**< Response PDU, if status is YAM_OK */
+} __attribute__((__packed__));
+
+#endif /* _YAM_BUSD_H_ */
@@ -0,0 +1,248 @@
+/**
+\file cache.c
+\brief Write-through cache of holding registers
+\author Jim George
+
+Each slave's 65536 holding registers are split into pages of
+YAM_CACHE_PAGE_REGS, allocated the first time one of their registers is
+stored, so that a cache costs memory only for the ranges actually used. Each
+register carries the CLOCK_MONOTONIC time its value was learned; a time of 0
+means the value is not known.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <assert.h>
+
+#include "modbus.h"
+#include "cache.h"
+
+struct yam_cache_page {
+	uint16_t regs[YAM_CACHE_PAGE_REGS];
+	uint64_t stamp_ns[YAM_CACHE_PAGE_REGS];
+};
+
+static uint64_t cache_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct yam_cache_slave *cache_slave(struct yam_cache *cache,
+                                           uint8_t addr)
+{
+	if (addr == 0 || addr > YAM_MAX_SLAVE_ADDR) {
+		return NULL;
+	}
+	return &cache->slaves[addr];
+}
+
+/**
+\brief Initialize a holding register cache
+\param *cache The cache to initialize
+\param fresh_ms Time a value is served for after it was learned, in
+milliseconds, 0 for YAM_CACHE_DEFAULT_FRESH_MS
+\return 0 on success, error code on failure
+*/
+int yam_cache_init(struct yam_cache *cache, unsigned int fresh_ms)
+{
+	assert(cache != NULL);
+
+	bzero(cache, sizeof(struct yam_cache));
+	cache->fresh_ms = fresh_ms ? fresh_ms : YAM_CACHE_DEFAULT_FRESH_MS;
+
+	return YAM_OK;
+}
+
+/**
+\brief Free the pages of a cache
+\param *cache The cache to free
+*/
+void yam_cache_free(struct yam_cache *cache)
+{
+	assert(cache != NULL);
+
+	int addr, page;
+
+	for (addr = 0; addr <= YAM_MAX_SLAVE_ADDR; addr++) {
+		struct yam_cache_slave *slave = &cache->slaves[addr];
+		if (slave->pages == NULL) {
+			continue;
+		}
+		for (page = 0; page < YAM_CACHE_PAGES; page++) {
+			free(slave->pages[page]);
+		}
+		free(slave->pages);
+		slave->pages = NULL;
+	}
+}
+
+/**
+\brief Set the freshness window and flags of one slave
+\param *cache The cache
+\param addr Slave address
+\param fresh_ms Freshness window for the slave, 0 for the cache default
+\param flags YAM_CACHE_BYPASS for a slave whose registers change by
+themselves, such as a controller that writes back its own setpoints
+\return 0 on success, error code on failure
+*/
+int yam_cache_set_slave(struct yam_cache *cache, uint8_t addr,
+                        unsigned int fresh_ms, unsigned int flags)
+{
+	assert(cache != NULL);
+
+	struct yam_cache_slave *slave = cache_slave(cache, addr);
+
+	if (slave == NULL) {
+		return YAM_ILLEGAL_DATA_VALUE;
+	}
+	slave->fresh_ms = fresh_ms;
+	slave->flags = flags;
+
+	return YAM_OK;
+}
+
+/**
+\brief Read a range of registers from the cache
+\param *cache The cache
+\param addr Slave address
+\param start_addr First register
+\param count Number of registers
+\param *regs Location to store the registers
+\return 0 if every register was known and fresh, 1 otherwise
+
+Either the whole range is served, or *regs is left unmodified.
+*/
+int yam_cache_lookup(struct yam_cache *cache, uint8_t addr,
+                     uint16_t start_addr, uint16_t count, uint16_t *regs)
+{
+	assert(cache != NULL);
+	assert(regs != NULL);
+
+	struct yam_cache_slave *slave = cache_slave(cache, addr);
+	struct yam_cache_page *page;
+	uint64_t oldest;
+	unsigned int reg, end = start_addr + count;
+
+	if (slave == NULL || slave->pages == NULL ||
+	    (slave->flags & YAM_CACHE_BYPASS) || end > 65536) {
+		cache->stats.misses++;
+		return 1;
+	}
+	oldest = cache_now() -
+	         (slave->fresh_ms ? slave->fresh_ms : cache->fresh_ms) * 1000000ULL;
+
+	for (reg = start_addr; reg < end; reg++) {
+		page = slave->pages[reg / YAM_CACHE_PAGE_REGS];
+		if (page == NULL ||
+		    page->stamp_ns[reg % YAM_CACHE_PAGE_REGS] == 0 ||
+		    page->stamp_ns[reg % YAM_CACHE_PAGE_REGS] < oldest) {
+			cache->stats.misses++;
+			return 1;
+		}
+	}
+	for (reg = start_addr; reg < end; reg++) {
+		page = slave->pages[reg / YAM_CACHE_PAGE_REGS];
+		regs[reg - start_addr] = page->regs[reg % YAM_CACHE_PAGE_REGS];
+	}
+	cache->stats.hits++;
+
+	return YAM_OK;
+}
+
+/**
+\brief Store the values of a range of registers
+\param *cache The cache
+\param addr Slave address, 0 for a broadcast write (the range is then
+invalidated on every slave, since not all of them may have taken it)
+\param start_addr First register
+\param count Number of registers
+\param *regs The values
+\return 0 on success, error code on failure
+*/
+int yam_cache_store(struct yam_cache *cache, uint8_t addr,
+                    uint16_t start_addr, uint16_t count, const uint16_t *regs)
+{
+	assert(cache != NULL);
+	assert(regs != NULL);
+
+	struct yam_cache_slave *slave;
+	struct yam_cache_page *page;
+	uint64_t now = cache_now();
+	unsigned int reg, end = start_addr + count;
+
+	if (addr == 0) {
+		yam_cache_invalidate(cache, 0, start_addr, count);
+		return YAM_OK;
+	}
+	if ((slave = cache_slave(cache, addr)) == NULL || end > 65536) {
+		return YAM_ILLEGAL_DATA_VALUE;
+	}
+	if (slave->pages == NULL) {
+		slave->pages = calloc(YAM_CACHE_PAGES,
+		                      sizeof(struct yam_cache_page *));
+		if (slave->pages == NULL) {
+			return YAM_NO_MEMORY;
+		}
+	}
+	for (reg = start_addr; reg < end; reg++) {
+		page = slave->pages[reg / YAM_CACHE_PAGE_REGS];
+		if (page == NULL) {
+			page = calloc(1, sizeof(struct yam_cache_page));
+			if (page == NULL) {
+				return YAM_NO_MEMORY;
+			}
+			slave->pages[reg / YAM_CACHE_PAGE_REGS] = page;
+		}
+		page->regs[reg % YAM_CACHE_PAGE_REGS] = regs[reg - start_addr];
+		page->stamp_ns[reg % YAM_CACHE_PAGE_REGS] = now;
+	}
+	cache->stats.stores++;
+
+	return YAM_OK;
+}
+
+/**
+\brief Forget cached registers
+\param *cache The cache
+\param addr Slave address, 0 for every slave
+\param start_addr First register
+\param count Number of registers, 0 for every register from start_addr up
+
+The next read of the range goes to the bus.
+*/
+void yam_cache_invalidate(struct yam_cache *cache, uint8_t addr,
+                          uint16_t start_addr, unsigned int count)
+{
+	assert(cache != NULL);
+
+	struct yam_cache_slave *slave;
+	struct yam_cache_page *page;
+	unsigned int reg, end;
+	int first = addr, last = addr;
+
+	if (addr == 0) {
+		first = 1;
+		last = YAM_MAX_SLAVE_ADDR;
+	}
+	end = (count == 0 || start_addr + count > 65536) ? 65536 :
+	      start_addr + count;
+	for (; first <= last; first++) {
+		slave = cache_slave(cache, first);
+		if (slave == NULL || slave->pages == NULL) {
+			continue;
+		}
+		for (reg = start_addr; reg < end; reg++) {
+			page = slave->pages[reg / YAM_CACHE_PAGE_REGS];
+			if (page == NULL) {
+				/* Skip to the start of the next page */
+				reg |= YAM_CACHE_PAGE_REGS - 1;
+				continue;
+			}
+			page->stamp_ns[reg % YAM_CACHE_PAGE_REGS] = 0;
+		}
+	}
+}
@@ -0,0 +1,70 @@
+/**
+\file cache.h
+\brief Include file for the YAM holding register cache
+\author Jim George
+*/
+
+#ifndef _YAM_CACHE_H_
+#define _YAM_CACHE_H_
+
+#include <stdint.h>
+#include "modbus.h"
+
+/** Registers per cache page */
+#define YAM_CACHE_PAGE_REGS 64
+/** Pages covering the register address space of one slave */
+#define YAM_CACHE_PAGES (65536 / YAM_CACHE_PAGE_REGS)
+/** Default time a cached value is served for, in milliseconds */
+#define YAM_CACHE_DEFAULT_FRESH_MS 1000
+
+/* Per-slave cache flags */
+/** Never serve reads of this slave from the cache (values are still kept) */
+#define YAM_CACHE_BYPASS (1 << 0)
+
+struct yam_cache_page;
+
+/**
+\brief Cached registers of one slave
+*/
+struct yam_cache_slave {
+	struct yam_cache_page **pages; /**< Page directory, allocated on first
+	                                    use */
+	unsigned int fresh_ms; /**< Freshness window, 0 for the cache default */
+	unsigned int flags; /**< YAM_CACHE_* */
+};
+
+/**
+\brief Cache counters
+*/
+struct yam_cache_stats {
+	unsigned long hits; /**< Reads served from the cache */
+	unsigned long misses; /**< Reads that had to go to the bus */
+	unsigned long stores; /**< Ranges stored from replies and writes */
+};
+
+/**
+\brief Holding register cache
+
+Keeps the last value known for each holding register of each slave, with
+the time it was learned, from read replies and from successful writes. A
+read whose whole range is known and fresher than the window is answered from
+the cache. See yam_set_cache().
+*/
+struct yam_cache {
+	unsigned int fresh_ms; /**< Default freshness window */
+	struct yam_cache_slave slaves[YAM_MAX_SLAVE_ADDR + 1]; /**< Per slave */
+	struct yam_cache_stats stats; /**< Counters */
+};
+
+int yam_cache_init(struct yam_cache *cache, unsigned int fresh_ms);
+void yam_cache_free(struct yam_cache *cache);
+int yam_cache_set_slave(struct yam_cache *cache, uint8_t addr,
+                        unsigned int fresh_ms, unsigned int flags);
+int yam_cache_lookup(struct yam_cache *cache, uint8_t addr,
+                     uint16_t start_addr, uint16_t count, uint16_t *regs);
+int yam_cache_store(struct yam_cache *cache, uint8_t addr,
+                    uint16_t start_addr, uint16_t count, const uint16_t *regs);
+void yam_cache_invalidate(struct yam_cache *cache, uint8_t addr,
+                          uint16_t start_addr, unsigned int count);
+
+#endif /* _YAM_CACHE_H_ */
@@ -0,0 +1,468 @@
+/**
+\file capture.c
+\brief Capture files of bus traffic, in pcap format, and their replay
+\author Jim George
+
+Captures are pcap files with nanosecond timestamps and the LINKTYPE_USER0
+link type, so that the usual tools can open them; each frame carries a small
+pseudo-header with its direction, its result and the bus parameters (see
+struct yam_capture_frame). Wireshark shows the frames as Modbus/RTU once
+USER0 is mapped to the mbrtu dissector with a header size of 8.
+
+A capture is replayed either through a bus, whose transport then answers
+each request with the reply recorded after it, so that the same calls run
+through the same decoder as in the field, or into a register image acting
+as the slave.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+#include <arpa/inet.h>
+
+#include "modbus.h"
+#include "image.h"
+#include "trace.h"
+#include "capture.h"
+#include "transport.h"
+
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_record_header {
+	uint32_t ts_sec;
+	uint32_t ts_frac;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+static uint64_t capture_now_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+\brief Create a capture file
+\param *cap The capture to initialize
+\param *path Path of the file, which is replaced if it exists
+\return 0 on success, YAM_FILE_FAILED on failure
+
+Attach the capture to a bus with yam_set_capture(), and close it with
+yam_capture_close() once it is detached.
+*/
+int yam_capture_open(struct yam_capture *cap, const char *path)
+{
+	assert(cap != NULL);
+	assert(path != NULL);
+
+	struct pcap_file_header header;
+
+	bzero(cap, sizeof(struct yam_capture));
+	if ((cap->fp = fopen(path, "wb")) == NULL) {
+		return YAM_FILE_FAILED;
+	}
+
+	bzero(&header, sizeof(header));
+	header.magic = YAM_PCAP_MAGIC_NS;
+	header.version_major = 2;
+	header.version_minor = 4;
+	header.snaplen = YAM_CAPTURE_SNAPLEN;
+	header.linktype = YAM_CAPTURE_LINKTYPE;
+	if (fwrite(&header, sizeof(header), 1, cap->fp) != 1) {
+		fclose(cap->fp);
+		cap->fp = NULL;
+		return YAM_FILE_FAILED;
+	}
+
+	return YAM_OK;
+}
+
+/**
+\brief Add a frame to a capture
+\param *cap The capture
+\param *bus The bus the frame was seen on
+\param dir YAM_TRACE_TX or YAM_TRACE_RX
+\param *adu The frame
+\param len Length of the frame
+\param status For replies, the frame length or the error it failed with
+
+Called by the library for every frame on a bus with a capture attached.
+*/
+void yam_capture_frame(struct yam_capture *cap, struct yam_modbus *bus,
+                       int dir, const uint8_t *adu, int len, int status)
+{
+	struct pcap_record_header rec;
+	uint8_t pseudo[YAM_CAPTURE_PSEUDO_LEN];
+	uint64_t now = capture_now_ns(CLOCK_REALTIME);
+	uint16_t status16 = htons((uint16_t)(int16_t)status);
+	uint32_t baud = htonl(bus->baudrate);
+
+	if (cap->fp == NULL || cap->failed) {
+		return;
+	}
+	if (len > YAM_MODBUS_MAX_ADU_LEN) {
+		len = YAM_MODBUS_MAX_ADU_LEN;
+	}
+
+	rec.ts_sec = now / 1000000000ULL;
+	rec.ts_frac = now % 1000000000ULL;
+	rec.incl_len = rec.orig_len = YAM_CAPTURE_PSEUDO_LEN + len;
+	pseudo[0] = dir;
+	pseudo[1] = bus->flags;
+	memcpy(&pseudo[2], &status16, 2);
+	memcpy(&pseudo[4], &baud, 4);
+
+	if (fwrite(&rec, sizeof(rec), 1, cap->fp) != 1 ||
+	    fwrite(pseudo, sizeof(pseudo), 1, cap->fp) != 1 ||
+	    fwrite(adu, 1, len, cap->fp) != (size_t)len) {
+		cap->failed = 1;
+		return;
+	}
+	cap->frames++;
+}
+
+/**
+\brief Close a capture file
+\param *cap The capture, which must no longer be attached to a bus
+\return 0 on success, YAM_FILE_FAILED if any frame could not be written
+*/
+int yam_capture_close(struct yam_capture *cap)
+{
+	assert(cap != NULL);
+
+	int ok = !cap->failed;
+
+	if (cap->fp) {
+		ok = !fclose(cap->fp) && ok;
+		cap->fp = NULL;
+	}
+
+	return ok ? YAM_OK : YAM_FILE_FAILED;
+}
+
+static uint32_t replay_u32(struct yam_replay *rep, uint32_t value)
+{
+	return rep->swapped ? __builtin_bswap32(value) : value;
+}
+
+/**
+\brief Open a capture file for replay
+\param *rep The replay to initialize
+\param *path Path of the capture
+\param flags YAM_REPLAY_REALTIME to replay requests with their recorded
+spacing, 0 to replay them as fast as possible
+\return 0 on success, YAM_FILE_FAILED if the file cannot be read or is not
+a Modbus/RTU capture
+*/
+int yam_replay_open(struct yam_replay *rep, const char *path,
+                    unsigned int flags)
+{
+	assert(rep != NULL);
+	assert(path != NULL);
+
+	struct pcap_file_header header;
+
+	bzero(rep, sizeof(struct yam_replay));
+	rep->flags = flags;
+	if ((rep->fp = fopen(path, "rb")) == NULL) {
+		return YAM_FILE_FAILED;
+	}
+	if (fread(&header, sizeof(header), 1, rep->fp) != 1) {
+		yam_replay_close(rep);
+		return YAM_FILE_FAILED;
+	}
+
+	if (header.magic == YAM_PCAP_MAGIC_NS ||
+	    header.magic == YAM_PCAP_MAGIC_US) {
+		rep->swapped = 0;
+	}
+	else if (__builtin_bswap32(header.magic) == YAM_PCAP_MAGIC_NS ||
+	         __builtin_bswap32(header.magic) == YAM_PCAP_MAGIC_US) {
+		rep->swapped = 1;
+	}
+	else {
+		yam_replay_close(rep);
+		return YAM_FILE_FAILED;
+	}
+	rep->nanosecond = replay_u32(rep, header.magic) == YAM_PCAP_MAGIC_NS;
+	if (replay_u32(rep, header.linktype) != YAM_CAPTURE_LINKTYPE) {
+		yam_replay_close(rep);
+		return YAM_FILE_FAILED;
+	}
+
+	return YAM_OK;
+}
+
+static int replay_read(struct yam_replay *rep, struct yam_capture_frame *frame)
+{
+	struct pcap_record_header rec;
+	uint8_t pseudo[YAM_CAPTURE_PSEUDO_LEN];
+	uint32_t len, skip;
+	uint16_t status16;
+	uint32_t baud;
+
+	if (fread(&rec, sizeof(rec), 1, rep->fp) != 1) {
+		return 0;
+	}
+	len = replay_u32(rep, rec.incl_len);
+	if (len < YAM_CAPTURE_PSEUDO_LEN ||
+	    fread(pseudo, sizeof(pseudo), 1, rep->fp) != 1) {
+		return 0;
+	}
+	len -= YAM_CAPTURE_PSEUDO_LEN;
+	skip = 0;
+	if (len > YAM_MODBUS_MAX_ADU_LEN) {
+		skip = len - YAM_MODBUS_MAX_ADU_LEN;
+		len = YAM_MODBUS_MAX_ADU_LEN;
+	}
+	if (fread(frame->data, 1, len, rep->fp) != len ||
+	    (skip && fseek(rep->fp, skip, SEEK_CUR))) {
+		return 0;
+	}
+
+	frame->timestamp_ns = (uint64_t)replay_u32(rep, rec.ts_sec) * 1000000000ULL +
+	                      (uint64_t)replay_u32(rep, rec.ts_frac) *
+	                      (rep->nanosecond ? 1 : 1000);
+	frame->dir = pseudo[0];
+	frame->flags = pseudo[1];
+	memcpy(&status16, &pseudo[2], 2);
+	memcpy(&baud, &pseudo[4], 4);
+	frame->status = (int16_t)ntohs(status16);
+	frame->baudrate = ntohl(baud);
+	frame->len = len;
+
+	return 1;
+}
+
+static struct yam_capture_frame *replay_peek(struct yam_replay *rep)
+{
+	if (!rep->have_next) {
+		rep->have_next = replay_read(rep, &rep->next);
+	}
+	return rep->have_next ? &rep->next : NULL;
+}
+
+/**
+\brief Read the next frame of a capture
+\param *rep The replay
+\param *frame Location to store the frame
+\return 1 if a frame was read, 0 at the end of the capture
+*/
+int yam_replay_next(struct yam_replay *rep, struct yam_capture_frame *frame)
+{
+	assert(rep != NULL);
+	assert(frame != NULL);
+
+	if (replay_peek(rep) == NULL) {
+		return 0;
+	}
+	*frame = rep->next;
+	rep->have_next = 0;
+	return 1;
+}
+
+/**
+\brief Close a capture being replayed
+\param *rep The replay, which must no longer be used by a bus
+*/
+void yam_replay_close(struct yam_replay *rep)
+{
+	assert(rep != NULL);
+
+	if (rep->fp) {
+		fclose(rep->fp);
+		rep->fp = NULL;
+	}
+	rep->have_next = 0;
+}
+
+/* Wait until the request recorded at ts_ns is due, if pacing in real time */
+static void replay_pace(struct yam_replay *rep, uint64_t ts_ns)
+{
+	struct timespec ts;
+	uint64_t due;
+
+	if (rep->requests == 0) {
+		rep->first_ns = ts_ns;
+		rep->start_ns = capture_now_ns(CLOCK_MONOTONIC);
+	}
+	if (!(rep->flags & YAM_REPLAY_REALTIME) || ts_ns < rep->first_ns) {
+		return;
+	}
+	due = rep->start_ns + (ts_ns - rep->first_ns);
+	ts.tv_sec = due / 1000000000ULL;
+	ts.tv_nsec = due % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* Skip to the next request of the capture */
+static struct yam_capture_frame *replay_next_request(struct yam_replay *rep)
+{
+	struct yam_capture_frame *frame;
+
+	while ((frame = replay_peek(rep)) != NULL && frame->dir != YAM_TRACE_TX) {
+		rep->have_next = 0;
+	}
+	return frame;
+}
+
+static int replay_send(struct yam_modbus *bus, const uint8_t *buf, size_t len)
+{
+	struct yam_replay *rep = bus->transport_data;
+	struct yam_capture_frame *req, *resp;
+
+	rep->reply.len = 0;
+	rep->reply_off = 0;
+	if ((req = replay_next_request(rep)) == NULL) {
+		rep->missing++;
+		return len;
+	}
+	replay_pace(rep, req->timestamp_ns);
+	rep->requests++;
+	if (req->len != len || memcmp(req->data, buf, len)) {
+		rep->mismatches++;
+	}
+	rep->have_next = 0;
+
+	/* The reply is whatever was received before the next request */
+	if ((resp = replay_peek(rep)) != NULL && resp->dir == YAM_TRACE_RX) {
+		rep->reply = *resp;
+		rep->have_next = 0;
+	}
+	return len;
+}
+
+static int replay_recv(struct yam_modbus *bus, uint8_t *buf, size_t len,
+                       int timeout_ms)
+{
+	struct yam_replay *rep = bus->transport_data;
+	int avail = rep->reply.len - rep->reply_off;
+
+	(void)timeout_ms;
+	/* Recorded timeouts and truncated replies time out at once */
+	if (avail <= 0) {
+		return 0;
+	}
+	if ((int)len > avail) {
+		len = avail;
+	}
+	memcpy(buf, &rep->reply.data[rep->reply_off], len);
+	rep->reply_off += len;
+	return len;
+}
+
+static void replay_flush(struct yam_modbus *bus)
+{
+	struct yam_replay *rep = bus->transport_data;
+
+	rep->reply_off = rep->reply.len;
+}
+
+static void replay_close(struct yam_modbus *bus)
+{
+	bus->transport_data = NULL;
+}
+
+static const struct yam_transport replay_transport = {
+	.name = "replay",
+	.send = replay_send,
+	.recv = replay_recv,
+	.flush = replay_flush,
+	.close = replay_close,
+};
+
+/**
+\brief Initialize a YAM object that replays a capture
+\param *rep A capture opened with yam_replay_open()
+\param *bus The YAM object representing the Modbus
+\return YAM_OK on success, error code on failure
+
+Use this instead of yam_modbus_init() to run a program against a capture.
+Each request the program sends consumes the next request of the capture and
+is answered with the reply recorded after it, which goes through the same
+decoder, retries and accounting as on a real bus; a recorded timeout times
+out at once. Requests that differ from the recorded ones are counted in
+rep->mismatches, and requests past the end of the capture in rep->missing.
+The capture is not closed with the bus.
+*/
+int yam_modbus_replay(struct yam_replay *rep, struct yam_modbus *bus)
+{
+	assert(rep != NULL);
+	assert(bus != NULL);
+
+	struct yam_capture_frame *first;
+
+	if (yam_bus_setup(bus, &replay_transport, rep, "replay")) {
+		return (bus->last_errorcode = YAM_NO_MEMORY);
+	}
+	/* Take the bus parameters from the capture, for the time accounting */
+	if ((first = replay_peek(rep)) != NULL) {
+		bus->baudrate = first->baudrate;
+		bus->flags = first->flags;
+	}
+
+	return (bus->last_errorcode = YAM_OK);
+}
+
+/**
+\brief Replay the requests of a capture into a register image
+\param *rep A capture opened with yam_replay_open()
+\param *image The image acting as the slave
+\return YAM_OK on success, error code on failure
+
+Every request of the capture is applied to the image with
+yam_image_process(), as a simulated slave would. Where the capture holds a
+good reply to the request, it is compared with the simulated one, and the
+replies that differ are counted in rep->mismatches. Requests go in as fast
+as possible, or with their recorded spacing if the replay was opened with
+YAM_REPLAY_REALTIME.
+*/
+int yam_replay_slave(struct yam_replay *rep, struct yam_image *image)
+{
+	assert(rep != NULL);
+	assert(image != NULL);
+
+	struct yam_capture_frame req, *resp;
+	uint8_t adu[YAM_MODBUS_MAX_ADU_LEN];
+	uint16_t crc;
+	int len;
+
+	while (replay_next_request(rep) != NULL) {
+		yam_replay_next(rep, &req);
+		replay_pace(rep, req.timestamp_ns);
+		rep->requests++;
+		if (req.len < 4 || yam_crc16(req.data, req.len)) {
+			continue;
+		}
+
+		adu[0] = req.data[0];
+		len = 1 + yam_image_process(image, &req.data[1], req.len - 3, &adu[1]);
+		crc = yam_crc16(adu, len);
+		adu[len++] = crc >> 8;
+		adu[len++] = crc & 0xFF;
+
+		resp = replay_peek(rep);
+		if (req.data[0] != 0 && resp != NULL && resp->dir == YAM_TRACE_RX &&
+		    resp->status > 0 &&
+		    (resp->len != len || memcmp(resp->data, adu, len))) {
+			rep->mismatches++;
+		}
+	}
+
+	return YAM_OK;
+}
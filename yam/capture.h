@@ -0,0 +1,91 @@
+/**
+\file capture.h
+\brief Include file for YAM capture files and their replay
+\author Jim George
+*/
+
+#ifndef _YAM_CAPTURE_H_
+#define _YAM_CAPTURE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "modbus.h"
+#include "image.h"
+
+/** Magic number of pcap files with nanosecond timestamps */
+#define YAM_PCAP_MAGIC_NS 0xA1B23C4D
+/** Magic number of pcap files with microsecond timestamps */
+#define YAM_PCAP_MAGIC_US 0xA1B2C3D4
+/** Link type of the frames (LINKTYPE_USER0, as pcap has none for Modbus/RTU) */
+#define YAM_CAPTURE_LINKTYPE 147
+/** Length of the pseudo-header that precedes each frame */
+#define YAM_CAPTURE_PSEUDO_LEN 8
+/** Longest frame kept in a capture */
+#define YAM_CAPTURE_SNAPLEN (YAM_CAPTURE_PSEUDO_LEN + YAM_MODBUS_MAX_ADU_LEN)
+
+/** Pace replayed requests as they were recorded, instead of at full speed */
+#define YAM_REPLAY_REALTIME (1 << 0)
+
+/**
+\brief A frame of a capture
+
+In the file, each frame starts with a pseudo-header of
+YAM_CAPTURE_PSEUDO_LEN bytes, in network byte order: the direction (one
+byte), the serial flags (one byte), the status (two bytes, signed) and the
+baud rate (four bytes). The ADU follows, CRC included.
+*/
+struct yam_capture_frame {
+	uint64_t timestamp_ns; /**< CLOCK_REALTIME time the frame was recorded */
+	uint8_t dir; /**< YAM_TRACE_TX for requests, YAM_TRACE_RX for replies */
+	uint8_t flags; /**< Serial flags of the bus (YAM_SERIAL_FLAGS_*) */
+	int16_t status; /**< 0 for requests; for replies, the ADU length or the
+	                     error they failed with */
+	uint32_t baudrate; /**< Speed of the bus */
+	uint16_t len; /**< Length of the ADU */
+	uint8_t data[YAM_MODBUS_MAX_ADU_LEN]; /**< The ADU */
+};
+
+/**
+\brief A capture file being written
+
+Frames are written with buffered stdio by the thread driving the bus, as
+they are sent and received. See yam_set_capture().
+*/
+struct yam_capture {
+	FILE *fp; /**< The file */
+	uint64_t frames; /**< Frames written */
+	int failed; /**< Nonzero once a write has failed */
+};
+
+/**
+\brief A capture file being replayed
+*/
+struct yam_replay {
+	FILE *fp; /**< The file */
+	int swapped; /**< Nonzero if the file has the other byte order */
+	int nanosecond; /**< Nonzero if timestamps are in nanoseconds */
+	unsigned int flags; /**< YAM_REPLAY_* flags */
+	struct yam_capture_frame next; /**< Frame read ahead */
+	int have_next; /**< Nonzero if next holds a frame */
+	uint64_t first_ns; /**< Capture time of the first request replayed */
+	uint64_t start_ns; /**< CLOCK_MONOTONIC time it was replayed */
+	struct yam_capture_frame reply; /**< Reply being served to a bus */
+	int reply_off; /**< Bytes of reply served so far */
+	uint64_t requests; /**< Requests replayed */
+	uint64_t mismatches; /**< Requests that differed from the recorded ones */
+	uint64_t missing; /**< Requests sent after the end of the capture */
+};
+
+int yam_capture_open(struct yam_capture *cap, const char *path);
+void yam_capture_frame(struct yam_capture *cap, struct yam_modbus *bus,
+                       int dir, const uint8_t *adu, int len, int status);
+int yam_capture_close(struct yam_capture *cap);
+
+int yam_replay_open(struct yam_replay *rep, const char *path,
+                    unsigned int flags);
+int yam_replay_next(struct yam_replay *rep, struct yam_capture_frame *frame);
+void yam_replay_close(struct yam_replay *rep);
+int yam_modbus_replay(struct yam_replay *rep, struct yam_modbus *bus);
+int yam_replay_slave(struct yam_replay *rep, struct yam_image *image);
+
+#endif /* _YAM_CAPTURE_H_ */
@@ -0,0 +1,223 @@
+/**
+\file change.c
+\brief Change detection with deadbands on polled reads
+\author Jim George
+
+Most polled values do not change from one poll to the next, so the new data
+of a read is first compared with the previous data a machine word at a time,
+and only the coils or registers in words that differ are looked at. Each of
+those that belongs to a tag is compared with the value last reported for the
+tag, and reported if it moved past the tag's deadband. Comparing against the
+last reported value rather than the previous poll means that a slow drift is
+reported once it adds up, instead of being lost in steps below the deadband.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+
+#include "modbus.h"
+#include "change.h"
+
+static double watch_signed(const struct yam_tag *tag, uint16_t value)
+{
+	return (tag->flags & YAM_TAG_SIGNED) ? (double)(int16_t)value : value;
+}
+
+static int watch_exceeds(const struct yam_tag *tag, uint16_t value)
+{
+	double now = watch_signed(tag, value);
+	double last = watch_signed(tag, tag->value);
+	double diff = (now > last) ? now - last : last - now;
+
+	if (tag->type == YAM_DEADBAND_PERCENT) {
+		return diff * 100.0 > tag->deadband * ((last < 0) ? -last : last);
+	}
+	return diff > tag->deadband;
+}
+
+static uint16_t watch_value(struct yam_watch *watch, const uint8_t *data,
+                            size_t elem)
+{
+	if (watch->elem_size == 1) {
+		return data[elem];
+	}
+	return ((const uint16_t *)data)[elem];
+}
+
+static int watch_report(struct yam_watch *watch, int tag_idx, uint16_t value)
+{
+	struct yam_tag *tag = &watch->tags[tag_idx];
+
+	if (tag->reported && !watch_exceeds(tag, value)) {
+		return 0;
+	}
+	tag->value = value;
+	tag->reported = 1;
+	watch->changes++;
+	if (watch->fn) {
+		watch->fn(watch->arg, tag);
+	}
+	return 1;
+}
+
+/**
+\brief Set up change detection on a read request
+\param *watch The watch to initialize
+\param *req The read request, whose data buffer is compared after each
+execution
+\param *tags Array of tags, or NULL to watch every coil or register with no
+deadband
+\param num_tags Number of tags in the array
+\param fn Function called for each tag that changed
+\param *arg Argument passed to fn
+\return 0 on success, error code on failure
+
+The request and the tags are used in place, and must stay valid while the
+watch is in use.
+*/
+int yam_watch_init(struct yam_watch *watch, struct yam_request *req,
+                   struct yam_tag *tags, int num_tags,
+                   yam_watch_fn fn, void *arg)
+{
+	assert(watch != NULL);
+	assert(req != NULL);
+
+	int ctr;
+
+	bzero(watch, sizeof(struct yam_watch));
+	switch (req->fncode) {
+	case YAM_READ_COILS:
+	case YAM_READ_DISCRETES:
+		watch->elem_size = 1;
+		break;
+	case YAM_READ_REGISTERS:
+	case YAM_READ_INPUTS:
+		watch->elem_size = 2;
+		break;
+	default:
+		return YAM_ILLEGAL_FUNCTION;
+	}
+	watch->req = req;
+	watch->fn = fn;
+	watch->arg = arg;
+	watch->image_len = req->count * watch->elem_size;
+
+	if (tags == NULL) {
+		num_tags = req->count;
+		tags = calloc(num_tags, sizeof(struct yam_tag));
+		if (tags == NULL) {
+			return YAM_NO_MEMORY;
+		}
+		for (ctr = 0; ctr < num_tags; ctr++) {
+			tags[ctr].index = ctr;
+		}
+		watch->own_tags = 1;
+	}
+	watch->tags = tags;
+	watch->num_tags = num_tags;
+
+	watch->image = malloc(watch->image_len);
+	watch->tag_of = malloc(req->count * sizeof(int));
+	if (watch->image == NULL || watch->tag_of == NULL) {
+		yam_watch_free(watch);
+		return YAM_NO_MEMORY;
+	}
+	for (ctr = 0; ctr < req->count; ctr++) {
+		watch->tag_of[ctr] = -1;
+	}
+	for (ctr = 0; ctr < num_tags; ctr++) {
+		if (tags[ctr].index >= req->count) {
+			yam_watch_free(watch);
+			return YAM_ILLEGAL_DATA_ADDR;
+		}
+		tags[ctr].reported = 0;
+		watch->tag_of[tags[ctr].index] = ctr;
+	}
+
+	return YAM_OK;
+}
+
+/**
+\brief Compare the latest data of a watched read and report changes
+\param *watch The watch
+\return Number of tags reported
+
+Call after each execution of the request (the scheduler does this for tasks
+with a watch, see struct yam_sched_task). Nothing is compared if the request
+failed. The first call after yam_watch_init() reports every tag, so that
+consumers start with a full picture.
+*/
+int yam_watch_update(struct yam_watch *watch)
+{
+	assert(watch != NULL);
+
+	const uint8_t *data = watch->req->data;
+	size_t len = watch->image_len, off, chunk, elem;
+	uint64_t now, last;
+	int ctr, reported = 0;
+
+	if (watch->req->status < 0) {
+		return 0;
+	}
+	watch->samples++;
+
+	if (!watch->primed) {
+		for (ctr = 0; ctr < watch->num_tags; ctr++) {
+			reported += watch_report(watch, ctr,
+			                         watch_value(watch, data, watch->tags[ctr].index));
+		}
+		memcpy(watch->image, data, len);
+		watch->primed = 1;
+		return reported;
+	}
+
+	for (off = 0; off < len; off += chunk) {
+		chunk = (len - off < sizeof(uint64_t)) ? len - off : sizeof(uint64_t);
+		if (chunk == sizeof(uint64_t)) {
+			memcpy(&now, data + off, sizeof(uint64_t));
+			memcpy(&last, watch->image + off, sizeof(uint64_t));
+			if (now == last) {
+				continue;
+			}
+		}
+		else if (!memcmp(data + off, watch->image + off, chunk)) {
+			continue;
+		}
+		/* Chunks are a whole number of coils or registers */
+		for (elem = off / watch->elem_size;
+		     elem < (off + chunk) / watch->elem_size; elem++) {
+			uint16_t value = watch_value(watch, data, elem);
+			if (watch->tag_of[elem] >= 0 &&
+			    value != watch_value(watch, watch->image, elem)) {
+				reported += watch_report(watch, watch->tag_of[elem], value);
+			}
+		}
+		memcpy(watch->image + off, data + off, chunk);
+	}
+
+	return reported;
+}
+
+/**
+\brief Free the image and tables of a watch
+\param *watch The watch to free
+
+Tags given to yam_watch_init() belong to the caller and are left alone.
+*/
+void yam_watch_free(struct yam_watch *watch)
+{
+	assert(watch != NULL);
+
+	if (watch->own_tags) {
+		free(watch->tags);
+	}
+	free(watch->image);
+	free(watch->tag_of);
+	watch->tags = NULL;
+	watch->image = NULL;
+	watch->tag_of = NULL;
+	watch->num_tags = 0;
+	watch->own_tags = 0;
+}
@@ -0,0 +1,76 @@
+/**
+\file change.h
+\brief Include file for YAM change detection
+\author Jim George
+*/
+
+#ifndef _YAM_CHANGE_H_
+#define _YAM_CHANGE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "modbus.h"
+
+/* Deadband types */
+/** Report when the value moves more than deadband counts */
+#define YAM_DEADBAND_ABSOLUTE 0
+/** Report when the value moves more than deadband percent of the value
+last reported */
+#define YAM_DEADBAND_PERCENT 1
+
+/* Tag flags */
+/** The register holds a signed (two's complement) value */
+#define YAM_TAG_SIGNED (1 << 0)
+
+/**
+\brief One watched coil or register of a read
+
+Fill in index, and optionally type, deadband, flags and user. The value and
+reported fields are kept by the watch. A deadband of 0 reports every change.
+*/
+struct yam_tag {
+	uint16_t index; /**< Offset of the coil or register within the read */
+	int type; /**< YAM_DEADBAND_ABSOLUTE or YAM_DEADBAND_PERCENT */
+	double deadband; /**< Change that must be exceeded before reporting */
+	unsigned int flags; /**< YAM_TAG_* */
+	void *user; /**< For the caller, to identify the tag */
+	uint16_t value; /**< Value last reported */
+	int reported; /**< Nonzero once a value has been reported */
+};
+
+/**
+\brief Callback for each changed tag
+\param *arg Argument given to yam_watch_init()
+\param *tag The tag; tag->value holds the new value
+*/
+typedef void (*yam_watch_fn)(void *arg, struct yam_tag *tag);
+
+/**
+\brief Change detection on one read request
+
+Keeps the image from the previous execution of the request and, after each
+new one, reports the tags whose value moved past their deadband.
+*/
+struct yam_watch {
+	struct yam_request *req; /**< The watched read */
+	struct yam_tag *tags; /**< Tags of the read */
+	int num_tags; /**< Number of tags */
+	int own_tags; /**< Nonzero if tags was allocated by yam_watch_init() */
+	uint8_t *image; /**< Data of the previous execution */
+	size_t image_len; /**< Size of the image in bytes */
+	size_t elem_size; /**< Bytes per coil or register in the image */
+	int *tag_of; /**< Tag of each coil or register, -1 for none */
+	int primed; /**< Nonzero once image holds data */
+	yam_watch_fn fn; /**< Called for each changed tag */
+	void *arg; /**< Argument passed to fn */
+	unsigned long samples; /**< Executions compared */
+	unsigned long changes; /**< Tags reported */
+};
+
+int yam_watch_init(struct yam_watch *watch, struct yam_request *req,
+                   struct yam_tag *tags, int num_tags,
+                   yam_watch_fn fn, void *arg);
+int yam_watch_update(struct yam_watch *watch);
+void yam_watch_free(struct yam_watch *watch);
+
+#endif /* _YAM_CHANGE_H_ */
@@ -0,0 +1,185 @@
+/**
+\file client.c
+\brief Transport that reaches the bus through the yam-busd daemon.
+\author Jim George
+
+A YAM object connected with yam_modbus_connect() hands each request to the
+bus daemon instead of writing it to a serial port. The daemon performs the
+transaction and sends back the reply PDU, which is turned back into an RTU
+ADU here, so the normal reply parser in modbus.c sees the same bytes it
+would have read from the port.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "modbus.h"
+#include "transport.h"
+#include "busd.h"
+
+struct busd_client {
+	uint16_t seq; /* Sequence number of the outstanding request */
+	int have_reply; /* Reply to the outstanding request has arrived */
+	int len, off; /* Reconstructed reply ADU, and how much has been read */
+	uint8_t adu[YAM_MODBUS_MAX_ADU_LEN];
+};
+
+static int busd_send(struct yam_modbus *bus, const uint8_t *buf, size_t len)
+{
+	struct busd_client *client = bus->transport_data;
+	struct busd_request req;
+	int pdu_len = len - 3;
+
+	if (len < 3 || pdu_len > YAM_MODBUS_MAX_PDU_LEN) {
+		return YAM_INVALIDBYTECOUNT;
+	}
+	client->seq++;
+	client->have_reply = 0;
+	client->len = client->off = 0;
+
+	req.seq = client->seq;
+	/* The field is 16 bits wide, so longer timeouts are capped */
+	req.timeout_ms = (bus->timeout_ms > UINT16_MAX) ? UINT16_MAX :
+	                 bus->timeout_ms;
+	req.addr = buf[0];
+	memcpy(req.pdu, &buf[1], pdu_len);
+	if (0 > send(bus->serial, &req, BUSD_REQUEST_HDR_LEN + pdu_len,
+	             MSG_NOSIGNAL)) {
+		return YAM_SOCKET_FAILED;
+	}
+	return len;
+}
+
+/*
+The daemon applies the slave timeout itself, so the first wait is for the
+daemon (which may be busy with other clients), not for the slave. Once the
+reply has arrived it is handed out in whatever pieces the parser asks for.
+*/
+static int busd_recv(struct yam_modbus *bus, uint8_t *buf, size_t len,
+                     int timeout_ms)
+{
+	struct busd_client *client = bus->transport_data;
+	struct busd_reply reply;
+	struct pollfd pfd;
+	int ret;
+
+	while (!client->have_reply) {
+		pfd.fd = bus->serial;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		do {
+			ret = poll(&pfd, 1, YAM_BUSD_REPLY_TIMEOUT);
+		} while ((ret == -1) && (errno == EINTR));
+		if (ret == 0) {
+			return 0;
+		}
+		ret = recv(bus->serial, &reply, sizeof(reply), 0);
+		if (ret < BUSD_REPLY_HDR_LEN) {
+			return YAM_SOCKET_FAILED;
+		}
+		/* Late reply to a request we already gave up on */
+		if (reply.seq != client->seq) {
+			continue;
+		}
+		client->have_reply = 1;
+		if (reply.status < 0) {
+			return reply.status;
+		}
+
+		int pdu_len = ret - BUSD_REPLY_HDR_LEN;
+		client->adu[0] = reply.addr;
+		memcpy(&client->adu[1], reply.pdu, pdu_len);
+		uint16_t crc = yam_crc16(client->adu, pdu_len + 1);
+		client->adu[pdu_len + 1] = crc >> 8;
+		client->adu[pdu_len + 2] = crc & 0x00FF;
+		client->len = pdu_len + 3;
+	}
+
+	if (client->off == client->len) {
+		return 0;
+	}
+	if (len > client->len - client->off) {
+		len = client->len - client->off;
+	}
+	memcpy(buf, &client->adu[client->off], len);
+	client->off += len;
+	return len;
+}
+
+static void busd_flush(struct yam_modbus *bus)
+{
+	struct busd_client *client = bus->transport_data;
+
+	/* Stale replies are recognized by sequence number, just drop this one */
+	client->len = client->off = 0;
+}
+
+static void busd_close(struct yam_modbus *bus)
+{
+	close(bus->serial);
+	free(bus->transport_data);
+	bus->transport_data = NULL;
+}
+
+static const struct yam_transport busd_transport = {
+	.name = "busd",
+	.send = busd_send,
+	.recv = busd_recv,
+	.flush = busd_flush,
+	.close = busd_close,
+};
+
+/**
+\brief Initialize a YAM object that shares a bus through yam-busd
+\param *socket_path Path of the daemon's socket, or NULL for the default
+\param *bus The YAM object representing the Modbus
+\return YAM_OK on success, YAM_SERIAL_INIT_FAILED on failure
+
+Use this instead of yam_modbus_init() when the serial port is owned by the
+yam-busd daemon. All the yam_read_* and yam_write_* functions work as usual;
+each transaction is queued by the daemon, fairly with those of the other
+processes using the same port. The timeout set with yam_set_timeout() is
+passed on to the daemon with each request, up to 65535 ms. The serial parameters are those
+the daemon was started with.
+*/
+int yam_modbus_connect(const char *socket_path, struct yam_modbus *bus)
+{
+	assert(bus != NULL);
+
+	struct sockaddr_un sa;
+	struct busd_client *client;
+	int fd;
+
+	if (socket_path == NULL) {
+		socket_path = YAM_BUSD_DEFAULT_SOCKET;
+	}
+	if (strlen(socket_path) >= sizeof(sa.sun_path)) {
+		return (bus->last_errorcode = YAM_SERIAL_INIT_FAILED);
+	}
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return (bus->last_errorcode = YAM_SERIAL_INIT_FAILED);
+	}
+	bzero(&sa, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, socket_path);
+	client = calloc(1, sizeof(struct busd_client));
+	if (client == NULL || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    yam_bus_setup(bus, &busd_transport, client, socket_path)) {
+		free(client);
+		close(fd);
+		return (bus->last_errorcode = YAM_SERIAL_INIT_FAILED);
+	}
+	bus->serial = fd;
+
+	return (bus->last_errorcode = YAM_OK);
+}
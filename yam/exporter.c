@@ -0,0 +1,442 @@
+/**
+\file exporter.c
+\brief Serves bus statistics in the Prometheus text format on a Unix socket
+\author Jim George
+
+The page is rendered straight into a fixed buffer, which is sent whenever it
+fills up, so serving a scrape allocates nothing and holds no more than one
+buffer of text. Counters are read with relaxed atomic loads and no locks;
+the bus threads are never made to wait for a scrape, at the cost of a page
+whose counters may be a transaction apart from each other.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "modbus.h"
+#include "metrics.h"
+#include "exporter.h"
+
+/* Longest the serving thread waits before checking whether it was stopped */
+#define EXPORTER_POLL_MS 100
+
+struct exporter_out {
+	int fd;
+	int len;
+	int failed;
+	char buf[YAM_EXPORTER_BUF_LEN];
+};
+
+struct exporter_family {
+	const char *name;
+	const char *type;
+	const char *help;
+	size_t offset;
+	double scale;
+};
+
+static const struct exporter_family bus_families[] = {
+	{"yam_bus_transactions_total", "counter", "Requests sent on the bus",
+	 offsetof(struct yam_bus_stats, transactions), 1},
+	{"yam_bus_replies_total", "counter", "Transactions in which a slave replied",
+	 offsetof(struct yam_bus_stats, replies), 1},
+	{"yam_bus_errors_total", "counter", "Transactions that failed",
+	 offsetof(struct yam_bus_stats, errors), 1},
+	{"yam_bus_timeouts_total", "counter", "Transactions that timed out",
+	 offsetof(struct yam_bus_stats, timeouts), 1},
+	{"yam_bus_wire_seconds_total", "counter",
+	 "Time needed to send the characters of all frames",
+	 offsetof(struct yam_bus_stats, wire_ns), 1e-9},
+	{"yam_bus_busy_seconds_total", "counter", "Time spent in transactions",
+	 offsetof(struct yam_bus_stats, busy_ns), 1e-9},
+	{"yam_bus_idle_seconds_total", "counter", "Time between transactions",
+	 offsetof(struct yam_bus_stats, idle_ns), 1e-9},
+	{"yam_bus_turnaround_seconds_total", "counter",
+	 "Time slaves took to start replying",
+	 offsetof(struct yam_bus_stats, turnaround_ns), 1e-9},
+};
+
+static const struct exporter_family cell_families[] = {
+	{"yam_transactions_total", "counter", "Requests sent",
+	 offsetof(struct yam_metrics_cell, transactions), 1},
+	{"yam_timeouts_total", "counter", "Requests that got no reply in time",
+	 offsetof(struct yam_metrics_cell, timeouts), 1},
+	{"yam_crc_errors_total", "counter", "Replies with a bad CRC",
+	 offsetof(struct yam_metrics_cell, crc_errors), 1},
+	{"yam_exceptions_total", "counter", "Exception replies",
+	 offsetof(struct yam_metrics_cell, exceptions), 1},
+	{"yam_other_errors_total", "counter", "Other failed requests",
+	 offsetof(struct yam_metrics_cell, other_errors), 1},
+	{"yam_rejected_total", "counter", "Requests failed without being sent",
+	 offsetof(struct yam_metrics_cell, rejected), 1},
+	{"yam_sent_bytes_total", "counter", "Bytes sent",
+	 offsetof(struct yam_metrics_cell, bytes_out), 1},
+	{"yam_received_bytes_total", "counter", "Bytes received",
+	 offsetof(struct yam_metrics_cell, bytes_in), 1},
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static uint64_t exporter_load(const void *base, size_t offset)
+{
+	return __atomic_load_n((const uint64_t *)((const char *)base + offset),
+	                       __ATOMIC_RELAXED);
+}
+
+static void out_flush(struct exporter_out *out)
+{
+	int sent = 0, ret;
+
+	while (!out->failed && sent < out->len) {
+		ret = send(out->fd, out->buf + sent, out->len - sent, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			out->failed = 1;
+			break;
+		}
+		sent += ret;
+	}
+	out->len = 0;
+}
+
+static void out_printf(struct exporter_out *out, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	if (out->failed) {
+		return;
+	}
+	va_start(ap, fmt);
+	len = vsnprintf(out->buf + out->len, sizeof(out->buf) - out->len, fmt, ap);
+	va_end(ap);
+	if (len >= (int)sizeof(out->buf) - out->len) {
+		out_flush(out);
+		va_start(ap, fmt);
+		len = vsnprintf(out->buf, sizeof(out->buf), fmt, ap);
+		va_end(ap);
+	}
+	out->len += len;
+}
+
+static void out_header(struct exporter_out *out,
+                       const struct exporter_family *family)
+{
+	out_printf(out, "# HELP %s %s\n# TYPE %s %s\n", family->name,
+	           family->help, family->name, family->type);
+}
+
+/* Function label of a slot of a slave's metrics cells */
+static void out_labels(struct exporter_out *out, const char *bus,
+                       int addr, int slot)
+{
+	uint8_t fncode = yam_metrics_slot_function(slot);
+
+	if (fncode) {
+		out_printf(out, "bus=\"%s\",slave=\"%d\",function=\"%d\"", bus, addr,
+		           fncode);
+	}
+	else {
+		out_printf(out, "bus=\"%s\",slave=\"%d\",function=\"other\"", bus,
+		           addr);
+	}
+}
+
+static const struct yam_metrics_cell *exporter_cell(struct yam_metrics *metrics,
+                                                    int addr, int slot)
+{
+	struct yam_metrics_cell *cells;
+
+	cells = __atomic_load_n(&metrics->slaves[addr], __ATOMIC_ACQUIRE);
+	if (cells == NULL ||
+	    (exporter_load(&cells[slot],
+	                   offsetof(struct yam_metrics_cell, transactions)) == 0 &&
+	     exporter_load(&cells[slot],
+	                   offsetof(struct yam_metrics_cell, rejected)) == 0)) {
+		return NULL;
+	}
+	return &cells[slot];
+}
+
+static void exporter_render(struct yam_exporter *ex, struct exporter_out *out)
+{
+	const struct yam_metrics_cell *src;
+	struct yam_metrics_cell cell;
+	struct yam_exporter_bus *eb;
+	const struct yam_slave *slave;
+	unsigned int family;
+	int ctr, addr, slot;
+	uint64_t count;
+	size_t word;
+
+	for (family = 0; family < sizeof(bus_families) / sizeof(bus_families[0]);
+	     family++) {
+		out_header(out, &bus_families[family]);
+		for (ctr = 0; ctr < ex->num_buses; ctr++) {
+			eb = &ex->buses[ctr];
+			out_printf(out, "%s{bus=\"%s\"} %.17g\n", bus_families[family].name,
+			           eb->name, exporter_load(&eb->bus->stats,
+			           bus_families[family].offset) * bus_families[family].scale);
+		}
+	}
+
+	for (family = 0; family < sizeof(cell_families) / sizeof(cell_families[0]);
+	     family++) {
+		out_header(out, &cell_families[family]);
+		for (ctr = 0; ctr < ex->num_buses; ctr++) {
+			eb = &ex->buses[ctr];
+			for (addr = 0; eb->metrics && addr <= YAM_MAX_SLAVE_ADDR; addr++) {
+				for (slot = 0; slot < YAM_METRICS_FUNCTIONS; slot++) {
+					if ((src = exporter_cell(eb->metrics, addr, slot)) == NULL) {
+						continue;
+					}
+					out_printf(out, "%s{", cell_families[family].name);
+					out_labels(out, eb->name, addr, slot);
+					out_printf(out, "} %lu\n", (unsigned long)exporter_load(src,
+					           cell_families[family].offset));
+				}
+			}
+		}
+	}
+
+	out_printf(out, "# HELP yam_latency_seconds Time from the start of a "
+	           "request to the end of its reply\n"
+	           "# TYPE yam_latency_seconds summary\n");
+	for (ctr = 0; ctr < ex->num_buses; ctr++) {
+		eb = &ex->buses[ctr];
+		for (addr = 0; eb->metrics && addr <= YAM_MAX_SLAVE_ADDR; addr++) {
+			for (slot = 0; slot < YAM_METRICS_FUNCTIONS; slot++) {
+				if ((src = exporter_cell(eb->metrics, addr, slot)) == NULL) {
+					continue;
+				}
+				count = 0;
+				for (word = 0; word < sizeof(cell) / sizeof(uint64_t); word++) {
+					((uint64_t *)&cell)[word] = exporter_load(src,
+					                             word * sizeof(uint64_t));
+				}
+				for (word = 0; word < YAM_METRICS_BUCKETS; word++) {
+					count += cell.hist[word];
+				}
+				if (count == 0) {
+					continue;
+				}
+				for (word = 0; word < sizeof(quantiles) / sizeof(quantiles[0]);
+				     word++) {
+					out_printf(out, "yam_latency_seconds{");
+					out_labels(out, eb->name, addr, slot);
+					out_printf(out, ",quantile=\"%g\"} %g\n", quantiles[word],
+					           yam_metrics_percentile(&cell,
+					           quantiles[word] * 100) / 1e6);
+				}
+				out_printf(out, "yam_latency_seconds_sum{");
+				out_labels(out, eb->name, addr, slot);
+				out_printf(out, "} %g\nyam_latency_seconds_count{",
+				           cell.latency_sum_us / 1e6);
+				out_labels(out, eb->name, addr, slot);
+				out_printf(out, "} %lu\n", (unsigned long)count);
+			}
+		}
+	}
+
+	out_printf(out, "# HELP yam_slave_up Whether the slave's circuit breaker "
+	           "is closed\n# TYPE yam_slave_up gauge\n");
+	for (ctr = 0; ctr < ex->num_buses; ctr++) {
+		eb = &ex->buses[ctr];
+		for (addr = 1; eb->metrics && addr <= YAM_MAX_SLAVE_ADDR; addr++) {
+			if (__atomic_load_n(&eb->metrics->slaves[addr],
+			                    __ATOMIC_ACQUIRE) == NULL ||
+			    (slave = yam_get_slave(eb->bus, addr)) == NULL) {
+				continue;
+			}
+			out_printf(out, "yam_slave_up{bus=\"%s\",slave=\"%d\"} %d\n",
+			           eb->name, addr,
+			           __atomic_load_n(&slave->state, __ATOMIC_RELAXED) ==
+			           YAM_SLAVE_STATE_UP);
+		}
+	}
+}
+
+static void exporter_serve(struct yam_exporter *ex, int fd)
+{
+	static const char http_header[] = "HTTP/1.0 200 OK\r\n"
+	        "Content-Type: text/plain; version=0.0.4\r\n"
+	        "Connection: close\r\n\r\n";
+	struct timeval tv = {YAM_EXPORTER_SEND_TIMEOUT / 1000,
+	                     (YAM_EXPORTER_SEND_TIMEOUT % 1000) * 1000};
+	struct pollfd pfd = {fd, POLLIN, 0};
+	struct exporter_out out;
+	char req[512];
+	int len = 0;
+
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	/* Clients that only want the page need not send anything */
+	if (poll(&pfd, 1, EXPORTER_POLL_MS) > 0) {
+		len = recv(fd, req, sizeof(req) - 1, MSG_DONTWAIT);
+	}
+
+	out.fd = fd;
+	out.len = 0;
+	out.failed = 0;
+	if (len >= 4 && (!memcmp(req, "GET ", 4) || !memcmp(req, "HEAD", 4))) {
+		out_printf(&out, "%s", http_header);
+		if (req[0] == 'H') {
+			out_flush(&out);
+			return;
+		}
+	}
+	exporter_render(ex, &out);
+	out_flush(&out);
+	ex->scrapes++;
+}
+
+static void *exporter_thread(void *arg)
+{
+	struct yam_exporter *ex = arg;
+	struct pollfd pfd = {ex->listen_fd, POLLIN, 0};
+	int fd;
+
+	while (!ex->stop) {
+		if (poll(&pfd, 1, EXPORTER_POLL_MS) <= 0) {
+			continue;
+		}
+		fd = accept4(ex->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			continue;
+		}
+		exporter_serve(ex, fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+/**
+\brief Create the socket of a statistics exporter
+\param *ex The exporter to initialize
+\param *path Path of the Unix socket; an existing socket there is replaced
+\return 0 on success, error code on failure
+
+Add the buses with yam_exporter_add_bus(), then start serving with
+yam_exporter_start().
+*/
+int yam_exporter_init(struct yam_exporter *ex, const char *path)
+{
+	assert(ex != NULL);
+	assert(path != NULL);
+
+	struct sockaddr_un sa;
+
+	bzero(ex, sizeof(struct yam_exporter));
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		return YAM_SOCKET_FAILED;
+	}
+	bzero(&sa, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	strcpy(ex->path, path);
+
+	ex->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (ex->listen_fd < 0) {
+		return YAM_SOCKET_FAILED;
+	}
+	unlink(path);
+	if (bind(ex->listen_fd, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    listen(ex->listen_fd, 8)) {
+		close(ex->listen_fd);
+		ex->listen_fd = -1;
+		return YAM_SOCKET_FAILED;
+	}
+
+	return YAM_OK;
+}
+
+/**
+\brief Add a bus to the exported statistics
+\param *ex The exporter
+\param *name Name of the bus, used as the bus label
+\param *bus The bus, whose time accounting is exported
+\param *metrics The metrics attached to the bus, or NULL for none
+\return 0 on success, error code on failure
+
+Buses must be added before the exporter is started.
+*/
+int yam_exporter_add_bus(struct yam_exporter *ex, const char *name,
+                         struct yam_modbus *bus, struct yam_metrics *metrics)
+{
+	assert(ex != NULL);
+	assert(name != NULL);
+	assert(bus != NULL);
+
+	struct yam_exporter_bus *eb;
+	char *c;
+
+	if (ex->running || ex->num_buses == YAM_EXPORTER_MAX_BUSES) {
+		return YAM_NO_MEMORY;
+	}
+	eb = &ex->buses[ex->num_buses++];
+	strncpy(eb->name, name, YAM_EXPORTER_MAX_NAME - 1);
+	eb->name[YAM_EXPORTER_MAX_NAME - 1] = 0;
+	/* Keep the label value free of characters that need escaping */
+	for (c = eb->name; *c; c++) {
+		if (*c == '"' || *c == '\\' || *c == '\n') {
+			*c = '_';
+		}
+	}
+	eb->bus = bus;
+	eb->metrics = metrics;
+
+	return YAM_OK;
+}
+
+/**
+\brief Start serving statistics
+\param *ex The exporter
+\return 0 on success, error code on failure
+
+The exporter serves clients from a thread of its own until
+yam_exporter_close() is called.
+*/
+int yam_exporter_start(struct yam_exporter *ex)
+{
+	assert(ex != NULL);
+
+	ex->stop = 0;
+	if (pthread_create(&ex->thread, NULL, exporter_thread, ex)) {
+		return YAM_NO_MEMORY;
+	}
+	ex->running = 1;
+
+	return YAM_OK;
+}
+
+/**
+\brief Stop the exporter and remove its socket
+\param *ex The exporter
+*/
+void yam_exporter_close(struct yam_exporter *ex)
+{
+	assert(ex != NULL);
+
+	if (ex->running) {
+		ex->stop = 1;
+		pthread_join(ex->thread, NULL);
+		ex->running = 0;
+	}
+	if (ex->listen_fd >= 0) {
+		close(ex->listen_fd);
+		ex->listen_fd = -1;
+		unlink(ex->path);
+	}
+}
@@ -0,0 +1,60 @@
+/**
+\file exporter.h
+\brief Include file for the YAM statistics exporter
+\author Jim George
+*/
+
+#ifndef _YAM_EXPORTER_H_
+#define _YAM_EXPORTER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/un.h>
+#include "modbus.h"
+#include "metrics.h"
+
+/** Maximum number of buses served by one exporter */
+#define YAM_EXPORTER_MAX_BUSES 8
+/** Maximum length of a bus name */
+#define YAM_EXPORTER_MAX_NAME 32
+/** Size of the output buffer, which is sent each time it fills up */
+#define YAM_EXPORTER_BUF_LEN 4096
+/** Longest a client may take to accept the page, in milliseconds */
+#define YAM_EXPORTER_SEND_TIMEOUT 1000
+
+/**
+\brief A bus whose statistics are exported
+*/
+struct yam_exporter_bus {
+	char name[YAM_EXPORTER_MAX_NAME]; /**< Value of the bus label */
+	struct yam_modbus *bus; /**< The bus */
+	struct yam_metrics *metrics; /**< Its metrics, or NULL */
+};
+
+/**
+\brief The YAM statistics exporter
+
+Serves the statistics of one or more buses on a Unix socket, in the
+Prometheus text exposition format, from a thread of its own. Each client
+that connects is sent the page and the connection is closed; a client that
+starts with an HTTP request gets an HTTP response, so that the page can be
+fetched with, for instance, curl --unix-socket.
+*/
+struct yam_exporter {
+	int listen_fd; /**< Listening socket */
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)]; /**< Socket path */
+	int num_buses; /**< Number of buses added */
+	struct yam_exporter_bus buses[YAM_EXPORTER_MAX_BUSES]; /**< Buses */
+	pthread_t thread; /**< Thread serving clients */
+	int running; /**< Nonzero while the thread runs */
+	volatile int stop; /**< Set to make the thread exit */
+	unsigned long scrapes; /**< Pages served */
+};
+
+int yam_exporter_init(struct yam_exporter *ex, const char *path);
+int yam_exporter_add_bus(struct yam_exporter *ex, const char *name,
+                         struct yam_modbus *bus, struct yam_metrics *metrics);
+int yam_exporter_start(struct yam_exporter *ex);
+void yam_exporter_close(struct yam_exporter *ex);
+
+#endif /* _YAM_EXPORTER_H_ */
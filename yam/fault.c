@@ -0,0 +1,217 @@
+/**
+\file fault.c
+\brief Fault injection between a bus and its transport
+\author Jim George
+
+Bytes read from the wrapped transport are damaged and then held until the
+library asks for them, which is what lets a duplicated byte or a split read
+come back later than it would have, and a late reply arrive after the
+library has flushed its buffers, as a slow slave's would.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "modbus.h"
+#include "transport.h"
+#include "fault.h"
+
+static void fault_sleep_ms(unsigned int ms)
+{
+	struct timespec ts = {ms / 1000, (ms % 1000) * 1000000};
+
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+static int fault_draw(struct yam_fault *fault, unsigned int permille)
+{
+	return permille && (unsigned int)(rand_r(&fault->seed) % 1000) < permille;
+}
+
+/* Copies len bytes from in to out through the byte faults, returns the
+number of bytes written, at most 2 * len */
+static int fault_bytes(struct yam_fault *fault, const uint8_t *in, int len,
+                       uint8_t *out)
+{
+	struct yam_fault_profile *profile = &fault->profile;
+	int ctr, out_len = 0;
+	uint8_t byte;
+
+	for (ctr = 0; ctr < len; ctr++) {
+		if (fault_draw(fault, profile->drop_byte_permille)) {
+			fault->stats.bytes_dropped++;
+			continue;
+		}
+		byte = in[ctr];
+		if (fault_draw(fault, profile->corrupt_byte_permille)) {
+			fault->stats.bytes_corrupted++;
+			byte ^= 1 << (rand_r(&fault->seed) % 8);
+		}
+		out[out_len++] = byte;
+		if (fault_draw(fault, profile->dup_byte_permille)) {
+			fault->stats.bytes_duplicated++;
+			out[out_len++] = byte;
+		}
+	}
+	return out_len;
+}
+
+/* The wrapped transport expects its own state in bus->transport_data */
+#define FAULT_INNER(bus, fault, call) \
+	do { \
+		(bus)->transport_data = (fault)->inner_data; \
+		call; \
+		(bus)->transport_data = (fault); \
+	} while (0)
+
+static int fault_send(struct yam_modbus *bus, const uint8_t *buf, size_t len)
+{
+	struct yam_fault *fault = bus->transport_data;
+	uint8_t out[2 * YAM_MODBUS_MAX_ADU_LEN];
+	int out_len, ret;
+
+	if (len > YAM_MODBUS_MAX_ADU_LEN) {
+		return YAM_INVALIDBYTECOUNT;
+	}
+	if (fault_draw(fault, fault->profile.drop_frame_permille)) {
+		fault->stats.frames_dropped++;
+		return len;
+	}
+	out_len = fault_bytes(fault, buf, len, out);
+	/* Transports take at most a whole ADU; the rest is lost on the line */
+	if (out_len > YAM_MODBUS_MAX_ADU_LEN) {
+		out_len = YAM_MODBUS_MAX_ADU_LEN;
+	}
+	FAULT_INNER(bus, fault, ret = fault->inner->send(bus, out, out_len));
+	return (ret < 0) ? ret : (int)len;
+}
+
+static int fault_recv(struct yam_modbus *bus, uint8_t *buf, size_t len,
+                      int timeout_ms)
+{
+	struct yam_fault *fault = bus->transport_data;
+	struct yam_fault_profile *profile = &fault->profile;
+	uint8_t in[YAM_FAULT_HELD_LEN / 2];
+	int ret;
+
+	if (fault->held_len == 0) {
+		if (len > sizeof(in)) {
+			len = sizeof(in);
+		}
+		/* If every byte read is lost, keep waiting for the next ones */
+		do {
+			FAULT_INNER(bus, fault,
+			            ret = fault->inner->recv(bus, in, len, timeout_ms));
+			if (ret <= 0) {
+				return ret;
+			}
+			fault->held_len = fault_bytes(fault, in, ret, fault->held);
+		} while (fault->held_len == 0);
+
+		if (fault_draw(fault, profile->delay_permille)) {
+			fault->stats.delays++;
+			if (profile->delay_ms >= (unsigned int)timeout_ms) {
+				fault_sleep_ms(timeout_ms);
+				fault->stats.late++;
+				fault->late = 1;
+				return 0;
+			}
+			fault_sleep_ms(profile->delay_ms);
+		}
+	}
+	fault->late = 0;
+
+	if ((int)len > fault->held_len) {
+		len = fault->held_len;
+	}
+	if (len > 1 && fault_draw(fault, profile->split_permille)) {
+		fault->stats.splits++;
+		len = 1 + rand_r(&fault->seed) % (len - 1);
+	}
+	memcpy(buf, fault->held, len);
+	fault->held_len -= len;
+	memmove(fault->held, &fault->held[len], fault->held_len);
+	return len;
+}
+
+static void fault_flush(struct yam_modbus *bus)
+{
+	struct yam_fault *fault = bus->transport_data;
+
+	/* Late bytes are still on their way, and arrive after the flush */
+	if (!fault->late) {
+		fault->held_len = 0;
+	}
+	fault->late = 0;
+	FAULT_INNER(bus, fault, fault->inner->flush(bus));
+}
+
+static void fault_close(struct yam_modbus *bus)
+{
+	struct yam_fault *fault = bus->transport_data;
+
+	bus->transport = fault->inner;
+	bus->transport_data = fault->inner_data;
+	bus->transport->close(bus);
+}
+
+static const struct yam_transport fault_transport = {
+	.name = "fault",
+	.send = fault_send,
+	.recv = fault_recv,
+	.flush = fault_flush,
+	.close = fault_close,
+};
+
+/**
+\brief Initialize a fault injector
+\param *fault The fault injector to initialize
+\param *profile Fault rates (copied)
+\param seed Seed of the fault generator, so that runs can be repeated
+*/
+void yam_fault_init(struct yam_fault *fault,
+                    const struct yam_fault_profile *profile,
+                    unsigned int seed)
+{
+	assert(fault != NULL);
+	assert(profile != NULL);
+
+	bzero(fault, sizeof(struct yam_fault));
+	fault->profile = *profile;
+	fault->seed = seed;
+}
+
+/**
+\brief Inject faults into the bytes going through a bus
+\param *bus The YAM object representing the Modbus, already opened
+\param *fault Fault injector set up with yam_fault_init(), or NULL to stop
+
+The fault injector wraps the bus's transport until it is removed, or the bus
+is closed. Bytes held back by the injector are lost when it is removed.
+*/
+void yam_set_faults(struct yam_modbus *bus, struct yam_fault *fault)
+{
+	assert(bus != NULL);
+	assert(bus->transport != NULL);
+
+	struct yam_fault *old;
+
+	if (bus->transport == &fault_transport) {
+		old = bus->transport_data;
+		bus->transport = old->inner;
+		bus->transport_data = old->inner_data;
+	}
+	if (fault) {
+		fault->inner = bus->transport;
+		fault->inner_data = bus->transport_data;
+		fault->held_len = 0;
+		fault->late = 0;
+		bus->transport = &fault_transport;
+		bus->transport_data = fault;
+	}
+}
@@ -0,0 +1,75 @@
+/**
+\file fault.h
+\brief Include file for YAM fault injection
+\author Jim George
+*/
+
+#ifndef _YAM_FAULT_H_
+#define _YAM_FAULT_H_
+
+#include <stdint.h>
+#include "modbus.h"
+
+/**
+\brief How often each kind of line fault happens
+
+Rates are in parts per thousand, drawn independently. Byte faults hit
+requests and replies alike; a dropped frame is a request that never reaches
+the slave.
+*/
+struct yam_fault_profile {
+	unsigned int drop_frame_permille; /**< Requests lost entirely */
+	unsigned int drop_byte_permille; /**< Bytes lost */
+	unsigned int corrupt_byte_permille; /**< Bytes with one bit flipped */
+	unsigned int dup_byte_permille; /**< Bytes received twice */
+	unsigned int delay_permille; /**< Reads held back by delay_ms */
+	unsigned int delay_ms; /**< Length of a delay; one as long as the
+	                            timeout makes the bytes arrive late, after
+	                            the library has given up on them */
+	unsigned int split_permille; /**< Reads cut short, returning the rest
+	                                  of the bytes on the next read */
+};
+
+/**
+\brief Counters of the faults injected
+*/
+struct yam_fault_stats {
+	uint64_t frames_dropped; /**< Requests not sent */
+	uint64_t bytes_dropped; /**< Bytes lost */
+	uint64_t bytes_corrupted; /**< Bytes altered */
+	uint64_t bytes_duplicated; /**< Bytes repeated */
+	uint64_t delays; /**< Reads delayed */
+	uint64_t late; /**< Delays that outlasted the timeout */
+	uint64_t splits; /**< Reads cut short */
+};
+
+/** Bytes held between reads, enough for a reply with every byte doubled */
+#define YAM_FAULT_HELD_LEN (2 * YAM_MODBUS_MAX_ADU_LEN)
+
+/**
+\brief Fault injection between a bus and its transport
+
+Wraps whatever transport the bus was opened with, serial port, loopback or
+replay, and damages the bytes going through it, so that the library's
+recovery from line noise can be tested and measured. Faults are drawn from
+a seeded generator, so a run can be repeated exactly, timing aside.
+*/
+struct yam_fault {
+	struct yam_fault_profile profile; /**< Fault rates */
+	unsigned int seed; /**< State of the fault generator */
+	struct yam_fault_stats stats; /**< Counters */
+	const struct yam_transport *inner; /**< Internal: wrapped transport */
+	void *inner_data; /**< Internal: its state */
+	uint8_t held[YAM_FAULT_HELD_LEN]; /**< Internal: bytes received but
+	                                       not yet returned */
+	int held_len; /**< Internal: number of bytes held */
+	int late; /**< Internal: nonzero if the held bytes are late, and
+	               survive the flush after a timeout */
+};
+
+void yam_fault_init(struct yam_fault *fault,
+                    const struct yam_fault_profile *profile,
+                    unsigned int seed);
+void yam_set_faults(struct yam_modbus *bus, struct yam_fault *fault);
+
+#endif /* _YAM_FAULT_H_ */
@@ -0,0 +1,447 @@
+/**
+\file gateway.c
+\brief Modbus/TCP to Modbus/RTU gateway.
+\author Jim George
+
+Requests arrive on the TCP server loop and are handed to one worker thread
+per RTU bus. Completed requests come back to the loop through an eventfd,
+where the replies are sent to every client waiting on them. All cache and
+bookkeeping state is only touched from the loop thread; the workers only see
+the job they are running.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+#include "modbus.h"
+#include "tcp.h"
+#include "gateway.h"
+
+/* A client waiting for the outcome of a job */
+struct gateway_waiter {
+	struct yam_tcp_deferred req;
+	struct gateway_waiter *next;
+};
+
+/* One request sent to an RTU bus on behalf of one or more clients */
+struct gateway_job {
+	struct gateway_bus *gbus;
+	struct gateway_entry *entry; /* Cache slot to fill, if any */
+	struct gateway_waiter *waiters;
+	struct gateway_job *next;
+	uint8_t unit;
+	int req_len;
+	int resp_len;
+	uint8_t req[YAM_MODBUS_MAX_PDU_LEN];
+	uint8_t resp[YAM_MODBUS_MAX_PDU_LEN];
+};
+
+/* An RTU bus and the worker thread that owns it */
+struct gateway_bus {
+	struct yam_gateway *gw;
+	struct yam_modbus *bus;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct gateway_job *head, *tail;
+	int stop;
+};
+
+/* Cache slot states */
+#define ENTRY_EMPTY 0
+#define ENTRY_PENDING 1
+#define ENTRY_VALID 2
+
+/* A read reply, keyed by bus, unit, function code and register range */
+struct gateway_entry {
+	struct gateway_bus *gbus;
+	uint8_t unit;
+	uint8_t fncode;
+	uint16_t start_addr;
+	uint16_t count;
+	int state;
+	int stale; /* A write hit this range while the read was in flight */
+	struct gateway_job *job; /* Job filling this slot, while pending */
+	long long stamp_ms; /* When the reply was received */
+	int resp_len;
+	uint8_t resp[YAM_MODBUS_MAX_PDU_LEN];
+};
+
+static long long gateway_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int gateway_exception(uint8_t fncode, int errcode, uint8_t *resp_pdu)
+{
+	resp_pdu[0] = fncode | 0x80;
+	resp_pdu[1] = -errcode;
+	return 2;
+}
+
+static void *gateway_worker(void *arg)
+{
+	struct gateway_bus *gbus = arg;
+	struct yam_gateway *gw = gbus->gw;
+	struct gateway_job *job;
+	uint64_t val = 1;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&gbus->lock);
+		while (gbus->head == NULL && !gbus->stop) {
+			pthread_cond_wait(&gbus->cond, &gbus->lock);
+		}
+		job = gbus->head;
+		if (job == NULL) {
+			pthread_mutex_unlock(&gbus->lock);
+			break;
+		}
+		gbus->head = job->next;
+		if (gbus->head == NULL) gbus->tail = NULL;
+		pthread_mutex_unlock(&gbus->lock);
+
+		ret = yam_raw_request(gbus->bus, job->unit, job->req, job->req_len,
+		                      job->resp, sizeof(job->resp));
+		if (ret >= 0) {
+			job->resp_len = ret;
+		}
+		else if (ret >= YAM_GATEWAY_TARGET_FAILED) {
+			/* Slave answered with an exception, pass it on */
+			job->resp_len = gateway_exception(job->req[0], ret, job->resp);
+		}
+		else {
+			job->resp_len = gateway_exception(job->req[0],
+			                                  YAM_GATEWAY_TARGET_FAILED,
+			                                  job->resp);
+		}
+
+		pthread_mutex_lock(&gw->done_lock);
+		job->next = gw->done;
+		gw->done = job;
+		pthread_mutex_unlock(&gw->done_lock);
+		if (write(gw->done_fd, &val, sizeof(val))) {}
+	}
+	return NULL;
+}
+
+static void gateway_job_free(struct gateway_job *job)
+{
+	while (job->waiters) {
+		struct gateway_waiter *waiter = job->waiters;
+		job->waiters = waiter->next;
+		free(waiter);
+	}
+	free(job);
+}
+
+/* Runs on the server loop when bus workers have finished jobs */
+static void gateway_complete(void *arg)
+{
+	struct yam_gateway *gw = arg;
+	struct gateway_job *job, *next;
+	uint64_t val;
+
+	if (read(gw->done_fd, &val, sizeof(val))) {}
+	pthread_mutex_lock(&gw->done_lock);
+	job = gw->done;
+	gw->done = NULL;
+	pthread_mutex_unlock(&gw->done_lock);
+
+	for (; job != NULL; job = next) {
+		next = job->next;
+		struct gateway_entry *entry = job->entry;
+		if (entry) {
+			entry->job = NULL;
+			entry->state = ENTRY_EMPTY;
+			if (!entry->stale && !(job->resp[0] & 0x80)) {
+				memcpy(entry->resp, job->resp, job->resp_len);
+				entry->resp_len = job->resp_len;
+				entry->stamp_ms = gateway_now_ms();
+				entry->state = ENTRY_VALID;
+			}
+		}
+		struct gateway_waiter *waiter;
+		for (waiter = job->waiters; waiter != NULL; waiter = waiter->next) {
+			yam_tcp_server_reply(&gw->server, &waiter->req, job->resp,
+			                     job->resp_len);
+		}
+		gateway_job_free(job);
+	}
+}
+
+/* Adds the request being handled to the job's list of waiters */
+static int gateway_wait(struct yam_gateway *gw, struct gateway_job *job)
+{
+	struct gateway_waiter *waiter = malloc(sizeof(struct gateway_waiter));
+
+	if (waiter == NULL) return YAM_NO_MEMORY;
+	yam_tcp_server_defer(&gw->server, &waiter->req);
+	waiter->next = job->waiters;
+	job->waiters = waiter;
+	return YAM_OK;
+}
+
+/* Drops cached reads of a unit after a write to it */
+static void gateway_invalidate(struct yam_gateway *gw,
+                               struct gateway_bus *gbus, uint8_t unit)
+{
+	int ctr;
+
+	for (ctr = 0; ctr < YAM_GATEWAY_CACHE_SLOTS; ctr++) {
+		struct gateway_entry *entry = &gw->cache[ctr];
+		if (entry->gbus != gbus || entry->unit != unit) continue;
+		if (entry->state == ENTRY_VALID) entry->state = ENTRY_EMPTY;
+		else if (entry->state == ENTRY_PENDING) entry->stale = 1;
+	}
+}
+
+static int gateway_handler(void *arg, uint8_t unit, const uint8_t *req_pdu,
+                           int req_len, uint8_t *resp_pdu)
+{
+	struct yam_gateway *gw = arg;
+	struct gateway_bus *gbus = gw->routes[unit];
+	struct gateway_entry *entry = NULL;
+	uint8_t fncode = req_pdu[0];
+
+	gw->stats.requests++;
+	if (gbus == NULL) {
+		gw->stats.unrouted++;
+		return gateway_exception(fncode, YAM_GATEWAY_PATH_UNAVAILABLE,
+		                         resp_pdu);
+	}
+
+	if (fncode >= YAM_READ_COILS && fncode <= YAM_READ_INPUTS && req_len == 5) {
+		uint16_t start_addr = (req_pdu[1] << 8) | req_pdu[2];
+		uint16_t count = (req_pdu[3] << 8) | req_pdu[4];
+		unsigned int hash = (unit * 31 + fncode) * 65599 +
+		                    start_addr * 257 + count;
+		struct gateway_entry *slot =
+			&gw->cache[hash & (YAM_GATEWAY_CACHE_SLOTS - 1)];
+		int match = (slot->state != ENTRY_EMPTY) && (slot->gbus == gbus) &&
+		            (slot->unit == unit) && (slot->fncode == fncode) &&
+		            (slot->start_addr == start_addr) && (slot->count == count);
+
+		if (match && slot->state == ENTRY_VALID && gw->ttl_ms > 0 &&
+		    gateway_now_ms() - slot->stamp_ms <= gw->ttl_ms) {
+			gw->stats.cache_hits++;
+			memcpy(resp_pdu, slot->resp, slot->resp_len);
+			return slot->resp_len;
+		}
+		if (match && slot->state == ENTRY_PENDING && !slot->stale) {
+			if (gateway_wait(gw, slot->job)) {
+				return gateway_exception(fncode, YAM_SLAVE_FAILURE, resp_pdu);
+			}
+			gw->stats.merged++;
+			return 0;
+		}
+		/* Claim the slot, unless another read is in flight there */
+		if (slot->state != ENTRY_PENDING) {
+			entry = slot;
+		}
+	}
+	else {
+		gateway_invalidate(gw, gbus, unit);
+	}
+
+	struct gateway_job *job = calloc(1, sizeof(struct gateway_job));
+	if (job == NULL || gateway_wait(gw, job)) {
+		free(job);
+		return gateway_exception(fncode, YAM_SLAVE_FAILURE, resp_pdu);
+	}
+	job->gbus = gbus;
+	job->unit = unit;
+	job->req_len = req_len;
+	memcpy(job->req, req_pdu, req_len);
+	if (entry) {
+		entry->gbus = gbus;
+		entry->unit = unit;
+		entry->fncode = fncode;
+		entry->start_addr = (req_pdu[1] << 8) | req_pdu[2];
+		entry->count = (req_pdu[3] << 8) | req_pdu[4];
+		entry->state = ENTRY_PENDING;
+		entry->stale = 0;
+		entry->job = job;
+		job->entry = entry;
+	}
+
+	pthread_mutex_lock(&gbus->lock);
+	if (gbus->tail) gbus->tail->next = job;
+	else gbus->head = job;
+	gbus->tail = job;
+	pthread_cond_signal(&gbus->cond);
+	pthread_mutex_unlock(&gbus->lock);
+	gw->stats.forwarded++;
+
+	return 0;
+}
+
+/**
+\brief Initialize a gateway
+\param *gw The gateway object
+\param *bind_addr Local address to listen on, or NULL for all addresses
+\param port TCP port to listen on (normally YAM_TCP_DEFAULT_PORT)
+\param flags YAM_TCP_FLAGS_* options for the listening socket
+\return YAM_OK on success, error code on failure
+
+Creates the TCP front end. Buses are attached afterwards with
+yam_gateway_add_bus(). Read replies are cached for YAM_GATEWAY_DEFAULT_TTL
+milliseconds unless changed with yam_gateway_set_ttl().
+*/
+int yam_gateway_init(struct yam_gateway *gw, const char *bind_addr,
+                     uint16_t port, unsigned int flags)
+{
+	assert(gw != NULL);
+
+	int ret;
+
+	bzero(gw, sizeof(struct yam_gateway));
+	gw->ttl_ms = YAM_GATEWAY_DEFAULT_TTL;
+	gw->done_fd = -1;
+
+	ret = yam_tcp_server_init(&gw->server, bind_addr, port, flags);
+	if (ret) return ret;
+
+	gw->cache = calloc(YAM_GATEWAY_CACHE_SLOTS, sizeof(struct gateway_entry));
+	if (gw->cache == NULL) {
+		yam_tcp_server_close(&gw->server);
+		return YAM_NO_MEMORY;
+	}
+	gw->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (gw->done_fd < 0 ||
+	    yam_tcp_server_watch(&gw->server, gw->done_fd, gateway_complete, gw)) {
+		if (gw->done_fd >= 0) close(gw->done_fd);
+		free(gw->cache);
+		yam_tcp_server_close(&gw->server);
+		return YAM_SOCKET_FAILED;
+	}
+	pthread_mutex_init(&gw->done_lock, NULL);
+	yam_tcp_server_set_handler(&gw->server, gateway_handler, gw);
+
+	return YAM_OK;
+}
+
+/**
+\brief Attach an RTU bus to the gateway
+\param *gw The gateway object
+\param *bus An initialized YAM object, owned by the gateway from now on
+\param first_unit First unit identifier routed to this bus
+\param last_unit Last unit identifier routed to this bus
+\return YAM_OK on success, error code on failure
+
+Requests for unit identifiers in [first_unit, last_unit] are forwarded to
+the slave with the same address on this bus. A worker thread is started for
+the bus; the application must not use the bus directly afterwards.
+*/
+int yam_gateway_add_bus(struct yam_gateway *gw, struct yam_modbus *bus,
+                        uint8_t first_unit, uint8_t last_unit)
+{
+	assert(gw != NULL);
+	assert(bus != NULL);
+
+	int ctr;
+
+	if (gw->num_buses == YAM_GATEWAY_MAX_BUSES) return YAM_NO_MEMORY;
+
+	struct gateway_bus *gbus = calloc(1, sizeof(struct gateway_bus));
+	if (gbus == NULL) return YAM_NO_MEMORY;
+	gbus->gw = gw;
+	gbus->bus = bus;
+	pthread_mutex_init(&gbus->lock, NULL);
+	pthread_cond_init(&gbus->cond, NULL);
+	if (pthread_create(&gbus->thread, NULL, gateway_worker, gbus)) {
+		pthread_cond_destroy(&gbus->cond);
+		pthread_mutex_destroy(&gbus->lock);
+		free(gbus);
+		return YAM_NO_MEMORY;
+	}
+
+	gw->buses[gw->num_buses++] = gbus;
+	for (ctr = first_unit; ctr <= last_unit; ctr++) {
+		gw->routes[ctr] = gbus;
+	}
+	return YAM_OK;
+}
+
+/**
+\brief Set the lifetime of cached read replies
+\param *gw The gateway object
+\param ttl_ms Lifetime in milliseconds, 0 to disable caching
+
+Identical reads in flight at the same time are merged regardless of this
+setting. Any write to a unit discards the cached reads of that unit.
+*/
+void yam_gateway_set_ttl(struct yam_gateway *gw, int ttl_ms)
+{
+	assert(gw != NULL);
+	gw->ttl_ms = ttl_ms;
+}
+
+/**
+\brief Run the gateway
+\param *gw The gateway object
+\return YAM_OK when stopped, error code on failure
+
+Serves clients until yam_gateway_stop() is called.
+*/
+int yam_gateway_run(struct yam_gateway *gw)
+{
+	assert(gw != NULL);
+	return yam_tcp_server_run(&gw->server);
+}
+
+/**
+\brief Stop the gateway
+\param *gw The gateway object
+
+Makes yam_gateway_run() return. May be called from any thread.
+*/
+void yam_gateway_stop(struct yam_gateway *gw)
+{
+	assert(gw != NULL);
+	yam_tcp_server_stop(&gw->server);
+}
+
+/**
+\brief Close the gateway
+\param *gw The gateway object
+
+Stops the bus workers, once they have finished their queued requests, and
+closes the TCP front end. The buses themselves are left open.
+*/
+void yam_gateway_close(struct yam_gateway *gw)
+{
+	assert(gw != NULL);
+
+	int ctr;
+
+	for (ctr = 0; ctr < gw->num_buses; ctr++) {
+		struct gateway_bus *gbus = gw->buses[ctr];
+		pthread_mutex_lock(&gbus->lock);
+		gbus->stop = 1;
+		pthread_cond_signal(&gbus->cond);
+		pthread_mutex_unlock(&gbus->lock);
+		pthread_join(gbus->thread, NULL);
+		pthread_cond_destroy(&gbus->cond);
+		pthread_mutex_destroy(&gbus->lock);
+		free(gbus);
+	}
+	gw->num_buses = 0;
+
+	/* Answer whatever the workers finished, then drop the clients */
+	gateway_complete(gw);
+	yam_tcp_server_close(&gw->server);
+	pthread_mutex_destroy(&gw->done_lock);
+	close(gw->done_fd);
+	free(gw->cache);
+	gw->cache = NULL;
+}
@@ -0,0 +1,69 @@
+/**
+\file gateway.h
+\brief Include file for the YAM Modbus/TCP to Modbus/RTU gateway
+\author Jim George
+*/
+
+#ifndef _YAM_GATEWAY_H_
+#define _YAM_GATEWAY_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "modbus.h"
+#include "tcp.h"
+
+/** Maximum number of RTU buses behind one gateway */
+#define YAM_GATEWAY_MAX_BUSES 8
+/** Number of slots in the read response cache (power of two) */
+#define YAM_GATEWAY_CACHE_SLOTS 1024
+/** Default lifetime of a cached read response, in milliseconds */
+#define YAM_GATEWAY_DEFAULT_TTL 100
+
+struct gateway_bus;
+struct gateway_entry;
+struct gateway_job;
+
+/**
+\brief Gateway counters
+*/
+struct yam_gateway_stats {
+	unsigned long requests; /**< Requests received from TCP clients */
+	unsigned long cache_hits; /**< Reads answered from the response cache */
+	unsigned long merged; /**< Reads attached to an identical read in flight */
+	unsigned long forwarded; /**< Requests sent to an RTU bus */
+	unsigned long unrouted; /**< Requests for a unit with no bus */
+};
+
+/**
+\brief The YAM gateway object
+
+Accepts Modbus/TCP clients and forwards their requests to Modbus/RTU buses,
+chosen by unit identifier. Each bus is driven by its own worker thread.
+Identical reads (same unit, function, start address and count) that are in
+flight together are sent once and the reply is given to every requester,
+and read replies are cached for a short time so that clients polling the
+same data do not each cost a round trip on the serial line.
+*/
+struct yam_gateway {
+	struct yam_tcp_server server; /**< Modbus/TCP front end */
+	int ttl_ms; /**< Lifetime of cached read replies, 0 disables the cache */
+	int num_buses; /**< Number of buses added */
+	struct gateway_bus *buses[YAM_GATEWAY_MAX_BUSES]; /**< RTU buses */
+	struct gateway_bus *routes[256]; /**< Bus serving each unit identifier */
+	struct gateway_entry *cache; /**< Read response cache */
+	int done_fd; /**< eventfd signalled by bus workers */
+	pthread_mutex_t done_lock; /**< Guards the completed job list */
+	struct gateway_job *done; /**< Jobs completed by bus workers */
+	struct yam_gateway_stats stats; /**< Counters, updated by the server loop */
+};
+
+int yam_gateway_init(struct yam_gateway *gw, const char *bind_addr,
+                     uint16_t port, unsigned int flags);
+int yam_gateway_add_bus(struct yam_gateway *gw, struct yam_modbus *bus,
+                        uint8_t first_unit, uint8_t last_unit);
+void yam_gateway_set_ttl(struct yam_gateway *gw, int ttl_ms);
+int yam_gateway_run(struct yam_gateway *gw);
+void yam_gateway_stop(struct yam_gateway *gw);
+void yam_gateway_close(struct yam_gateway *gw);
+
+#endif /* _YAM_GATEWAY_H_ */
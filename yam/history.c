@@ -0,0 +1,359 @@
+/**
+\file history.c
+\brief Poll historian: an append-only ring of poll results in a mapped file
+\author Jim George
+
+Every successful read on a bus with a historian attached is appended to a
+fixed-size ring of fixed-size records in a memory-mapped file. Appending a
+record is a copy into the mapping; the kernel writes the pages back, and the
+historian only asks for that explicitly (msync) once per batch of records.
+
+Records hold the response data as received, so nothing is formatted or
+unpacked on the polling path. Because records have a fixed size and are in
+time order, a reader can binary-search for a time range and walk it without
+parsing anything. Readers in other processes may scan the file while it is
+being written; records overwritten during a scan are skipped.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "modbus.h"
+#include "history.h"
+
+static size_t history_record_size(uint32_t data_len)
+{
+	return (sizeof(struct yam_history_record) + data_len + 7) & ~7;
+}
+
+static struct yam_history_record *history_slot(struct yam_history *hist,
+                                               uint64_t pos)
+{
+	struct yam_history_header *header = hist->header;
+
+	return (struct yam_history_record *)((uint8_t *)(header + 1) +
+	        (pos % header->num_records) * header->record_size);
+}
+
+/* Asks for records [first, last) to be written back, along with the header */
+static int history_msync(struct yam_history *hist, uint64_t first,
+                         uint64_t last, int flags)
+{
+	struct yam_history_header *header = hist->header;
+	long page = sysconf(_SC_PAGESIZE);
+	uint64_t n = header->num_records;
+	int ret = 0;
+
+	if (last - first > n) {
+		first = last - n;
+	}
+	while (first < last) {
+		/* Up to the end of the ring, then from its start */
+		uint64_t end = first + (n - first % n);
+		if (end > last) end = last;
+
+		uintptr_t from = (uintptr_t)history_slot(hist, first);
+		uintptr_t to = (uintptr_t)history_slot(hist, end - 1) +
+		               header->record_size;
+		from &= ~(uintptr_t)(page - 1);
+		ret |= msync((void *)from, to - from, flags);
+		first = end;
+	}
+	ret |= msync(header, sizeof(struct yam_history_header), flags);
+	return ret ? YAM_FILE_FAILED : YAM_OK;
+}
+
+/**
+\brief Create or reopen a history file for writing
+\param *hist The handle to initialize
+\param *path Path of the file
+\param num_records Number of records in the ring
+\param data_len Number of data bytes per record, 0 for the default
+\return YAM_OK on success, or an error code
+
+If the file already holds a history with the same number and size of
+records, new records are appended after the existing ones; otherwise the file
+is (re)initialized. A read of 125 registers needs 250 data bytes, so with
+smaller records long reads take several records; choose data_len to fit the
+typical poll. Attach the historian to a bus with yam_set_history().
+*/
+int yam_history_create(struct yam_history *hist, const char *path,
+                       uint32_t num_records, uint32_t data_len)
+{
+	struct yam_history_header *header;
+	struct stat st;
+	size_t record_size, size;
+	int fd;
+
+	bzero(hist, sizeof(struct yam_history));
+	if (data_len == 0) {
+		data_len = YAM_HISTORY_DEFAULT_DATA_LEN;
+	}
+	if (num_records == 0 || data_len < 2 ||
+	    data_len > YAM_HISTORY_MAX_DATA_LEN) {
+		return YAM_ILLEGAL_DATA_VALUE;
+	}
+	record_size = history_record_size(data_len);
+	size = sizeof(struct yam_history_header) + num_records * record_size;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return YAM_FILE_FAILED;
+	}
+	if (fstat(fd, &st) || (st.st_size != size && ftruncate(fd, size))) {
+		close(fd);
+		return YAM_FILE_FAILED;
+	}
+	header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		return YAM_FILE_FAILED;
+	}
+
+	if (header->magic != YAM_HISTORY_MAGIC ||
+	    header->version != YAM_HISTORY_VERSION ||
+	    header->record_size != record_size ||
+	    header->num_records != num_records) {
+		bzero(header, sizeof(struct yam_history_header));
+		header->version = YAM_HISTORY_VERSION;
+		header->record_size = record_size;
+		header->num_records = num_records;
+		__atomic_store_n(&header->magic, YAM_HISTORY_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	hist->header = header;
+	hist->size = size;
+	hist->writable = 1;
+	hist->synced = header->head;
+	hist->sync_every = YAM_HISTORY_DEFAULT_SYNC;
+	pthread_mutex_init(&hist->lock, NULL);
+	return YAM_OK;
+}
+
+/**
+\brief Open a history file for reading
+\param *hist The handle to initialize
+\param *path Path of the file
+\return YAM_OK on success, YAM_FILE_FAILED if there is no valid history
+*/
+int yam_history_open(struct yam_history *hist, const char *path)
+{
+	struct yam_history_header *header;
+	struct stat st;
+	int fd;
+
+	bzero(hist, sizeof(struct yam_history));
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return YAM_FILE_FAILED;
+	}
+	if (fstat(fd, &st) || st.st_size < sizeof(struct yam_history_header)) {
+		close(fd);
+		return YAM_FILE_FAILED;
+	}
+	header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		return YAM_FILE_FAILED;
+	}
+	if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != YAM_HISTORY_MAGIC ||
+	    header->version != YAM_HISTORY_VERSION || header->num_records == 0 ||
+	    header->record_size > history_record_size(YAM_HISTORY_MAX_DATA_LEN) ||
+	    sizeof(struct yam_history_header) +
+	    (uint64_t)header->num_records * header->record_size > st.st_size) {
+		munmap(header, st.st_size);
+		return YAM_FILE_FAILED;
+	}
+
+	hist->header = header;
+	hist->size = st.st_size;
+	pthread_mutex_init(&hist->lock, NULL);
+	return YAM_OK;
+}
+
+/**
+\brief Close a history file
+\param *hist The handle
+
+A writer's outstanding records are flushed to disk first.
+*/
+void yam_history_close(struct yam_history *hist)
+{
+	if (hist->header == NULL) {
+		return;
+	}
+	if (hist->writable) {
+		yam_history_sync(hist);
+	}
+	munmap(hist->header, hist->size);
+	hist->header = NULL;
+	pthread_mutex_destroy(&hist->lock);
+}
+
+/**
+\brief Set how often records are flushed to disk
+\param *hist The handle, from yam_history_create()
+\param records Number of records appended between flushes, 0 to leave
+flushing to the kernel
+
+The flush is asynchronous (MS_ASYNC), so it does not block the poll loop.
+Records are visible to readers as soon as they are appended, whatever this
+is set to.
+*/
+void yam_history_set_sync(struct yam_history *hist, unsigned int records)
+{
+	hist->sync_every = records;
+}
+
+/**
+\brief Write all records appended so far to disk, and wait for it
+\param *hist The handle, from yam_history_create()
+\return YAM_OK on success, YAM_FILE_FAILED on failure
+*/
+int yam_history_sync(struct yam_history *hist)
+{
+	int ret;
+
+	if (hist->header == NULL || !hist->writable) {
+		return YAM_FILE_FAILED;
+	}
+	pthread_mutex_lock(&hist->lock);
+	ret = history_msync(hist, hist->synced, hist->header->head, MS_SYNC);
+	hist->synced = hist->header->head;
+	pthread_mutex_unlock(&hist->lock);
+	return ret;
+}
+
+/**
+\brief Append a poll result
+\param *hist The handle, from yam_history_create()
+\param addr Slave address
+\param fncode Function code of the read
+\param start_addr Address of the first value
+\param count Number of coils or registers
+\param *data Response data, as received
+\param data_len Number of bytes of response data
+
+This is called by the read functions of a bus the historian is attached to,
+with the data still in the receive buffer.
+*/
+void yam_history_append(struct yam_history *hist, uint8_t addr,
+                        uint8_t fncode, uint16_t start_addr, uint16_t count,
+                        const uint8_t *data, int data_len)
+{
+	struct yam_history_header *header = hist->header;
+	struct timespec now;
+	uint64_t head;
+	int bits = (fncode == YAM_READ_COILS || fncode == YAM_READ_DISCRETES);
+	int cap;
+
+	if (header == NULL || !hist->writable) {
+		return;
+	}
+	clock_gettime(CLOCK_REALTIME, &now);
+	/* Whole values per record: registers are two bytes */
+	cap = header->record_size - sizeof(struct yam_history_record);
+	if (!bits) {
+		cap &= ~1;
+	}
+
+	pthread_mutex_lock(&hist->lock);
+	head = header->head;
+	do {
+		struct yam_history_record *rec = history_slot(hist, head);
+		int len = (data_len > cap) ? cap : data_len;
+		int n = bits ? len * 8 : len / 2;
+
+		if (n > count) n = count;
+		rec->timestamp_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+		rec->addr = addr;
+		rec->fncode = fncode;
+		rec->start_addr = start_addr;
+		rec->count = n;
+		rec->data_len = len;
+		memcpy(rec->data, data, len);
+
+		/* Publish the record to readers */
+		__atomic_store_n(&header->head, ++head, __ATOMIC_RELEASE);
+		start_addr += n;
+		count -= n;
+		data += len;
+		data_len -= len;
+	} while (data_len > 0);
+
+	if (hist->sync_every && head - hist->synced >= hist->sync_every) {
+		history_msync(hist, hist->synced, head, MS_ASYNC);
+		hist->synced = head;
+	}
+	pthread_mutex_unlock(&hist->lock);
+}
+
+/**
+\brief Visit the records of a time range
+\param *hist The handle, from yam_history_open() or yam_history_create()
+\param from_ns Start of the range, in nanoseconds since the epoch
+\param to_ns End of the range (inclusive), in nanoseconds since the epoch
+\param fn Function called with each record, oldest first
+\param *arg Argument passed to fn
+\return Number of records passed to fn, or an error code
+
+The first record is found by binary search, so this relies on the system
+clock not having been set back while the history was being written. The
+record passed to fn is a copy, valid only during the call.
+*/
+int yam_history_scan(struct yam_history *hist, uint64_t from_ns,
+                     uint64_t to_ns, yam_history_fn fn, void *arg)
+{
+	struct yam_history_header *header = hist->header;
+	union {
+		struct yam_history_record rec;
+		uint64_t raw[(sizeof(struct yam_history_record) +
+		              YAM_HISTORY_MAX_DATA_LEN) / sizeof(uint64_t)];
+	} copy;
+	uint64_t head, lo, hi, pos, n;
+	int visited = 0;
+
+	if (header == NULL) {
+		return YAM_FILE_FAILED;
+	}
+	n = header->num_records;
+	head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+	/* The oldest slot is the next to be overwritten, leave it out */
+	lo = (head >= n) ? head - n + 1 : 0;
+	hi = head;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (history_slot(hist, mid)->timestamp_ns < from_ns) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	for (pos = lo; pos < head; pos++) {
+		memcpy(&copy, history_slot(hist, pos), header->record_size);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		/* Skip records the writer has started to overwrite meanwhile */
+		if (__atomic_load_n(&header->head, __ATOMIC_RELAXED) >= pos + n) {
+			continue;
+		}
+		if (copy.rec.timestamp_ns > to_ns) {
+			break;
+		}
+		if (copy.rec.timestamp_ns < from_ns) {
+			continue;
+		}
+		visited++;
+		if (fn(arg, &copy.rec)) {
+			break;
+		}
+	}
+	return visited;
+}
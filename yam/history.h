@@ -0,0 +1,89 @@
+/**
+\file history.h
+\brief Include file for the YAM poll historian
+\author Jim George
+*/
+
+#ifndef _YAM_HISTORY_H_
+#define _YAM_HISTORY_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/** Identifies a YAM history file ("YAMH") */
+#define YAM_HISTORY_MAGIC 0x59414D48
+/** File layout version */
+#define YAM_HISTORY_VERSION 1
+/** Default number of data bytes per record */
+#define YAM_HISTORY_DEFAULT_DATA_LEN 48
+/** Maximum number of data bytes per record */
+#define YAM_HISTORY_MAX_DATA_LEN 256
+/** Default number of records between flushes to disk */
+#define YAM_HISTORY_DEFAULT_SYNC 1024
+
+/**
+\brief Header at the start of a history file
+*/
+struct yam_history_header {
+	uint32_t magic; /**< YAM_HISTORY_MAGIC */
+	uint32_t version; /**< YAM_HISTORY_VERSION */
+	uint32_t record_size; /**< Size of each record in bytes */
+	uint32_t num_records; /**< Number of records in the ring */
+	uint64_t head; /**< Number of records ever written; the next one goes
+	                    to slot head % num_records */
+	uint64_t reserved[5];
+};
+
+/**
+\brief One record of a history file
+
+The data is the response payload exactly as received from the slave: coils
+and discretes packed eight to a byte, registers in big-endian order. A read
+that does not fit in one record is spread over consecutive records with the
+same timestamp.
+*/
+struct yam_history_record {
+	uint64_t timestamp_ns; /**< CLOCK_REALTIME of the poll, in nanoseconds */
+	uint8_t addr; /**< Slave address */
+	uint8_t fncode; /**< Function code of the read */
+	uint16_t start_addr; /**< Address of the first value */
+	uint16_t count; /**< Number of coils or registers */
+	uint16_t data_len; /**< Number of data bytes */
+	uint8_t data[]; /**< Raw response data */
+};
+
+/**
+\brief Handle on a mapped history file
+*/
+struct yam_history {
+	struct yam_history_header *header; /**< Start of the mapping */
+	size_t size; /**< Size of the mapping */
+	int writable; /**< Nonzero for the writer's mapping */
+	uint64_t synced; /**< Records before this have been flushed to disk */
+	unsigned int sync_every; /**< Records between flushes to disk */
+	pthread_mutex_t lock; /**< Serializes writers sharing the handle */
+};
+
+/**
+\brief Callback for yam_history_scan()
+\param *arg Argument given to yam_history_scan()
+\param *rec The record
+\return 0 to continue scanning, nonzero to stop
+*/
+typedef int (*yam_history_fn)(void *arg, const struct yam_history_record *rec);
+
+int yam_history_create(struct yam_history *hist, const char *path,
+                       uint32_t num_records, uint32_t data_len);
+int yam_history_open(struct yam_history *hist, const char *path);
+void yam_history_close(struct yam_history *hist);
+void yam_history_set_sync(struct yam_history *hist, unsigned int records);
+int yam_history_sync(struct yam_history *hist);
+
+void yam_history_append(struct yam_history *hist, uint8_t addr,
+                        uint8_t fncode, uint16_t start_addr, uint16_t count,
+                        const uint8_t *data, int data_len);
+int yam_history_scan(struct yam_history *hist, uint64_t from_ns,
+                     uint64_t to_ns, yam_history_fn fn, void *arg);
+
+#endif /* _YAM_HISTORY_H_ */
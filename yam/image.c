@@ -0,0 +1,402 @@
+/**
+\file image.c
+\brief Register image and slave-side Modbus PDU handling.
+\author Jim George
+
+This module keeps an in-memory copy of a slave's register tables, and
+answers Modbus request PDUs from it. It is the slave-side counterpart of the
+request builders in modbus.c, and is shared by the TCP server and anything
+else that needs to impersonate a slave.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "modbus.h"
+#include "image.h"
+
+/* Per-request limits from the Modbus application protocol specification */
+#define IMAGE_MAX_READ_BITS 2000
+#define IMAGE_MAX_WRITE_BITS 1968
+#define IMAGE_MAX_READ_REGS 125
+#define IMAGE_MAX_WRITE_REGS 123
+
+/**
+\brief Initialize a register image
+\param *image The image to initialize
+\param num_coils Number of coils
+\param num_discretes Number of discrete inputs
+\param num_inputs Number of input registers
+\param num_regs Number of holding registers
+\return YAM_OK on success, YAM_NO_MEMORY on failure
+
+Allocates the four tables of the image, and zeroes them. Any table may be
+empty, in which case every access to it is answered with an Illegal Data
+Address exception.
+*/
+int yam_image_init(struct yam_image *image, unsigned int num_coils,
+                   unsigned int num_discretes, unsigned int num_inputs,
+                   unsigned int num_regs)
+{
+	assert(image != NULL);
+
+	bzero(image, sizeof(struct yam_image));
+	pthread_rwlock_init(&image->lock, NULL);
+	image->coils = calloc(num_coils + 1, sizeof(uint8_t));
+	image->discretes = calloc(num_discretes + 1, sizeof(uint8_t));
+	image->inputs = calloc(num_inputs + 1, sizeof(uint16_t));
+	image->regs = calloc(num_regs + 1, sizeof(uint16_t));
+	if (!image->coils || !image->discretes || !image->inputs || !image->regs) {
+		yam_image_free(image);
+		return YAM_NO_MEMORY;
+	}
+	image->num_coils = num_coils;
+	image->num_discretes = num_discretes;
+	image->num_inputs = num_inputs;
+	image->num_regs = num_regs;
+
+	return YAM_OK;
+}
+
+/**
+\brief Release the tables held by a register image
+\param *image The image to free
+*/
+void yam_image_free(struct yam_image *image)
+{
+	assert(image != NULL);
+
+	free(image->coils);
+	free(image->discretes);
+	free(image->inputs);
+	free(image->regs);
+	pthread_rwlock_destroy(&image->lock);
+	bzero(image, sizeof(struct yam_image));
+}
+
+/* Returns nonzero if [start, start + num) lies within a table of size len */
+static int image_range_ok(unsigned int start, unsigned int num,
+                          unsigned int len)
+{
+	return (num != 0) && (start + num <= len);
+}
+
+/**
+\brief Update coils in the image
+\param *image The register image
+\param start_addr Address of the first coil
+\param num_coils Number of coils to set
+\param *coils New coil states, one byte per coil, nonzero = on
+\return YAM_OK on success, YAM_ILLEGAL_DATA_ADDR if out of range
+*/
+int yam_image_set_coils(struct yam_image *image, uint16_t start_addr,
+                        uint16_t num_coils, const uint8_t *coils)
+{
+	assert(image != NULL);
+	assert(coils != NULL);
+
+	if (!image_range_ok(start_addr, num_coils, image->num_coils)) {
+		return YAM_ILLEGAL_DATA_ADDR;
+	}
+	pthread_rwlock_wrlock(&image->lock);
+	int ctr;
+	for (ctr = 0; ctr < num_coils; ctr++) {
+		image->coils[start_addr + ctr] = coils[ctr] ? 0xFF : 0x00;
+	}
+	pthread_rwlock_unlock(&image->lock);
+	return YAM_OK;
+}
+
+/**
+\brief Update discrete inputs in the image
+\param *image The register image
+\param start_addr Address of the first input
+\param num_discretes Number of inputs to set
+\param *discretes New input states, one byte per input, nonzero = on
+\return YAM_OK on success, YAM_ILLEGAL_DATA_ADDR if out of range
+*/
+int yam_image_set_discretes(struct yam_image *image, uint16_t start_addr,
+                            uint16_t num_discretes, const uint8_t *discretes)
+{
+	assert(image != NULL);
+	assert(discretes != NULL);
+
+	if (!image_range_ok(start_addr, num_discretes, image->num_discretes)) {
+		return YAM_ILLEGAL_DATA_ADDR;
+	}
+	pthread_rwlock_wrlock(&image->lock);
+	int ctr;
+	for (ctr = 0; ctr < num_discretes; ctr++) {
+		image->discretes[start_addr + ctr] = discretes[ctr] ? 0xFF : 0x00;
+	}
+	pthread_rwlock_unlock(&image->lock);
+	return YAM_OK;
+}
+
+/**
+\brief Update input registers in the image
+\param *image The register image
+\param start_addr Address of the first register
+\param num_regs Number of registers to set
+\param *regs New register values, in host byte order
+\return YAM_OK on success, YAM_ILLEGAL_DATA_ADDR if out of range
+*/
+int yam_image_set_inputs(struct yam_image *image, uint16_t start_addr,
+                         uint16_t num_regs, const uint16_t *regs)
+{
+	assert(image != NULL);
+	assert(regs != NULL);
+
+	if (!image_range_ok(start_addr, num_regs, image->num_inputs)) {
+		return YAM_ILLEGAL_DATA_ADDR;
+	}
+	pthread_rwlock_wrlock(&image->lock);
+	memcpy(&image->inputs[start_addr], regs, num_regs * sizeof(uint16_t));
+	pthread_rwlock_unlock(&image->lock);
+	return YAM_OK;
+}
+
+/**
+\brief Update holding registers in the image
+\param *image The register image
+\param start_addr Address of the first register
+\param num_regs Number of registers to set
+\param *regs New register values, in host byte order
+\return YAM_OK on success, YAM_ILLEGAL_DATA_ADDR if out of range
+*/
+int yam_image_set_registers(struct yam_image *image, uint16_t start_addr,
+                            uint16_t num_regs, const uint16_t *regs)
+{
+	assert(image != NULL);
+	assert(regs != NULL);
+
+	if (!image_range_ok(start_addr, num_regs, image->num_regs)) {
+		return YAM_ILLEGAL_DATA_ADDR;
+	}
+	pthread_rwlock_wrlock(&image->lock);
+	memcpy(&image->regs[start_addr], regs, num_regs * sizeof(uint16_t));
+	pthread_rwlock_unlock(&image->lock);
+	return YAM_OK;
+}
+
+/**
+\brief Read coils from the image
+\param *image The register image
+\param start_addr Address of the first coil
+\param num_coils Number of coils to read
+\param *coils Location to store the coils, one byte per coil
+\return YAM_OK on success, YAM_ILLEGAL_DATA_ADDR if out of range
+
+Used to pick up coils written by Modbus clients.
+*/
+int yam_image_get_coils(struct yam_image *image, uint16_t start_addr,
+                        uint16_t num_coils, uint8_t *coils)
+{
+	assert(image != NULL);
+	assert(coils != NULL);
+
+	if (!image_range_ok(start_addr, num_coils, image->num_coils)) {
+		return YAM_ILLEGAL_DATA_ADDR;
+	}
+	pthread_rwlock_rdlock(&image->lock);
+	memcpy(coils, &image->coils[start_addr], num_coils);
+	pthread_rwlock_unlock(&image->lock);
+	return YAM_OK;
+}
+
+/**
+\brief Read holding registers from the image
+\param *image The register image
+\param start_addr Address of the first register
+\param num_regs Number of registers to read
+\param *regs Location to store the registers, in host byte order
+\return YAM_OK on success, YAM_ILLEGAL_DATA_ADDR if out of range
+
+Used to pick up setpoints written by Modbus clients.
+*/
+int yam_image_get_registers(struct yam_image *image, uint16_t start_addr,
+                            uint16_t num_regs, uint16_t *regs)
+{
+	assert(image != NULL);
+	assert(regs != NULL);
+
+	if (!image_range_ok(start_addr, num_regs, image->num_regs)) {
+		return YAM_ILLEGAL_DATA_ADDR;
+	}
+	pthread_rwlock_rdlock(&image->lock);
+	memcpy(regs, &image->regs[start_addr], num_regs * sizeof(uint16_t));
+	pthread_rwlock_unlock(&image->lock);
+	return YAM_OK;
+}
+
+/* Builds an exception response, returns the PDU length */
+static int image_exception(uint8_t fncode, int errcode, uint8_t *resp_pdu)
+{
+	resp_pdu[0] = fncode | 0x80;
+	resp_pdu[1] = -errcode;
+	return 2;
+}
+
+/* Packs bytes-per-bit into the wire format, returns the byte count */
+static int image_pack_bits(const uint8_t *bits, unsigned int num,
+                           uint8_t *packed)
+{
+	int bytecount = (num + 7) / 8;
+	unsigned int ctr;
+
+	bzero(packed, bytecount);
+	for (ctr = 0; ctr < num; ctr++) {
+		if (bits[ctr]) {
+			packed[ctr / 8] |= (1 << (ctr % 8));
+		}
+	}
+	return bytecount;
+}
+
+/**
+\brief Answer a Modbus request PDU from a register image
+\param *image The register image
+\param *req_pdu Request PDU (function code and data, no address or CRC)
+\param req_len Length of the request PDU
+\param *resp_pdu Buffer for the response PDU, at least YAM_MODBUS_MAX_PDU_LEN
+\return Length of the response PDU
+
+Decodes a request, applies it to the image and encodes the reply, exactly as
+a slave would. Errors are reported to the requester in the response PDU as
+Modbus exceptions, so the return value is always a valid PDU length.
+*/
+int yam_image_process(struct yam_image *image, const uint8_t *req_pdu,
+                      int req_len, uint8_t *resp_pdu)
+{
+	assert(image != NULL);
+	assert(req_pdu != NULL);
+	assert(resp_pdu != NULL);
+
+	if (req_len < 1) {
+		return image_exception(0, YAM_ILLEGAL_FUNCTION, resp_pdu);
+	}
+
+	uint8_t fncode = req_pdu[0];
+	unsigned int addr = 0, num = 0;
+	int ctr;
+
+	if (req_len >= 5) {
+		addr = (req_pdu[1] << 8) | req_pdu[2];
+		num = (req_pdu[3] << 8) | req_pdu[4];
+	}
+
+	switch (fncode) {
+	case YAM_READ_COILS:
+	case YAM_READ_DISCRETES:
+		{
+		int coils = (fncode == YAM_READ_COILS);
+		if (req_len != 5 || num == 0 || num > IMAGE_MAX_READ_BITS) {
+			return image_exception(fncode, YAM_ILLEGAL_DATA_VALUE, resp_pdu);
+		}
+		if (!image_range_ok(addr, num,
+		                    coils ? image->num_coils : image->num_discretes)) {
+			return image_exception(fncode, YAM_ILLEGAL_DATA_ADDR, resp_pdu);
+		}
+		pthread_rwlock_rdlock(&image->lock);
+		resp_pdu[1] = image_pack_bits(
+			coils ? &image->coils[addr] : &image->discretes[addr],
+			num, &resp_pdu[2]);
+		pthread_rwlock_unlock(&image->lock);
+		resp_pdu[0] = fncode;
+		return 2 + resp_pdu[1];
+		}
+	case YAM_READ_REGISTERS:
+	case YAM_READ_INPUTS:
+		{
+		uint16_t *table = (fncode == YAM_READ_REGISTERS) ?
+		                  image->regs : image->inputs;
+		if (req_len != 5 || num == 0 || num > IMAGE_MAX_READ_REGS) {
+			return image_exception(fncode, YAM_ILLEGAL_DATA_VALUE, resp_pdu);
+		}
+		if (!image_range_ok(addr, num, (fncode == YAM_READ_REGISTERS) ?
+		                    image->num_regs : image->num_inputs)) {
+			return image_exception(fncode, YAM_ILLEGAL_DATA_ADDR, resp_pdu);
+		}
+		pthread_rwlock_rdlock(&image->lock);
+		for (ctr = 0; ctr < num; ctr++) {
+			resp_pdu[2 + 2 * ctr] = table[addr + ctr] >> 8;
+			resp_pdu[3 + 2 * ctr] = table[addr + ctr] & 0x00FF;
+		}
+		pthread_rwlock_unlock(&image->lock);
+		resp_pdu[0] = fncode;
+		resp_pdu[1] = num * 2;
+		return 2 + num * 2;
+		}
+	case YAM_WRITE_SINGLECOIL:
+		/* num holds the output value here */
+		if (req_len != 5 || (num != 0xFF00 && num != 0x0000)) {
+			return image_exception(fncode, YAM_ILLEGAL_DATA_VALUE, resp_pdu);
+		}
+		if (!image_range_ok(addr, 1, image->num_coils)) {
+			return image_exception(fncode, YAM_ILLEGAL_DATA_ADDR, resp_pdu);
+		}
+		pthread_rwlock_wrlock(&image->lock);
+		image->coils[addr] = num ? 0xFF : 0x00;
+		pthread_rwlock_unlock(&image->lock);
+		/* Reply is an echo of the request */
+		memcpy(resp_pdu, req_pdu, 5);
+		return 5;
+	case YAM_WRITE_SINGLEREGISTER:
+		if (req_len != 5) {
+			return image_exception(fncode, YAM_ILLEGAL_DATA_VALUE, resp_pdu);
+		}
+		if (!image_range_ok(addr, 1, image->num_regs)) {
+			return image_exception(fncode, YAM_ILLEGAL_DATA_ADDR, resp_pdu);
+		}
+		pthread_rwlock_wrlock(&image->lock);
+		image->regs[addr] = num;
+		pthread_rwlock_unlock(&image->lock);
+		memcpy(resp_pdu, req_pdu, 5);
+		return 5;
+	case YAM_READ_EXCEPTIONSTATUS:
+		if (req_len != 1) {
+			return image_exception(fncode, YAM_ILLEGAL_DATA_VALUE, resp_pdu);
+		}
+		resp_pdu[0] = fncode;
+		resp_pdu[1] = 0;
+		return 2;
+	case YAM_WRITE_COILS:
+		if (req_len < 6 || num == 0 || num > IMAGE_MAX_WRITE_BITS ||
+		    req_pdu[5] != (num + 7) / 8 || req_len != 6 + req_pdu[5]) {
+			return image_exception(fncode, YAM_ILLEGAL_DATA_VALUE, resp_pdu);
+		}
+		if (!image_range_ok(addr, num, image->num_coils)) {
+			return image_exception(fncode, YAM_ILLEGAL_DATA_ADDR, resp_pdu);
+		}
+		pthread_rwlock_wrlock(&image->lock);
+		for (ctr = 0; ctr < num; ctr++) {
+			image->coils[addr + ctr] =
+				(req_pdu[6 + ctr / 8] & (1 << (ctr % 8))) ? 0xFF : 0x00;
+		}
+		pthread_rwlock_unlock(&image->lock);
+		memcpy(resp_pdu, req_pdu, 5);
+		return 5;
+	case YAM_WRITE_REGISTERS:
+		if (req_len < 6 || num == 0 || num > IMAGE_MAX_WRITE_REGS ||
+		    req_pdu[5] != num * 2 || req_len != 6 + req_pdu[5]) {
+			return image_exception(fncode, YAM_ILLEGAL_DATA_VALUE, resp_pdu);
+		}
+		if (!image_range_ok(addr, num, image->num_regs)) {
+			return image_exception(fncode, YAM_ILLEGAL_DATA_ADDR, resp_pdu);
+		}
+		pthread_rwlock_wrlock(&image->lock);
+		for (ctr = 0; ctr < num; ctr++) {
+			image->regs[addr + ctr] =
+				(req_pdu[6 + 2 * ctr] << 8) | req_pdu[7 + 2 * ctr];
+		}
+		pthread_rwlock_unlock(&image->lock);
+		memcpy(resp_pdu, req_pdu, 5);
+		return 5;
+	default:
+		return image_exception(fncode, YAM_ILLEGAL_FUNCTION, resp_pdu);
+	}
+}
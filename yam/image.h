@@ -0,0 +1,64 @@
+/**
+\file image.h
+\brief Include file for the YAM register image and slave-side codec
+\author Jim George
+*/
+
+#ifndef _YAM_IMAGE_H_
+#define _YAM_IMAGE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* Register tables */
+#define YAM_TABLE_COILS 0
+#define YAM_TABLE_DISCRETES 1
+#define YAM_TABLE_INPUTS 2
+#define YAM_TABLE_REGISTERS 3
+#define YAM_NUM_TABLES 4
+
+/**
+\brief In-memory register image
+
+This structure holds the four Modbus tables (coils, discrete inputs, input
+registers and holding registers) of a simulated or proxied slave. Coils and
+discretes are stored one byte per bit, using the same 0x00/0xFF convention as
+yam_read_coils(). Registers are stored in host byte order.
+
+The image is protected by a reader/writer lock, so it may be shared between
+several server loops and the thread that refreshes it from the bus.
+*/
+struct yam_image {
+	unsigned int num_coils; /**< Number of coils in the image */
+	unsigned int num_discretes; /**< Number of discrete inputs in the image */
+	unsigned int num_inputs; /**< Number of input registers in the image */
+	unsigned int num_regs; /**< Number of holding registers in the image */
+	uint8_t *coils; /**< Coil table */
+	uint8_t *discretes; /**< Discrete input table */
+	uint16_t *inputs; /**< Input register table */
+	uint16_t *regs; /**< Holding register table */
+	pthread_rwlock_t lock; /**< Guards all four tables */
+};
+
+int yam_image_init(struct yam_image *image, unsigned int num_coils,
+                   unsigned int num_discretes, unsigned int num_inputs,
+                   unsigned int num_regs);
+void yam_image_free(struct yam_image *image);
+
+int yam_image_set_coils(struct yam_image *image, uint16_t start_addr,
+                        uint16_t num_coils, const uint8_t *coils);
+int yam_image_set_discretes(struct yam_image *image, uint16_t start_addr,
+                            uint16_t num_discretes, const uint8_t *discretes);
+int yam_image_set_inputs(struct yam_image *image, uint16_t start_addr,
+                         uint16_t num_regs, const uint16_t *regs);
+int yam_image_set_registers(struct yam_image *image, uint16_t start_addr,
+                            uint16_t num_regs, const uint16_t *regs);
+int yam_image_get_coils(struct yam_image *image, uint16_t start_addr,
+                        uint16_t num_coils, uint8_t *coils);
+int yam_image_get_registers(struct yam_image *image, uint16_t start_addr,
+                            uint16_t num_regs, uint16_t *regs);
+
+int yam_image_process(struct yam_image *image, const uint8_t *req_pdu,
+                      int req_len, uint8_t *resp_pdu);
+
+#endif /* _YAM_IMAGE_H_ */
@@ -0,0 +1,136 @@
+/**
+\file loopback.c
+\brief In-process transport between a bus and simulated slaves
+\author Jim George
+
+Both ends run in the thread driving the bus: each request is answered by
+the slave engine as soon as it has been sent, and the reply then waits in
+its ring to be read back byte by byte, as it would be from a serial port.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+
+#include "modbus.h"
+#include "sim.h"
+#include "loopback.h"
+#include "transport.h"
+
+#define RING_MASK (YAM_LOOPBACK_RING_LEN - 1)
+
+static unsigned int ring_put(struct yam_loopback_ring *ring,
+                             const uint8_t *buf, unsigned int len)
+{
+	unsigned int ctr, room = YAM_LOOPBACK_RING_LEN - (ring->head - ring->tail);
+
+	if (len > room) {
+		len = room;
+	}
+	for (ctr = 0; ctr < len; ctr++) {
+		ring->buf[(ring->head + ctr) & RING_MASK] = buf[ctr];
+	}
+	ring->head += len;
+	return len;
+}
+
+static unsigned int ring_get(struct yam_loopback_ring *ring, uint8_t *buf,
+                             unsigned int len)
+{
+	unsigned int ctr, avail = ring->head - ring->tail;
+
+	if (len > avail) {
+		len = avail;
+	}
+	for (ctr = 0; ctr < len; ctr++) {
+		buf[ctr] = ring->buf[(ring->tail + ctr) & RING_MASK];
+	}
+	ring->tail += len;
+	return len;
+}
+
+static int loopback_send(struct yam_modbus *bus, const uint8_t *buf,
+                         size_t len)
+{
+	struct yam_loopback *lb = bus->transport_data;
+	uint8_t req[YAM_MODBUS_MAX_ADU_LEN], resp[YAM_MODBUS_MAX_ADU_LEN];
+	int req_len, resp_len;
+
+	if (len > YAM_MODBUS_MAX_ADU_LEN) {
+		return YAM_INVALIDBYTECOUNT;
+	}
+	ring_put(&lb->to_slave, buf, len);
+
+	/* The silence after a frame ends it, so the slave takes it whole */
+	req_len = ring_get(&lb->to_slave, req, sizeof(req));
+	lb->frames++;
+	resp_len = yam_sim_process(lb->sim, req, req_len, resp);
+	if (resp_len > 0) {
+		ring_put(&lb->to_master, resp, resp_len);
+		lb->sim->stats.replies++;
+	}
+	return len;
+}
+
+static int loopback_recv(struct yam_modbus *bus, uint8_t *buf, size_t len,
+                         int timeout_ms)
+{
+	struct yam_loopback *lb = bus->transport_data;
+
+	/* Nothing more can arrive while the caller waits, so time out at once */
+	(void)timeout_ms;
+	return ring_get(&lb->to_master, buf, len);
+}
+
+static void loopback_flush(struct yam_modbus *bus)
+{
+	struct yam_loopback *lb = bus->transport_data;
+
+	lb->to_slave.tail = lb->to_slave.head;
+	lb->to_master.tail = lb->to_master.head;
+}
+
+static void loopback_close(struct yam_modbus *bus)
+{
+	bus->transport_data = NULL;
+}
+
+static const struct yam_transport loopback_transport = {
+	.name = "loopback",
+	.send = loopback_send,
+	.recv = loopback_recv,
+	.flush = loopback_flush,
+	.close = loopback_close,
+};
+
+/**
+\brief Initialize a YAM object connected to simulated slaves in memory
+\param *lb The loopback to initialize
+\param *sim The slaves, typically set up with yam_sim_init_engine() and
+yam_sim_add_slave(); it must not be running on a terminal at the same time
+\param *bus The YAM object representing the Modbus
+\return YAM_OK on success, error code on failure
+
+Use this instead of yam_modbus_init(). The bus has no baud rate, so frames
+are neither paced nor counted as wire time; set bus->baudrate afterwards to
+have the library pace them as it would on a line of that speed. A request
+the slaves do not answer times out at once. The simulator is not closed
+with the bus.
+*/
+int yam_modbus_loopback(struct yam_loopback *lb, struct yam_sim *sim,
+                        struct yam_modbus *bus)
+{
+	assert(lb != NULL);
+	assert(sim != NULL);
+	assert(bus != NULL);
+
+	if (yam_bus_setup(bus, &loopback_transport, lb, "loopback")) {
+		return (bus->last_errorcode = YAM_NO_MEMORY);
+	}
+	bus->flags = YAM_SERIAL_FLAGS_DEFAULT;
+	bzero(lb, sizeof(struct yam_loopback));
+	lb->sim = sim;
+
+	return (bus->last_errorcode = YAM_OK);
+}
@@ -0,0 +1,45 @@
+/**
+\file loopback.h
+\brief Include file for the YAM in-process loopback transport
+\author Jim George
+*/
+
+#ifndef _YAM_LOOPBACK_H_
+#define _YAM_LOOPBACK_H_
+
+#include <stdint.h>
+#include "modbus.h"
+#include "sim.h"
+
+/** Size of each ring buffer, a power of two holding several frames */
+#define YAM_LOOPBACK_RING_LEN 1024
+
+/**
+\brief Bytes in flight in one direction
+*/
+struct yam_loopback_ring {
+	uint8_t buf[YAM_LOOPBACK_RING_LEN]; /**< Data */
+	unsigned int head; /**< Count of bytes ever written */
+	unsigned int tail; /**< Count of bytes ever read */
+};
+
+/**
+\brief A bus connected to simulated slaves in memory
+
+Requests sent on the bus go into one ring buffer, from which the slave
+engine of a struct yam_sim takes them, and its replies come back through the
+other. Nothing is copied through the kernel and nothing sleeps, so the
+library's framing, decoding and scheduling can be measured and fuzzed by
+themselves. The slaves' latencies are not simulated; their faults are.
+*/
+struct yam_loopback {
+	struct yam_sim *sim; /**< The slaves */
+	struct yam_loopback_ring to_slave; /**< Requests */
+	struct yam_loopback_ring to_master; /**< Replies */
+	uint64_t frames; /**< Requests handed to the slaves */
+};
+
+int yam_modbus_loopback(struct yam_loopback *lb, struct yam_sim *sim,
+                        struct yam_modbus *bus);
+
+#endif /* _YAM_LOOPBACK_H_ */
@@ -0,0 +1,315 @@
+/**
+\file metrics.c
+\brief Per-slave, per-function transaction counters and latency histograms
+\author Jim George
+
+Latencies go into a log-bucketed histogram in the style of HdrHistogram:
+each doubling of the latency is split into 2^YAM_METRICS_SUB_BITS buckets,
+so a percentile read back from it is within 1/8 of the true value, whatever
+its magnitude, in a fixed amount of memory.
+
+Only the thread driving the bus records. It uses relaxed atomic additions,
+which take no lock and never wait, so that snapshots and resets may be done
+from any other thread.
+*/
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+
+#include "modbus.h"
+#include "metrics.h"
+
+#define SUB_BUCKETS (1 << YAM_METRICS_SUB_BITS)
+#define CELL_WORDS (sizeof(struct yam_metrics_cell) / sizeof(uint64_t))
+
+/* Function code counted in each slot, 0 for the slot shared by the rest */
+static const uint8_t slot_functions[YAM_METRICS_FUNCTIONS] = {
+	YAM_READ_COILS, YAM_READ_DISCRETES, YAM_READ_REGISTERS, YAM_READ_INPUTS,
+	YAM_WRITE_SINGLECOIL, YAM_WRITE_SINGLEREGISTER, YAM_READ_EXCEPTIONSTATUS,
+	YAM_WRITE_COILS, YAM_WRITE_REGISTERS, 0
+};
+
+/**
+\brief Slot of a function code in a slave's cells
+\param fncode Function code (the exception bit is ignored)
+\return Index into the cells of a slave in struct yam_metrics
+*/
+int yam_metrics_slot(uint8_t fncode)
+{
+	switch (fncode & 0x7F) {
+	case YAM_READ_COILS: return 0;
+	case YAM_READ_DISCRETES: return 1;
+	case YAM_READ_REGISTERS: return 2;
+	case YAM_READ_INPUTS: return 3;
+	case YAM_WRITE_SINGLECOIL: return 4;
+	case YAM_WRITE_SINGLEREGISTER: return 5;
+	case YAM_READ_EXCEPTIONSTATUS: return 6;
+	case YAM_WRITE_COILS: return 7;
+	case YAM_WRITE_REGISTERS: return 8;
+	default: return YAM_METRICS_FUNCTIONS - 1;
+	}
+}
+
+/**
+\brief Function code counted in a slot of a slave's cells
+\param slot Slot number, below YAM_METRICS_FUNCTIONS
+\return The function code, or 0 for the slot shared by the other codes
+*/
+uint8_t yam_metrics_slot_function(int slot)
+{
+	return slot_functions[slot];
+}
+
+static int metrics_bucket(uint64_t value)
+{
+	int exp;
+
+	if (value > UINT32_MAX) {
+		value = UINT32_MAX;
+	}
+	if (value < SUB_BUCKETS) {
+		return value;
+	}
+	exp = 63 - __builtin_clzll(value);
+	return ((exp - YAM_METRICS_SUB_BITS + 1) << YAM_METRICS_SUB_BITS) +
+	       ((value >> (exp - YAM_METRICS_SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+static void metrics_add(uint64_t *counter, uint64_t value)
+{
+	__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+/**
+\brief Initialize the metrics of a bus
+\param *metrics The metrics to initialize
+\return 0 on success, error code on failure
+
+Attach the metrics to a bus with yam_set_metrics().
+*/
+int yam_metrics_init(struct yam_metrics *metrics)
+{
+	assert(metrics != NULL);
+
+	bzero(metrics, sizeof(struct yam_metrics));
+	return YAM_OK;
+}
+
+/**
+\brief Free the counters of all slaves
+\param *metrics The metrics, which must no longer be attached to a bus
+*/
+void yam_metrics_free(struct yam_metrics *metrics)
+{
+	assert(metrics != NULL);
+
+	int addr;
+
+	for (addr = 0; addr <= YAM_MAX_SLAVE_ADDR; addr++) {
+		free(metrics->slaves[addr]);
+		metrics->slaves[addr] = NULL;
+	}
+}
+
+/**
+\brief Record one transaction
+\param *metrics The metrics
+\param addr Slave address (0 for broadcasts)
+\param fncode Function code of the request
+\param status Result of the transaction
+\param bytes_out Bytes sent, 0 if the request failed without being sent
+\param bytes_in Bytes received
+\param latency_us Latency in microseconds, negative if nothing was received
+
+Called by the library for every request on a bus with metrics attached.
+Only the thread driving the bus may call this.
+*/
+void yam_metrics_record(struct yam_metrics *metrics, uint8_t addr,
+                        uint8_t fncode, int status, int bytes_out,
+                        int bytes_in, int64_t latency_us)
+{
+	struct yam_metrics_cell *cells, *cell;
+
+	if (addr > YAM_MAX_SLAVE_ADDR) {
+		return;
+	}
+	cells = __atomic_load_n(&metrics->slaves[addr], __ATOMIC_ACQUIRE);
+	if (cells == NULL) {
+		cells = calloc(YAM_METRICS_FUNCTIONS, sizeof(struct yam_metrics_cell));
+		if (cells == NULL) {
+			return;
+		}
+		__atomic_store_n(&metrics->slaves[addr], cells, __ATOMIC_RELEASE);
+	}
+	cell = &cells[yam_metrics_slot(fncode)];
+
+	if (bytes_out == 0) {
+		metrics_add(&cell->rejected, 1);
+		return;
+	}
+	metrics_add(&cell->transactions, 1);
+	metrics_add(&cell->bytes_out, bytes_out);
+	metrics_add(&cell->bytes_in, bytes_in);
+	if (status == YAM_TIMEOUT) {
+		metrics_add(&cell->timeouts, 1);
+	}
+	else if (status == YAM_CRC_ERROR) {
+		metrics_add(&cell->crc_errors, 1);
+	}
+	else if (status < 0 && status > YAM_CRC_ERROR) {
+		metrics_add(&cell->exceptions, 1);
+	}
+	else if (status < 0) {
+		metrics_add(&cell->other_errors, 1);
+	}
+
+	if (latency_us >= 0) {
+		metrics_add(&cell->hist[metrics_bucket(latency_us)], 1);
+		metrics_add(&cell->latency_sum_us, latency_us);
+		if ((uint64_t)latency_us >
+		    __atomic_load_n(&cell->latency_max_us, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&cell->latency_max_us, latency_us,
+			                 __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/**
+\brief Sum the counters of some slaves and function codes
+\param *metrics The metrics
+\param addr Slave address, or 0 for all slaves (broadcasts included)
+\param fncode Function code, or 0 for all function codes
+\param *cell Location to store the sums
+\return 0 on success, YAM_ILLEGAL_DATA_VALUE for an invalid address
+
+Function codes other than the standard read and write functions are counted
+together, so asking for any one of them returns the sum of all of them.
+*/
+int yam_metrics_snapshot(struct yam_metrics *metrics, uint8_t addr,
+                         uint8_t fncode, struct yam_metrics_cell *cell)
+{
+	assert(metrics != NULL);
+	assert(cell != NULL);
+
+	struct yam_metrics_cell *cells, *src;
+	uint64_t *dst_words, *src_words, value;
+	int first = addr, last = addr, slot, word;
+	size_t max_word = offsetof(struct yam_metrics_cell, latency_max_us) /
+	                  sizeof(uint64_t);
+
+	if (addr > YAM_MAX_SLAVE_ADDR) {
+		return YAM_ILLEGAL_DATA_VALUE;
+	}
+	if (addr == 0) {
+		last = YAM_MAX_SLAVE_ADDR;
+	}
+	bzero(cell, sizeof(struct yam_metrics_cell));
+	dst_words = (uint64_t *)cell;
+
+	for (; first <= last; first++) {
+		cells = __atomic_load_n(&metrics->slaves[first], __ATOMIC_ACQUIRE);
+		if (cells == NULL) {
+			continue;
+		}
+		for (slot = 0; slot < YAM_METRICS_FUNCTIONS; slot++) {
+			if (fncode && slot != yam_metrics_slot(fncode)) {
+				continue;
+			}
+			src = &cells[slot];
+			src_words = (uint64_t *)src;
+			for (word = 0; word < (int)CELL_WORDS; word++) {
+				value = __atomic_load_n(&src_words[word], __ATOMIC_RELAXED);
+				if ((size_t)word == max_word) {
+					if (value > dst_words[word]) {
+						dst_words[word] = value;
+					}
+				}
+				else {
+					dst_words[word] += value;
+				}
+			}
+		}
+	}
+
+	return YAM_OK;
+}
+
+/**
+\brief Set all counters back to zero
+\param *metrics The metrics
+*/
+void yam_metrics_reset(struct yam_metrics *metrics)
+{
+	assert(metrics != NULL);
+
+	struct yam_metrics_cell *cells;
+	uint64_t *words;
+	int addr;
+	size_t word;
+
+	for (addr = 0; addr <= YAM_MAX_SLAVE_ADDR; addr++) {
+		cells = __atomic_load_n(&metrics->slaves[addr], __ATOMIC_ACQUIRE);
+		if (cells == NULL) {
+			continue;
+		}
+		words = (uint64_t *)cells;
+		for (word = 0; word < CELL_WORDS * YAM_METRICS_FUNCTIONS; word++) {
+			__atomic_store_n(&words[word], 0, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/**
+\brief Highest latency counted in a histogram bucket
+\param bucket Bucket number
+\return Latency in microseconds
+*/
+uint64_t yam_metrics_bucket_limit(int bucket)
+{
+	int exp, shift;
+
+	if (bucket < SUB_BUCKETS) {
+		return bucket;
+	}
+	exp = (bucket >> YAM_METRICS_SUB_BITS) + YAM_METRICS_SUB_BITS - 1;
+	shift = exp - YAM_METRICS_SUB_BITS;
+	return (((uint64_t)SUB_BUCKETS + (bucket & (SUB_BUCKETS - 1))) << shift) +
+	       (1ULL << shift) - 1;
+}
+
+/**
+\brief Latency below which a given share of the transactions fell
+\param *cell Counters, as returned by yam_metrics_snapshot()
+\param percent Share of the transactions, such as 50 or 99.9
+\return Latency in microseconds, 0 if none was recorded
+*/
+uint64_t yam_metrics_percentile(const struct yam_metrics_cell *cell,
+                                double percent)
+{
+	assert(cell != NULL);
+
+	uint64_t total = 0, seen = 0, target, limit;
+	int bucket;
+
+	for (bucket = 0; bucket < YAM_METRICS_BUCKETS; bucket++) {
+		total += cell->hist[bucket];
+	}
+	if (total == 0) {
+		return 0;
+	}
+	target = total * percent / 100.0;
+	if (target == 0) {
+		target = 1;
+	}
+	for (bucket = 0; bucket < YAM_METRICS_BUCKETS; bucket++) {
+		seen += cell->hist[bucket];
+		if (seen >= target) {
+			break;
+		}
+	}
+	limit = yam_metrics_bucket_limit(bucket);
+	return (limit < cell->latency_max_us) ? limit : cell->latency_max_us;
+}
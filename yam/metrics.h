@@ -0,0 +1,69 @@
+/**
+\file metrics.h
+\brief Include file for YAM per-slave, per-function metrics
+\author Jim George
+*/
+
+#ifndef _YAM_METRICS_H_
+#define _YAM_METRICS_H_
+
+#include <stdint.h>
+#include "modbus.h"
+
+/** Bits of precision of the latency histogram (8 buckets per doubling) */
+#define YAM_METRICS_SUB_BITS 3
+/** Number of latency buckets, covering 0 to 2^32 microseconds */
+#define YAM_METRICS_BUCKETS ((32 - YAM_METRICS_SUB_BITS + 1) << YAM_METRICS_SUB_BITS)
+/** Function codes counted separately; the rest share the last slot */
+#define YAM_METRICS_FUNCTIONS 10
+
+/**
+\brief Counters of one slave and function code, or of a sum of them
+
+Every attempt sent on the bus counts as a transaction, so a request that
+was retried counts more than once. Latencies run from the start of the
+request on the line to the last byte of the reply, in microseconds, and are
+only recorded when something was received.
+*/
+struct yam_metrics_cell {
+	uint64_t transactions; /**< Requests sent */
+	uint64_t timeouts; /**< Requests that got no complete reply in time */
+	uint64_t crc_errors; /**< Replies with a bad CRC */
+	uint64_t exceptions; /**< Exception replies */
+	uint64_t other_errors; /**< Other failed transactions */
+	uint64_t rejected; /**< Requests failed locally, without being sent */
+	uint64_t bytes_out; /**< Bytes sent */
+	uint64_t bytes_in; /**< Bytes received */
+	uint64_t latency_sum_us; /**< Sum of recorded latencies */
+	uint64_t latency_max_us; /**< Longest recorded latency */
+	uint64_t hist[YAM_METRICS_BUCKETS]; /**< Latency histogram */
+};
+
+/**
+\brief Metrics of one bus
+
+Recording is done by the thread driving the bus with relaxed atomic
+operations and no locks, so any thread may take snapshots or reset the
+counters while the bus runs. A slave's counters are allocated the first
+time it is used. See yam_set_metrics().
+*/
+struct yam_metrics {
+	struct yam_metrics_cell *slaves[YAM_MAX_SLAVE_ADDR + 1]; /**< Counters
+	                   of each slave, YAM_METRICS_FUNCTIONS cells each */
+};
+
+int yam_metrics_init(struct yam_metrics *metrics);
+void yam_metrics_free(struct yam_metrics *metrics);
+void yam_metrics_record(struct yam_metrics *metrics, uint8_t addr,
+                        uint8_t fncode, int status, int bytes_out,
+                        int bytes_in, int64_t latency_us);
+int yam_metrics_snapshot(struct yam_metrics *metrics, uint8_t addr,
+                         uint8_t fncode, struct yam_metrics_cell *cell);
+void yam_metrics_reset(struct yam_metrics *metrics);
+uint64_t yam_metrics_percentile(const struct yam_metrics_cell *cell,
+                                double percent);
+uint64_t yam_metrics_bucket_limit(int bucket);
+int yam_metrics_slot(uint8_t fncode);
+uint8_t yam_metrics_slot_function(int slot);
+
+#endif /* _YAM_METRICS_H_ */
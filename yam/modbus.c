@@ -8,6 +8,7 @@ received packets. Actual serial I/O is handled in the serial.c module.
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
 #include <termios.h>
@@ -22,6 +23,13 @@ received packets. Actual serial I/O is handled in the serial.c module.
 
 #include "modbus.h"
 #include "serial.h"
+#include "transport.h"
+#include "shm.h"
+#include "history.h"
+#include "cache.h"
+#include "trace.h"
+#include "metrics.h"
+#include "capture.h"
 
 #define PACKED __attribute__((__packed__))
 
@@ -91,7 +99,7 @@ static uint8_t crc_table_lo[] = {
 \param buffer_length Length of input buffer
 \return The computed CRC
 */
-static uint16_t crc16(uint8_t *buffer, uint16_t buffer_length)
+uint16_t yam_crc16(const uint8_t *buffer, uint16_t buffer_length)
 {
 	uint8_t crc_hi = 0xFF; /* high CRC byte initialized */
 	uint8_t crc_lo = 0xFF; /* low CRC byte initialized */
@@ -107,6 +115,143 @@ static uint16_t crc16(uint8_t *buffer, uint16_t buffer_length)
 	return (crc_hi << 8 | crc_lo);
 }
 
+static uint64_t yam_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Bits per character on the line: start, data, parity and stop bits */
+static int yam_char_bits(struct yam_modbus *bus)
+{
+	int bits = 1 + 8 + 1;
+
+	switch (bus->flags & YAM_SERIAL_FLAGS_BITS_MSK) {
+	case YAM_SERIAL_FLAGS_7BIT: bits -= 1; break;
+	case YAM_SERIAL_FLAGS_6BIT: bits -= 2; break;
+	}
+	if (bus->flags & YAM_SERIAL_FLAGS_PARITY_MSK) bits++;
+	if (bus->flags & YAM_SERIAL_FLAGS_TWO_STOP) bits++;
+	return bits;
+}
+
+/* Time to send one character, in nanoseconds; 0 if the baud rate is unknown */
+static uint64_t yam_char_ns(struct yam_modbus *bus)
+{
+	if (bus->baudrate <= 0) {
+		return 0;
+	}
+	return (uint64_t)yam_char_bits(bus) * 1000000000 / bus->baudrate;
+}
+
+/* Silent interval (3.5 characters) that ends a frame, in nanoseconds */
+static uint64_t yam_gap_ns(struct yam_modbus *bus)
+{
+	/* The spec fixes the interval above 19200 bps */
+	if (bus->baudrate > 19200) {
+		return YAM_T35_FIXED_US * 1000ULL;
+	}
+	return yam_char_ns(bus) * 7 / 2;
+}
+
+/* Health entry of a slave, NULL for broadcasts and invalid addresses */
+static struct yam_slave *yam_slave_entry(struct yam_modbus *bus, uint8_t addr)
+{
+	if (bus->slaves == NULL || addr == 0 || addr > YAM_MAX_SLAVE_ADDR) {
+		return NULL;
+	}
+	return &bus->slaves[addr];
+}
+
+static unsigned int yam_profile_quirks(struct yam_modbus *bus, uint8_t addr)
+{
+	struct yam_slave *slave = yam_slave_entry(bus, addr);
+	return slave ? slave->profile.quirks : 0;
+}
+
+/*
+Checks a request against what the target device supports, so that requests
+it cannot handle fail locally instead of costing a round trip.
+*/
+static int yam_profile_check(const struct yam_profile *profile,
+                             const uint8_t *adu)
+{
+	uint8_t fncode = adu[1];
+	uint16_t count = (adu[4] << 8) | adu[5];
+
+	if (profile->functions && (fncode >= 32 ||
+	    !(profile->functions & YAM_FUNCTION_BIT(fncode)))) {
+		return YAM_ILLEGAL_FUNCTION;
+	}
+	switch (fncode) {
+	case YAM_READ_COILS:
+	case YAM_READ_DISCRETES:
+	case YAM_WRITE_COILS:
+		if (profile->max_coils && count > profile->max_coils) {
+			return YAM_TOO_MANY_REGISTERS;
+		}
+		break;
+	case YAM_READ_REGISTERS:
+	case YAM_READ_INPUTS:
+	case YAM_WRITE_REGISTERS:
+		if (profile->max_regs && count > profile->max_regs) {
+			return YAM_TOO_MANY_REGISTERS;
+		}
+		break;
+	}
+	return YAM_OK;
+}
+
+/* A single write held by write batching, value as sent on the wire */
+struct yam_pending_write {
+	uint8_t addr;
+	uint8_t fncode;
+	uint16_t reg;
+	uint16_t value;
+};
+
+static int yam_flush_pending(struct yam_modbus *bus);
+
+/**
+\brief Set up a YAM object on a transport
+\param *bus The YAM object to set up
+\param *transport The transport that carries its frames
+\param *transport_data Private state of the transport
+\param *device_name Name of the device, for diagnostics
+\return YAM_OK on success, YAM_NO_MEMORY on failure
+
+Every function that opens a bus starts here, and then fills in what is
+particular to its transport, such as the serial port and its speed. The bus
+has no serial port, no baud rate and the default timeout. If an error
+occurs, no change is made to the bus.
+*/
+int yam_bus_setup(struct yam_modbus *bus, const struct yam_transport *transport,
+                  void *transport_data, const char *device_name)
+{
+	struct yam_slave *slaves;
+
+	assert(bus != NULL);
+	assert(transport != NULL);
+	assert(device_name != NULL);
+
+	slaves = calloc(YAM_MAX_SLAVE_ADDR + 1, sizeof(struct yam_slave));
+	if (slaves == NULL) {
+		return YAM_NO_MEMORY;
+	}
+	bzero(bus, sizeof(struct yam_modbus));
+	bus->slaves = slaves;
+	bus->transport = transport;
+	bus->transport_data = transport_data;
+	bus->serial = -1;
+	bus->timeout_ms = YAM_DEFAULT_TIMEOUT;
+	strncpy(bus->device_name, device_name, YAM_MAX_DEVICE_NAME - 1);
+	yam_reset_bus_stats(bus);
+
+	return YAM_OK;
+}
+
 /**
 \brief Initialize a YAM object with the specified parameters
 \param *device_name Name of serial port device to use
@@ -116,8 +261,12 @@ static uint16_t crc16(uint8_t *buffer, uint16_t buffer_length)
 \return YAM_OK on success, YAM_SERIAL_INIT_FAILED on failure
 
 This function initializes a YAM object. The specified serial device is opened
-with the specified bus speed. The flags affect the number of bits,
+with the specified bus speed, which on Linux need not be one of the standard
+rates, if the serial driver supports it. The flags affect the number of bits,
 handshaking mode and parity (use the YAM_SERIAL_FLAGS_* constants).
+With YAM_SERIAL_FLAGS_LOW_LATENCY, the port is also tuned to answer as soon
+as a reply arrives; not every driver allows every setting, and
+bus->serial_tuning tells which ones took effect.
 The YAM object is returned in the *bus parameter, which
 must be allocated prior to calling this function. If an error occurs, no
 change is made to the bus parameter, and -1 is returned.
@@ -127,18 +276,22 @@ int yam_modbus_init(const char *device_name,
              struct yam_modbus *bus)
 {
 	int port;
+	unsigned int tuning;
 	assert(device_name != NULL);
 	assert(bus != NULL);
 
 	/* First initialize the serial port */
-	if (-1 == serial_port_init(device_name, speed, flags, &port)) {
+	if (-1 == serial_port_init(device_name, speed, flags, &port, &tuning)) {
 		return (bus->last_errorcode = YAM_SERIAL_INIT_FAILED);
 	}
-	bzero(bus, sizeof(struct yam_modbus));
+	if (yam_bus_setup(bus, &yam_serial_transport, NULL, device_name)) {
+		close(port);
+		return (bus->last_errorcode = YAM_NO_MEMORY);
+	}
 	bus->serial = port;
 	bus->baudrate = speed;
-	bus->timeout_ms = YAM_DEFAULT_TIMEOUT;
-	strncpy(bus->device_name, device_name, YAM_MAX_DEVICE_NAME);
+	bus->flags = flags;
+	bus->serial_tuning = tuning;
 
 	return (bus->last_errorcode = YAM_OK);
 }
@@ -148,12 +301,24 @@ int yam_modbus_init(const char *device_name,
 \param *bus The YAM object representing the Modbus
 
 This function closes the interface specified by the YAM object. The associated
-serial port is closed, but the YAM object is left untouched.
+serial port (or bus daemon connection) is closed, after sending any writes
+held by write batching, and the slave health table is freed, but the rest of
+the YAM object is left untouched.
 */
 void yam_modbus_close(struct yam_modbus *bus)
 {
 	assert(bus != NULL);
-	close(bus->serial);
+	if (bus->num_pending && bus->transport) {
+		yam_flush_pending(bus);
+	}
+	if (bus->transport) {
+		bus->transport->close(bus);
+	}
+	free(bus->slaves);
+	bus->slaves = NULL;
+	free(bus->pending);
+	bus->pending = NULL;
+	bus->batch_window_ms = 0;
 }
 
 /**
@@ -162,7 +327,9 @@ void yam_modbus_close(struct yam_modbus *bus)
 \param debug_status 0 to disable debug, nonzero to enable
 
 Changes the debugging status of the specified YAM object. When debugging is
-enabled, YAM logs all serial port I/O to the console.
+enabled, YAM prints every frame sent and received to stderr, one line per
+frame. This slows the bus down; to watch a bus in production, attach a trace
+instead (see yam_set_trace()).
 */
 void yam_debug(struct yam_modbus *bus, int debug_status)
 {
@@ -184,6 +351,328 @@ void yam_set_timeout(struct yam_modbus *bus, int timeout_ms)
 	bus->timeout_ms = timeout_ms;
 }
 
+/**
+\brief Publish read results to a shared-memory image
+\param *bus The YAM object representing the Modbus
+\param *shm Region created with yam_shm_create(), or NULL to stop publishing
+
+After every successful yam_read_coils(), yam_read_discretes(),
+yam_read_registers() or yam_read_inputs() on this bus, the values read are
+also written to the blocks of the region that cover them.
+*/
+void yam_set_shm(struct yam_modbus *bus, struct yam_shm *shm)
+{
+	assert(bus != NULL);
+	bus->shm = shm;
+}
+
+/**
+\brief Record every frame on the bus in a trace
+\param *bus The YAM object representing the Modbus
+\param *trace Trace set up with yam_trace_init(), or NULL to stop tracing
+
+Each request sent and each reply received (or what arrived of it, if it was
+bad) is added to the trace with its time and result. This is cheap enough to
+leave on; see trace.h for reading the trace back.
+*/
+void yam_set_trace(struct yam_modbus *bus, struct yam_trace *trace)
+{
+	assert(bus != NULL);
+	bus->trace = trace;
+}
+
+/**
+\brief Count transactions and latencies per slave and function code
+\param *bus The YAM object representing the Modbus
+\param *metrics Metrics set up with yam_metrics_init(), or NULL to stop
+
+Every request on the bus is then counted in the metrics, by slave and by
+function code: attempts, each class of error, bytes each way, and a latency
+histogram. See metrics.h for reading them.
+*/
+void yam_set_metrics(struct yam_modbus *bus, struct yam_metrics *metrics)
+{
+	assert(bus != NULL);
+	bus->metrics = metrics;
+}
+
+/**
+\brief Write every frame on the bus to a capture file
+\param *bus The YAM object representing the Modbus
+\param *capture Capture opened with yam_capture_open(), or NULL to stop
+
+Unlike a trace, a capture keeps everything, in a pcap file that can be
+opened with the usual tools or replayed later (see capture.h).
+*/
+void yam_set_capture(struct yam_modbus *bus, struct yam_capture *capture)
+{
+	assert(bus != NULL);
+	bus->capture = capture;
+}
+
+/**
+\brief Serve holding register reads from a write-through cache
+\param *bus The YAM object representing the Modbus
+\param *cache Cache set up with yam_cache_init(), or NULL to stop caching
+
+Every successful yam_read_registers() reply and every successful write of
+holding registers on this bus updates the cache, and a failed write forgets
+the registers it was for. yam_read_registers() then answers from the cache,
+without using the bus, when every register it asks for is fresh; see
+yam_cache_set_slave() for slaves whose registers must always be read, and
+yam_cache_invalidate() to force a read. Request batches always use the bus.
+*/
+void yam_set_cache(struct yam_modbus *bus, struct yam_cache *cache)
+{
+	assert(bus != NULL);
+	bus->cache = cache;
+}
+
+/**
+\brief Get the bus time accounting
+\param *bus The YAM object representing the Modbus
+\param *stats Location to store the counters
+
+Copies the counters and fills in elapsed_ns. The time since the last
+transaction is included in idle_ns. Call from the thread that uses the bus.
+
+Useful figures: busy_ns / elapsed_ns is the utilization of the line;
+wire_ns / busy_ns is how much of that time characters were actually being
+sent; turnaround_ns / replies is the slaves' average response time. The
+rest of busy_ns (busy_ns - wire_ns - turnaround_ns) goes to silent intervals,
+driver and adapter latency, and timeouts.
+*/
+void yam_get_bus_stats(struct yam_modbus *bus, struct yam_bus_stats *stats)
+{
+	assert(bus != NULL);
+	assert(stats != NULL);
+
+	uint64_t now = yam_now_ns();
+
+	*stats = bus->stats;
+	stats->elapsed_ns = now - stats->since_ns;
+	stats->idle_ns += now - stats->last_end_ns;
+}
+
+/**
+\brief Restart the bus time accounting
+\param *bus The YAM object representing the Modbus
+*/
+void yam_reset_bus_stats(struct yam_modbus *bus)
+{
+	assert(bus != NULL);
+
+	bzero(&bus->stats, sizeof(struct yam_bus_stats));
+	bus->stats.since_ns = bus->stats.last_end_ns = yam_now_ns();
+}
+
+/**
+\brief Set up the circuit breaker that isolates dead slaves
+\param *bus The YAM object representing the Modbus
+\param threshold Consecutive timeouts after which a slave is taken down, 0
+to disable the breaker
+\param min_backoff_ms Time before the first probe of a down slave
+\param max_backoff_ms Longest time between probes
+
+A dead slave costs a full timeout on every request, which on a shared line
+delays every other slave. Once a slave has timed out threshold times in a
+row it is taken down: requests to it fail immediately with YAM_SLAVE_DOWN,
+without touching the bus, except for one probe request after min_backoff_ms.
+Each probe that times out doubles the wait before the next, up to
+max_backoff_ms. Any reply brings the slave back up. The breaker is disabled
+by default.
+*/
+void yam_set_breaker(struct yam_modbus *bus, unsigned int threshold,
+                     unsigned int min_backoff_ms, unsigned int max_backoff_ms)
+{
+	assert(bus != NULL);
+	bus->breaker_threshold = threshold;
+	bus->breaker_min_ms = min_backoff_ms ? min_backoff_ms : 1;
+	bus->breaker_max_ms = (max_backoff_ms > bus->breaker_min_ms) ?
+	                      max_backoff_ms : bus->breaker_min_ms;
+}
+
+/**
+\brief Set the retry policy of the bus
+\param *bus The YAM object representing the Modbus
+\param *policy The policy, or NULL to never retry
+
+The policy applies to every slave that has no policy of its own (see
+yam_set_slave_retry()). Requests that fail with an error in one of
+policy->classes are sent again, up to policy->max_retries times: at once
+after a CRC error or a timeout, after policy->busy_delay_ms if the slave
+reported itself busy. No retry is started that could not finish before
+policy->deadline_ms from the first attempt: there must be time left for the
+request and its reply on the line (see yam_request_wire_time()) and for
+YAM_RETRY_MIN_REPLY_MS of waiting. The last attempt's timeout is shortened to
+end at the deadline. Note that a write that timed out may still
+have been carried out by the slave.
+*/
+void yam_set_retry(struct yam_modbus *bus, const struct yam_retry_policy *policy)
+{
+	assert(bus != NULL);
+
+	if (policy) {
+		bus->retry = *policy;
+	}
+	else {
+		bzero(&bus->retry, sizeof(struct yam_retry_policy));
+	}
+}
+
+/**
+\brief Set the retry policy of one slave
+\param *bus The YAM object representing the Modbus
+\param addr Slave address
+\param *policy The policy, or NULL to use the bus's policy
+\return YAM_OK on success, YAM_ILLEGAL_DATA_ADDR for an invalid address
+*/
+int yam_set_slave_retry(struct yam_modbus *bus, uint8_t addr,
+                        const struct yam_retry_policy *policy)
+{
+	assert(bus != NULL);
+
+	struct yam_slave *slave = yam_slave_entry(bus, addr);
+	if (slave == NULL) {
+		return YAM_ILLEGAL_DATA_ADDR;
+	}
+	slave->has_retry = (policy != NULL);
+	if (policy) {
+		slave->retry = *policy;
+	}
+	return YAM_OK;
+}
+
+/**
+\brief Set the extra turnaround a slave needs between frames
+\param *bus The YAM object representing the Modbus
+\param addr Slave address
+\param turnaround_us Extra silence, in microseconds, before a request to the
+slave
+\return YAM_OK on success, YAM_ILLEGAL_DATA_ADDR for an invalid address
+
+The library always leaves the 3.5 character silent interval the spec asks
+for between the end of one frame and the start of the next. Some slaves need
+longer to switch their transceiver back to receive; give them the extra time
+here instead of sleeping in the application, so that other slaves are not
+slowed down. This sets the turnaround_us field of the slave's profile.
+*/
+int yam_set_slave_turnaround(struct yam_modbus *bus, uint8_t addr,
+                             unsigned int turnaround_us)
+{
+	assert(bus != NULL);
+
+	struct yam_slave *slave = yam_slave_entry(bus, addr);
+	if (slave == NULL) {
+		return YAM_ILLEGAL_DATA_ADDR;
+	}
+	slave->profile.turnaround_us = turnaround_us;
+	return YAM_OK;
+}
+
+/**
+\brief Describe the capabilities of a device
+\param *bus The YAM object representing the Modbus
+\param addr Slave address, or 0 to set the profile of every slave
+\param *profile The profile, or NULL for a device that follows the spec
+\return YAM_OK on success, YAM_ILLEGAL_DATA_ADDR for an invalid address
+
+The profile is used wherever the library needs to know what the device can
+take. Requests with a function code it does not support, or with more
+registers or coils than it accepts, fail locally (YAM_ILLEGAL_FUNCTION,
+YAM_TOO_MANY_REGISTERS). The bulk read functions split ranges into the
+largest requests it accepts. Its turnaround is added to the silent interval
+before each request to it, and to the scheduler's wire time estimates. Its
+word order is used by yam_regs_to_u32() and yam_u32_to_regs().
+*/
+int yam_set_profile(struct yam_modbus *bus, uint8_t addr,
+                    const struct yam_profile *profile)
+{
+	assert(bus != NULL);
+
+	struct yam_profile none;
+	int ctr;
+
+	if (profile == NULL) {
+		bzero(&none, sizeof(none));
+		profile = &none;
+	}
+	if (addr == 0 && bus->slaves) {
+		for (ctr = 1; ctr <= YAM_MAX_SLAVE_ADDR; ctr++) {
+			bus->slaves[ctr].profile = *profile;
+		}
+		return YAM_OK;
+	}
+
+	struct yam_slave *slave = yam_slave_entry(bus, addr);
+	if (slave == NULL) {
+		return YAM_ILLEGAL_DATA_ADDR;
+	}
+	slave->profile = *profile;
+	return YAM_OK;
+}
+
+/**
+\brief Get the profile of a device
+\param *bus The YAM object representing the Modbus
+\param addr Slave address
+\return The profile, or NULL for an invalid address
+*/
+const struct yam_profile *yam_get_profile(struct yam_modbus *bus, uint8_t addr)
+{
+	assert(bus != NULL);
+
+	struct yam_slave *slave = yam_slave_entry(bus, addr);
+	return slave ? &slave->profile : NULL;
+}
+
+/**
+\brief Get the health of a slave
+\param *bus The YAM object representing the Modbus
+\param addr Slave address
+\return The slave's health entry, or NULL for an invalid address
+*/
+const struct yam_slave *yam_get_slave(struct yam_modbus *bus, uint8_t addr)
+{
+	assert(bus != NULL);
+	return yam_slave_entry(bus, addr);
+}
+
+/**
+\brief Bring a slave back up
+\param *bus The YAM object representing the Modbus
+\param addr Slave address
+
+Clears the slave's failure count, so that the next request to it goes to the
+bus. Use this when the application knows the slave has been repaired.
+*/
+void yam_reset_slave(struct yam_modbus *bus, uint8_t addr)
+{
+	assert(bus != NULL);
+
+	struct yam_slave *slave = yam_slave_entry(bus, addr);
+	if (slave) {
+		slave->state = YAM_SLAVE_STATE_UP;
+		slave->failures = 0;
+		slave->backoff_ms = 0;
+	}
+}
+
+/**
+\brief Record read results in a historian
+\param *bus The YAM object representing the Modbus
+\param *hist History opened with yam_history_create(), or NULL to stop
+
+After every successful yam_read_coils(), yam_read_discretes(),
+yam_read_registers() or yam_read_inputs() on this bus, the response data is
+appended to the history.
+*/
+void yam_set_history(struct yam_modbus *bus, struct yam_history *hist)
+{
+	assert(bus != NULL);
+	bus->history = hist;
+}
+
 /**
 \brief Get the serial device handler
 \param *bus The YAM object representing the Modbus
@@ -200,38 +689,113 @@ int yam_get_serial_device(struct yam_modbus *bus)
 }
 
 /**
-\brief Send generic Modbus/RTU packet to the specified address
-\param *bus The YAM object representing the Modbus
+\brief Address a Modbus/RTU packet and compute its CRC
 \param addr Address of the target Modbus device
 \param *adu Application Data Unit (PDU + address + CRC) to send to the slave
 \param adu_len Length of the ADU
 
-Sends the specified PDU (payload) to the specified address on the bus. The
-CRC is computed before sending.
+Fills in the address and the CRC, so that the ADU is ready to be sent (and
+sent again, if it has to be retried).
 */
-static void yam_send_generic_packet(struct yam_modbus *bus, uint8_t addr,
-                            uint8_t *adu, uint8_t adu_len)
+static void yam_encode_generic_packet(uint8_t addr, uint8_t *adu,
+                                      int adu_len)
 {
-	assert(bus != NULL);
 	assert(adu != NULL);
-	assert(adu_len < YAM_MODBUS_MAX_ADU_LEN);
+	assert(adu_len >= 4 && adu_len < YAM_MODBUS_MAX_ADU_LEN);
 
 	adu[0] = addr;
 	/* Compute CRC over entire ADU, except for last 2 bytes that hold CRC */
-	uint16_t crc = crc16(adu, adu_len - sizeof(uint16_t));
+	uint16_t crc = yam_crc16(adu, adu_len - sizeof(uint16_t));
 	adu[adu_len - 2] = crc >> 8;
 	adu[adu_len - 1] = crc & 0x00FF;
+}
 
+/*
+Waits until a frame may be sent to the given slave: the line must have been
+silent for 3.5 characters since the end of the last frame in either
+direction, plus any extra turnaround the slave needs. The sleep is to an
+absolute time, so the gap is no longer than that.
+*/
+static void yam_pace(struct yam_modbus *bus, uint8_t addr)
+{
+	struct yam_slave *slave = yam_slave_entry(bus, addr);
+	uint64_t ready = (bus->rx_last_ns > bus->tx_end_ns) ?
+	                 bus->rx_last_ns : bus->tx_end_ns;
+	struct timespec ts;
+
+	if (ready == 0) {
+		return;
+	}
+	ready += yam_gap_ns(bus);
+	if (slave) {
+		ready += slave->profile.turnaround_us * 1000ULL;
+	}
+	if (yam_now_ns() >= ready) {
+		return;
+	}
+	ts.tv_sec = ready / 1000000000ULL;
+	ts.tv_nsec = ready % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/*
+Records a frame in the bus's trace and, in debug mode, prints it. The whole
+frame goes out in one write to stderr, which is unbuffered.
+*/
+static void yam_log_frame(struct yam_modbus *bus, int dir, const uint8_t *adu,
+                          int adu_len, int status)
+{
+	if (bus->trace) {
+		yam_trace_frame(bus->trace, dir, adu, adu_len, status);
+	}
+	if (bus->capture) {
+		yam_capture_frame(bus->capture, bus, dir, adu, adu_len, status);
+	}
 	if (bus->debug) {
-		fprintf(stderr, "Generic send packet to %02X: CRC = %04X, "
-			"ADU: %d bytes\n", addr, crc, adu_len);
-		int ctr;
+		char line[32 + 3 * YAM_MODBUS_MAX_ADU_LEN];
+		int len, ctr;
+
+		len = sprintf(line, "%s %d bytes:", (dir == YAM_TRACE_TX) ? "TX" : "RX",
+		              adu_len);
 		for (ctr = 0; ctr < adu_len; ctr++) {
-			fprintf(stderr, "[%.2X]", adu[ctr]);
+			len += sprintf(line + len, " %.2X", adu[ctr]);
+		}
+		if (status < 0) {
+			len += snprintf(line + len, sizeof(line) - len, " (%s)",
+			                yam_strerror(status));
+		}
+		/* snprintf() returns the length it wanted, even if truncated */
+		if (len > (int)sizeof(line) - 1) {
+			len = sizeof(line) - 1;
 		}
-		fprintf(stderr, "\n");
+		line[len++] = '\n';
+		fwrite(line, 1, len, stderr);
+	}
+}
+
+/**
+\brief Send generic Modbus/RTU packet
+\param *bus The YAM object representing the Modbus
+\param *adu Application Data Unit (PDU + address + CRC) to send to the slave
+\param adu_len Length of the ADU
+
+Sends an ADU prepared by yam_encode_generic_packet() on the bus.
+*/
+static void yam_send_generic_packet(struct yam_modbus *bus,
+                                    const uint8_t *adu, int adu_len)
+{
+	assert(bus != NULL);
+	assert(adu != NULL);
+
+	yam_pace(bus, adu[0]);
+	bus->transport->send(bus, adu, adu_len);
+	yam_log_frame(bus, YAM_TRACE_TX, adu, adu_len, 0);
+	/* write() returns once the driver has the bytes, not once they are sent,
+	unless the serial port drains them */
+	bus->tx_end_ns = yam_now_ns();
+	if (!(bus->serial_tuning & YAM_SERIAL_TUNED_DRAIN)) {
+		bus->tx_end_ns += adu_len * yam_char_ns(bus);
 	}
-	write(bus->serial, adu, adu_len);
 }
 
 /**
@@ -240,7 +804,7 @@ static void yam_send_generic_packet(struct yam_modbus *bus, uint8_t addr,
 \param *addr Address of the replying Modbus device
 \param *adu Application Data Unit (PDU + address + CRC) to send to the slave
 \param adu_len Length of the ADU buffer pointed to by *adu
-\return YAM_OK on success, error code on failure
+\return Length of the received ADU on success, error code on failure
 
 This function reads back a packet of data from the Modbus/RTU, and splits
 it up into the ADU and PDU. The CRC is also verified.
@@ -259,23 +823,8 @@ static int yam_read_generic_packet(struct yam_modbus *bus, uint8_t *addr,
 	int bytes_read;
 	int errcode = YAM_TIMEOUT;
 
+	bus->rx_len = 0;
 	do {
-		/* First wait until there's something to read from port */
-		struct pollfd pfd;
-		pfd.fd = bus->serial;
-		pfd.events = POLLIN;
-		pfd.revents = 0;
-
-		int ret;
-		do {
-			ret = poll(&pfd, 1, bus->timeout_ms);
-		} while ((ret == -1) && (errno == EINTR));
-		if (ret == 0) {
-			state = ERROR;
-			errcode = YAM_TIMEOUT;
-			break;
-		}
-
 		/* Check to see if next read will exceed max ADU size */
 		if ((adu_len + bytes_to_read) > adu_buf_len) {
 			state = ERROR;
@@ -283,26 +832,25 @@ static int yam_read_generic_packet(struct yam_modbus *bus, uint8_t *addr,
 			break;
 		}
 
-		/* Now read the appropriate number of bytes, as determined by the
-		state machine */
-		bytes_read = read(bus->serial, &adu[adu_len], bytes_to_read);
+		/* Wait for, and read, the appropriate number of bytes, as determined
+		by the state machine */
+		bytes_read = bus->transport->recv(bus, &adu[adu_len], bytes_to_read,
+		                                  bus->timeout_ms);
 
-		if (bus->debug) {
-			int ctr;
-			for (ctr = 0; ctr < bytes_read; ctr++) {
-				fprintf(stderr, "<%.2X>", adu[adu_len + ctr]);
-			}
-		}
-		/* If read returns 0 bytes despite poll saying there's something to
-		read, we've timed out. */
-		if (bytes_read == 0) {
+		/* Nothing arrived in time, or the transport reported an error */
+		if (bytes_read <= 0) {
 			state = ERROR;
-			errcode = YAM_TIMEOUT;
+			errcode = bytes_read ? bytes_read : YAM_TIMEOUT;
 			break;
 		}
 
+		bus->rx_last_ns = yam_now_ns();
+		if (adu_len == 0) {
+			bus->rx_first_ns = bus->rx_last_ns;
+		}
 		bytes_to_read -= bytes_read;
 		adu_len += bytes_read;
+		bus->rx_len = adu_len;
 
 		/* If we're still waiting for bytes, don't enter the state machine, so
 		the next time around, the read will fetch the remaining bytes */
@@ -376,7 +924,10 @@ static int yam_read_generic_packet(struct yam_modbus *bus, uint8_t *addr,
 			case GETBYTECOUNT:
 				/* Byte count encoded in the byte just received */
 				bytes_to_read = adu[adu_len - 1];
-				if (bus->slaveidhack) bytes_to_read--;
+				if (bus->slaveidhack || (adu[1] == YAM_REPORTSLAVEID &&
+				    (yam_profile_quirks(bus, adu[0]) & YAM_QUIRK_SLAVEID_COUNT))) {
+					bytes_to_read--;
+				}
 				if (bytes_to_read > YAM_MODBUS_MAX_PDU_LEN) {
 					errcode = YAM_INVALIDBYTECOUNT;
 					state = ERROR;
@@ -402,27 +953,361 @@ static int yam_read_generic_packet(struct yam_modbus *bus, uint8_t *addr,
 		}
 	} while ((state != DONE) && (state != ERROR));
 
-	if (bus->debug) {
-		fprintf(stderr, "\nadu_len = %d\n", adu_len);
-	}
-
 	/* Check to see if we encountered any errors during receive */
 	if (state == ERROR) {
+		yam_log_frame(bus, YAM_TRACE_RX, adu, adu_len, errcode);
 		/* We may be out of sync, flush buffers */
-		serial_port_flush(bus->serial);
+		bus->transport->flush(bus);
 		return errcode;
 	}
 
 	/* CRC computed over buffer (including recv'd CRC) should be zero */
-	if(0 != crc16(adu, adu_len)) {
+	if(0 != yam_crc16(adu, adu_len)) {
+		yam_log_frame(bus, YAM_TRACE_RX, adu, adu_len, YAM_CRC_ERROR);
 		return YAM_CRC_ERROR;
 	}
+	yam_log_frame(bus, YAM_TRACE_RX, adu, adu_len, adu_len);
 
 	if (addr != NULL) *addr = adu[0];
-	return YAM_OK;
+	return adu_len;
+}
+
+/**
+\brief Hand the result of a successful read to the attached consumers
+\param *bus The YAM object representing the Modbus
+\param addr Address of the target Modbus device
+\param fncode Function code of the read
+\param start_addr Address of the first value
+\param count Number of values read
+\param *raw Response data, as received
+\param raw_len Number of bytes of response data
+\param *values Decoded values, as returned to the caller
+*/
+static void yam_record_read(struct yam_modbus *bus, uint8_t addr,
+                            uint8_t fncode, uint16_t start_addr,
+                            uint16_t count, const uint8_t *raw, int raw_len,
+                            const void *values)
+{
+	static const uint8_t tables[] = {
+		[YAM_READ_COILS] = YAM_TABLE_COILS,
+		[YAM_READ_DISCRETES] = YAM_TABLE_DISCRETES,
+		[YAM_READ_REGISTERS] = YAM_TABLE_REGISTERS,
+		[YAM_READ_INPUTS] = YAM_TABLE_INPUTS,
+	};
+
+	if (bus->shm) {
+		yam_shm_publish(bus->shm, addr, tables[fncode], start_addr, count,
+		                values);
+	}
+	if (bus->history) {
+		yam_history_append(bus->history, addr, fncode, start_addr, count,
+		                   raw, raw_len);
+	}
+	if (bus->cache && fncode == YAM_READ_REGISTERS) {
+		yam_cache_store(bus->cache, addr, start_addr, count, values);
+	}
+}
+
+/* Keeps the cache in step with a write of holding registers */
+static void yam_record_write(struct yam_modbus *bus, uint8_t addr,
+                             uint16_t start_addr, uint16_t count,
+                             const uint16_t *regs, int ret)
+{
+	if (bus->cache == NULL) {
+		return;
+	}
+	/* A failed write may or may not have been carried out */
+	if (ret < 0) {
+		yam_cache_invalidate(bus->cache, addr, start_addr, count);
+	}
+	else {
+		yam_cache_store(bus->cache, addr, start_addr, count, regs);
+	}
+}
+
+/*
+Adds a finished transaction to the bus's time accounting. The reply's first
+byte should arrive no earlier than the request's last character leaves the
+line (bus->tx_end_ns); the time between the two is the slave's turnaround.
+The attempt starts after pacing, so the gap before it counts as idle time.
+*/
+static void yam_account(struct yam_modbus *bus, int req_len, uint64_t start,
+                        int ret)
+{
+	struct yam_bus_stats *stats = &bus->stats;
+	uint64_t end = yam_now_ns();
+	uint64_t char_ns = yam_char_ns(bus);
+
+	stats->transactions++;
+	if (ret < 0) {
+		stats->errors++;
+		if (ret == YAM_TIMEOUT) {
+			stats->timeouts++;
+		}
+	}
+	stats->wire_ns += (req_len + bus->rx_len) * char_ns;
+	stats->busy_ns += end - start;
+	if (start > stats->last_end_ns) {
+		stats->idle_ns += start - stats->last_end_ns;
+	}
+	stats->last_end_ns = end;
+
+	if (bus->rx_len) {
+		uint64_t turnaround = (bus->rx_first_ns > bus->tx_end_ns) ?
+		                      bus->rx_first_ns - bus->tx_end_ns : 0;
+
+		stats->replies++;
+		stats->turnaround_ns += turnaround;
+		if (turnaround > stats->max_turnaround_ns) {
+			stats->max_turnaround_ns = turnaround;
+		}
+	}
+}
+
+/* Records a transaction, or a request failed locally, in the bus's metrics */
+static void yam_measure(struct yam_modbus *bus, const uint8_t *req,
+                        int req_len, int ret)
+{
+	int64_t latency_us = -1;
+
+	if (bus->metrics == NULL) {
+		return;
+	}
+	if (req_len && bus->rx_len) {
+		/* From the first character of the request on the line */
+		uint64_t tx_start = bus->tx_end_ns - req_len * yam_char_ns(bus);
+		latency_us = (int64_t)(bus->rx_last_ns - tx_start) / 1000;
+	}
+	yam_metrics_record(bus->metrics, req[0], req[1], ret, req_len,
+	                   req_len ? bus->rx_len : 0, latency_us);
+}
+
+/*
+Updates a slave's health after a transaction. Only timeouts count against
+it: a slave that answers with a bad CRC or an exception is still there.
+Local failures, such as a broken connection to the bus daemon, say nothing
+about the slave and leave its health as it was.
+*/
+static void yam_slave_update(struct yam_modbus *bus, struct yam_slave *slave,
+                             int ret)
+{
+	uint64_t now;
+
+	if (ret >= 0 || (ret <= YAM_ILLEGAL_FUNCTION &&
+	    ret >= YAM_GATEWAY_TARGET_FAILED) ||
+	    ((ret == YAM_CRC_ERROR || ret == YAM_INVALIDBYTECOUNT) &&
+	    bus->rx_len > 0)) {
+		slave->state = YAM_SLAVE_STATE_UP;
+		slave->failures = 0;
+		slave->backoff_ms = 0;
+		slave->last_success_ns = bus->stats.last_end_ns;
+		return;
+	}
+	if (ret != YAM_TIMEOUT) {
+		return;
+	}
+
+	slave->failures++;
+	if (bus->breaker_threshold == 0 ||
+	    slave->failures < bus->breaker_threshold) {
+		return;
+	}
+	/* Each failed probe doubles the wait before the next one */
+	if (slave->state == YAM_SLAVE_STATE_DOWN) {
+		slave->backoff_ms *= 2;
+		if (slave->backoff_ms > bus->breaker_max_ms) {
+			slave->backoff_ms = bus->breaker_max_ms;
+		}
+	}
+	else {
+		slave->state = YAM_SLAVE_STATE_DOWN;
+		slave->backoff_ms = bus->breaker_min_ms;
+	}
+	now = bus->stats.last_end_ns;
+	slave->retry_ns = now + slave->backoff_ms * 1000000ULL;
+}
+
+/* Retry policy that applies to a slave */
+static const struct yam_retry_policy *yam_retry_policy(struct yam_modbus *bus,
+                                                       struct yam_slave *slave)
+{
+	if (slave && slave->has_retry) {
+		return &slave->retry;
+	}
+	return &bus->retry;
+}
+
+/* Delay before retrying after an error, or -1 if it must not be retried */
+static int yam_retry_delay(const struct yam_retry_policy *policy, int ret)
+{
+	switch (ret) {
+	case YAM_CRC_ERROR:
+		return (policy->classes & YAM_RETRY_CRC) ? 0 : -1;
+	case YAM_TIMEOUT:
+		return (policy->classes & YAM_RETRY_TIMEOUT) ? 0 : -1;
+	case YAM_SLAVE_BUSY:
+	case YAM_ACKNOWLEDGE:
+		return (policy->classes & YAM_RETRY_BUSY) ? policy->busy_delay_ms : -1;
+	default:
+		return -1;
+	}
+}
+
+/*
+Shortest time an attempt at an encoded request needs before the deadline:
+the frames on the line, as far as they can be told from the request, and a
+minimal wait for the reply.
+*/
+static uint64_t yam_attempt_ns(struct yam_modbus *bus, const uint8_t *req,
+                               int req_len)
+{
+	struct yam_request r = {req[0], req[1], 0, 0, NULL, 0};
+	uint64_t wire_us;
+
+	if (req_len >= 8) {
+		r.start_addr = (req[2] << 8) | req[3];
+		r.count = (req[4] << 8) | req[5];
+	}
+	wire_us = yam_request_wire_time(bus, &r);
+	if (wire_us == 0) {
+		/* Not a request it knows, so count the request frame alone */
+		wire_us = (req_len * yam_char_ns(bus) + yam_gap_ns(bus)) / 1000;
+	}
+	return (wire_us + YAM_RETRY_MIN_REPLY_MS * 1000ULL) * 1000;
 }
 
-#define MAX_ERRORS 13
+/*
+Held writes must reach a slave before anything else is sent to it, so that
+a read sees them and explicit writes are not overtaken. A broadcast may go
+to any slave, so it flushes everything, as does an expired window.
+*/
+static int yam_flush_due(struct yam_modbus *bus, uint8_t addr)
+{
+	int ctr;
+
+	if (bus->batch_window_ms > 0 && yam_now_ns() - bus->batch_start_ns >=
+	    bus->batch_window_ms * 1000000ULL) {
+		return 1;
+	}
+	if (addr == 0) {
+		return 1;
+	}
+	for (ctr = 0; ctr < bus->num_pending; ctr++) {
+		if (bus->pending[ctr].addr == addr || bus->pending[ctr].addr == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+Sends an encoded request and reads the reply, retrying as allowed by the
+retry policy; a retry sends the same request again. Every request in the
+library goes through here, so this is the one place that sees both halves of
+each transaction.
+*/
+static int yam_exchange(struct yam_modbus *bus, const uint8_t *req,
+                        int req_len, uint8_t *resp, size_t resp_buf_len)
+{
+	uint8_t addr = req[0], ret_addr;
+	uint64_t start = yam_now_ns(), attempt_start, deadline = 0, now;
+	struct yam_slave *slave = yam_slave_entry(bus, addr);
+	const struct yam_retry_policy *policy = yam_retry_policy(bus, slave);
+	int timeout_ms = bus->timeout_ms;
+	int attempt = 0, delay, ret;
+
+	if (bus->num_pending && yam_flush_due(bus, addr)) {
+		yam_flush_pending(bus);
+	}
+	if (slave && (ret = yam_profile_check(&slave->profile, req)) < 0) {
+		yam_measure(bus, req, 0, ret);
+		return ret;
+	}
+	if (policy->deadline_ms) {
+		deadline = start + policy->deadline_ms * 1000000ULL;
+	}
+
+	for (;;) {
+		/* A down slave only gets a request when it is due for a probe */
+		if (slave && slave->state == YAM_SLAVE_STATE_DOWN &&
+		    yam_now_ns() < slave->retry_ns) {
+			slave->fast_fails++;
+			ret = YAM_SLAVE_DOWN;
+			yam_measure(bus, req, 0, ret);
+			break;
+		}
+		/* Flushing held writes, sleeping before a retry or pacing may
+		already have used up the deadline */
+		yam_pace(bus, addr);
+		attempt_start = yam_now_ns();
+		if (deadline && attempt_start >= deadline) {
+			if (attempt == 0) {
+				ret = YAM_TIMEOUT;
+				yam_measure(bus, req, 0, ret);
+			}
+			break;
+		}
+
+		yam_send_generic_packet(bus, req, req_len);
+		/* Do not wait for a reply past the deadline */
+		now = yam_now_ns();
+		if (deadline && now + timeout_ms * 1000000ULL > deadline) {
+			bus->timeout_ms = (now < deadline) ?
+			                  (deadline - now) / 1000000 : 0;
+		}
+		ret = yam_read_generic_packet(bus, &ret_addr, resp, resp_buf_len);
+		bus->timeout_ms = timeout_ms;
+		yam_account(bus, req_len, attempt_start, ret);
+		yam_measure(bus, req, req_len, ret);
+		if (slave) {
+			yam_slave_update(bus, slave, ret);
+		}
+
+		if (ret >= 0 || attempt == policy->max_retries ||
+		    (delay = yam_retry_delay(policy, ret)) < 0) {
+			break;
+		}
+		now = yam_now_ns();
+		if (deadline && now + delay * 1000000ULL +
+		    yam_attempt_ns(bus, req, req_len) > deadline) {
+			break;
+		}
+		if (delay) {
+			struct timespec ts = {delay / 1000, (delay % 1000) * 1000000};
+			while (nanosleep(&ts, &ts) && errno == EINTR);
+		}
+		attempt++;
+		if (slave) {
+			slave->retries++;
+		}
+	}
+	return ret;
+}
+
+/**
+\brief Perform one request/reply exchange with a slave
+\param *bus The YAM object representing the Modbus
+\param addr Address of the target Modbus device
+\param *adu Buffer holding the request ADU, overwritten with the reply
+\param req_len Length of the request ADU, including space for the CRC
+\param adu_buf_len Size of the buffer pointed to by *adu
+\return Length of the reply ADU on success, error code on failure
+
+Encodes the request in place and exchanges it with the slave. The encoded
+request is kept apart from *adu, which the reply overwrites, so that it can
+be sent again on a retry.
+*/
+static int yam_transaction(struct yam_modbus *bus, uint8_t addr, uint8_t *adu,
+                           int req_len, size_t adu_buf_len)
+{
+	uint8_t req[YAM_MODBUS_MAX_ADU_LEN];
+
+	yam_encode_generic_packet(addr, adu, req_len);
+	memcpy(req, adu, req_len);
+	return yam_exchange(bus, req, req_len, adu, adu_buf_len);
+}
+
+#define MAX_ERRORS 19
 static struct {
 	int errnum;
 	char error_string[100];
@@ -434,11 +1319,18 @@ static struct {
 	{YAM_ACKNOWLEDGE, "Acknowledge"},
 	{YAM_SLAVE_BUSY, "Slave Busy"},
 	{YAM_PARITY_ERROR, "Parity Error"},
+	{YAM_GATEWAY_PATH_UNAVAILABLE, "Gateway Path Unavailable"},
+	{YAM_GATEWAY_TARGET_FAILED, "Gateway Target Failed To Respond"},
 	{YAM_CRC_ERROR, "CRC Error"},
 	{YAM_TIMEOUT, "Timeout"},
 	{YAM_SERIAL_INIT_FAILED, "Serial Initialization Failed"},
 	{YAM_INVALIDBYTECOUNT, "Invalid Byte Count"},
 	{YAM_TOO_MANY_REGISTERS, "Too many registers or coils"},
+	{YAM_SOCKET_FAILED, "Socket Operation Failed"},
+	{YAM_NO_MEMORY, "Out of Memory"},
+	{YAM_SHM_FAILED, "Shared Memory Operation Failed"},
+	{YAM_FILE_FAILED, "File Operation Failed"},
+	{YAM_SLAVE_DOWN, "Slave Down"},
 };
 
 static char *unknown_err = "Unknown Error";
@@ -545,10 +1437,8 @@ int yam_read_coils(struct yam_modbus *bus, uint8_t addr,
 	adu.req_adu.pdu.start_addr = htons(start_addr);
 	adu.req_adu.pdu.num_coils = htons(num_coils);
 
-	yam_send_generic_packet(bus, addr, (uint8_t *)(&adu), sizeof(adu.req_adu));
-
-	uint8_t ret_addr;
-	ret = yam_read_generic_packet(bus, &ret_addr, (uint8_t *)&adu, sizeof(adu));
+	ret = yam_transaction(bus, addr, (uint8_t *)&adu, sizeof(adu.req_adu),
+	                      sizeof(adu));
 	if (0 > ret) {
 		return (bus->last_errorcode = ret);
 	}
@@ -563,6 +1453,9 @@ int yam_read_coils(struct yam_modbus *bus, uint8_t addr,
 		coils[ctr] = (adu.resp_adu.pdu.coils[ctr / 8] & mask) ? 0xFF : 0x00;
 	}
 
+	yam_record_read(bus, addr, YAM_READ_COILS, start_addr, num_coils,
+	                adu.resp_adu.pdu.coils, adu.resp_adu.pdu.bytecount, coils);
+
 	return (bus->last_errorcode = YAM_OK);
 }
 
@@ -620,10 +1513,8 @@ int yam_read_discretes(struct yam_modbus *bus, uint8_t addr,
 	adu.req_adu.pdu.start_addr = htons(start_addr);
 	adu.req_adu.pdu.num_discretes = htons(num_discretes);
 
-	yam_send_generic_packet(bus, addr, (uint8_t *)(&adu), sizeof(adu.req_adu));
-
-	uint8_t ret_addr;
-	ret = yam_read_generic_packet(bus, &ret_addr, (uint8_t *)&adu, sizeof(adu));
+	ret = yam_transaction(bus, addr, (uint8_t *)&adu, sizeof(adu.req_adu),
+	                      sizeof(adu));
 	if (0 > ret) {
 		return (bus->last_errorcode = ret);
 	}
@@ -638,6 +1529,9 @@ int yam_read_discretes(struct yam_modbus *bus, uint8_t addr,
 		discretes[ctr] = (adu.resp_adu.pdu.discretes[ctr / 8] & mask) ? 0xFF : 0x00;
 	}
 
+	yam_record_read(bus, addr, YAM_READ_DISCRETES, start_addr, num_discretes,
+	                adu.resp_adu.pdu.discretes, adu.resp_adu.pdu.bytecount, discretes);
+
 	return (bus->last_errorcode = YAM_OK);
 }
 
@@ -659,9 +1553,12 @@ int yam_read_registers(struct yam_modbus *bus, uint8_t addr,
                        uint16_t *regs)
 {
 	assert(bus != NULL);
-	assert(num_regs < YAM_REGS_PER_REQUEST);
 	assert(num_regs != 0);
 
+	if (num_regs > YAM_REGS_PER_REQUEST) {
+		return (bus->last_errorcode = YAM_TOO_MANY_REGISTERS);
+	}
+
 	int ret;
 
 	union {
@@ -686,17 +1583,22 @@ int yam_read_registers(struct yam_modbus *bus, uint8_t addr,
 		} PACKED resp_adu;
 	} PACKED adu;
 
+	if (bus->cache) {
+		/* Writes held for the slave must not be overtaken by the cache */
+		if (bus->num_pending && yam_flush_due(bus, addr)) {
+			yam_flush_pending(bus);
+		}
+		if (!yam_cache_lookup(bus->cache, addr, start_addr, num_regs, regs)) {
+			return (bus->last_errorcode = YAM_OK);
+		}
+	}
+
 	adu.req_adu.pdu.fncode = YAM_READ_REGISTERS;
 	adu.req_adu.pdu.start_addr = htons(start_addr);
 	adu.req_adu.pdu.num_regs = htons(num_regs);
 
-	int avail;
-	ioctl(bus->serial, FIONREAD, &avail);
-
-	yam_send_generic_packet(bus, addr, (uint8_t *)(&adu), sizeof(adu.req_adu));
-
-	uint8_t ret_addr;
-	ret = yam_read_generic_packet(bus, &ret_addr, (uint8_t *)&adu, sizeof(adu));
+	ret = yam_transaction(bus, addr, (uint8_t *)&adu, sizeof(adu.req_adu),
+	                      sizeof(adu));
 	if (0 > ret) {
 		return (bus->last_errorcode = ret);
 	}
@@ -713,6 +1615,9 @@ int yam_read_registers(struct yam_modbus *bus, uint8_t addr,
 		regs[ctr] = ntohs(adu.resp_adu.pdu.reg[ctr]);
 	}
 
+	yam_record_read(bus, addr, YAM_READ_REGISTERS, start_addr, num_regs,
+	                (uint8_t *)adu.resp_adu.pdu.reg, adu.resp_adu.pdu.bytecount, regs);
+
 	return (bus->last_errorcode = YAM_OK);
 }
 
@@ -768,10 +1673,8 @@ int yam_read_inputs(struct yam_modbus *bus, uint8_t addr,
 	adu.req_adu.pdu.start_addr = htons(start_addr);
 	adu.req_adu.pdu.num_regs = htons(num_regs);
 
-	yam_send_generic_packet(bus, addr, (uint8_t *)(&adu), sizeof(adu.req_adu));
-
-	uint8_t ret_addr;
-	ret = yam_read_generic_packet(bus, &ret_addr, (uint8_t *)&adu, sizeof(adu));
+	ret = yam_transaction(bus, addr, (uint8_t *)&adu, sizeof(adu.req_adu),
+	                      sizeof(adu));
 	if (0 > ret) {
 		return (bus->last_errorcode = ret);
 	}
@@ -787,24 +1690,17 @@ int yam_read_inputs(struct yam_modbus *bus, uint8_t addr,
 		regs[ctr] = ntohs(adu.resp_adu.pdu.reg[ctr]);
 	}
 
+	yam_record_read(bus, addr, YAM_READ_INPUTS, start_addr, num_regs,
+	                (uint8_t *)adu.resp_adu.pdu.reg, adu.resp_adu.pdu.bytecount, regs);
+
 	return (bus->last_errorcode = YAM_OK);
 }
 
-/**
-\brief Write a single coil on the specified target
-\param *bus The YAM object representing the Modbus
-\param addr Address of the target Modbus device
-\param coil_addr Address of the coil within the target
-\param coil_state Desired state of the coil (0 = off, nonzero = on)
-\return 0 on success, error code on failure
-
-Write to a single coil on the Modbus/RTU target.
-*/
-int yam_write_single_coil(struct yam_modbus *bus, uint8_t addr,
-                       uint16_t coil_addr, uint8_t coil_state)
+/* Sends a Write Single Coil or Write Single Register request */
+static int yam_send_single_write(struct yam_modbus *bus, uint8_t addr,
+                                 uint8_t fncode, uint16_t output_addr,
+                                 uint16_t output_value)
 {
-	assert(bus != NULL);
-
 	int ret;
 
 	struct {
@@ -817,19 +1713,81 @@ int yam_write_single_coil(struct yam_modbus *bus, uint8_t addr,
 		uint16_t crc;
 	} PACKED adu;
 
-	adu.pdu.fncode = YAM_WRITE_SINGLECOIL;
-	adu.pdu.output_addr = htons(coil_addr);
-	adu.pdu.output_value = htons(coil_state ? 0xFF00 : 0x0000);
+	adu.pdu.fncode = fncode;
+	adu.pdu.output_addr = htons(output_addr);
+	adu.pdu.output_value = htons(output_value);
+
+	ret = yam_transaction(bus, addr, (uint8_t *)&adu, sizeof(adu), sizeof(adu));
+	if (fncode == YAM_WRITE_SINGLEREGISTER) {
+		yam_record_write(bus, addr, output_addr, 1, &output_value, ret);
+	}
+	if (0 > ret) {
+		return ret;
+	}
+
+	return YAM_OK;
+}
+
+/* Holds a single write for batching, replacing an earlier write to it */
+static int yam_queue_write(struct yam_modbus *bus, uint8_t addr,
+                           uint8_t fncode, uint16_t output_addr,
+                           uint16_t output_value)
+{
+	struct yam_pending_write *w = NULL;
+	uint64_t now = yam_now_ns();
+	int ctr;
+
+	for (ctr = 0; ctr < bus->num_pending; ctr++) {
+		if (bus->pending[ctr].addr == addr && bus->pending[ctr].fncode == fncode &&
+		    bus->pending[ctr].reg == output_addr) {
+			w = &bus->pending[ctr];
+			break;
+		}
+	}
+	if (w == NULL) {
+		if (bus->num_pending == 0) {
+			bus->batch_start_ns = now;
+		}
+		w = &bus->pending[bus->num_pending++];
+		w->addr = addr;
+		w->fncode = fncode;
+		w->reg = output_addr;
+	}
+	w->value = output_value;
+
+	if (bus->num_pending == YAM_WRITE_QUEUE_LEN ||
+	    (bus->batch_window_ms > 0 && now - bus->batch_start_ns >=
+	     bus->batch_window_ms * 1000000ULL)) {
+		yam_flush_pending(bus);
+	}
+
+	return (bus->last_errorcode = YAM_OK);
+}
+
+/**
+\brief Write a single coil on the specified target
+\param *bus The YAM object representing the Modbus
+\param addr Address of the target Modbus device
+\param coil_addr Address of the coil within the target
+\param coil_state Desired state of the coil (0 = off, nonzero = on)
+\return 0 on success, error code on failure
+
+Write to a single coil on the Modbus/RTU target. With write batching on (see
+yam_set_write_batch()), the write is held and YAM_OK is returned at once.
+*/
+int yam_write_single_coil(struct yam_modbus *bus, uint8_t addr,
+                       uint16_t coil_addr, uint8_t coil_state)
+{
+	assert(bus != NULL);
 
-	yam_send_generic_packet(bus, addr, (uint8_t *)(&adu), sizeof(adu));
+	uint16_t value = coil_state ? 0xFF00 : 0x0000;
 
-	uint8_t ret_addr;
-	ret = yam_read_generic_packet(bus, &ret_addr, (uint8_t *)&adu, sizeof(adu));
-	if (0 > ret) {
-		return (bus->last_errorcode = ret);
+	if (bus->batch_window_ms) {
+		return yam_queue_write(bus, addr, YAM_WRITE_SINGLECOIL, coil_addr,
+		                       value);
 	}
-
-	return (bus->last_errorcode = YAM_OK);
+	return (bus->last_errorcode = yam_send_single_write(bus, addr,
+	        YAM_WRITE_SINGLECOIL, coil_addr, value));
 }
 
 /**
@@ -840,38 +1798,21 @@ int yam_write_single_coil(struct yam_modbus *bus, uint8_t addr,
 \param register_value Desired value of the register
 \return 0 on success, error code on failure
 
-Write to a single holding register on the Modbus/RTU target.
+Write to a single holding register on the Modbus/RTU target. With write
+batching on (see yam_set_write_batch()), the write is held and YAM_OK is
+returned at once.
 */
 int yam_write_single_register(struct yam_modbus *bus, uint8_t addr,
                        uint16_t register_addr, uint16_t register_value)
 {
 	assert(bus != NULL);
 
-	int ret;
-
-	struct {
-		uint8_t addr;
-		struct {
-			uint8_t fncode;
-			uint16_t output_addr;
-			uint16_t output_value;
-		} PACKED pdu;
-		uint16_t crc;
-	} PACKED adu;
-
-	adu.pdu.fncode = YAM_WRITE_SINGLEREGISTER;
-	adu.pdu.output_addr = htons(register_addr);
-	adu.pdu.output_value = htons(register_value);
-
-	yam_send_generic_packet(bus, addr, (uint8_t *)(&adu), sizeof(adu));
-
-	uint8_t ret_addr;
-	ret = yam_read_generic_packet(bus, &ret_addr, (uint8_t *)&adu, sizeof(adu));
-	if (0 > ret) {
-		return (bus->last_errorcode = ret);
+	if (bus->batch_window_ms) {
+		return yam_queue_write(bus, addr, YAM_WRITE_SINGLEREGISTER,
+		                       register_addr, register_value);
 	}
-
-	return (bus->last_errorcode = YAM_OK);
+	return (bus->last_errorcode = yam_send_single_write(bus, addr,
+	        YAM_WRITE_SINGLEREGISTER, register_addr, register_value));
 }
 
 /**
@@ -910,10 +1851,8 @@ int yam_read_exception_status(struct yam_modbus *bus, uint8_t addr,
 
 	adu.req_adu.pdu.fncode = YAM_READ_EXCEPTIONSTATUS;
 
-	yam_send_generic_packet(bus, addr, (uint8_t *)(&adu), sizeof(adu.req_adu));
-
-	uint8_t ret_addr;
-	ret = yam_read_generic_packet(bus, &ret_addr, (uint8_t *)&adu, sizeof(adu));
+	ret = yam_transaction(bus, addr, (uint8_t *)&adu, sizeof(adu.req_adu),
+	                      sizeof(adu));
 	if (0 > ret) {
 		return (bus->last_errorcode = ret);
 	}
@@ -982,14 +1921,12 @@ int yam_write_multiple_coils(struct yam_modbus *bus, uint8_t addr,
 			adu.req_adu.pdu.packed_coils[ctr / 8] |= (1 << (ctr % 8));
 		}
 	}
-	adu.req_adu.pdu.byte_count = num_coils / 8 + 1;
+	adu.req_adu.pdu.byte_count = (num_coils + 7) / 8;
 	/* For this call, we must calculate the number of bytes, since
 	sizeof will return even those members of packed_coils that are unused */
-	yam_send_generic_packet(bus, addr, (uint8_t *)(&adu),
-	                        sizeof(adu.req_adu) - YAM_MODBUS_MAX_PDU_LEN +
-	                        adu.req_adu.pdu.byte_count);
-	uint8_t ret_addr;
-	ret = yam_read_generic_packet(bus, &ret_addr, (uint8_t *)&adu, sizeof(adu));
+	ret = yam_transaction(bus, addr, (uint8_t *)&adu,
+	                      sizeof(adu.req_adu) - YAM_MODBUS_MAX_PDU_LEN +
+	                      adu.req_adu.pdu.byte_count, sizeof(adu));
 	if (0 > ret) {
 		return (bus->last_errorcode = ret);
 	}
@@ -1057,11 +1994,11 @@ int yam_write_multiple_registers(struct yam_modbus *bus, uint8_t addr,
 
 	/* For this call, we must calculate the number of bytes, since
 	sizeof will return even those members of regs that are unused */
-	yam_send_generic_packet(bus, addr, (uint8_t *)(&adu),
-	                        sizeof(adu.req_adu) - YAM_REGS_PER_REQUEST *
-	                        sizeof(uint16_t) + adu.req_adu.pdu.byte_count);
-	uint8_t ret_addr;
-	ret = yam_read_generic_packet(bus, &ret_addr, (uint8_t *)&adu, sizeof(adu));
+	ret = yam_transaction(bus, addr, (uint8_t *)&adu,
+	                      sizeof(adu.req_adu) - YAM_REGS_PER_REQUEST *
+	                      sizeof(uint16_t) + adu.req_adu.pdu.byte_count,
+	                      sizeof(adu));
+	yam_record_write(bus, addr, start_addr, num_regs, regs, ret);
 	if (0 > ret) {
 		return (bus->last_errorcode = ret);
 	}
@@ -1069,6 +2006,165 @@ int yam_write_multiple_registers(struct yam_modbus *bus, uint8_t addr,
 	return (bus->last_errorcode = YAM_OK);
 }
 
+/* Most coils or registers one batched write request may carry */
+static int yam_batch_limit(struct yam_modbus *bus, uint8_t addr,
+                           uint8_t fncode)
+{
+	struct yam_slave *slave = yam_slave_entry(bus, addr);
+	uint8_t multi = YAM_WRITE_REGISTERS;
+	int limit = YAM_REGS_PER_REQUEST, max = 0;
+
+	if (fncode == YAM_WRITE_SINGLECOIL) {
+		multi = YAM_WRITE_COILS;
+		limit = YAM_COILS_PER_REQUEST;
+	}
+	if (slave) {
+		if (slave->profile.functions &&
+		    !(slave->profile.functions & YAM_FUNCTION_BIT(multi))) {
+			return 1;
+		}
+		max = (multi == YAM_WRITE_COILS) ? slave->profile.max_coils :
+		                                   slave->profile.max_regs;
+	}
+	if (max && max < limit) {
+		limit = max;
+	}
+	return limit;
+}
+
+static int yam_pending_cmp(const void *a, const void *b)
+{
+	const struct yam_pending_write *wa = a, *wb = b;
+
+	if (wa->addr != wb->addr) return wa->addr - wb->addr;
+	if (wa->fncode != wb->fncode) return wa->fncode - wb->fncode;
+	return wa->reg - wb->reg;
+}
+
+/*
+Sends all held writes, merging runs of consecutive addresses on a slave into
+Write Multiple Coils or Write Multiple Registers requests. The queue is
+emptied first, so the requests sent here do not flush it again.
+*/
+static int yam_flush_pending(struct yam_modbus *bus)
+{
+	struct yam_pending_write w[YAM_WRITE_QUEUE_LEN];
+	uint8_t coils[YAM_WRITE_QUEUE_LEN];
+	uint16_t regs[YAM_WRITE_QUEUE_LEN];
+	int num = bus->num_pending;
+	int first, last, limit, ctr, ret;
+
+	memcpy(w, bus->pending, num * sizeof(struct yam_pending_write));
+	bus->num_pending = 0;
+	qsort(w, num, sizeof(struct yam_pending_write), yam_pending_cmp);
+
+	for (first = 0; first < num; first = last) {
+		limit = yam_batch_limit(bus, w[first].addr, w[first].fncode);
+		for (last = first + 1; last < num && last - first < limit; last++) {
+			if (w[last].addr != w[first].addr ||
+			    w[last].fncode != w[first].fncode ||
+			    w[last].reg != w[last - 1].reg + 1) {
+				break;
+			}
+		}
+		if (last - first == 1) {
+			ret = yam_send_single_write(bus, w[first].addr, w[first].fncode,
+			                            w[first].reg, w[first].value);
+		}
+		else if (w[first].fncode == YAM_WRITE_SINGLECOIL) {
+			for (ctr = first; ctr < last; ctr++) {
+				coils[ctr - first] = (w[ctr].value != 0);
+			}
+			ret = yam_write_multiple_coils(bus, w[first].addr, w[first].reg,
+			                               last - first, coils);
+		}
+		else {
+			for (ctr = first; ctr < last; ctr++) {
+				regs[ctr - first] = w[ctr].value;
+			}
+			ret = yam_write_multiple_registers(bus, w[first].addr,
+			                                   w[first].reg, last - first,
+			                                   regs);
+		}
+		if (ret < 0 && bus->batch_error == YAM_OK) {
+			bus->batch_error = ret;
+		}
+	}
+
+	return bus->batch_error;
+}
+
+/**
+\brief Turn write batching on or off
+\param *bus The YAM object representing the Modbus
+\param window_ms Longest time a write is held, in milliseconds, 0 to send
+writes at once, or YAM_WRITE_BATCH_EXPLICIT to hold them until
+yam_flush_writes()
+\return 0 on success, error code on failure
+
+With write batching on, yam_write_single_coil() and
+yam_write_single_register() do not send anything; the write is held, and a
+later write to the same coil or register on the same slave replaces it.
+Held writes are sent when yam_flush_writes() is called, when the window has
+passed since the oldest was held, when YAM_WRITE_QUEUE_LEN writes are held,
+or before any other request to a slave they are for. Writes to consecutive
+addresses of a slave go out as one Write Multiple Coils or Write Multiple
+Registers request, up to the size the slave's profile allows.
+
+There is no timer: the window is checked whenever the bus is used, so call
+yam_flush_writes() at the end of each control cycle. Writes held for a slave
+may reach it in address order rather than the order they were made in; call
+yam_flush_writes() between writes whose order matters. Turning batching off
+sends any held writes first and returns the result of that.
+*/
+int yam_set_write_batch(struct yam_modbus *bus, int window_ms)
+{
+	assert(bus != NULL);
+
+	if (window_ms == 0) {
+		int ret = yam_flush_writes(bus);
+		bus->batch_window_ms = 0;
+		free(bus->pending);
+		bus->pending = NULL;
+		return ret;
+	}
+	if (bus->pending == NULL) {
+		bus->pending = calloc(YAM_WRITE_QUEUE_LEN,
+		                      sizeof(struct yam_pending_write));
+		if (bus->pending == NULL) {
+			return (bus->last_errorcode = YAM_NO_MEMORY);
+		}
+	}
+	bus->batch_window_ms = window_ms;
+
+	return (bus->last_errorcode = YAM_OK);
+}
+
+/**
+\brief Send all writes held by write batching
+\param *bus The YAM object representing the Modbus
+\return 0 on success, error code on failure
+
+Sends the held writes (see yam_set_write_batch()). Since a held write is
+reported as successful when it is made, this returns the first error of any
+batched write sent since the previous call, including those sent by a window
+expiring or ahead of another request.
+*/
+int yam_flush_writes(struct yam_modbus *bus)
+{
+	assert(bus != NULL);
+
+	int ret;
+
+	if (bus->num_pending) {
+		yam_flush_pending(bus);
+	}
+	ret = bus->batch_error;
+	bus->batch_error = YAM_OK;
+
+	return (bus->last_errorcode = ret);
+}
+
 /**
 \brief Write to multiple registers on the Modbus target
 \param *bus The YAM object representing the Modbus
@@ -1117,9 +2213,8 @@ int yam_report_slave_id(struct yam_modbus *bus, uint8_t addr, uint8_t *id,
 
 	adu.req_adu.pdu.fncode = YAM_REPORTSLAVEID;
 
-	yam_send_generic_packet(bus, addr, (uint8_t *)(&adu), sizeof(adu.req_adu));
-	uint8_t ret_addr;
-	ret = yam_read_generic_packet(bus, &ret_addr, (uint8_t *)&adu, sizeof(adu));
+	ret = yam_transaction(bus, addr, (uint8_t *)&adu, sizeof(adu.req_adu),
+	                      sizeof(adu));
 	if (0 > ret) {
 		return (bus->last_errorcode = ret);
 	}
@@ -1135,6 +2230,556 @@ int yam_report_slave_id(struct yam_modbus *bus, uint8_t addr, uint8_t *id,
 	return (bus->last_errorcode = YAM_OK);
 }
 
+/**
+\brief Send a request PDU to a slave and return the reply PDU
+\param *bus The YAM object representing the Modbus
+\param addr Address of the target Modbus device
+\param *req_pdu Request PDU (function code and data)
+\param req_len Length of the request PDU
+\param *resp_pdu Buffer to store the response PDU
+\param resp_buf_len Size of the buffer pointed to by *resp_pdu
+\return Length of the response PDU on success, error code on failure
+
+Sends an already encoded PDU, and returns the slave's reply undecoded. This
+is meant for code that relays requests on behalf of another master, such as
+a Modbus/TCP gateway. Exception replies are returned as error codes, as with
+the other functions. Only the function codes listed in the main page are
+understood by the receiver.
+*/
+int yam_raw_request(struct yam_modbus *bus, uint8_t addr,
+                    const uint8_t *req_pdu, int req_len,
+                    uint8_t *resp_pdu, int resp_buf_len)
+{
+	assert(bus != NULL);
+	assert(req_pdu != NULL);
+	assert(resp_pdu != NULL);
+
+	uint8_t adu[YAM_MODBUS_MAX_ADU_LEN];
+	int ret;
+
+	/* The ADU, with the address and the CRC, must fit in 255 bytes */
+	if (req_len < 1 || req_len > YAM_MODBUS_MAX_ADU_LEN - 4) {
+		return (bus->last_errorcode = YAM_INVALIDBYTECOUNT);
+	}
+	memcpy(&adu[1], req_pdu, req_len);
+
+	ret = yam_transaction(bus, addr, adu, req_len + 3, sizeof(adu));
+	if (0 > ret) {
+		return (bus->last_errorcode = ret);
+	}
+	/* Strip the address and the CRC */
+	ret -= 3;
+	if (ret > resp_buf_len) {
+		return (bus->last_errorcode = YAM_INVALIDBYTECOUNT);
+	}
+	memcpy(resp_pdu, &adu[1], ret);
+	bus->last_errorcode = YAM_OK;
+
+	return ret;
+}
+
+/**
+\brief Issue a prepared request
+\param *bus The YAM object representing the Modbus
+\param *req The request
+\return YAM_OK on success, error code on failure
+
+Calls the yam_read_* or yam_write_* function matching req->fncode. The result
+is also left in req->status.
+*/
+int yam_request_execute(struct yam_modbus *bus, struct yam_request *req)
+{
+	assert(bus != NULL);
+	assert(req != NULL);
+
+	int ret;
+
+	switch (req->fncode) {
+	case YAM_READ_COILS:
+		ret = yam_read_coils(bus, req->addr, req->start_addr, req->count,
+		                     req->data);
+		break;
+	case YAM_READ_DISCRETES:
+		ret = yam_read_discretes(bus, req->addr, req->start_addr, req->count,
+		                         req->data);
+		break;
+	case YAM_READ_REGISTERS:
+		ret = yam_read_registers(bus, req->addr, req->start_addr, req->count,
+		                         req->data);
+		break;
+	case YAM_READ_INPUTS:
+		ret = yam_read_inputs(bus, req->addr, req->start_addr, req->count,
+		                      req->data);
+		break;
+	case YAM_WRITE_SINGLECOIL:
+		ret = yam_write_single_coil(bus, req->addr, req->start_addr,
+		                            *(uint8_t *)req->data);
+		break;
+	case YAM_WRITE_SINGLEREGISTER:
+		ret = yam_write_single_register(bus, req->addr, req->start_addr,
+		                                *(uint16_t *)req->data);
+		break;
+	case YAM_WRITE_COILS:
+		ret = yam_write_multiple_coils(bus, req->addr, req->start_addr,
+		                               req->count, req->data);
+		break;
+	case YAM_WRITE_REGISTERS:
+		ret = yam_write_multiple_registers(bus, req->addr, req->start_addr,
+		                                   req->count, req->data);
+		break;
+	default:
+		ret = bus->last_errorcode = YAM_ILLEGAL_FUNCTION;
+		break;
+	}
+
+	return (req->status = ret);
+}
+
+/*
+Encodes a request into a complete ADU, CRC included, and returns its length
+or an error code if the request is not one the spec allows.
+*/
+static int yam_encode_request(const struct yam_request *req, uint8_t *adu)
+{
+	const uint8_t *coils = req->data;
+	const uint16_t *regs = req->data;
+	int len = 6, ctr, max = YAM_REGS_PER_REQUEST;
+
+	adu[1] = req->fncode;
+	adu[2] = req->start_addr >> 8;
+	adu[3] = req->start_addr & 0xFF;
+	adu[4] = req->count >> 8;
+	adu[5] = req->count & 0xFF;
+
+	switch (req->fncode) {
+	case YAM_READ_COILS:
+	case YAM_READ_DISCRETES:
+		max = YAM_COILS_PER_REQUEST;
+		/* fall through */
+	case YAM_READ_REGISTERS:
+	case YAM_READ_INPUTS:
+		break;
+	case YAM_WRITE_SINGLECOIL:
+		adu[4] = coils[0] ? 0xFF : 0x00;
+		adu[5] = 0x00;
+		break;
+	case YAM_WRITE_SINGLEREGISTER:
+		adu[4] = regs[0] >> 8;
+		adu[5] = regs[0] & 0xFF;
+		break;
+	case YAM_WRITE_COILS:
+		max = YAM_COILS_PER_REQUEST;
+		if (req->count == 0 || req->count > max) break;
+		adu[6] = (req->count + 7) / 8;
+		bzero(&adu[7], adu[6]);
+		for (ctr = 0; ctr < req->count; ctr++) {
+			if (coils[ctr]) {
+				adu[7 + ctr / 8] |= 1 << (ctr % 8);
+			}
+		}
+		len = 7 + adu[6];
+		break;
+	case YAM_WRITE_REGISTERS:
+		if (req->count == 0 || req->count > max) break;
+		adu[6] = req->count * 2;
+		for (ctr = 0; ctr < req->count; ctr++) {
+			adu[7 + ctr * 2] = regs[ctr] >> 8;
+			adu[8 + ctr * 2] = regs[ctr] & 0xFF;
+		}
+		len = 7 + adu[6];
+		break;
+	default:
+		return YAM_ILLEGAL_FUNCTION;
+	}
+	if (req->fncode != YAM_WRITE_SINGLECOIL &&
+	    req->fncode != YAM_WRITE_SINGLEREGISTER) {
+		if (req->count == 0) {
+			return YAM_ILLEGAL_DATA_VALUE;
+		}
+		if (req->count > max) {
+			return YAM_TOO_MANY_REGISTERS;
+		}
+	}
+	yam_encode_generic_packet(req->addr, adu, len + sizeof(uint16_t));
+	return len + sizeof(uint16_t);
+}
+
+/* Unpacks the reply to a read into the request's buffer */
+static int yam_decode_reply(struct yam_modbus *bus,
+                            const struct yam_request *req, const uint8_t *adu)
+{
+	uint8_t *coils = req->data;
+	uint16_t *regs = req->data;
+	int ctr;
+
+	switch (req->fncode) {
+	case YAM_READ_COILS:
+	case YAM_READ_DISCRETES:
+		if (adu[2] != (req->count + 7) / 8) {
+			return YAM_INVALIDBYTECOUNT;
+		}
+		for (ctr = 0; ctr < req->count; ctr++) {
+			coils[ctr] = (adu[3 + ctr / 8] & (1 << (ctr % 8))) ? 0xFF : 0x00;
+		}
+		break;
+	case YAM_READ_REGISTERS:
+	case YAM_READ_INPUTS:
+		if (adu[2] != req->count * 2) {
+			return YAM_INVALIDBYTECOUNT;
+		}
+		for (ctr = 0; ctr < req->count; ctr++) {
+			regs[ctr] = (adu[3 + ctr * 2] << 8) | adu[4 + ctr * 2];
+		}
+		break;
+	case YAM_WRITE_SINGLEREGISTER:
+	case YAM_WRITE_REGISTERS:
+		yam_record_write(bus, req->addr, req->start_addr,
+		                 (req->fncode == YAM_WRITE_REGISTERS) ? req->count : 1,
+		                 req->data, YAM_OK);
+		return YAM_OK;
+	default:
+		return YAM_OK;
+	}
+	yam_record_read(bus, req->addr, req->fncode, req->start_addr, req->count,
+	                &adu[3], adu[2], req->data);
+	return YAM_OK;
+}
+
+/**
+\brief Prepare a list of requests to be run as a batch
+\param *batch The batch to fill in
+\param *reqs Array of requests, as for yam_request_execute()
+\param num_reqs Number of requests in the array
+\return 0 on success, error code on failure
+
+Encodes every request once, so that each run of the batch sends ready-made
+frames. The array is used in place and must stay valid while the batch is in
+use; the data of the write requests is read again at each run, so new values
+can be written by updating the buffers. If a request is invalid, its status
+is set and the error is returned.
+*/
+int yam_batch_init(struct yam_batch *batch, struct yam_request *reqs,
+                   int num_reqs)
+{
+	assert(batch != NULL);
+	assert(reqs != NULL);
+
+	int ctr, ret;
+
+	bzero(batch, sizeof(struct yam_batch));
+	batch->adus = malloc(num_reqs * YAM_MODBUS_MAX_ADU_LEN);
+	batch->adu_lens = malloc(num_reqs * sizeof(int));
+	if (batch->adus == NULL || batch->adu_lens == NULL) {
+		yam_batch_free(batch);
+		return YAM_NO_MEMORY;
+	}
+	batch->reqs = reqs;
+	batch->num_reqs = num_reqs;
+
+	for (ctr = 0; ctr < num_reqs; ctr++) {
+		ret = yam_encode_request(&reqs[ctr],
+		                         &batch->adus[ctr * YAM_MODBUS_MAX_ADU_LEN]);
+		if (ret < 0) {
+			reqs[ctr].status = ret;
+			yam_batch_free(batch);
+			return ret;
+		}
+		batch->adu_lens[ctr] = ret;
+	}
+
+	return YAM_OK;
+}
+
+/**
+\brief Run a batch of requests back to back
+\param *bus The YAM object representing the Modbus
+\param *batch A batch prepared with yam_batch_init()
+\return 0 if every request succeeded, else the first error
+
+Sends the requests of the batch in order, each as soon as the line allows
+after the reply to the one before. Write requests are encoded again first,
+with the current contents of their buffers, so that no encoding is left for
+the time between frames. The result of each request is left in its status,
+and the data read is stored as with yam_request_execute(). A failed request
+does not stop the batch; a write that can no longer be encoded, because its
+count was changed, is skipped with the encoding error as its status.
+*/
+int yam_batch_run(struct yam_modbus *bus, struct yam_batch *batch)
+{
+	assert(bus != NULL);
+	assert(batch != NULL);
+
+	uint8_t resp[YAM_MODBUS_MAX_ADU_LEN];
+	struct yam_request *req;
+	int ctr, ret, first_error = YAM_OK;
+
+	for (ctr = 0; ctr < batch->num_reqs; ctr++) {
+		req = &batch->reqs[ctr];
+		if (req->fncode > YAM_READ_INPUTS) {
+			batch->adu_lens[ctr] = yam_encode_request(req,
+			        &batch->adus[ctr * YAM_MODBUS_MAX_ADU_LEN]);
+		}
+	}
+
+	for (ctr = 0; ctr < batch->num_reqs; ctr++) {
+		req = &batch->reqs[ctr];
+		/* A write changed since yam_batch_init() may no longer encode */
+		if (batch->adu_lens[ctr] < 0) {
+			req->status = batch->adu_lens[ctr];
+			if (first_error == YAM_OK) {
+				first_error = req->status;
+			}
+			continue;
+		}
+		ret = yam_exchange(bus, &batch->adus[ctr * YAM_MODBUS_MAX_ADU_LEN],
+		                   batch->adu_lens[ctr], resp, sizeof(resp));
+		if (ret >= 0) {
+			ret = yam_decode_reply(bus, req, resp);
+		}
+		else if (req->fncode == YAM_WRITE_SINGLEREGISTER ||
+		         req->fncode == YAM_WRITE_REGISTERS) {
+			yam_record_write(bus, req->addr, req->start_addr,
+			                 (req->fncode == YAM_WRITE_REGISTERS) ? req->count : 1,
+			                 req->data, ret);
+		}
+		req->status = ret;
+		if (ret < 0 && first_error == YAM_OK) {
+			first_error = ret;
+		}
+	}
+
+	return (bus->last_errorcode = first_error);
+}
+
+/**
+\brief Free the encoded requests of a batch
+\param *batch The batch to free
+
+The request array itself belongs to the caller and is left alone.
+*/
+void yam_batch_free(struct yam_batch *batch)
+{
+	assert(batch != NULL);
+
+	free(batch->adus);
+	free(batch->adu_lens);
+	batch->adus = NULL;
+	batch->adu_lens = NULL;
+	batch->num_reqs = 0;
+}
+
+/* Reads a range of any length, in the largest requests the device takes */
+static int yam_read_bulk(struct yam_modbus *bus, uint8_t addr, uint8_t fncode,
+                         uint16_t start_addr, unsigned int count,
+                         void *data, size_t elem_size)
+{
+	struct yam_slave *slave = yam_slave_entry(bus, addr);
+	int bits = (fncode == YAM_READ_COILS || fncode == YAM_READ_DISCRETES);
+	unsigned int max = bits ? YAM_COILS_PER_REQUEST : YAM_REGS_PER_REQUEST;
+	unsigned int limit = 0;
+	struct yam_request req;
+	int ret;
+
+	if (count == 0 || start_addr + count > 0x10000) {
+		return (bus->last_errorcode = YAM_ILLEGAL_DATA_ADDR);
+	}
+	if (slave) {
+		limit = bits ? slave->profile.max_coils : slave->profile.max_regs;
+	}
+	if (limit && limit < max) {
+		max = limit;
+	}
+
+	req.addr = addr;
+	req.fncode = fncode;
+	req.start_addr = start_addr;
+	req.data = data;
+	while (count) {
+		req.count = (count > max) ? max : count;
+		if ((ret = yam_request_execute(bus, &req)) < 0) {
+			return ret;
+		}
+		req.start_addr += req.count;
+		req.data = (uint8_t *)req.data + req.count * elem_size;
+		count -= req.count;
+	}
+	return (bus->last_errorcode = YAM_OK);
+}
+
+/**
+\brief Read any number of coils, in as few requests as the device allows
+\param *bus The YAM object representing the Modbus
+\param addr Address of the target Modbus device
+\param start_addr Address of the first coil
+\param num_coils Number of coils
+\param *coils Location to store the coils, as for yam_read_coils()
+\return YAM_OK on success, error code of the first failed request otherwise
+
+The range is split into requests of the largest size the device's profile
+allows (see yam_set_profile()).
+*/
+int yam_read_coils_bulk(struct yam_modbus *bus, uint8_t addr,
+                        uint16_t start_addr, unsigned int num_coils,
+                        uint8_t *coils)
+{
+	assert(bus != NULL);
+	return yam_read_bulk(bus, addr, YAM_READ_COILS, start_addr, num_coils,
+	                     coils, sizeof(uint8_t));
+}
+
+/**
+\brief Read any number of discretes, in as few requests as the device allows
+\param *bus The YAM object representing the Modbus
+\param addr Address of the target Modbus device
+\param start_addr Address of the first discrete
+\param num_discretes Number of discretes
+\param *discretes Location to store the discretes, as for yam_read_discretes()
+\return YAM_OK on success, error code of the first failed request otherwise
+*/
+int yam_read_discretes_bulk(struct yam_modbus *bus, uint8_t addr,
+                            uint16_t start_addr, unsigned int num_discretes,
+                            uint8_t *discretes)
+{
+	assert(bus != NULL);
+	return yam_read_bulk(bus, addr, YAM_READ_DISCRETES, start_addr,
+	                     num_discretes, discretes, sizeof(uint8_t));
+}
+
+/**
+\brief Read any number of registers, in as few requests as the device allows
+\param *bus The YAM object representing the Modbus
+\param addr Address of the target Modbus device
+\param start_addr Address of the first register
+\param num_regs Number of registers
+\param *regs Location to store the registers
+\return YAM_OK on success, error code of the first failed request otherwise
+*/
+int yam_read_registers_bulk(struct yam_modbus *bus, uint8_t addr,
+                            uint16_t start_addr, unsigned int num_regs,
+                            uint16_t *regs)
+{
+	assert(bus != NULL);
+	return yam_read_bulk(bus, addr, YAM_READ_REGISTERS, start_addr, num_regs,
+	                     regs, sizeof(uint16_t));
+}
+
+/**
+\brief Read any number of input registers, in as few requests as the device
+allows
+\param *bus The YAM object representing the Modbus
+\param addr Address of the target Modbus device
+\param start_addr Address of the first input register
+\param num_regs Number of input registers
+\param *regs Location to store the registers
+\return YAM_OK on success, error code of the first failed request otherwise
+*/
+int yam_read_inputs_bulk(struct yam_modbus *bus, uint8_t addr,
+                         uint16_t start_addr, unsigned int num_regs,
+                         uint16_t *regs)
+{
+	assert(bus != NULL);
+	return yam_read_bulk(bus, addr, YAM_READ_INPUTS, start_addr, num_regs,
+	                     regs, sizeof(uint16_t));
+}
+
+/**
+\brief Combine two registers into a 32-bit value
+\param *bus The YAM object representing the Modbus
+\param addr Address of the device the registers came from
+\param *regs The two registers, as read
+\return The value, assembled in the device's word order
+*/
+uint32_t yam_regs_to_u32(struct yam_modbus *bus, uint8_t addr,
+                         const uint16_t *regs)
+{
+	const struct yam_profile *profile = yam_get_profile(bus, addr);
+
+	if (profile && profile->word_order == YAM_WORD_ORDER_LITTLE) {
+		return ((uint32_t)regs[1] << 16) | regs[0];
+	}
+	return ((uint32_t)regs[0] << 16) | regs[1];
+}
+
+/**
+\brief Split a 32-bit value into two registers
+\param *bus The YAM object representing the Modbus
+\param addr Address of the device the registers are for
+\param value The value
+\param *regs Location to store the two registers, in the device's word order
+*/
+void yam_u32_to_regs(struct yam_modbus *bus, uint8_t addr, uint32_t value,
+                     uint16_t *regs)
+{
+	const struct yam_profile *profile = yam_get_profile(bus, addr);
+
+	if (profile && profile->word_order == YAM_WORD_ORDER_LITTLE) {
+		regs[0] = value & 0xFFFF;
+		regs[1] = value >> 16;
+	}
+	else {
+		regs[0] = value >> 16;
+		regs[1] = value & 0xFFFF;
+	}
+}
+
+/**
+\brief Estimate how long a request occupies the bus
+\param *bus The YAM object representing the Modbus
+\param *req The request
+\return Time in microseconds, or 0 if it cannot be estimated
+
+Counts the request and response frames at the bus's baud rate and character
+format, plus the silent interval that must follow each frame and any extra
+turnaround in the slave's profile. The slave's own processing time is not
+included. Returns 0 for buses that are not driven
+directly, such as those opened with yam_modbus_connect().
+*/
+unsigned int yam_request_wire_time(struct yam_modbus *bus,
+                                   const struct yam_request *req)
+{
+	assert(bus != NULL);
+	assert(req != NULL);
+
+	struct yam_slave *slave;
+	int req_len, resp_len;
+	uint64_t char_ns;
+
+	/* Frame lengths including address and CRC */
+	switch (req->fncode) {
+	case YAM_READ_COILS:
+	case YAM_READ_DISCRETES:
+		req_len = 8;
+		resp_len = 5 + (req->count + 7) / 8;
+		break;
+	case YAM_READ_REGISTERS:
+	case YAM_READ_INPUTS:
+		req_len = 8;
+		resp_len = 5 + 2 * req->count;
+		break;
+	case YAM_WRITE_SINGLECOIL:
+	case YAM_WRITE_SINGLEREGISTER:
+		req_len = resp_len = 8;
+		break;
+	case YAM_WRITE_COILS:
+		req_len = 9 + (req->count + 7) / 8;
+		resp_len = 8;
+		break;
+	case YAM_WRITE_REGISTERS:
+		req_len = 9 + 2 * req->count;
+		resp_len = 8;
+		break;
+	default:
+		return 0;
+	}
+	char_ns = yam_char_ns(bus);
+	if (char_ns == 0) {
+		return 0;
+	}
+	slave = yam_slave_entry(bus, req->addr);
+	return ((req_len + resp_len) * char_ns + 2 * yam_gap_ns(bus)) / 1000 +
+	       (slave ? slave->profile.turnaround_us : 0);
+}
+
 /**
 \mainpage Yet Another Modbus Library
 \author Jim George
@@ -1164,8 +2809,10 @@ Commands currently implemented are:
 \section tutorial Quick tutorial
 \li Open the Modbus serial device, using the yam_modbus_init() function
 \li Optionally, enable debug output using yam_debug(). Debug output contains
-all the serial traffic. Transmitted bytes are enclosed in [box brackets], and
-received bytes in &lt;angle brackets&gt;.
+all the serial traffic, one line per frame on stderr: "TX n bytes:" followed
+by the bytes sent, or "RX n bytes:" followed by the bytes received and any
+error. To watch a bus in production, attach a trace with yam_set_trace()
+instead, and read it with yam-tracedump (see \ref trace).
 \li Optionally, set up the timeout using yam_set_timeout()
 \li Use any of the yam_read_* or yam_write_* functions to communicate with a
 Modbus device on the bus
@@ -1199,6 +2846,184 @@ the base address for all registers. Attempting to read address 40001 will
 silently fail - you should in fact start at address 0. Other manufacturers
 follow different conventions, please check the documentation.
 
+\section tcpserver Modbus/TCP server
+Data polled over Modbus/RTU can be republished to Modbus/TCP clients. Keep
+the polled values in a register image (struct yam_image, see image.h) and
+serve it with a struct yam_tcp_server (see tcp.h):
+\li Create the image with yam_image_init(), and refresh it from the poll loop
+with yam_image_set_registers() and friends
+\li Create the server with yam_tcp_server_init(), attach the image with
+yam_tcp_server_set_image(), and call yam_tcp_server_run() from a dedicated
+thread
+\li To use several cores, initialize one server per core with
+YAM_TCP_FLAGS_REUSEPORT and run them all with yam_tcp_server_run_loops()
+
+\section gateway Modbus/TCP gateway
+struct yam_gateway (see gateway.h) forwards Modbus/TCP requests to one or
+more RTU buses, chosen by unit identifier. Identical reads that arrive while
+one is already in flight are answered from that one transaction, and read
+replies are cached for a configurable time (yam_gateway_set_ttl()). The
+yam-gateway program wraps this up as a standalone gateway.
+
+\section busd Sharing a bus between processes
+Only one process can drive a serial port at a time. To let several processes
+use the same bus, run the yam-busd daemon on the port and open the bus in
+each process with yam_modbus_connect() instead of yam_modbus_init(). The rest
+of the API is unchanged. The daemon serves the processes in turn, and a read
+that is already queued by another process is not sent twice.
+
+\section shm Shared-memory image
+Processes that only need the latest polled values can read them from shared
+memory instead of polling the bus themselves. The polling process lays out a
+region with yam_shm_create(), one block per range of a slave table, and
+attaches it to its bus with yam_set_shm(); every successful read is then
+written into the blocks it covers. Readers map the region with yam_shm_open()
+and copy values out with yam_shm_snapshot(), which makes no system calls and
+returns values from a single update, along with the time of that update.
+
+\section history Poll historian
+To keep a record of every poll, open a history file with yam_history_create()
+and attach it to the bus with yam_set_history(). Each successful read is
+appended to a ring of fixed-size records in the memory-mapped file, holding
+the timestamp, slave, function, start address and the response data as
+received. Records are flushed to disk in batches (yam_history_set_sync()).
+Other processes can open the file with yam_history_open() and walk a time
+range with yam_history_scan().
+
+\section scheduler Polling scheduler
+Instead of a hand-written loop of reads and sleeps, describe each poll as a
+struct yam_sched_task (a struct yam_request with a period and an optional
+deadline) and add it to a struct yam_sched (see scheduler.h). yam_sched_run()
+then issues the requests earliest deadline first, back to back while any is
+due. yam_request_wire_time() estimates the line time of each request, and
+yam_sched_load() sums these against the periods: a load above 1000 means the
+polls cannot all fit on the line, and the tasks' overrun counters show which
+ones suffer.
+
+\section accounting Bus time accounting
+Every transaction is timed, and the bus keeps a running account (struct
+yam_bus_stats, read with yam_get_bus_stats()) of where the line's time goes:
+the theoretical time needed to send the characters of requests and replies
+at the configured baud rate and character format, the measured time spent in
+transactions, the idle time between them, and the slaves' turnaround from the
+end of each request to the start of its reply. Comparing these shows how
+close a line is to saturation, and whether time is lost to slow slaves,
+adapter latency or the application itself.
+
+\section health Slave health
+The bus tracks the health of each slave (yam_get_slave()): consecutive
+timeouts and the time of the last reply. On a multi-drop line a dead slave
+costs a full timeout on every poll, slowing down all the others. To prevent
+this, enable the circuit breaker with yam_set_breaker(). After a given number
+of consecutive timeouts, requests to the slave fail at once with
+YAM_SLAVE_DOWN, except for occasional probes at exponentially increasing
+intervals; the first reply to a probe brings the slave back.
+
+\section retry Retries
+Rather than checking for YAM_CRC_ERROR or YAM_TIMEOUT and calling again, set
+a struct yam_retry_policy on the bus with yam_set_retry(), or on a single
+slave with yam_set_slave_retry(). It selects which classes of error are
+retried (corrupted replies and timeouts at once, busy slaves after a delay),
+how many times, and a deadline for the whole transaction. Retries resend the
+request already encoded, and are counted in the slave's health entry.
+
+\section pacing Frame pacing
+Before sending a request, the library waits until the line has been silent
+for 3.5 characters since the last byte received, or since the estimated end
+of the last frame sent, sleeping to that exact time. Slaves that need longer
+to turn their line around can be given extra time with
+yam_set_slave_turnaround(), which then applies only to requests to them.
+There is no need to add sleeps between calls.
+
+\section profiles Device profiles
+Each slave can be given a struct yam_profile with yam_set_profile(), which
+records the largest read it accepts, the function codes it implements, its
+turnaround time, its word order and any quirks (such as the off-by-one byte
+count of Report Slave ID that slaveidhack works around bus-wide). Requests
+the profile rules out fail locally without using the bus. The _bulk read
+functions split a long range into as many requests as the profile allows,
+and yam_regs_to_u32() and yam_u32_to_regs() assemble 32 bit values in the
+slave's word order.
+
+\section batching Write batching
+Control loops that write many single coils or registers each cycle can turn
+on write batching with yam_set_write_batch(). Single writes are then held
+instead of sent, a later write to the same address replaces an earlier one,
+and writes to consecutive addresses are merged into Write Multiple requests
+when the batch is flushed with yam_flush_writes(), or when its window ends.
+
+\section batches Request batches
+A scan cycle that issues the same list of requests every time can describe
+them as an array of struct yam_request, prepare it once with
+yam_batch_init(), and run it with yam_batch_run(). The frames are encoded
+ahead of time and sent back to back, and each request gets its own status.
+
+\section change Change detection
+Consumers that only want to hear about values that changed can attach a
+struct yam_watch (see change.h) to a read request. After each execution,
+yam_watch_update() compares the data with the previous poll and calls back
+for each tag that moved past its absolute or percent deadband. Scheduler
+tasks update their watch themselves.
+
+\section cache Holding register cache
+Reading back setpoints right after writing them costs a round trip for
+values the master already knows. With a struct yam_cache (see cache.h)
+attached by yam_set_cache(), successful writes and reads of holding
+registers are remembered, and yam_read_registers() answers from the cache
+while every register it asks for is fresher than the window.
+
+\section trace Frame trace
+Printing frames with yam_debug() slows the bus down enough to hide timing
+problems. A struct yam_trace (see trace.h) attached with yam_set_trace()
+instead keeps the latest frames, with their times and results, in a ring
+that costs a copy per frame. Another thread can drain it while the bus runs,
+and yam_trace_save() writes it to a file for the yam-tracedump program.
+
+\section metrics Metrics
+For a view of each device over time, attach a struct yam_metrics (see
+metrics.h) with yam_set_metrics(). Each slave and function code gets
+counters of transactions, timeouts, CRC errors, exceptions and bytes, and a
+latency histogram from which yam_metrics_percentile() reads p50, p99 and so
+on. Snapshots and resets may be taken from any thread while the bus runs.
+
+\section exporter Exporting statistics
+A struct yam_exporter (see exporter.h) serves the time accounting and metrics
+of one or more buses on a Unix socket in the Prometheus text format, from a
+thread of its own, so that a collector can scrape them with, for instance,
+curl --unix-socket. Call yam_exporter_init(), yam_exporter_add_bus() for each
+bus and yam_exporter_start(); yam_exporter_close() stops it.
+
+\section capture Captures and replay
+To reproduce a problem seen in the field, write the traffic of the bus to a
+capture file with yam_capture_open() and yam_set_capture(). Captures are pcap
+files (see capture.h), with the bus parameters kept with each frame. A
+capture opened with yam_replay_open() can then be replayed, in real time or
+as fast as possible, either through a YAM object initialized with
+yam_modbus_replay(), which answers the program's requests with the recorded
+replies, or into a register image with yam_replay_slave().
+
+\section sim Simulated slaves
+A struct yam_sim (see sim.h) emulates a bus of slaves on a pseudo-terminal,
+each answering from a register image with a given latency and rate of
+dropped, corrupted and busy replies. Pass sim->path to yam_modbus_init() to
+test or benchmark a master without hardware. The yam-sim program does the
+same from the command line, for use with test-rtu or any other master.
+
+\section loopback Loopback transport
+yam_modbus_loopback() (see loopback.h) connects a bus directly to the slaves
+of a simulator set up with yam_sim_init_engine(), through a pair of ring
+buffers. No system calls are made and nothing sleeps unless the bus is
+given a baud rate, so the library's own cost per transaction can be
+measured, and its decoding fuzzed with corrupted replies, at memory speed.
+
+\section fault Fault injection
+A struct yam_fault (see fault.h) wraps the transport of an open bus, and
+drops, corrupts, duplicates, delays or splits the bytes and frames going
+through it at given rates. Attach it with yam_set_faults(). The faults come
+from a seeded generator, so a failure found this way can be reproduced.
+bench-rtu reports throughput and recovery times under several fault
+profiles.
+
 \todo
-Add support for Modbus/TCP
+Add support for Modbus/TCP master mode
 */
@@ -11,6 +11,123 @@
 
 #define YAM_MAX_DEVICE_NAME 64
 
+struct yam_transport;
+struct yam_shm;
+struct yam_history;
+struct yam_cache;
+struct yam_trace;
+struct yam_metrics;
+struct yam_capture;
+struct yam_pending_write;
+
+/**
+\brief Bus time accounting
+
+Times are in nanoseconds and accumulate from the last reset. See
+yam_get_bus_stats().
+*/
+struct yam_bus_stats {
+	uint64_t transactions; /**< Requests sent */
+	uint64_t replies; /**< Transactions in which the slave sent anything */
+	uint64_t errors; /**< Transactions that failed */
+	uint64_t timeouts; /**< Transactions that timed out */
+	uint64_t wire_ns; /**< Theoretical time to send the characters of all
+	                       requests and replies */
+	uint64_t busy_ns; /**< Measured time spent in transactions */
+	uint64_t idle_ns; /**< Time between transactions */
+	uint64_t turnaround_ns; /**< Time from the end of each request on the
+	                             line to the first byte of its reply; the
+	                             end is when the request was drained, if
+	                             the port drains requests, or else
+	                             estimated from the line speed */
+	uint64_t max_turnaround_ns; /**< Longest single turnaround */
+	uint64_t elapsed_ns; /**< Time since the last reset, filled in by
+	                          yam_get_bus_stats() */
+	uint64_t since_ns; /**< CLOCK_MONOTONIC time of the last reset */
+	uint64_t last_end_ns; /**< CLOCK_MONOTONIC time the last transaction
+	                           ended */
+};
+
+/** Highest unicast slave address */
+#define YAM_MAX_SLAVE_ADDR 247
+
+/* Slave health states */
+/** Slave is answering, requests go to the bus */
+#define YAM_SLAVE_STATE_UP 0
+/** Circuit breaker open: requests fail locally until the next probe */
+#define YAM_SLAVE_STATE_DOWN 1
+
+/* Error classes for struct yam_retry_policy */
+/** Retry after a reply with a bad CRC */
+#define YAM_RETRY_CRC (1 << 0)
+/** Retry after a timeout */
+#define YAM_RETRY_TIMEOUT (1 << 1)
+/** Retry, after busy_delay_ms, when the slave answers busy or acknowledge */
+#define YAM_RETRY_BUSY (1 << 2)
+
+/**
+\brief When and how failed requests are sent again
+
+Errors that are not in classes, such as an illegal address, are never
+retried. See yam_set_retry().
+*/
+struct yam_retry_policy {
+	unsigned int max_retries; /**< Retries after the first attempt, 0 for none */
+	unsigned int classes; /**< Errors to retry, YAM_RETRY_* */
+	unsigned int busy_delay_ms; /**< Wait before retrying a busy slave */
+	unsigned int deadline_ms; /**< Time from the first attempt after which no
+	                               retry is made, 0 for no limit */
+};
+
+/* Word orders of 32-bit values held in two registers */
+/** Most significant register first */
+#define YAM_WORD_ORDER_BIG 0
+/** Least significant register first */
+#define YAM_WORD_ORDER_LITTLE 1
+
+/* Device quirks */
+/** Report Slave ID byte count is one too high (as sent by libmodbus) */
+#define YAM_QUIRK_SLAVEID_COUNT (1 << 0)
+
+/** Bit for a function code in struct yam_profile functions */
+#define YAM_FUNCTION_BIT(fncode) (1UL << (fncode))
+
+/**
+\brief What a device can do, and how it needs to be driven
+
+A zeroed profile describes a device that follows the spec: it accepts the
+largest requests the spec allows, supports every function code, and needs
+no extra turnaround. See yam_set_profile().
+*/
+struct yam_profile {
+	uint16_t max_regs; /**< Registers per request, 0 for the spec limit */
+	uint16_t max_coils; /**< Coils or discretes per request, 0 for the spec
+	                         limit */
+	uint32_t functions; /**< YAM_FUNCTION_BIT() of each supported function
+	                         code, 0 if all are supported */
+	unsigned int turnaround_us; /**< Extra silence the device needs before a
+	                                 request, beyond 3.5 characters */
+	int word_order; /**< YAM_WORD_ORDER_BIG or YAM_WORD_ORDER_LITTLE */
+	unsigned int quirks; /**< YAM_QUIRK_* */
+};
+
+/**
+\brief Health and profile of one slave, as seen by the master
+*/
+struct yam_slave {
+	int state; /**< YAM_SLAVE_STATE_UP or YAM_SLAVE_STATE_DOWN */
+	unsigned int failures; /**< Consecutive timeouts */
+	uint64_t last_success_ns; /**< CLOCK_MONOTONIC time of the last reply, 0
+	                               if it never replied */
+	uint64_t retry_ns; /**< While down, when the next probe may be sent */
+	unsigned int backoff_ms; /**< While down, the current probe interval */
+	unsigned long fast_fails; /**< Requests failed locally while down */
+	unsigned long retries; /**< Requests sent again after an error */
+	struct yam_profile profile; /**< The device's capabilities */
+	int has_retry; /**< Nonzero if retry overrides the bus's policy */
+	struct yam_retry_policy retry; /**< The slave's own retry policy */
+};
+
 /**
 \brief The YAM object
 
@@ -20,14 +137,50 @@ to know which modbus serial device to use. This permits multiple serial
 devices to be open simultaneously.
 */
 struct yam_modbus {
-	int serial; /**< Serial port file descriptor */
+	int serial; /**< Serial port file descriptor (daemon socket, if
+	                 connected with yam_modbus_connect) */
 	int baudrate; /**< Baud rate */
+	unsigned int flags; /**< Serial flags (YAM_SERIAL_FLAGS_*) */
+	unsigned int serial_tuning; /**< Low-latency settings that took effect
+	                                 (YAM_SERIAL_TUNED_*) */
 	int debug; /**< Nonzero to enable debug stuff to stdout */
 	int timeout_ms; /**< Timeout, in milliseconds, when reading */
 	int last_errorcode; /**< Last error code seen by this bus */
 	char device_name[YAM_MAX_DEVICE_NAME]; /**< Name of the serial device */
 	char slaveidhack; /**< Set nonzero to subtract 1 from slave ID additional bytes
-	                       field, to match nonstandard behavior of libmodbus */
+	                       field, to match nonstandard behavior of libmodbus
+	                       (for all slaves; see also YAM_QUIRK_SLAVEID_COUNT) */
+	const struct yam_transport *transport; /**< Moves bytes to and from the
+	                                            slaves, normally the serial port */
+	void *transport_data; /**< Private state of the transport */
+	struct yam_shm *shm; /**< Shared-memory image that reads are published
+	                          to, or NULL */
+	struct yam_history *history; /**< Historian that reads are recorded in,
+	                                  or NULL */
+	struct yam_cache *cache; /**< Holding register cache, or NULL */
+	struct yam_trace *trace; /**< Trace that frames are recorded in, or NULL */
+	struct yam_metrics *metrics; /**< Per-slave counters, or NULL */
+	struct yam_capture *capture; /**< Capture file frames are written to, or
+	                                 NULL */
+	struct yam_bus_stats stats; /**< Bus time accounting */
+	uint64_t rx_first_ns; /**< Internal: arrival of the first reply byte */
+	int rx_len; /**< Internal: bytes of the last reply received */
+	uint64_t rx_last_ns; /**< Internal: arrival of the last byte received */
+	uint64_t tx_end_ns; /**< Internal: estimated end of the last frame sent */
+	struct yam_slave *slaves; /**< Health of each slave address */
+	unsigned int breaker_threshold; /**< Timeouts that take a slave down, 0
+	                                     to never take slaves down */
+	unsigned int breaker_min_ms; /**< First probe interval of a down slave */
+	unsigned int breaker_max_ms; /**< Longest probe interval */
+	struct yam_retry_policy retry; /**< Retry policy of the bus */
+	int batch_window_ms; /**< Write batching window, 0 if single writes are
+	                          sent at once (see yam_set_write_batch()) */
+	struct yam_pending_write *pending; /**< Single writes held for batching */
+	int num_pending; /**< Number of writes held */
+	uint64_t batch_start_ns; /**< Internal: when the oldest held write was
+	                              queued */
+	int batch_error; /**< First error of a batched write since the last
+	                      yam_flush_writes() */
 };
 
 /* Serial flags */
@@ -45,6 +198,20 @@ struct yam_modbus {
 #define YAM_SERIAL_FLAGS_8BIT (0 << 5)
 #define YAM_SERIAL_FLAGS_6BIT (1 << 5)
 #define YAM_SERIAL_FLAGS_7BIT (2 << 5)
+/** Tune the port for the shortest reply latency (see struct yam_modbus's
+serial_tuning for what took effect) */
+#define YAM_SERIAL_FLAGS_LOW_LATENCY (1 << 7)
+
+/* Low-latency settings, as reported in serial_tuning */
+/** The driver's ASYNC_LOW_LATENCY flag is set */
+#define YAM_SERIAL_TUNED_ASYNC_LOW_LATENCY (1 << 0)
+/** The USB adapter's latency timer (FTDI) is set to 1 ms */
+#define YAM_SERIAL_TUNED_LATENCY_TIMER (1 << 1)
+/** Long reads wait in the kernel for all the bytes expected */
+#define YAM_SERIAL_TUNED_READ_THRESHOLD (1 << 2)
+/** Requests are drained before the reply timeout starts, and turnaround is
+measured from the end of the drain */
+#define YAM_SERIAL_TUNED_DRAIN (1 << 3)
 
 #define YAM_SERIAL_FLAGS_8N1 (YAM_SERIAL_FLAGS_8BIT | \
 		YAM_SERIAL_FLAGS_NO_HANDSHAKE | \
@@ -88,6 +255,10 @@ struct yam_modbus {
 #define YAM_SLAVE_BUSY -6
 /** Return code - command sent to slave had a parity or CRC error */
 #define YAM_PARITY_ERROR -8
+/** Return code - gateway could not route the request to a slave */
+#define YAM_GATEWAY_PATH_UNAVAILABLE -10
+/** Return code - gateway's target slave did not respond */
+#define YAM_GATEWAY_TARGET_FAILED -11
 
 /* Exeception codes returned by YAM */
 /** Return code - everything's OK */
@@ -102,6 +273,16 @@ struct yam_modbus {
 #define YAM_SERIAL_INIT_FAILED -259
 /** Return code - too many registers/coils (exceeds ADU size) */
 #define YAM_TOO_MANY_REGISTERS -260
+/** Return code - socket operation failed */
+#define YAM_SOCKET_FAILED -261
+/** Return code - memory allocation failed */
+#define YAM_NO_MEMORY -262
+/** Return code - shared memory region could not be created or mapped */
+#define YAM_SHM_FAILED -263
+/** Return code - file could not be created, mapped or written */
+#define YAM_FILE_FAILED -264
+/** Return code - slave is down, request was not sent */
+#define YAM_SLAVE_DOWN -265
 
 /** Maximum ADU length, in bytes */
 #define YAM_MODBUS_MAX_ADU_LEN 256
@@ -113,13 +294,73 @@ struct yam_modbus {
 #define YAM_COILS_PER_REQUEST 1968
 /** Default timeout of a request, in milliseconds */
 #define YAM_DEFAULT_TIMEOUT 1000
+/** Silent interval between frames above 19200 bps, in microseconds */
+#define YAM_T35_FIXED_US 1750
+/** Shortest wait for a reply that a retry is started for, in milliseconds */
+#define YAM_RETRY_MIN_REPLY_MS 5
+/** Single writes held by write batching before a flush is forced */
+#define YAM_WRITE_QUEUE_LEN 256
+/** Write batching window that holds writes until yam_flush_writes() */
+#define YAM_WRITE_BATCH_EXPLICIT -1
+
+/**
+\brief A prepared request
+
+Describes one read or write so that it can be kept and issued later, for
+instance by the polling scheduler. data points to one byte per coil or one
+uint16_t per register, as with the yam_read_* and yam_write_* functions; for
+the single writes it points to the one value.
+*/
+struct yam_request {
+	uint8_t addr; /**< Slave address */
+	uint8_t fncode; /**< YAM_READ_COILS, YAM_WRITE_REGISTERS etc. */
+	uint16_t start_addr; /**< Address of the first coil or register */
+	uint16_t count; /**< Number of coils or registers */
+	void *data; /**< Values read, or to be written */
+	int status; /**< Result of the last execution */
+};
+
+/**
+\brief A list of requests prepared to be run back to back
+
+Filled in by yam_batch_init(), which encodes every request up front so that
+yam_batch_run() only has to send them.
+*/
+struct yam_batch {
+	struct yam_request *reqs; /**< The requests, owned by the caller */
+	int num_reqs; /**< Number of requests */
+	uint8_t *adus; /**< Encoded request ADU of each entry,
+	                    YAM_MODBUS_MAX_ADU_LEN bytes apart */
+	int *adu_lens; /**< Length of each encoded request */
+};
 
 int yam_modbus_init(const char *device_name,
              unsigned int speed, unsigned int flags,
              struct yam_modbus *bus);
+int yam_modbus_connect(const char *socket_path, struct yam_modbus *bus);
 void yam_modbus_close(struct yam_modbus *bus);
 void yam_debug(struct yam_modbus *bus, int debug_status);
 void yam_set_timeout(struct yam_modbus *bus, int timeout_ms);
+void yam_set_shm(struct yam_modbus *bus, struct yam_shm *shm);
+void yam_set_history(struct yam_modbus *bus, struct yam_history *hist);
+void yam_set_cache(struct yam_modbus *bus, struct yam_cache *cache);
+void yam_set_trace(struct yam_modbus *bus, struct yam_trace *trace);
+void yam_set_metrics(struct yam_modbus *bus, struct yam_metrics *metrics);
+void yam_set_capture(struct yam_modbus *bus, struct yam_capture *capture);
+void yam_get_bus_stats(struct yam_modbus *bus, struct yam_bus_stats *stats);
+void yam_reset_bus_stats(struct yam_modbus *bus);
+void yam_set_breaker(struct yam_modbus *bus, unsigned int threshold,
+                     unsigned int min_backoff_ms, unsigned int max_backoff_ms);
+const struct yam_slave *yam_get_slave(struct yam_modbus *bus, uint8_t addr);
+void yam_set_retry(struct yam_modbus *bus, const struct yam_retry_policy *policy);
+int yam_set_slave_turnaround(struct yam_modbus *bus, uint8_t addr,
+                             unsigned int turnaround_us);
+int yam_set_profile(struct yam_modbus *bus, uint8_t addr,
+                    const struct yam_profile *profile);
+const struct yam_profile *yam_get_profile(struct yam_modbus *bus, uint8_t addr);
+int yam_set_slave_retry(struct yam_modbus *bus, uint8_t addr,
+                        const struct yam_retry_policy *policy);
+void yam_reset_slave(struct yam_modbus *bus, uint8_t addr);
 int yam_get_serial_device(struct yam_modbus *bus);
 
 int yam_read_coils(struct yam_modbus *bus, uint8_t addr,
@@ -146,8 +387,36 @@ int yam_write_multiple_coils(struct yam_modbus *bus, uint8_t addr,
 int yam_write_multiple_registers(struct yam_modbus *bus, uint8_t addr,
                                  uint16_t start_addr, uint16_t num_regs,
                                  uint16_t *regs);
+int yam_set_write_batch(struct yam_modbus *bus, int window_ms);
+int yam_flush_writes(struct yam_modbus *bus);
 int yam_report_slave_id(struct yam_modbus *bus, uint8_t addr, uint8_t *id,
                         uint8_t *run_status, char *additional_data, int *buflen);
+int yam_raw_request(struct yam_modbus *bus, uint8_t addr,
+                    const uint8_t *req_pdu, int req_len,
+                    uint8_t *resp_pdu, int resp_buf_len);
+int yam_request_execute(struct yam_modbus *bus, struct yam_request *req);
+int yam_batch_init(struct yam_batch *batch, struct yam_request *reqs,
+                   int num_reqs);
+int yam_batch_run(struct yam_modbus *bus, struct yam_batch *batch);
+void yam_batch_free(struct yam_batch *batch);
+int yam_read_coils_bulk(struct yam_modbus *bus, uint8_t addr,
+                        uint16_t start_addr, unsigned int num_coils,
+                        uint8_t *coils);
+int yam_read_discretes_bulk(struct yam_modbus *bus, uint8_t addr,
+                            uint16_t start_addr, unsigned int num_discretes,
+                            uint8_t *discretes);
+int yam_read_registers_bulk(struct yam_modbus *bus, uint8_t addr,
+                            uint16_t start_addr, unsigned int num_regs,
+                            uint16_t *regs);
+int yam_read_inputs_bulk(struct yam_modbus *bus, uint8_t addr,
+                         uint16_t start_addr, unsigned int num_regs,
+                         uint16_t *regs);
+uint32_t yam_regs_to_u32(struct yam_modbus *bus, uint8_t addr,
+                         const uint16_t *regs);
+void yam_u32_to_regs(struct yam_modbus *bus, uint8_t addr, uint32_t value,
+                     uint16_t *regs);
+unsigned int yam_request_wire_time(struct yam_modbus *bus,
+                                   const struct yam_request *req);
 
 void yam_perror(struct yam_modbus *bus, char *s);
 char *yam_strerror(int errnum);
@@ -0,0 +1,282 @@
+/**
+\file scheduler.c
+\brief Periodic polling scheduler
+\author Jim George
+
+Each task is a prepared request with a period and a relative deadline. A
+task is released once per period, and the scheduler issues released requests
+earliest deadline first, back to back, sleeping only when nothing is due.
+
+A Modbus transaction cannot be interrupted once started, so running a long
+request just before an urgent one is released can make the urgent one late.
+The scheduler uses each task's cost (its estimated wire time until it has
+run, then its measured duration) to spot this: if starting the chosen
+request now would make a shorter-deadline task released during it miss its
+deadline, and waiting for that task still lets the chosen one finish in
+time, the bus is left idle until the other task is released.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "modbus.h"
+#include "scheduler.h"
+#include "change.h"
+
+static uint64_t sched_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Expected bus time of a task, in nanoseconds */
+static uint64_t sched_cost(struct yam_sched_task *task)
+{
+	return (task->runs ? task->exec_us : task->wire_us) * 1000ULL;
+}
+
+static void sched_release(struct yam_sched_task *task, uint64_t release)
+{
+	task->release_ns = release;
+	task->deadline_ns = release + 1000000ULL *
+	                    (task->deadline_ms ? task->deadline_ms : task->period_ms);
+}
+
+/**
+\brief Initialize a scheduler
+\param *sched The scheduler
+\param *bus Bus the requests are issued on
+\return YAM_OK
+*/
+int yam_sched_init(struct yam_sched *sched, struct yam_modbus *bus)
+{
+	assert(sched != NULL);
+	assert(bus != NULL);
+
+	bzero(sched, sizeof(struct yam_sched));
+	sched->bus = bus;
+	return YAM_OK;
+}
+
+/**
+\brief Add a periodic request
+\param *sched The scheduler
+\param *task The task, which must stay valid until yam_sched_free()
+\return YAM_OK on success, YAM_ILLEGAL_DATA_VALUE if the task has no period,
+YAM_NO_MEMORY on allocation failure
+
+The task is first released immediately. Tasks may not be added while
+yam_sched_run() is running. Check yam_sched_load() after adding tasks: a
+load above 1000 means the requests do not fit on the line, and some of them
+will overrun their deadlines.
+*/
+int yam_sched_add(struct yam_sched *sched, struct yam_sched_task *task)
+{
+	assert(sched != NULL);
+	assert(task != NULL);
+
+	if (task->period_ms == 0) {
+		return YAM_ILLEGAL_DATA_VALUE;
+	}
+	if (sched->num_tasks == sched->max_tasks) {
+		int max = sched->max_tasks ? 2 * sched->max_tasks : 16;
+		struct yam_sched_task **tasks;
+
+		tasks = realloc(sched->tasks, max * sizeof(struct yam_sched_task *));
+		if (tasks == NULL) {
+			return YAM_NO_MEMORY;
+		}
+		sched->tasks = tasks;
+		sched->max_tasks = max;
+	}
+
+	task->wire_us = yam_request_wire_time(sched->bus, &task->req);
+	task->exec_us = 0;
+	task->runs = task->overruns = task->skipped = 0;
+	sched_release(task, sched_now());
+	sched->tasks[sched->num_tasks++] = task;
+	return YAM_OK;
+}
+
+/**
+\brief Fraction of the bus the tasks need
+\param *sched The scheduler
+\return Sum over all tasks of cost / period, in thousandths
+
+The cost of a task is its estimated wire time until it has run once, and its
+measured duration after that, which includes the slaves' response times.
+*/
+unsigned int yam_sched_load(struct yam_sched *sched)
+{
+	uint64_t load = 0;
+	int ctr;
+
+	for (ctr = 0; ctr < sched->num_tasks; ctr++) {
+		struct yam_sched_task *task = sched->tasks[ctr];
+		load += sched_cost(task) / task->period_ms;
+	}
+	/* ns per ms is parts per million */
+	return load / 1000;
+}
+
+/*
+Picks the task to run at time now. Returns NULL if nothing should start yet,
+with *wake set to when to look again.
+*/
+static struct yam_sched_task *sched_pick(struct yam_sched *sched,
+                                         uint64_t now, uint64_t *wake)
+{
+	struct yam_sched_task *best = NULL, *task;
+	uint64_t next = UINT64_MAX;
+	int ctr;
+
+	for (ctr = 0; ctr < sched->num_tasks; ctr++) {
+		task = sched->tasks[ctr];
+		if (task->release_ns > now) {
+			if (task->release_ns < next) next = task->release_ns;
+		}
+		else if (best == NULL || task->deadline_ns < best->deadline_ns) {
+			best = task;
+		}
+	}
+	*wake = next;
+	if (best == NULL) {
+		return NULL;
+	}
+
+	/* Would starting best now make a more urgent, later release late? */
+	uint64_t end = now + sched_cost(best);
+	for (ctr = 0; ctr < sched->num_tasks; ctr++) {
+		task = sched->tasks[ctr];
+		if (task->release_ns <= now || task->release_ns >= end ||
+		    task->deadline_ns >= best->deadline_ns) {
+			continue;
+		}
+		if (end + sched_cost(task) > task->deadline_ns &&
+		    task->release_ns + sched_cost(task) + sched_cost(best) <=
+		    best->deadline_ns) {
+			*wake = task->release_ns;
+			return NULL;
+		}
+	}
+	return best;
+}
+
+static void sched_execute(struct yam_sched *sched, struct yam_sched_task *task,
+                          uint64_t start)
+{
+	uint64_t end, period = task->period_ms * 1000000ULL;
+	uint64_t next;
+
+	yam_request_execute(sched->bus, &task->req);
+	end = sched_now();
+
+	task->exec_us = (end - start) / 1000;
+	task->runs++;
+	sched->stats.runs++;
+	if (end > task->deadline_ns) {
+		task->overruns++;
+		sched->stats.overruns++;
+	}
+
+	/* Keep at most one release pending, drop the ones that were missed */
+	next = task->release_ns + period;
+	if (next + period <= end) {
+		uint64_t missed = (end - next) / period;
+		task->skipped += missed;
+		sched->stats.skipped += missed;
+		next += missed * period;
+	}
+	sched_release(task, next);
+
+	if (task->watch) {
+		yam_watch_update(task->watch);
+	}
+	if (task->done) {
+		task->done(task->arg, task);
+	}
+}
+
+/**
+\brief Issue the next due request, if any
+\param *sched The scheduler
+\return 0 if a request was issued, otherwise the number of milliseconds until
+the next one is due (at most YAM_SCHED_MAX_SLEEP_MS)
+
+For applications that run their own loop; yam_sched_run() does this for
+the caller otherwise.
+*/
+int yam_sched_step(struct yam_sched *sched)
+{
+	struct yam_sched_task *task;
+	uint64_t now = sched_now(), wake;
+
+	task = sched_pick(sched, now, &wake);
+	if (task != NULL) {
+		sched_execute(sched, task, now);
+		return 0;
+	}
+	if (wake - now >= YAM_SCHED_MAX_SLEEP_MS * 1000000ULL) {
+		return YAM_SCHED_MAX_SLEEP_MS;
+	}
+	return (wake - now + 999999) / 1000000;
+}
+
+/**
+\brief Issue requests until stopped
+\param *sched The scheduler
+\return YAM_OK after yam_sched_stop() has been called
+*/
+int yam_sched_run(struct yam_sched *sched)
+{
+	struct yam_sched_task *task;
+	struct timespec ts;
+	uint64_t now, wake, limit;
+
+	sched->stop = 0;
+	while (!sched->stop) {
+		now = sched_now();
+		task = sched_pick(sched, now, &wake);
+		if (task != NULL) {
+			sched_execute(sched, task, now);
+			continue;
+		}
+		limit = now + YAM_SCHED_MAX_SLEEP_MS * 1000000ULL;
+		if (wake > limit) wake = limit;
+		ts.tv_sec = wake / 1000000000ULL;
+		ts.tv_nsec = wake % 1000000000ULL;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+	return YAM_OK;
+}
+
+/**
+\brief Make yam_sched_run() return
+\param *sched The scheduler
+
+May be called from another thread or a signal handler. yam_sched_run()
+returns after the request in progress, if any, completes.
+*/
+void yam_sched_stop(struct yam_sched *sched)
+{
+	sched->stop = 1;
+}
+
+/**
+\brief Release the scheduler's resources
+\param *sched The scheduler
+
+The tasks themselves belong to the caller and are not touched.
+*/
+void yam_sched_free(struct yam_sched *sched)
+{
+	free(sched->tasks);
+	sched->tasks = NULL;
+	sched->num_tasks = sched->max_tasks = 0;
+}
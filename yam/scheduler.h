@@ -0,0 +1,86 @@
+/**
+\file scheduler.h
+\brief Include file for the YAM polling scheduler
+\author Jim George
+*/
+
+#ifndef _YAM_SCHEDULER_H_
+#define _YAM_SCHEDULER_H_
+
+#include <stdint.h>
+#include "modbus.h"
+
+/** Longest the scheduler sleeps before checking whether it was stopped */
+#define YAM_SCHED_MAX_SLEEP_MS 100
+
+struct yam_sched_task;
+struct yam_watch;
+
+/**
+\brief Callback run after each execution of a task
+\param *arg Argument given in the task
+\param *task The task; task->req.status holds the result
+*/
+typedef void (*yam_sched_fn)(void *arg, struct yam_sched_task *task);
+
+/**
+\brief A periodic request
+
+Fill in req, period_ms and optionally deadline_ms, done, arg and watch, then
+add the task with yam_sched_add(). The remaining fields are kept by the
+scheduler.
+*/
+struct yam_sched_task {
+	struct yam_request req; /**< Request to issue */
+	unsigned int period_ms; /**< Interval between releases */
+	unsigned int deadline_ms; /**< Time after release by which the request
+	                               must complete, 0 for the period */
+	yam_sched_fn done; /**< Called after each execution, or NULL */
+	void *arg; /**< Argument passed to done */
+	struct yam_watch *watch; /**< Change detection on req (see change.h),
+	                              updated before done is called, or NULL */
+
+	unsigned int wire_us; /**< Estimated bus time of the request */
+	unsigned int exec_us; /**< Measured duration of the last execution */
+	uint64_t release_ns; /**< Current release time (CLOCK_MONOTONIC) */
+	uint64_t deadline_ns; /**< Current absolute deadline */
+	unsigned long runs; /**< Number of executions */
+	unsigned long overruns; /**< Executions that completed after the deadline */
+	unsigned long skipped; /**< Releases dropped because the previous one
+	                            had not run yet */
+};
+
+/**
+\brief Scheduler counters
+*/
+struct yam_sched_stats {
+	unsigned long runs; /**< Requests issued */
+	unsigned long overruns; /**< Requests completed after their deadline */
+	unsigned long skipped; /**< Releases dropped */
+};
+
+/**
+\brief The YAM polling scheduler
+
+Issues periodic requests on one bus, earliest deadline first. Requests are
+sent back to back while any is due, so the bus is never idle while there is
+work, and a slow or overloaded bus shows up as overruns rather than as drift.
+*/
+struct yam_sched {
+	struct yam_modbus *bus; /**< Bus the requests are issued on */
+	int num_tasks; /**< Number of tasks */
+	int max_tasks; /**< Allocated size of tasks */
+	struct yam_sched_task **tasks; /**< Tasks, owned by the caller */
+	volatile int stop; /**< Set to make yam_sched_run() return */
+	struct yam_sched_stats stats; /**< Counters */
+};
+
+int yam_sched_init(struct yam_sched *sched, struct yam_modbus *bus);
+int yam_sched_add(struct yam_sched *sched, struct yam_sched_task *task);
+unsigned int yam_sched_load(struct yam_sched *sched);
+int yam_sched_step(struct yam_sched *sched);
+int yam_sched_run(struct yam_sched *sched);
+void yam_sched_stop(struct yam_sched *sched);
+void yam_sched_free(struct yam_sched *sched);
+
+#endif /* _YAM_SCHEDULER_H_ */
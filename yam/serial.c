@@ -6,7 +6,9 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
+#include <limits.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -15,14 +17,15 @@
 #include <sys/ioctl.h>
 #include <linux/serial.h>
 #include <errno.h>
+#include <poll.h>
 #include "serial.h"
 #include "modbus.h"
+#include "transport.h"
 
-#define SERIAL_PORT_SPD_TBL_MAX 18
-static struct {
-	int baud;
+static const struct {
+	unsigned int baud;
 	speed_t ident;
-} serial_port_speed_table[SERIAL_PORT_SPD_TBL_MAX] = {
+} serial_port_speed_table[] = {
 {50, B50},
 {75, B75},
 {110, B110},
@@ -40,8 +43,50 @@ static struct {
 {38400, B38400},
 {57600, B57600},
 {115200, B115200},
-{230400, B230400}
+{230400, B230400},
+#ifdef B460800
+{460800, B460800},
+#endif
+#ifdef B500000
+{500000, B500000},
+#endif
+#ifdef B576000
+{576000, B576000},
+#endif
+#ifdef B921600
+{921600, B921600},
+#endif
+#ifdef B1000000
+{1000000, B1000000},
+#endif
+#ifdef B1152000
+{1152000, B1152000},
+#endif
+#ifdef B1500000
+{1500000, B1500000},
+#endif
+#ifdef B2000000
+{2000000, B2000000},
+#endif
+#ifdef B2500000
+{2500000, B2500000},
+#endif
+#ifdef B3000000
+{3000000, B3000000},
+#endif
+#ifdef B3500000
+{3500000, B3500000},
+#endif
+#ifdef B4000000
+{4000000, B4000000},
+#endif
 };
+/* Reads at least this long wait in the kernel for all their bytes, on a
+low-latency port */
+#define SERIAL_PORT_THRESHOLD_MIN 32
+
+#define SERIAL_PORT_SPD_TBL_MAX \
+	(sizeof(serial_port_speed_table) / sizeof(serial_port_speed_table[0]))
 
 /**
 \brief Get interface speed macro from integer speed
@@ -51,11 +96,11 @@ or -1 on error
 
 Converts an integer baud rate into one of the termios speed
 macros. If the baud rate specified is not found, an error is
-returned.
+returned, and the speed has to be set with serial_port_set_custom_speed().
 */
 static speed_t serial_port_get_speed(const unsigned int speed)
 {
-	int ctr;
+	unsigned int ctr;
 
 	for (ctr = 0; ctr < SERIAL_PORT_SPD_TBL_MAX; ctr++) {
 		if (speed == serial_port_speed_table[ctr].baud) {
@@ -65,23 +110,91 @@ static speed_t serial_port_get_speed(const unsigned int speed)
 	return -1;
 }
 
+/**
+\brief Set a USB serial adapter's latency timer to its minimum
+\param *device_name Unix device name for the serial port
+\return 0 on success, -1 if the adapter has no such timer, or it cannot be
+set
+
+FTDI adapters hold received bytes for up to the latency timer, 16 ms by
+default, before passing them to the host. The timer is a sysfs attribute of
+the USB device, and needs write permission on it.
+*/
+static int serial_port_set_latency_timer(const char *device_name)
+{
+	char real[PATH_MAX], path[PATH_MAX + 64], value[16];
+	const char *name;
+	FILE *fp;
+	int ok;
+
+	if (realpath(device_name, real) == NULL) {
+		return -1;
+	}
+	name = strrchr(real, '/') ? strrchr(real, '/') + 1 : real;
+	snprintf(path, sizeof(path), "/sys/class/tty/%s/device/latency_timer",
+	         name);
+	if ((fp = fopen(path, "r+")) == NULL) {
+		return -1;
+	}
+	ok = fputs("1", fp) >= 0 && fflush(fp) == 0;
+	rewind(fp);
+	ok = ok && fgets(value, sizeof(value), fp) && atoi(value) == 1;
+	fclose(fp);
+	return ok ? 0 : -1;
+}
+
+/**
+\brief Tune a serial port for the shortest reply latency
+\param fd Serial port
+\param *device_name Unix device name for the serial port
+\return The YAM_SERIAL_TUNED_* settings that took effect
+*/
+static unsigned int serial_port_low_latency(int fd, const char *device_name)
+{
+	struct serial_struct serial;
+	unsigned int tuning = YAM_SERIAL_TUNED_READ_THRESHOLD |
+	                      YAM_SERIAL_TUNED_DRAIN;
+
+	/* Have the driver pass received bytes on at once */
+	if (ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+		serial.flags |= ASYNC_LOW_LATENCY;
+		if (ioctl(fd, TIOCSSERIAL, &serial) == 0 &&
+		    ioctl(fd, TIOCGSERIAL, &serial) == 0 &&
+		    (serial.flags & ASYNC_LOW_LATENCY)) {
+			tuning |= YAM_SERIAL_TUNED_ASYNC_LOW_LATENCY;
+		}
+	}
+	if (serial_port_set_latency_timer(device_name) == 0) {
+		tuning |= YAM_SERIAL_TUNED_LATENCY_TIMER;
+	}
+	return tuning;
+}
+
 /**
 \brief Initialize serial port
 \param *device_name Unix device name for the serial port to open
 \param speed Speed at which to open port
 \param *port Pointer to the file descriptor for the serial port
+\param *tuning Set to the YAM_SERIAL_TUNED_* settings that took effect
 \return 0 on success, -1 on error
 
-The port is opened with 8N1 settings (8-bit, no parity, 1 stop bit)
+The port is opened with 8N1 settings (8-bit, no parity, 1 stop bit).
+Speeds that have no termios constant, such as 250000, are set through the
+Linux termios2 interface, if the driver can make them to within 2%.
+With YAM_SERIAL_FLAGS_LOW_LATENCY, the port is tuned as far as the driver
+allows.
 */
 int serial_port_init(const char *device_name,
 	unsigned int speed, unsigned int flags,
-	int *port)
+	int *port, unsigned int *tuning)
 {
 	struct termios term_st;
 
 	assert(device_name != NULL);
 	assert(port != NULL);
+	assert(tuning != NULL);
+
+	*tuning = 0;
 
 	*port = open(device_name, O_RDWR | O_NOCTTY);
 	if (*port < 0) {
@@ -92,6 +205,7 @@ int serial_port_init(const char *device_name,
 
 	if (tcgetattr(*port, &term_st)) {
 		perror("tcgetattr");
+		close(*port);
 		return -1;
 	}
 
@@ -100,13 +214,11 @@ int serial_port_init(const char *device_name,
 	status &= ~TIOCM_DTR;
 	ioctl(*port, TIOCMSET, &status);
 
-	/* Set interface speed */
-	{
-		int spd_macro = serial_port_get_speed(speed);
-		if (spd_macro == -1) return -1;
-		cfsetispeed(&term_st, spd_macro);
-		cfsetospeed(&term_st, spd_macro);
-	}
+	/* Set interface speed; any other speed is set once the rest is done,
+	and B38400 stands in for it until then */
+	speed_t spd_macro = serial_port_get_speed(speed);
+	cfsetispeed(&term_st, (spd_macro == (speed_t)-1) ? B38400 : spd_macro);
+	cfsetospeed(&term_st, (spd_macro == (speed_t)-1) ? B38400 : spd_macro);
 	/* Enable raw mode output */
 	cfmakeraw(&term_st);
 	term_st.c_oflag &= ~OPOST;
@@ -169,12 +281,22 @@ int serial_port_init(const char *device_name,
 
 	if (tcflush(*port, TCIOFLUSH)) {
 		perror("tcflush");
+		close(*port);
 		return -1;
 	}
 	if (tcsetattr(*port, TCSANOW, &term_st)) {
-		perror("tcgetattr");
+		perror("tcsetattr");
+		close(*port);
 		return -1;
 	}
+	if (spd_macro == (speed_t)-1 &&
+	    serial_port_set_custom_speed(*port, speed)) {
+		close(*port);
+		return -1;
+	}
+	if (flags & YAM_SERIAL_FLAGS_LOW_LATENCY) {
+		*tuning = serial_port_low_latency(*port, device_name);
+	}
 
 	ioctl(*port, TIOCMGET, &status);
 	status |= TIOCM_DTR;
@@ -193,3 +315,94 @@ void serial_port_flush(int fd)
 {
 	tcflush(fd, TCIOFLUSH);
 }
+
+static int serial_send(struct yam_modbus *bus, const uint8_t *buf, size_t len)
+{
+	int ret = write(bus->serial, buf, len);
+
+	/* Start the reply timeout once the request has left */
+	if (ret > 0 && (bus->serial_tuning & YAM_SERIAL_TUNED_DRAIN)) {
+		tcdrain(bus->serial);
+	}
+	return ret;
+}
+
+/*
+Reads len bytes, waiting in the kernel until they have all arrived, or the
+line has been quiet for a tenth of a second, rather than returning each
+piece the driver passes on.
+*/
+static int serial_read_threshold(int fd, uint8_t *buf, size_t len)
+{
+	struct termios term_st;
+	int ret;
+
+	if (tcgetattr(fd, &term_st)) {
+		return read(fd, buf, len);
+	}
+	term_st.c_cc[VMIN] = (len > 255) ? 255 : len;
+	term_st.c_cc[VTIME] = 1;
+	if (tcsetattr(fd, TCSANOW, &term_st)) {
+		return read(fd, buf, len);
+	}
+	ret = read(fd, buf, len);
+	term_st.c_cc[VMIN] = 0;
+	term_st.c_cc[VTIME] = 0;
+	tcsetattr(fd, TCSANOW, &term_st);
+	return ret;
+}
+
+/**
+\brief Wait for and read bytes from the serial port
+\param *bus The YAM object representing the Modbus
+\param *buf Location to store the bytes
+\param len Maximum number of bytes to read
+\param timeout_ms How long to wait for the first byte
+\return Number of bytes read, or 0 on timeout
+*/
+static int serial_recv(struct yam_modbus *bus, uint8_t *buf, size_t len,
+                       int timeout_ms)
+{
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = bus->serial;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	do {
+		ret = poll(&pfd, 1, timeout_ms);
+	} while ((ret == -1) && (errno == EINTR));
+	if (ret <= 0) {
+		return 0;
+	}
+
+	/* If read returns 0 bytes despite poll saying there's something to
+	read, we've timed out. */
+	if ((bus->serial_tuning & YAM_SERIAL_TUNED_READ_THRESHOLD) &&
+	    len >= SERIAL_PORT_THRESHOLD_MIN) {
+		ret = serial_read_threshold(bus->serial, buf, len);
+	}
+	else {
+		ret = read(bus->serial, buf, len);
+	}
+	return (ret < 0) ? 0 : ret;
+}
+
+static void serial_flush(struct yam_modbus *bus)
+{
+	serial_port_flush(bus->serial);
+}
+
+static void serial_close(struct yam_modbus *bus)
+{
+	close(bus->serial);
+}
+
+/** Transport for a bus opened on a local serial port */
+const struct yam_transport yam_serial_transport = {
+	.name = "serial",
+	.send = serial_send,
+	.recv = serial_recv,
+	.flush = serial_flush,
+	.close = serial_close,
+};
@@ -8,8 +8,9 @@
 
 int serial_port_init(const char *device_name,
 	unsigned int speed, unsigned int flags,
-	int *port);
+	int *port, unsigned int *tuning);
 void serial_port_flush(int fd);
+int serial_port_set_custom_speed(int fd, unsigned int speed);
 
 #define _YAM_SERIAL_H_
 
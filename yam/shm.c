@@ -0,0 +1,345 @@
+/**
+\file shm.c
+\brief Shared-memory register image, for sharing poll results between processes
+\author Jim George
+
+A publisher (the process polling the bus) creates a named POSIX shared-memory
+region laid out as blocks, each holding a range of one table of one slave, and
+writes every successful read into it. Any number of reader processes map the
+region read-only and take snapshots of it without system calls and without
+generating bus traffic.
+
+Each block is guarded by a sequence lock. The publisher makes the sequence
+number odd, updates the data and timestamp, then makes it even again; a
+reader copies the data and retries if the sequence number was odd or changed
+while it was copying. Readers never write to the region, so they cannot slow
+down the publisher or each other.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "modbus.h"
+#include "shm.h"
+
+/* Let a preempted publisher run after this many failed attempts */
+#define SHM_SPINS_BEFORE_YIELD 64
+/* Give up on a block whose publisher died in the middle of an update */
+#define SHM_SPIN_LIMIT 100000
+
+static size_t shm_elem_size(uint8_t table)
+{
+	return (table == YAM_TABLE_INPUTS || table == YAM_TABLE_REGISTERS) ?
+	       sizeof(uint16_t) : sizeof(uint8_t);
+}
+
+static int shm_def_cmp(const void *a, const void *b)
+{
+	const struct yam_shm_block_def *da = a, *db = b;
+
+	if (da->addr != db->addr) return da->addr - db->addr;
+	if (da->table != db->table) return da->table - db->table;
+	return da->start - db->start;
+}
+
+/**
+\brief Create a shared-memory region and map it for publishing
+\param *shm The handle to initialize
+\param *name Name of the region, as for shm_open() (e.g. "/yam-ttyS0")
+\param *defs Blocks to lay out in the region
+\param num_defs Number of blocks
+\return YAM_OK on success, or an error code
+
+An existing region of the same name is replaced by a new one. Readers that
+have the old region mapped keep it, unchanging, until they open the name
+again. Blocks are zero until the first read covering them is published, and
+have a timestamp of 0 until then.
+Attach the region to a bus with yam_set_shm().
+*/
+int yam_shm_create(struct yam_shm *shm, const char *name,
+                   const struct yam_shm_block_def *defs, int num_defs)
+{
+	struct yam_shm_block_def *sorted;
+	struct yam_shm_header *header;
+	size_t size;
+	uint32_t offset;
+	int fd, ctr;
+
+	bzero(shm, sizeof(struct yam_shm));
+	if (num_defs <= 0 || num_defs > YAM_SHM_MAX_BLOCKS) {
+		return YAM_TOO_MANY_REGISTERS;
+	}
+	for (ctr = 0; ctr < num_defs; ctr++) {
+		if (defs[ctr].table >= YAM_NUM_TABLES || defs[ctr].count == 0 ||
+		    defs[ctr].start + defs[ctr].count > 0x10000) {
+			return YAM_ILLEGAL_DATA_ADDR;
+		}
+	}
+
+	sorted = malloc(num_defs * sizeof(struct yam_shm_block_def));
+	if (sorted == NULL) {
+		return YAM_NO_MEMORY;
+	}
+	memcpy(sorted, defs, num_defs * sizeof(struct yam_shm_block_def));
+	qsort(sorted, num_defs, sizeof(struct yam_shm_block_def), shm_def_cmp);
+
+	/* Data follows the descriptors, each block 8-byte aligned */
+	size = sizeof(struct yam_shm_header) +
+	       num_defs * sizeof(struct yam_shm_block);
+	for (ctr = 0; ctr < num_defs; ctr++) {
+		size += (sorted[ctr].count * shm_elem_size(sorted[ctr].table) + 7) & ~7;
+	}
+
+	/* Truncating a region in place would pull it out from under its
+	readers, so they keep the old object and this one is made afresh */
+	if (shm_unlink(name) && errno != ENOENT) {
+		free(sorted);
+		return YAM_SHM_FAILED;
+	}
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		free(sorted);
+		return YAM_SHM_FAILED;
+	}
+	if (ftruncate(fd, size)) {
+		close(fd);
+		free(sorted);
+		return YAM_SHM_FAILED;
+	}
+	header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		free(sorted);
+		return YAM_SHM_FAILED;
+	}
+
+	header->version = YAM_SHM_VERSION;
+	header->size = size;
+	header->num_blocks = num_defs;
+	offset = sizeof(struct yam_shm_header) +
+	         num_defs * sizeof(struct yam_shm_block);
+	for (ctr = 0; ctr < num_defs; ctr++) {
+		struct yam_shm_block *block = &header->blocks[ctr];
+
+		block->addr = sorted[ctr].addr;
+		block->table = sorted[ctr].table;
+		block->start = sorted[ctr].start;
+		block->count = sorted[ctr].count;
+		block->offset = offset;
+		offset += (block->count * shm_elem_size(block->table) + 7) & ~7;
+		if (header->index[block->addr][block->table] == 0) {
+			header->index[block->addr][block->table] = ctr + 1;
+		}
+	}
+	free(sorted);
+	/* Readers ignore the region until the layout is complete */
+	__atomic_store_n(&header->magic, YAM_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	shm->header = header;
+	shm->size = size;
+	shm->writable = 1;
+	return YAM_OK;
+}
+
+/**
+\brief Map an existing shared-memory region for reading
+\param *shm The handle to initialize
+\param *name Name of the region, as given to yam_shm_create()
+\return YAM_OK on success, YAM_SHM_FAILED if there is no valid region
+*/
+int yam_shm_open(struct yam_shm *shm, const char *name)
+{
+	struct yam_shm_header *header;
+	struct stat st;
+	int fd;
+
+	bzero(shm, sizeof(struct yam_shm));
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		return YAM_SHM_FAILED;
+	}
+	if (fstat(fd, &st) || st.st_size < sizeof(struct yam_shm_header)) {
+		close(fd);
+		return YAM_SHM_FAILED;
+	}
+	header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		return YAM_SHM_FAILED;
+	}
+	if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != YAM_SHM_MAGIC ||
+	    header->version != YAM_SHM_VERSION || header->size > st.st_size) {
+		munmap(header, st.st_size);
+		return YAM_SHM_FAILED;
+	}
+
+	shm->header = header;
+	shm->size = st.st_size;
+	return YAM_OK;
+}
+
+/**
+\brief Unmap a shared-memory region
+\param *shm The handle
+
+The region itself stays in place for other processes; see yam_shm_unlink().
+*/
+void yam_shm_close(struct yam_shm *shm)
+{
+	if (shm->header) {
+		munmap(shm->header, shm->size);
+	}
+	shm->header = NULL;
+}
+
+/**
+\brief Remove a shared-memory region
+\param *name Name of the region
+\return YAM_OK on success, YAM_SHM_FAILED on failure
+
+Processes that have the region mapped keep their mapping.
+*/
+int yam_shm_unlink(const char *name)
+{
+	return shm_unlink(name) ? YAM_SHM_FAILED : YAM_OK;
+}
+
+/**
+\brief Write values read from a slave into the region
+\param *shm The handle, from yam_shm_create()
+\param addr Slave address
+\param table YAM_TABLE_COILS, YAM_TABLE_REGISTERS etc.
+\param start_addr Address of the first value
+\param count Number of values
+\param *data Values, as returned by yam_read_coils() or yam_read_registers()
+
+Every block that overlaps the range is updated with the overlapping part, and
+timestamped. Values outside all blocks are ignored. This is called by the read
+functions of a bus the region is attached to, but may also be called directly.
+*/
+void yam_shm_publish(struct yam_shm *shm, uint8_t addr, uint8_t table,
+                     uint16_t start_addr, uint16_t count, const void *data)
+{
+	struct yam_shm_header *header = shm->header;
+	struct timespec now;
+	uint32_t seq;
+	int idx;
+
+	if (header == NULL || !shm->writable || table >= YAM_NUM_TABLES ||
+	    header->index[addr][table] == 0) {
+		return;
+	}
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	size_t elem = shm_elem_size(table);
+	uint32_t end = start_addr + count;
+	for (idx = header->index[addr][table] - 1; idx < header->num_blocks; idx++) {
+		struct yam_shm_block *block = &header->blocks[idx];
+		uint32_t first, last;
+
+		if (block->addr != addr || block->table != table) {
+			break;
+		}
+		first = (start_addr > block->start) ? start_addr : block->start;
+		last = block->start + block->count;
+		if (end < last) last = end;
+		if (first >= last) {
+			continue;
+		}
+
+		/* Take the block; the odd count also locks out other publishers */
+		do {
+			seq = __atomic_load_n(&block->seq, __ATOMIC_RELAXED);
+		} while ((seq & 1) || !__atomic_compare_exchange_n(&block->seq,
+		         &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+
+		memcpy((uint8_t *)header + block->offset + (first - block->start) * elem,
+		       (const uint8_t *)data + (first - start_addr) * elem,
+		       (last - first) * elem);
+		block->timestamp_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+		__atomic_store_n(&block->seq, seq + 2, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+\brief Take a consistent copy of values from the region
+\param *shm The handle, from yam_shm_open() or yam_shm_create()
+\param addr Slave address
+\param table YAM_TABLE_COILS, YAM_TABLE_REGISTERS etc.
+\param start_addr Address of the first value
+\param count Number of values
+\param *data Location to store the values: one byte per coil or discrete
+(0x00/0xFF), host-order uint16_t per register
+\param *timestamp_ns If not NULL, receives the time of the last update of the
+block, in nanoseconds since the epoch (0 if it was never updated)
+\return YAM_OK on success, YAM_ILLEGAL_DATA_ADDR if no single block holds the
+whole range, YAM_SHM_FAILED if the block stays locked
+
+The values come from a single update of a single block, so they are
+consistent with each other.
+*/
+int yam_shm_snapshot(struct yam_shm *shm, uint8_t addr, uint8_t table,
+                     uint16_t start_addr, uint16_t count, void *data,
+                     uint64_t *timestamp_ns)
+{
+	struct yam_shm_header *header = shm->header;
+	struct yam_shm_block *block = NULL;
+	uint32_t seq1, seq2 = 0;
+	uint64_t ts = 0;
+	int idx, spins = 0;
+
+	if (header == NULL || table >= YAM_NUM_TABLES ||
+	    header->index[addr][table] == 0) {
+		return YAM_ILLEGAL_DATA_ADDR;
+	}
+	for (idx = header->index[addr][table] - 1; idx < header->num_blocks; idx++) {
+		struct yam_shm_block *b = &header->blocks[idx];
+
+		if (b->addr != addr || b->table != table) {
+			break;
+		}
+		if (b->start <= start_addr &&
+		    start_addr + count <= b->start + b->count) {
+			block = b;
+			break;
+		}
+	}
+	if (block == NULL) {
+		return YAM_ILLEGAL_DATA_ADDR;
+	}
+
+	size_t elem = shm_elem_size(table);
+	const uint8_t *src = (const uint8_t *)header + block->offset +
+	                     (start_addr - block->start) * elem;
+	do {
+		if (++spins > SHM_SPIN_LIMIT) {
+			return YAM_SHM_FAILED;
+		}
+		if (spins % SHM_SPINS_BEFORE_YIELD == 0) {
+			sched_yield();
+		}
+		seq1 = __atomic_load_n(&block->seq, __ATOMIC_ACQUIRE);
+		if (seq1 & 1) {
+			continue;
+		}
+		memcpy(data, src, count * elem);
+		ts = block->timestamp_ns;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		seq2 = __atomic_load_n(&block->seq, __ATOMIC_RELAXED);
+	} while ((seq1 & 1) || seq1 != seq2);
+
+	if (timestamp_ns) {
+		*timestamp_ns = ts;
+	}
+	return YAM_OK;
+}
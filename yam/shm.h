@@ -0,0 +1,88 @@
+/**
+\file shm.h
+\brief Include file for the YAM shared-memory register image
+\author Jim George
+*/
+
+#ifndef _YAM_SHM_H_
+#define _YAM_SHM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "image.h"
+
+/** Identifies a YAM shared-memory region ("YAMS") */
+#define YAM_SHM_MAGIC 0x59414D53
+/** Layout version, bumped when the region layout changes */
+#define YAM_SHM_VERSION 1
+/** Maximum number of blocks in a region */
+#define YAM_SHM_MAX_BLOCKS 4096
+
+/**
+\brief Block of a shared-memory region, as requested by the publisher
+
+Each block holds one contiguous range of one table of one slave.
+*/
+struct yam_shm_block_def {
+	uint8_t addr; /**< Slave address */
+	uint8_t table; /**< YAM_TABLE_COILS, YAM_TABLE_REGISTERS etc. */
+	uint16_t start; /**< First address held by the block */
+	uint16_t count; /**< Number of coils or registers held by the block */
+};
+
+/**
+\brief Block descriptor, as stored in the region
+
+seq is a sequence lock: it is odd while the publisher is updating the block,
+and advances by two with every update.
+*/
+struct yam_shm_block {
+	uint32_t seq; /**< Sequence lock */
+	uint8_t addr; /**< Slave address */
+	uint8_t table; /**< Register table */
+	uint16_t start; /**< First address held by the block */
+	uint16_t count; /**< Number of coils or registers held by the block */
+	uint16_t reserved;
+	uint32_t offset; /**< Offset of the data from the start of the region */
+	uint64_t timestamp_ns; /**< CLOCK_REALTIME of the last update, 0 if never */
+	uint32_t reserved2[2];
+};
+
+/**
+\brief Header at the start of a shared-memory region
+
+Blocks are sorted by slave address and table, so all the blocks of one
+slave table are adjacent, starting at the one named by index.
+*/
+struct yam_shm_header {
+	uint32_t magic; /**< YAM_SHM_MAGIC, written last by the publisher */
+	uint32_t version; /**< YAM_SHM_VERSION */
+	uint32_t size; /**< Size of the region in bytes */
+	uint32_t num_blocks; /**< Number of block descriptors */
+	uint16_t index[256][YAM_NUM_TABLES]; /**< First block + 1 of each slave
+	                                          table, 0 if it has none */
+	struct yam_shm_block blocks[]; /**< Block descriptors */
+};
+
+/**
+\brief Handle on a mapped shared-memory region
+*/
+struct yam_shm {
+	struct yam_shm_header *header; /**< Start of the mapping */
+	size_t size; /**< Size of the mapping */
+	int writable; /**< Nonzero for the publisher's mapping */
+};
+
+int yam_shm_create(struct yam_shm *shm, const char *name,
+                   const struct yam_shm_block_def *defs, int num_defs);
+int yam_shm_open(struct yam_shm *shm, const char *name);
+void yam_shm_close(struct yam_shm *shm);
+int yam_shm_unlink(const char *name);
+
+void yam_shm_publish(struct yam_shm *shm, uint8_t addr, uint8_t table,
+                     uint16_t start_addr, uint16_t count, const void *data);
+int yam_shm_snapshot(struct yam_shm *shm, uint8_t addr, uint8_t table,
+                     uint16_t start_addr, uint16_t count, void *data,
+                     uint64_t *timestamp_ns);
+
+#endif /* _YAM_SHM_H_ */
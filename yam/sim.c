@@ -0,0 +1,372 @@
+/**
+\file sim.c
+\brief Simulated Modbus/RTU slaves on a pseudo-terminal
+\author Jim George
+
+The simulator owns the master side of a pseudo-terminal, and the library
+under test opens the slave side as if it were a serial port. Requests are
+framed by their function code where the length can be predicted, and by a
+silence of 3.5 characters otherwise; bytes that make no sense are dropped
+at the next silence, as a real slave resynchronizes.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+#include <termios.h>
+
+#include "modbus.h"
+#include "image.h"
+#include "transport.h"
+#include "sim.h"
+
+/* Longest the simulator waits before checking whether it was stopped */
+#define SIM_POLL_MS 100
+
+static void sim_sleep_us(uint64_t us)
+{
+	struct timespec ts;
+
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+/* Time to send one character at the emulated speed (11 bits), 0 if none */
+static uint64_t sim_char_us(struct yam_sim *sim)
+{
+	return sim->baudrate ? 11000000ULL / sim->baudrate : 0;
+}
+
+/*
+Length of the request at the start of buf, 0 if more bytes are needed to
+tell, or -1 if it cannot be predicted from the function code.
+*/
+static int sim_request_len(const uint8_t *buf, int len)
+{
+	if (len < 2) {
+		return 0;
+	}
+	switch (buf[1]) {
+	case YAM_READ_COILS:
+	case YAM_READ_DISCRETES:
+	case YAM_READ_REGISTERS:
+	case YAM_READ_INPUTS:
+	case YAM_WRITE_SINGLECOIL:
+	case YAM_WRITE_SINGLEREGISTER:
+		return 8;
+	case YAM_READ_EXCEPTIONSTATUS:
+	case YAM_REPORTSLAVEID:
+		return 4;
+	case YAM_WRITE_COILS:
+	case YAM_WRITE_REGISTERS:
+		return (len < 7) ? 0 : 9 + buf[6];
+	default:
+		return -1;
+	}
+}
+
+static int sim_draw(struct yam_sim *sim, unsigned int permille)
+{
+	return permille && (unsigned int)(rand_r(&sim->seed) % 1000) < permille;
+}
+
+/**
+\brief Answer one request frame
+\param *sim The simulator
+\param *req Request ADU, CRC included
+\param len Length of the request
+\param *resp Buffer for the reply ADU, YAM_MODBUS_MAX_ADU_LEN bytes
+\return Length of the reply, 0 if none is to be sent
+
+Applies the request to the addressed slave's image and draws its faults, as
+the simulator does for frames arriving on its terminal, but leaves the
+latency and line speed to the caller. This is the slave engine behind
+yam_sim_run() and the loopback transport (see loopback.h).
+*/
+int yam_sim_process(struct yam_sim *sim, const uint8_t *req, int len,
+                    uint8_t *resp)
+{
+	assert(sim != NULL);
+	assert(req != NULL);
+	assert(resp != NULL);
+
+	struct yam_sim_slave *slave;
+	uint16_t crc;
+	int resp_len, addr;
+
+	if (len < 4 || yam_crc16(req, len) != 0) {
+		sim->stats.ignored++;
+		return 0;
+	}
+
+	if (req[0] == 0) {
+		/* Broadcasts go to every slave, and nobody replies */
+		sim->stats.broadcasts++;
+		for (addr = 1; addr <= YAM_MAX_SLAVE_ADDR; addr++) {
+			if (sim->slaves[addr].image) {
+				yam_image_process(sim->slaves[addr].image, &req[1], len - 3,
+				                  resp);
+			}
+		}
+		return 0;
+	}
+	slave = &sim->slaves[req[0]];
+	if (slave->image == NULL) {
+		sim->stats.ignored++;
+		return 0;
+	}
+	sim->stats.requests++;
+
+	if (sim_draw(sim, slave->drop_permille)) {
+		sim->stats.dropped++;
+		return 0;
+	}
+	resp[0] = req[0];
+	if (sim_draw(sim, slave->busy_permille)) {
+		sim->stats.busy++;
+		resp[1] = req[1] | 0x80;
+		resp[2] = -YAM_SLAVE_BUSY;
+		resp_len = 3;
+	}
+	else {
+		resp_len = 1 + yam_image_process(slave->image, &req[1], len - 3,
+		                                 &resp[1]);
+	}
+	crc = yam_crc16(resp, resp_len);
+	resp[resp_len++] = crc >> 8;
+	resp[resp_len++] = crc & 0xFF;
+	if (sim_draw(sim, slave->corrupt_permille)) {
+		sim->stats.corrupted++;
+		resp[resp_len - 1] ^= 0xFF;
+	}
+
+	return resp_len;
+}
+
+/* Answers one request frame received on the terminal */
+static void sim_frame(struct yam_sim *sim, const uint8_t *req, int len)
+{
+	uint8_t resp[YAM_MODBUS_MAX_ADU_LEN];
+	int resp_len;
+
+	if ((resp_len = yam_sim_process(sim, req, len, resp)) == 0) {
+		return;
+	}
+	/* The reply is complete once it would have gone down the line */
+	sim_sleep_us(sim->slaves[req[0]].latency_us +
+	             resp_len * sim_char_us(sim));
+	if (write(sim->master_fd, resp, resp_len) == resp_len) {
+		sim->stats.replies++;
+	}
+}
+
+/**
+\brief Initialize a simulator without a terminal
+\param *sim The simulator to initialize
+\param seed Seed of the fault generator, so that runs can be repeated
+
+Such a simulator only answers requests handed to yam_sim_process(), as the
+loopback transport does (see yam_modbus_loopback()).
+*/
+void yam_sim_init_engine(struct yam_sim *sim, unsigned int seed)
+{
+	assert(sim != NULL);
+
+	bzero(sim, sizeof(struct yam_sim));
+	sim->master_fd = -1;
+	sim->slave_fd = -1;
+	sim->seed = seed;
+}
+
+/**
+\brief Open the pseudo-terminal of a simulator
+\param *sim The simulator to initialize
+\param baudrate Line speed emulated for replies, or 0 to reply at once
+\param seed Seed of the fault generator, so that runs can be repeated
+\return YAM_OK on success, YAM_SERIAL_INIT_FAILED on failure
+
+Add slaves with yam_sim_add_slave(), then run the simulator with
+yam_sim_run() or yam_sim_start(), and open sim->path with yam_modbus_init().
+*/
+int yam_sim_init(struct yam_sim *sim, unsigned int baudrate, unsigned int seed)
+{
+	assert(sim != NULL);
+
+	struct termios tio;
+
+	yam_sim_init_engine(sim, seed);
+	sim->baudrate = baudrate;
+
+	sim->master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (sim->master_fd < 0) {
+		return YAM_SERIAL_INIT_FAILED;
+	}
+	if (grantpt(sim->master_fd) || unlockpt(sim->master_fd) ||
+	    ptsname_r(sim->master_fd, sim->path, sizeof(sim->path))) {
+		yam_sim_close(sim);
+		return YAM_SERIAL_INIT_FAILED;
+	}
+
+	/* Holding the slave side open keeps the master readable between
+	clients, and lets it be made raw before anybody writes to it */
+	sim->slave_fd = open(sim->path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (sim->slave_fd < 0 || tcgetattr(sim->slave_fd, &tio)) {
+		yam_sim_close(sim);
+		return YAM_SERIAL_INIT_FAILED;
+	}
+	cfmakeraw(&tio);
+	tcsetattr(sim->slave_fd, TCSANOW, &tio);
+
+	return YAM_OK;
+}
+
+/**
+\brief Add a simulated slave
+\param *sim The simulator
+\param addr Slave address (1 to YAM_MAX_SLAVE_ADDR)
+\param *slave Register image, latency and faults of the slave (copied)
+\return YAM_OK on success, YAM_ILLEGAL_DATA_VALUE for an invalid address
+
+Slaves must be added before the simulator runs.
+*/
+int yam_sim_add_slave(struct yam_sim *sim, uint8_t addr,
+                      const struct yam_sim_slave *slave)
+{
+	assert(sim != NULL);
+	assert(slave != NULL);
+
+	if (addr == 0 || addr > YAM_MAX_SLAVE_ADDR) {
+		return YAM_ILLEGAL_DATA_VALUE;
+	}
+	sim->slaves[addr] = *slave;
+
+	return YAM_OK;
+}
+
+/**
+\brief Answer requests until the simulator is stopped
+\param *sim The simulator
+\return YAM_OK once stopped, YAM_SERIAL_INIT_FAILED if the terminal fails
+*/
+int yam_sim_run(struct yam_sim *sim)
+{
+	assert(sim != NULL);
+
+	uint8_t buf[2 * YAM_MODBUS_MAX_ADU_LEN];
+	struct pollfd pfd = {sim->master_fd, POLLIN, 0};
+	int len = 0, frame_len, ret, gap_ms;
+
+	gap_ms = (3.5 * sim_char_us(sim) + 999) / 1000;
+	if (gap_ms < YAM_SIM_MIN_GAP_US / 1000) {
+		gap_ms = YAM_SIM_MIN_GAP_US / 1000;
+	}
+
+	while (!sim->stop) {
+		ret = poll(&pfd, 1, len ? gap_ms : SIM_POLL_MS);
+		if (ret < 0 && errno != EINTR) {
+			return YAM_SERIAL_INIT_FAILED;
+		}
+		if (ret <= 0) {
+			/* A silence ends whatever frame was being received */
+			if (len) {
+				if (sim_request_len(buf, len) < 0) {
+					sim_frame(sim, buf, len);
+				}
+				else {
+					sim->stats.ignored++;
+				}
+				len = 0;
+			}
+			continue;
+		}
+
+		ret = read(sim->master_fd, &buf[len], sizeof(buf) - len);
+		if (ret <= 0) {
+			continue;
+		}
+		len += ret;
+
+		/* Answer every complete request received so far */
+		while ((frame_len = sim_request_len(buf, len)) > 0 &&
+		       frame_len <= len) {
+			sim_frame(sim, buf, frame_len);
+			len -= frame_len;
+			memmove(buf, &buf[frame_len], len);
+		}
+		if (len == sizeof(buf)) {
+			sim->stats.ignored++;
+			len = 0;
+		}
+	}
+
+	return YAM_OK;
+}
+
+static void *sim_thread(void *arg)
+{
+	yam_sim_run(arg);
+	return NULL;
+}
+
+/**
+\brief Run the simulator in a thread of its own
+\param *sim The simulator
+\return YAM_OK on success, YAM_NO_MEMORY if the thread cannot be created
+*/
+int yam_sim_start(struct yam_sim *sim)
+{
+	assert(sim != NULL);
+
+	sim->stop = 0;
+	if (pthread_create(&sim->thread, NULL, sim_thread, sim)) {
+		return YAM_NO_MEMORY;
+	}
+	sim->running = 1;
+
+	return YAM_OK;
+}
+
+/**
+\brief Make yam_sim_run() return
+\param *sim The simulator
+
+Safe to call from a signal handler. The simulator notices within
+100 milliseconds.
+*/
+void yam_sim_stop(struct yam_sim *sim)
+{
+	sim->stop = 1;
+}
+
+/**
+\brief Stop the simulator and close its pseudo-terminal
+\param *sim The simulator
+*/
+void yam_sim_close(struct yam_sim *sim)
+{
+	assert(sim != NULL);
+
+	if (sim->running) {
+		yam_sim_stop(sim);
+		pthread_join(sim->thread, NULL);
+		sim->running = 0;
+	}
+	if (sim->slave_fd >= 0) {
+		close(sim->slave_fd);
+		sim->slave_fd = -1;
+	}
+	if (sim->master_fd >= 0) {
+		close(sim->master_fd);
+		sim->master_fd = -1;
+	}
+}
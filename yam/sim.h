@@ -0,0 +1,85 @@
+/**
+\file sim.h
+\brief Include file for the YAM pseudo-terminal slave simulator
+\author Jim George
+*/
+
+#ifndef _YAM_SIM_H_
+#define _YAM_SIM_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "modbus.h"
+#include "image.h"
+
+/** Longest name of the simulator's terminal */
+#define YAM_SIM_MAX_PATH 64
+/** Shortest silence that ends a frame whose length cannot be predicted,
+in microseconds */
+#define YAM_SIM_MIN_GAP_US 2000
+
+/**
+\brief A simulated slave
+
+Faults are drawn independently for each request, in parts per thousand.
+*/
+struct yam_sim_slave {
+	struct yam_image *image; /**< Register map, NULL if there is no slave at
+	                              this address; slaves may share an image */
+	unsigned int latency_us; /**< Time taken to start replying */
+	unsigned int drop_permille; /**< Requests left unanswered */
+	unsigned int corrupt_permille; /**< Replies sent with a bad CRC */
+	unsigned int busy_permille; /**< Requests answered with a Slave Device
+	                                 Busy exception */
+};
+
+/**
+\brief Counters of a simulator
+
+Updated by the thread running the simulator.
+*/
+struct yam_sim_stats {
+	uint64_t requests; /**< Good requests addressed to a simulated slave */
+	uint64_t broadcasts; /**< Broadcast requests */
+	uint64_t replies; /**< Replies sent */
+	uint64_t dropped; /**< Requests left unanswered on purpose */
+	uint64_t corrupted; /**< Replies sent with a bad CRC on purpose */
+	uint64_t busy; /**< Busy exceptions sent on purpose */
+	uint64_t ignored; /**< Frames with a bad CRC, or for absent slaves */
+};
+
+/**
+\brief The YAM slave simulator
+
+Emulates a bus of slaves on a pseudo-terminal, so that a master can be run
+and tested without hardware: pass path to yam_modbus_init() (the baud rate
+and flags given there are accepted but make no difference). Each request is
+answered from the slave's register image with yam_image_process(), as
+yam-gateway's images are.
+*/
+struct yam_sim {
+	int master_fd; /**< Master side of the pseudo-terminal */
+	int slave_fd; /**< Slave side, kept open between clients */
+	char path[YAM_SIM_MAX_PATH]; /**< Path of the slave side */
+	unsigned int baudrate; /**< Line speed emulated for replies, 0 for no
+	                            limit */
+	unsigned int seed; /**< State of the fault generator */
+	struct yam_sim_slave slaves[YAM_MAX_SLAVE_ADDR + 1]; /**< Slaves */
+	struct yam_sim_stats stats; /**< Counters */
+	pthread_t thread; /**< Thread started by yam_sim_start() */
+	int running; /**< Nonzero while that thread runs */
+	volatile int stop; /**< Set nonzero to make the simulator return */
+};
+
+int yam_sim_init(struct yam_sim *sim, unsigned int baudrate, unsigned int seed);
+void yam_sim_init_engine(struct yam_sim *sim, unsigned int seed);
+int yam_sim_add_slave(struct yam_sim *sim, uint8_t addr,
+                      const struct yam_sim_slave *slave);
+int yam_sim_run(struct yam_sim *sim);
+int yam_sim_start(struct yam_sim *sim);
+void yam_sim_stop(struct yam_sim *sim);
+void yam_sim_close(struct yam_sim *sim);
+int yam_sim_process(struct yam_sim *sim, const uint8_t *req, int len,
+                    uint8_t *resp);
+
+#endif /* _YAM_SIM_H_ */
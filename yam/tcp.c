@@ -0,0 +1,697 @@
+/**
+\file tcp.c
+\brief Modbus/TCP server.
+\author Jim George
+
+This module accepts Modbus/TCP clients and answers their requests through a
+handler, normally a register image. Each server object is one
+single-threaded epoll loop. Requests are pipelined: every complete frame in
+the receive buffer is answered before the loop goes back to epoll, and the
+replies are gathered into a single vectored write.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "modbus.h"
+#include "image.h"
+#include "tcp.h"
+
+#define TCP_RBUF_LEN 4096
+#define TCP_EPOLL_EVENTS 64
+
+/* A reply waiting to be written: MBAP header and PDU */
+struct tcp_reply {
+	uint8_t mbap[YAM_TCP_MBAP_LEN];
+	uint8_t pdu[YAM_MODBUS_MAX_PDU_LEN];
+	int pdu_len;
+};
+
+/* One client connection */
+struct yam_tcp_conn {
+	int fd;
+	struct yam_tcp_conn *next, *prev;
+	uint32_t events; /* Events currently registered with epoll */
+	int deferred; /* Replies still owed by the handler */
+	int closed; /* Socket closed, waiting for deferred replies to drain */
+	size_t rlen; /* Bytes held in rbuf */
+	size_t wlen, woff; /* Unsent bytes of a partially written batch */
+	uint8_t rbuf[TCP_RBUF_LEN];
+	uint8_t wbuf[(YAM_TCP_MAX_BATCH + YAM_TCP_MAX_DEFERRED) *
+	             YAM_TCP_MAX_FRAME_LEN];
+	struct tcp_reply replies[YAM_TCP_MAX_BATCH];
+};
+
+/**
+\brief Initialize a Modbus/TCP server
+\param *srv The server object
+\param *bind_addr Local address to listen on, or NULL for all addresses
+\param port TCP port to listen on (normally YAM_TCP_DEFAULT_PORT)
+\param flags YAM_TCP_FLAGS_* options
+\return YAM_OK on success, YAM_SOCKET_FAILED on failure
+
+Creates the listening socket and the epoll instance. No handler is
+installed; use yam_tcp_server_set_image() or yam_tcp_server_set_handler()
+before running the server.
+*/
+int yam_tcp_server_init(struct yam_tcp_server *srv, const char *bind_addr,
+                        uint16_t port, unsigned int flags)
+{
+	assert(srv != NULL);
+
+	struct addrinfo hints, *res;
+	char portstr[8];
+	int one = 1;
+
+	bzero(srv, sizeof(struct yam_tcp_server));
+	srv->listen_fd = srv->epoll_fd = srv->wake_fd = -1;
+	srv->max_conns = YAM_TCP_DEFAULT_MAX_CONNS;
+	int ctr;
+	for (ctr = 0; ctr < YAM_TCP_MAX_WATCHES; ctr++) {
+		srv->watches[ctr].fd = -1;
+	}
+
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	snprintf(portstr, sizeof(portstr), "%u", port);
+	if (getaddrinfo(bind_addr, portstr, &hints, &res)) {
+		return YAM_SOCKET_FAILED;
+	}
+
+	srv->listen_fd = socket(res->ai_family,
+	                        res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	                        res->ai_protocol);
+	if (srv->listen_fd < 0) {
+		freeaddrinfo(res);
+		return YAM_SOCKET_FAILED;
+	}
+	setsockopt(srv->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (flags & YAM_TCP_FLAGS_REUSEPORT) {
+		setsockopt(srv->listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+	}
+	if (bind(srv->listen_fd, res->ai_addr, res->ai_addrlen) ||
+	    listen(srv->listen_fd, SOMAXCONN)) {
+		freeaddrinfo(res);
+		goto fail;
+	}
+	freeaddrinfo(res);
+
+	srv->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	srv->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (srv->epoll_fd < 0 || srv->wake_fd < 0) {
+		goto fail;
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &srv->listen_fd;
+	if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, srv->listen_fd, &ev)) {
+		goto fail;
+	}
+	ev.data.ptr = &srv->wake_fd;
+	if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, srv->wake_fd, &ev)) {
+		goto fail;
+	}
+
+	return YAM_OK;
+
+fail:
+	yam_tcp_server_close(srv);
+	return YAM_SOCKET_FAILED;
+}
+
+/**
+\brief Install a request handler
+\param *srv The server object
+\param handler Function called for every request
+\param *arg Opaque pointer passed to the handler
+
+The handler is called from the server loop, once per request, in the order
+the requests arrive on each connection.
+*/
+void yam_tcp_server_set_handler(struct yam_tcp_server *srv,
+                                yam_tcp_handler handler, void *arg)
+{
+	assert(srv != NULL);
+	srv->handler = handler;
+	srv->handler_arg = arg;
+}
+
+/**
+\brief Serve a register image
+\param *srv The server object
+\param *image Register image to answer requests from
+
+Requests for any unit identifier are answered from the image. The image may
+be shared between several servers, and updated at any time by the
+application.
+*/
+void yam_tcp_server_set_image(struct yam_tcp_server *srv,
+                              struct yam_image *image)
+{
+	yam_tcp_server_set_handler(srv, yam_tcp_image_handler, image);
+}
+
+/**
+\brief Request handler answering from a register image
+\param *arg The struct yam_image to answer from
+\param unit Unit identifier (ignored)
+\param *req_pdu Request PDU
+\param req_len Length of the request PDU
+\param *resp_pdu Buffer for the response PDU
+\return Length of the response PDU
+
+Exported so that custom handlers can fall back on it.
+*/
+int yam_tcp_image_handler(void *arg, uint8_t unit, const uint8_t *req_pdu,
+                          int req_len, uint8_t *resp_pdu)
+{
+	return yam_image_process((struct yam_image *)arg, req_pdu, req_len,
+	                         resp_pdu);
+}
+
+/*
+Queues a closed connection for freeing. Memory is only released once the
+current batch of epoll events has been dispatched, since later events in
+the batch may still refer to it.
+*/
+static void tcp_conn_release(struct yam_tcp_server *srv,
+                             struct yam_tcp_conn *conn)
+{
+	conn->next = srv->dead;
+	srv->dead = conn;
+}
+
+/*
+Closes a connection. If the handler still owes it replies, the memory is
+kept until the last one has been delivered to yam_tcp_server_reply().
+*/
+static void tcp_conn_close(struct yam_tcp_server *srv, struct yam_tcp_conn *conn)
+{
+	epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	if (conn->prev) conn->prev->next = conn->next;
+	else srv->conns = conn->next;
+	if (conn->next) conn->next->prev = conn->prev;
+	srv->num_conns--;
+	conn->closed = 1;
+	if (conn->deferred == 0) tcp_conn_release(srv, conn);
+}
+
+/*
+Registers the events the connection is ready for: draining queued replies
+takes priority, and reading stops while too many replies are outstanding.
+*/
+static void tcp_conn_watch(struct yam_tcp_server *srv,
+                           struct yam_tcp_conn *conn)
+{
+	struct epoll_event ev;
+
+	if (conn->wlen) {
+		ev.events = EPOLLOUT;
+	}
+	else if (conn->deferred >= YAM_TCP_MAX_DEFERRED ||
+	         conn->rlen == TCP_RBUF_LEN) {
+		ev.events = 0;
+	}
+	else {
+		ev.events = EPOLLIN;
+	}
+	if (ev.events == conn->events) return;
+	conn->events = ev.events;
+	ev.data.ptr = conn;
+	epoll_ctl(srv->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/*
+Writes out the first num_replies reply slots with a single call. Whatever
+the socket does not accept is copied to the connection's write buffer.
+Returns -1 if the connection failed.
+*/
+static int tcp_conn_send(struct yam_tcp_server *srv, struct yam_tcp_conn *conn,
+                         int num_replies)
+{
+	struct iovec iov[2 * YAM_TCP_MAX_BATCH];
+	struct msghdr msg;
+	size_t total = 0;
+	ssize_t ret;
+	int ctr;
+
+	for (ctr = 0; ctr < num_replies; ctr++) {
+		iov[2 * ctr].iov_base = conn->replies[ctr].mbap;
+		iov[2 * ctr].iov_len = YAM_TCP_MBAP_LEN;
+		iov[2 * ctr + 1].iov_base = conn->replies[ctr].pdu;
+		iov[2 * ctr + 1].iov_len = conn->replies[ctr].pdu_len;
+		total += YAM_TCP_MBAP_LEN + conn->replies[ctr].pdu_len;
+	}
+
+	/* sendmsg() rather than writev(), so a vanished client can't raise SIGPIPE */
+	bzero(&msg, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2 * num_replies;
+	do {
+		ret = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+	} while ((ret == -1) && (errno == EINTR));
+	if (ret < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+		ret = 0;
+	}
+	if (ret == total) return 0;
+
+	/* Short write, keep the remainder until the socket drains */
+	for (ctr = 0; ctr < 2 * num_replies; ctr++) {
+		if (ret >= iov[ctr].iov_len) {
+			ret -= iov[ctr].iov_len;
+			continue;
+		}
+		memcpy(&conn->wbuf[conn->wlen], (uint8_t *)iov[ctr].iov_base + ret,
+		       iov[ctr].iov_len - ret);
+		conn->wlen += iov[ctr].iov_len - ret;
+		ret = 0;
+	}
+	return 0;
+}
+
+/*
+Answers every complete request in the receive buffer. Stops early if a
+previous batch is still being written, or if the handler owes too many
+replies. Returns -1 on a protocol error.
+*/
+static int tcp_conn_process(struct yam_tcp_server *srv,
+                            struct yam_tcp_conn *conn)
+{
+	size_t off = 0;
+	int num_replies = 0;
+
+	while ((conn->wlen == 0) && (conn->deferred < YAM_TCP_MAX_DEFERRED) &&
+	       (conn->rlen - off >= YAM_TCP_MBAP_LEN)) {
+		uint8_t *frame = &conn->rbuf[off];
+		uint16_t proto = (frame[2] << 8) | frame[3];
+		uint16_t len = (frame[4] << 8) | frame[5];
+
+		/* Length covers the unit identifier and the PDU */
+		if (proto != 0 || len < 2 || len > YAM_MODBUS_MAX_PDU_LEN + 1) {
+			return -1;
+		}
+		if (conn->rlen - off < 6 + len) break;
+
+		struct tcp_reply *reply = &conn->replies[num_replies];
+		reply->pdu_len = 0;
+		if (srv->handler) {
+			srv->cur_conn = conn;
+			srv->cur_frame = frame;
+			reply->pdu_len = srv->handler(srv->handler_arg, frame[6],
+			                              &frame[YAM_TCP_MBAP_LEN], len - 1,
+			                              reply->pdu);
+			srv->cur_conn = NULL;
+		}
+		if (reply->pdu_len > 0) {
+			/* Transaction ID, protocol ID and unit are echoed back */
+			memcpy(reply->mbap, frame, 4);
+			reply->mbap[4] = (reply->pdu_len + 1) >> 8;
+			reply->mbap[5] = (reply->pdu_len + 1) & 0x00FF;
+			reply->mbap[6] = frame[6];
+			num_replies++;
+		}
+		off += 6 + len;
+
+		if (num_replies == YAM_TCP_MAX_BATCH) {
+			if (tcp_conn_send(srv, conn, num_replies)) return -1;
+			num_replies = 0;
+		}
+	}
+	if (num_replies && tcp_conn_send(srv, conn, num_replies)) {
+		return -1;
+	}
+
+	/* Keep any partial frame for the next read */
+	if (off) {
+		memmove(conn->rbuf, &conn->rbuf[off], conn->rlen - off);
+		conn->rlen -= off;
+	}
+	tcp_conn_watch(srv, conn);
+	return 0;
+}
+
+static void tcp_conn_readable(struct yam_tcp_server *srv,
+                              struct yam_tcp_conn *conn)
+{
+	ssize_t ret;
+
+	if (conn->rlen == TCP_RBUF_LEN) return;
+	do {
+		ret = read(conn->fd, &conn->rbuf[conn->rlen],
+		           TCP_RBUF_LEN - conn->rlen);
+	} while ((ret == -1) && (errno == EINTR));
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return;
+	}
+	if (ret <= 0) {
+		tcp_conn_close(srv, conn);
+		return;
+	}
+	conn->rlen += ret;
+	if (tcp_conn_process(srv, conn)) {
+		tcp_conn_close(srv, conn);
+	}
+}
+
+static void tcp_conn_writable(struct yam_tcp_server *srv,
+                              struct yam_tcp_conn *conn)
+{
+	ssize_t ret;
+
+	do {
+		ret = send(conn->fd, &conn->wbuf[conn->woff], conn->wlen - conn->woff,
+		           MSG_NOSIGNAL);
+	} while ((ret == -1) && (errno == EINTR));
+	if (ret < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			tcp_conn_close(srv, conn);
+		}
+		return;
+	}
+	conn->woff += ret;
+	if (conn->woff < conn->wlen) return;
+
+	/* Drained, go back to reading and answer anything already queued */
+	conn->wlen = conn->woff = 0;
+	if (tcp_conn_process(srv, conn)) {
+		tcp_conn_close(srv, conn);
+	}
+}
+
+static void tcp_accept(struct yam_tcp_server *srv)
+{
+	int fd, one = 1;
+
+	while (0 <= (fd = accept4(srv->listen_fd, NULL, NULL,
+	                          SOCK_NONBLOCK | SOCK_CLOEXEC))) {
+		if (srv->num_conns >= srv->max_conns) {
+			close(fd);
+			continue;
+		}
+		struct yam_tcp_conn *conn = malloc(sizeof(struct yam_tcp_conn));
+		if (conn == NULL) {
+			close(fd);
+			continue;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		bzero(conn, offsetof(struct yam_tcp_conn, rbuf));
+		conn->fd = fd;
+		conn->events = EPOLLIN;
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+		if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+			close(fd);
+			free(conn);
+			continue;
+		}
+		conn->prev = NULL;
+		conn->next = srv->conns;
+		if (srv->conns) srv->conns->prev = conn;
+		srv->conns = conn;
+		srv->num_conns++;
+	}
+}
+
+static void tcp_free_dead(struct yam_tcp_server *srv)
+{
+	while (srv->dead) {
+		struct yam_tcp_conn *conn = srv->dead;
+		srv->dead = conn->next;
+		free(conn);
+	}
+}
+
+/**
+\brief Run the server loop
+\param *srv The server object
+\return YAM_OK when stopped, YAM_SOCKET_FAILED on failure
+
+Accepts clients and answers their requests until yam_tcp_server_stop() is
+called.
+*/
+int yam_tcp_server_run(struct yam_tcp_server *srv)
+{
+	assert(srv != NULL);
+
+	struct epoll_event events[TCP_EPOLL_EVENTS];
+	int ret, ctr;
+
+	while (!srv->stop) {
+		ret = epoll_wait(srv->epoll_fd, events, TCP_EPOLL_EVENTS, -1);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			return YAM_SOCKET_FAILED;
+		}
+		for (ctr = 0; ctr < ret; ctr++) {
+			void *ptr = events[ctr].data.ptr;
+			if (ptr == &srv->listen_fd) {
+				tcp_accept(srv);
+			}
+			else if (ptr == &srv->wake_fd) {
+				uint64_t val;
+				if (read(srv->wake_fd, &val, sizeof(val))) {}
+			}
+			else if (ptr >= (void *)&srv->watches[0] &&
+			         ptr < (void *)&srv->watches[YAM_TCP_MAX_WATCHES]) {
+				struct yam_tcp_watch *watch = ptr;
+				watch->fn(watch->arg);
+			}
+			else if (((struct yam_tcp_conn *)ptr)->closed) {
+				continue;
+			}
+			else if (events[ctr].events & (EPOLLERR | EPOLLHUP)) {
+				tcp_conn_close(srv, ptr);
+			}
+			else if (events[ctr].events & EPOLLOUT) {
+				tcp_conn_writable(srv, ptr);
+			}
+			else if (events[ctr].events & EPOLLIN) {
+				tcp_conn_readable(srv, ptr);
+			}
+		}
+		tcp_free_dead(srv);
+	}
+	return YAM_OK;
+}
+
+/**
+\brief Take ownership of the request being handled
+\param *srv The server object
+\param *req Location to store the request's identity
+\return YAM_OK on success, YAM_INVALIDBYTECOUNT if called outside a handler
+
+Called from a request handler that will answer later, typically after a
+slow operation on another thread. The handler then returns 0, and the reply
+must eventually be supplied, from the server loop's thread, with
+yam_tcp_server_reply(). Replies may be supplied in any order; clients match
+them up by transaction identifier.
+*/
+int yam_tcp_server_defer(struct yam_tcp_server *srv,
+                         struct yam_tcp_deferred *req)
+{
+	assert(srv != NULL);
+	assert(req != NULL);
+
+	if (srv->cur_conn == NULL) return YAM_INVALIDBYTECOUNT;
+	req->conn = srv->cur_conn;
+	memcpy(req->mbap, srv->cur_frame, YAM_TCP_MBAP_LEN);
+	req->conn->deferred++;
+	return YAM_OK;
+}
+
+/**
+\brief Send the reply to a deferred request
+\param *srv The server object
+\param *req Request identity filled in by yam_tcp_server_defer()
+\param *resp_pdu Response PDU
+\param resp_len Length of the response PDU, or 0 to drop the request
+
+Must be called from the server loop's thread, for example from a callback
+registered with yam_tcp_server_watch(). If the client has disconnected in
+the meantime, the reply is discarded.
+*/
+void yam_tcp_server_reply(struct yam_tcp_server *srv,
+                          struct yam_tcp_deferred *req,
+                          const uint8_t *resp_pdu, int resp_len)
+{
+	assert(srv != NULL);
+	assert(req != NULL);
+
+	struct yam_tcp_conn *conn = req->conn;
+
+	conn->deferred--;
+	if (conn->closed) {
+		if (conn->deferred == 0) tcp_conn_release(srv, conn);
+		return;
+	}
+
+	if (resp_len > 0) {
+		if (conn->wlen) {
+			/* Queue behind the replies already waiting */
+			memcpy(&conn->wbuf[conn->wlen], req->mbap, 4);
+			conn->wbuf[conn->wlen + 4] = (resp_len + 1) >> 8;
+			conn->wbuf[conn->wlen + 5] = (resp_len + 1) & 0x00FF;
+			conn->wbuf[conn->wlen + 6] = req->mbap[6];
+			memcpy(&conn->wbuf[conn->wlen + YAM_TCP_MBAP_LEN], resp_pdu,
+			       resp_len);
+			conn->wlen += YAM_TCP_MBAP_LEN + resp_len;
+		}
+		else {
+			struct tcp_reply *reply = &conn->replies[0];
+			memcpy(reply->mbap, req->mbap, 4);
+			reply->mbap[4] = (resp_len + 1) >> 8;
+			reply->mbap[5] = (resp_len + 1) & 0x00FF;
+			reply->mbap[6] = req->mbap[6];
+			memcpy(reply->pdu, resp_pdu, resp_len);
+			reply->pdu_len = resp_len;
+			if (tcp_conn_send(srv, conn, 1)) {
+				tcp_conn_close(srv, conn);
+				return;
+			}
+		}
+	}
+
+	/* Requests may have been held back waiting for this reply */
+	if (tcp_conn_process(srv, conn)) {
+		tcp_conn_close(srv, conn);
+	}
+}
+
+/**
+\brief Service an extra file descriptor from the server loop
+\param *srv The server object
+\param fd File descriptor to watch for readability
+\param fn Function called from the loop when fd becomes readable
+\param *arg Opaque pointer passed to fn
+\return YAM_OK on success, YAM_SOCKET_FAILED on failure
+
+Lets other threads hand work back to the server loop, typically through an
+eventfd, so that deferred replies are sent from the loop's own thread.
+*/
+int yam_tcp_server_watch(struct yam_tcp_server *srv, int fd,
+                         yam_tcp_watch_fn fn, void *arg)
+{
+	assert(srv != NULL);
+	assert(fn != NULL);
+
+	int ctr;
+	for (ctr = 0; ctr < YAM_TCP_MAX_WATCHES; ctr++) {
+		if (srv->watches[ctr].fd == -1) break;
+	}
+	if (ctr == YAM_TCP_MAX_WATCHES) return YAM_SOCKET_FAILED;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &srv->watches[ctr];
+	if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+		return YAM_SOCKET_FAILED;
+	}
+	srv->watches[ctr].fd = fd;
+	srv->watches[ctr].fn = fn;
+	srv->watches[ctr].arg = arg;
+	return YAM_OK;
+}
+
+static void *tcp_loop_thread(void *arg)
+{
+	yam_tcp_server_run((struct yam_tcp_server *)arg);
+	return NULL;
+}
+
+/**
+\brief Run several server loops, one per thread
+\param *srvs Array of server objects
+\param num_loops Number of server objects in the array
+\return YAM_OK when all loops have stopped, YAM_NO_MEMORY on failure
+
+Each server should have been initialized with YAM_TCP_FLAGS_REUSEPORT on the
+same port, so the kernel spreads incoming connections across the loops.
+Returns once every loop has been stopped with yam_tcp_server_stop().
+*/
+int yam_tcp_server_run_loops(struct yam_tcp_server *srvs, int num_loops)
+{
+	assert(srvs != NULL);
+
+	pthread_t *threads = calloc(num_loops, sizeof(pthread_t));
+	int ctr, started;
+
+	if (threads == NULL) return YAM_NO_MEMORY;
+	for (started = 0; started < num_loops; started++) {
+		if (pthread_create(&threads[started], NULL, tcp_loop_thread,
+		                   &srvs[started])) {
+			break;
+		}
+	}
+	if (started < num_loops) {
+		for (ctr = 0; ctr < started; ctr++) {
+			yam_tcp_server_stop(&srvs[ctr]);
+		}
+	}
+	for (ctr = 0; ctr < started; ctr++) {
+		pthread_join(threads[ctr], NULL);
+	}
+	free(threads);
+
+	return (started < num_loops) ? YAM_NO_MEMORY : YAM_OK;
+}
+
+/**
+\brief Stop the server loop
+\param *srv The server object
+
+Makes yam_tcp_server_run() return. May be called from any thread.
+*/
+void yam_tcp_server_stop(struct yam_tcp_server *srv)
+{
+	assert(srv != NULL);
+
+	uint64_t val = 1;
+	srv->stop = 1;
+	if (write(srv->wake_fd, &val, sizeof(val))) {}
+}
+
+/**
+\brief Close the server
+\param *srv The server object
+
+Closes all client connections and the listening socket. The server must not
+be running.
+*/
+void yam_tcp_server_close(struct yam_tcp_server *srv)
+{
+	assert(srv != NULL);
+
+	while (srv->conns) {
+		tcp_conn_close(srv, srv->conns);
+	}
+	tcp_free_dead(srv);
+	if (srv->listen_fd >= 0) close(srv->listen_fd);
+	if (srv->epoll_fd >= 0) close(srv->epoll_fd);
+	if (srv->wake_fd >= 0) close(srv->wake_fd);
+	srv->listen_fd = srv->epoll_fd = srv->wake_fd = -1;
+}
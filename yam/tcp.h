@@ -0,0 +1,116 @@
+/**
+\file tcp.h
+\brief Include file for the YAM Modbus/TCP server
+\author Jim George
+*/
+
+#ifndef _YAM_TCP_H_
+#define _YAM_TCP_H_
+
+#include <stdint.h>
+#include "modbus.h"
+#include "image.h"
+
+/** Default Modbus/TCP port */
+#define YAM_TCP_DEFAULT_PORT 502
+/** Length of the MBAP header, including the unit identifier */
+#define YAM_TCP_MBAP_LEN 7
+/** Maximum Modbus/TCP frame length (MBAP header + PDU) */
+#define YAM_TCP_MAX_FRAME_LEN (YAM_TCP_MBAP_LEN + YAM_MODBUS_MAX_PDU_LEN)
+/** Maximum number of pipelined replies gathered into one vectored write */
+#define YAM_TCP_MAX_BATCH 16
+/** Maximum number of deferred replies outstanding per connection */
+#define YAM_TCP_MAX_DEFERRED 16
+/** Default limit on simultaneous client connections per loop */
+#define YAM_TCP_DEFAULT_MAX_CONNS 1024
+/** Maximum number of extra file descriptors watched by a server loop */
+#define YAM_TCP_MAX_WATCHES 4
+
+/* Server flags */
+/** Bind with SO_REUSEPORT, so several loops can share the port */
+#define YAM_TCP_FLAGS_REUSEPORT (1 << 0)
+
+/**
+\brief Request handler for the TCP server
+\param *arg Opaque pointer given to yam_tcp_server_set_handler()
+\param unit Unit identifier from the MBAP header
+\param *req_pdu Request PDU
+\param req_len Length of the request PDU
+\param *resp_pdu Buffer for the response PDU (YAM_MODBUS_MAX_PDU_LEN bytes)
+\return Length of the response PDU, or 0 to send no reply
+
+A handler that cannot answer straight away calls yam_tcp_server_defer() and
+returns 0, then supplies the reply later with yam_tcp_server_reply().
+*/
+typedef int (*yam_tcp_handler)(void *arg, uint8_t unit,
+                               const uint8_t *req_pdu, int req_len,
+                               uint8_t *resp_pdu);
+
+struct yam_tcp_conn;
+
+/**
+\brief A request whose reply will be supplied later
+*/
+struct yam_tcp_deferred {
+	struct yam_tcp_conn *conn; /**< Connection the request arrived on */
+	uint8_t mbap[YAM_TCP_MBAP_LEN]; /**< MBAP header of the request */
+};
+
+/**
+\brief Callback for a file descriptor watched by the server loop
+\param *arg Opaque pointer given to yam_tcp_server_watch()
+*/
+typedef void (*yam_tcp_watch_fn)(void *arg);
+
+/** An extra file descriptor serviced by the server loop */
+struct yam_tcp_watch {
+	int fd; /**< File descriptor, -1 if the slot is unused */
+	yam_tcp_watch_fn fn; /**< Called from the loop when fd is readable */
+	void *arg; /**< Argument passed to fn */
+};
+
+/**
+\brief The YAM Modbus/TCP server object
+
+One server object runs one single-threaded epoll loop. Several loops can
+serve the same port (one per core) by initializing each with
+YAM_TCP_FLAGS_REUSEPORT and running them with yam_tcp_server_run_loops().
+*/
+struct yam_tcp_server {
+	int listen_fd; /**< Listening socket */
+	int epoll_fd; /**< epoll instance driving the loop */
+	int wake_fd; /**< eventfd used to interrupt the loop */
+	volatile int stop; /**< Set nonzero to make the loop return */
+	int num_conns; /**< Number of open client connections */
+	int max_conns; /**< Limit on open client connections */
+	yam_tcp_handler handler; /**< Request handler */
+	void *handler_arg; /**< Argument passed to the request handler */
+	struct yam_tcp_conn *conns; /**< List of open client connections */
+	struct yam_tcp_conn *dead; /**< Closed connections awaiting release */
+	struct yam_tcp_conn *cur_conn; /**< Connection of the request being handled */
+	const uint8_t *cur_frame; /**< Frame of the request being handled */
+	struct yam_tcp_watch watches[YAM_TCP_MAX_WATCHES]; /**< Extra descriptors */
+};
+
+int yam_tcp_server_init(struct yam_tcp_server *srv, const char *bind_addr,
+                        uint16_t port, unsigned int flags);
+void yam_tcp_server_set_handler(struct yam_tcp_server *srv,
+                                yam_tcp_handler handler, void *arg);
+void yam_tcp_server_set_image(struct yam_tcp_server *srv,
+                              struct yam_image *image);
+int yam_tcp_server_run(struct yam_tcp_server *srv);
+int yam_tcp_server_run_loops(struct yam_tcp_server *srvs, int num_loops);
+void yam_tcp_server_stop(struct yam_tcp_server *srv);
+int yam_tcp_server_defer(struct yam_tcp_server *srv,
+                         struct yam_tcp_deferred *req);
+void yam_tcp_server_reply(struct yam_tcp_server *srv,
+                          struct yam_tcp_deferred *req,
+                          const uint8_t *resp_pdu, int resp_len);
+int yam_tcp_server_watch(struct yam_tcp_server *srv, int fd,
+                         yam_tcp_watch_fn fn, void *arg);
+void yam_tcp_server_close(struct yam_tcp_server *srv);
+
+int yam_tcp_image_handler(void *arg, uint8_t unit, const uint8_t *req_pdu,
+                          int req_len, uint8_t *resp_pdu);
+
+#endif /* _YAM_TCP_H_ */
@@ -0,0 +1,58 @@
+/**
+\file termios2.c
+\brief Arbitrary serial port speeds through the Linux termios2 interface
+\author Jim George
+
+The kernel's struct termios2 clashes with the C library's struct termios,
+so this lives apart from serial.c.
+*/
+
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+#include "serial.h"
+
+/* Largest difference between the speed asked for and the one the UART can
+make, in tenths of a percent; beyond about 2% characters are misread */
+#define SERIAL_PORT_SPEED_TOLERANCE 20
+
+/**
+\brief Set a serial port to any speed the driver can make
+\param fd Serial port, already set up with tcsetattr()
+\param speed Speed, in baud
+\return 0 on success, -1 if the driver refuses the speed or cannot come
+close enough to it
+*/
+int serial_port_set_custom_speed(int fd, unsigned int speed)
+{
+#if defined(TCGETS2) && defined(BOTHER)
+	struct termios2 term_st;
+	unsigned int diff;
+
+	if (speed == 0 || ioctl(fd, TCGETS2, &term_st)) {
+		return -1;
+	}
+	term_st.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+	term_st.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+	term_st.c_ispeed = speed;
+	term_st.c_ospeed = speed;
+	if (ioctl(fd, TCSETS2, &term_st)) {
+		return -1;
+	}
+
+	/* The driver reports the speed it actually set */
+	if (ioctl(fd, TCGETS2, &term_st)) {
+		return -1;
+	}
+	diff = (term_st.c_ospeed > speed) ? term_st.c_ospeed - speed :
+	       speed - term_st.c_ospeed;
+	if ((unsigned long long)diff * 1000 >
+	    (unsigned long long)speed * SERIAL_PORT_SPEED_TOLERANCE) {
+		return -1;
+	}
+	return 0;
+#else
+	(void)fd;
+	(void)speed;
+	return -1;
+#endif
+}
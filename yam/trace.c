@@ -0,0 +1,240 @@
+/**
+\file trace.c
+\brief Frame trace: a ring of timestamped frames that is cheap to leave on
+\author Jim George
+
+Tracing a frame is a timestamp and a copy into a preallocated slot; nothing
+is formatted and no system call is made, so a trace can stay attached to a
+bus in production. Formatting is left to whoever reads the trace, such as
+the yam-tracedump program.
+
+There is one writer, the thread driving the bus. Each slot carries a
+sequence word that is odd while the slot is being written and otherwise
+holds twice the frame's number plus two, so a reader can tell both a slot
+that is being rewritten and one that has already been reused for a later
+frame, and skip it, without ever holding up the writer.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <assert.h>
+
+#include "modbus.h"
+#include "trace.h"
+
+struct trace_slot {
+	uint64_t lock;
+	struct yam_trace_record rec;
+};
+
+static uint64_t trace_clock(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Copies frame number pos out of the ring, returns 0 if it is gone */
+static int trace_read(struct yam_trace *trace, uint64_t pos,
+                      struct yam_trace_record *rec)
+{
+	struct trace_slot *slot = &trace->slots[pos % trace->num_records];
+	uint64_t lock = __atomic_load_n(&slot->lock, __ATOMIC_ACQUIRE);
+
+	if (lock != 2 * pos + 2) {
+		return 0;
+	}
+	memcpy(rec, &slot->rec, sizeof(struct yam_trace_record));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&slot->lock, __ATOMIC_RELAXED) == lock;
+}
+
+/**
+\brief Allocate a frame trace
+\param *trace The trace to initialize
+\param num_records Number of frames kept, 0 for YAM_TRACE_DEFAULT_RECORDS
+\return 0 on success, error code on failure
+
+Attach the trace to a bus with yam_set_trace().
+*/
+int yam_trace_init(struct yam_trace *trace, unsigned int num_records)
+{
+	assert(trace != NULL);
+
+	bzero(trace, sizeof(struct yam_trace));
+	if (num_records == 0) {
+		num_records = YAM_TRACE_DEFAULT_RECORDS;
+	}
+	trace->slots = calloc(num_records, sizeof(struct trace_slot));
+	if (trace->slots == NULL) {
+		return YAM_NO_MEMORY;
+	}
+	trace->num_records = num_records;
+	trace->realtime_offset_ns = trace_clock(CLOCK_REALTIME) -
+	                            trace_clock(CLOCK_MONOTONIC);
+
+	return YAM_OK;
+}
+
+/**
+\brief Free a frame trace
+\param *trace The trace, which must no longer be attached to a bus
+*/
+void yam_trace_free(struct yam_trace *trace)
+{
+	assert(trace != NULL);
+
+	free(trace->slots);
+	trace->slots = NULL;
+	trace->num_records = 0;
+}
+
+/**
+\brief Add a frame to the trace
+\param *trace The trace
+\param dir YAM_TRACE_TX or YAM_TRACE_RX
+\param *data The frame
+\param len Length of the frame
+\param status Result of receiving the frame, 0 for frames sent
+
+Called by the library for every frame on a bus with a trace attached. Only
+the thread driving the bus may call this.
+*/
+void yam_trace_frame(struct yam_trace *trace, int dir, const uint8_t *data,
+                     int len, int status)
+{
+	uint64_t pos = trace->head;
+	struct trace_slot *slot = &trace->slots[pos % trace->num_records];
+
+	if (len > YAM_MODBUS_MAX_ADU_LEN) {
+		len = YAM_MODBUS_MAX_ADU_LEN;
+	}
+	__atomic_store_n(&slot->lock, 2 * pos + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->rec.seq = pos;
+	slot->rec.timestamp_ns = trace_clock(CLOCK_MONOTONIC);
+	slot->rec.status = status;
+	slot->rec.len = len;
+	slot->rec.dir = dir;
+	memcpy(slot->rec.data, data, len);
+	__atomic_store_n(&slot->lock, 2 * pos + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&trace->head, pos + 1, __ATOMIC_RELEASE);
+}
+
+/**
+\brief Take the frames traced since the last drain
+\param *trace The trace
+\param *recs Location to store the frames
+\param max_recs Size of the recs array
+\return Number of frames stored
+
+Frames are returned oldest first, and each is returned by only one drain.
+Frames that were overwritten before they could be drained are counted in
+trace->dropped; the seq field of the records shows where the gaps are. Only
+one thread may drain a trace.
+*/
+int yam_trace_drain(struct yam_trace *trace, struct yam_trace_record *recs,
+                    int max_recs)
+{
+	assert(trace != NULL);
+	assert(recs != NULL);
+
+	uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = trace->tail;
+	int num = 0;
+
+	if (head - tail > trace->num_records) {
+		trace->dropped += head - tail - trace->num_records;
+		tail = head - trace->num_records;
+	}
+	while (tail < head && num < max_recs) {
+		if (trace_read(trace, tail, &recs[num])) {
+			num++;
+		}
+		else {
+			trace->dropped++;
+		}
+		tail++;
+	}
+	trace->tail = tail;
+
+	return num;
+}
+
+/**
+\brief Copy the most recent frames without draining them
+\param *trace The trace
+\param *recs Location to store the frames
+\param max_recs Size of the recs array
+\return Number of frames stored, oldest first
+*/
+int yam_trace_snapshot(struct yam_trace *trace, struct yam_trace_record *recs,
+                       int max_recs)
+{
+	assert(trace != NULL);
+	assert(recs != NULL);
+
+	uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+	uint64_t pos = 0;
+	uint64_t max = ((unsigned int)max_recs < trace->num_records) ?
+	               (unsigned int)max_recs : trace->num_records;
+	int num = 0;
+
+	if (head > max) {
+		pos = head - max;
+	}
+	for (; pos < head; pos++) {
+		if (trace_read(trace, pos, &recs[num])) {
+			num++;
+		}
+	}
+
+	return num;
+}
+
+/**
+\brief Write the frames in the trace to a file
+\param *trace The trace
+\param *path Name of the file to create
+\return 0 on success, error code on failure
+
+Writes a snapshot of the trace, for reading with yam-tracedump.
+*/
+int yam_trace_save(struct yam_trace *trace, const char *path)
+{
+	assert(trace != NULL);
+	assert(path != NULL);
+
+	struct yam_trace_file_header header;
+	struct yam_trace_record *recs;
+	FILE *fp;
+	int num, ok;
+
+	recs = malloc(trace->num_records * sizeof(struct yam_trace_record));
+	if (recs == NULL) {
+		return YAM_NO_MEMORY;
+	}
+	num = yam_trace_snapshot(trace, recs, trace->num_records);
+
+	bzero(&header, sizeof(header));
+	header.magic = YAM_TRACE_MAGIC;
+	header.version = YAM_TRACE_VERSION;
+	header.record_size = sizeof(struct yam_trace_record);
+	header.num_records = num;
+	header.realtime_offset_ns = trace->realtime_offset_ns;
+	header.dropped = trace->dropped;
+
+	if ((fp = fopen(path, "wb")) == NULL) {
+		free(recs);
+		return YAM_FILE_FAILED;
+	}
+	ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+	     fwrite(recs, sizeof(struct yam_trace_record), num, fp) == (size_t)num;
+	ok = !fclose(fp) && ok;
+	free(recs);
+
+	return ok ? YAM_OK : YAM_FILE_FAILED;
+}
@@ -0,0 +1,82 @@
+/**
+\file trace.h
+\brief Include file for the YAM frame trace
+\author Jim George
+*/
+
+#ifndef _YAM_TRACE_H_
+#define _YAM_TRACE_H_
+
+#include <stdint.h>
+#include "modbus.h"
+
+/** Identifies a YAM trace file ("YAMT") */
+#define YAM_TRACE_MAGIC 0x59414D54
+/** File layout version */
+#define YAM_TRACE_VERSION 1
+/** Default number of frames kept */
+#define YAM_TRACE_DEFAULT_RECORDS 1024
+
+/* Frame directions */
+/** Frame sent by the master */
+#define YAM_TRACE_TX 0
+/** Frame (or the part of one that arrived) received from a slave */
+#define YAM_TRACE_RX 1
+
+/**
+\brief One traced frame
+*/
+struct yam_trace_record {
+	uint64_t seq; /**< Number of frames traced before this one */
+	uint64_t timestamp_ns; /**< CLOCK_MONOTONIC time of the last byte
+	                            received, or of the frame being sent */
+	int32_t status; /**< For received frames, the length on success or the
+	                     YAM_* error code */
+	uint16_t len; /**< Number of bytes in data */
+	uint8_t dir; /**< YAM_TRACE_TX or YAM_TRACE_RX */
+	uint8_t reserved;
+	uint8_t data[YAM_MODBUS_MAX_ADU_LEN]; /**< The frame, as on the wire */
+};
+
+/**
+\brief Header of a trace file, followed by the records
+*/
+struct yam_trace_file_header {
+	uint32_t magic; /**< YAM_TRACE_MAGIC */
+	uint32_t version; /**< YAM_TRACE_VERSION */
+	uint32_t record_size; /**< sizeof(struct yam_trace_record) */
+	uint32_t num_records; /**< Number of records in the file */
+	int64_t realtime_offset_ns; /**< CLOCK_REALTIME - CLOCK_MONOTONIC when
+	                                 the trace was created */
+	uint64_t dropped; /**< Frames overwritten before they were drained */
+};
+
+struct trace_slot;
+
+/**
+\brief Ring of the most recent frames on a bus
+
+The bus thread writes, and one other thread may drain or snapshot the ring
+at the same time without locking. When the ring is full the oldest frames
+are overwritten, so the trace always holds the latest history.
+*/
+struct yam_trace {
+	struct trace_slot *slots; /**< The ring */
+	unsigned int num_records; /**< Size of the ring */
+	uint64_t head; /**< Frames ever traced */
+	uint64_t tail; /**< Frames drained, or skipped by draining */
+	uint64_t dropped; /**< Frames overwritten before they were drained */
+	int64_t realtime_offset_ns; /**< See struct yam_trace_file_header */
+};
+
+int yam_trace_init(struct yam_trace *trace, unsigned int num_records);
+void yam_trace_free(struct yam_trace *trace);
+void yam_trace_frame(struct yam_trace *trace, int dir, const uint8_t *data,
+                     int len, int status);
+int yam_trace_drain(struct yam_trace *trace, struct yam_trace_record *recs,
+                    int max_recs);
+int yam_trace_snapshot(struct yam_trace *trace, struct yam_trace_record *recs,
+                       int max_recs);
+int yam_trace_save(struct yam_trace *trace, const char *path);
+
+#endif /* _YAM_TRACE_H_ */
@@ -0,0 +1,41 @@
+/**
+\file transport.h
+\brief Internal interface between YAM objects and their byte transports
+\author Jim George
+*/
+
+#ifndef _YAM_TRANSPORT_H_
+#define _YAM_TRANSPORT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "modbus.h"
+
+/**
+\brief Byte transport underneath a YAM object
+
+The protocol code in modbus.c frames requests and parses replies; a
+transport only moves the bytes. The default transport is the serial port
+opened by yam_modbus_init().
+*/
+struct yam_transport {
+	const char *name; /**< Short name, for diagnostics */
+	/** Send a complete request ADU. Returns bytes sent, or a YAM error code */
+	int (*send)(struct yam_modbus *bus, const uint8_t *buf, size_t len);
+	/** Wait up to timeout_ms for reply bytes, and read at most len of them.
+	Returns the number of bytes read, 0 on timeout, or a YAM error code */
+	int (*recv)(struct yam_modbus *bus, uint8_t *buf, size_t len,
+	            int timeout_ms);
+	/** Discard anything buffered in either direction */
+	void (*flush)(struct yam_modbus *bus);
+	/** Release the transport */
+	void (*close)(struct yam_modbus *bus);
+};
+
+extern const struct yam_transport yam_serial_transport;
+
+int yam_bus_setup(struct yam_modbus *bus, const struct yam_transport *transport,
+                  void *transport_data, const char *device_name);
+uint16_t yam_crc16(const uint8_t *buffer, uint16_t buffer_length);
+
+#endif /* _YAM_TRANSPORT_H_ */